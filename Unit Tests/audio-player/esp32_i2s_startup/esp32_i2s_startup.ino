@@ -0,0 +1,139 @@
+/*
+Compare the startup latency of the two I2S backends of esp32-audio-recorder (audioSTD.h).
+The legacy driver/i2s.h and the channel-based driver/i2s_std.h can't be linked together,
+so build the sketch twice: with I2S_LEGACY_DRIVER true, then false, and compare the two reports.
+
+Test setup:
+  - ESP32 (CH9102), INMP441 microphone and MAX98357A DAC wired as in audioWIRE.h
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+  - Place the microphone close to the speaker
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. Note the install, reclock and click latencies, switch I2S_LEGACY_DRIVER and repeat.
+     The legacy DAC plays the zeros already queued in its DMA before the click,
+     the preloaded DMA starts with the click. The acoustic path is the same for both builds.
+*/
+
+#define I2S_LEGACY_DRIVER false  // true - driver/i2s.h, false - driver/i2s_std.h
+
+#include <audioSTD.h>  // from Diana-audio-utils
+
+#define TEST_DAC_RATE (48000)
+#define TEST_TRIALS (5)
+#define TEST_TIMEOUT_MS (500)
+
+int16_t clickBuffer[DMA_BUF_LEN * 2];  // one DMA buffer, 16-bit stereo
+uint8_t micBuffer[BUFF_SIZE];
+
+// us spent in a driver call
+typedef esp_err_t (*TestFn)();
+int64_t testTime(TestFn fn, const char *name) {
+  int64_t start = esp_timer_get_time();
+  esp_err_t res = fn();
+  int64_t elapsed = esp_timer_get_time() - start;
+  Serial.printf("%-24s %8lld us%s\n", name, elapsed, res == ESP_OK ? "" : " (failed)");
+  return elapsed;
+}
+
+esp_err_t testDacInit() {
+  return dacInitStd(TEST_DAC_RATE, 16, 2, DMA_BUF_COUNT, DMA_BUF_LEN, DAC_USE_APLL);
+}
+
+esp_err_t testMicInit() {
+  return micInitStd(MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, DMA_BUF_COUNT, DMA_BUF_LEN, MIC_USE_APLL, MIC_CHANNEL_NUM);
+}
+
+esp_err_t testDacReclock() {
+  return dacSetClkStd(44100, 16, 2);
+}
+
+esp_err_t testDacReclockBack() {
+  return dacSetClkStd(TEST_DAC_RATE, 16, 2);
+}
+
+// the largest sample of the mic block, with the recording gain
+int32_t testMicPeak(size_t *frames) {
+  size_t bytesRead;
+  micReadBuff(micBuffer, BUFF_SIZE, &bytesRead);
+  size_t n = convBlock<FmtS16, FmtS16, 1, 1, MIC_GAIN_SHIFT>(micBuffer, micBuffer, bytesRead) / sizeof(int16_t);
+  int32_t peak = 0;
+  for (size_t i = 0; i < n; i++) {
+    peak = max(peak, (int32_t)abs(((int16_t *)micBuffer)[i]));
+  }
+  *frames = n;
+  return peak;
+}
+
+// us from the start of a playback (preload, write) to the click on the microphone, -1 - not heard
+int64_t testClick(int32_t threshold) {
+  size_t bytesWritten;
+  size_t frames;
+
+  // the DAC is idle and running, like between two requests
+  dacClearStd();
+  delay(200);
+  micFlushStd();
+
+  int64_t start = esp_timer_get_time();
+  dacPreloadStd();  // nothing on the legacy driver
+  dacWriteBuff(clickBuffer, sizeof(clickBuffer), &bytesWritten);
+  dacStartStd();
+
+  while (esp_timer_get_time() - start < TEST_TIMEOUT_MS * 1000LL) {
+    int32_t peak = testMicPeak(&frames);
+    if (peak > threshold) {
+      return esp_timer_get_time() - start;
+    }
+  }
+  return -1;
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  Serial.printf("\nI2S backend: %s\n", I2S_LEGACY_DRIVER ? "legacy driver/i2s.h" : "channel-based driver/i2s_std.h");
+
+  // cold start
+  testTime(testDacInit, "DAC install");
+  testTime(testMicInit, "Mic install");
+  testTime(testDacReclock, "DAC reclock 44.1kHz");
+  testTime(testDacReclockBack, "DAC reclock 48kHz");
+
+  // the noise floor, after the INMP441 startup time
+  size_t frames;
+  int32_t noise = 0;
+  for (int b = 0; b < 8; b++) {
+    noise = max(noise, testMicPeak(&frames));
+  }
+  int32_t threshold = max(noise * 4, (int32_t)2000);
+
+  // the click: one DMA buffer of a 2kHz square wave, at half scale
+  int halfPeriod = TEST_DAC_RATE / 4000;
+  for (int i = 0; i < DMA_BUF_LEN; i++) {
+    clickBuffer[2 * i] = clickBuffer[2 * i + 1] = ((i / halfPeriod) & 1) ? 16384 : -16384;
+  }
+
+  int64_t total = 0;
+  int heard = 0;
+  for (int t = 0; t < TEST_TRIALS; t++) {
+    int64_t latency = testClick(threshold);
+    Serial.printf("Click %d: %lld us\n", t + 1, latency);
+    if (latency >= 0) {
+      total += latency;
+      heard++;
+    }
+  }
+  if (heard > 0) {
+    Serial.printf("Average start to click: %lld us (noise %d, threshold %d, DMA %d x %d frames)\n",
+                  total / heard, noise, threshold, DMA_BUF_COUNT, DMA_BUF_LEN);
+  } else {
+    Serial.println("The click was not heard, place the mic near the speaker");
+  }
+}
+
+void loop() {
+}
@@ -0,0 +1,322 @@
+/*
+Benchmark the audio processing kernels of esp32-audio-recorder, no peripherals needed.
+Our infrastructure encapsulates the common functionality for FileSystem, Microphone and DSP
+
+Test setup:
+  - ESP32 (CH9102)
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. Compare the samples per second of each kernel against its baseline,
+     and the CPU load of the recording codecs at 16kHz and 44.1kHz.
+     The resampler also shows how much of a tone above the output Nyquist frequency aliases when downsampling.
+  4. Check the cycles per sample of each stage of the DSP profiles, and their CPU load on the mic stream.
+*/
+
+#include <audioCONV.h>  // from Diana-audio-utils
+#include <audioSRC.h>   // from Diana-audio-utils
+#include <audioCODEC.h> // from Diana-audio-utils
+#include <audioNR.h>    // from Diana-audio-utils
+#include <audioDSP.h>   // from Diana-audio-utils, after audioCONV.h and audioNR.h
+
+#define BENCH_SAMPLES (1024)  // samples per block
+#define BENCH_BLOCKS (200)    // blocks per measurement
+
+int32_t srcBuffer[BENCH_SAMPLES * 2];  // large enough for stereo 32-bit
+int32_t dstBuffer[BENCH_SAMPLES * 2];
+
+// some noise to work on, 24-bit left-justified like the microphone
+void benchFillNoise() {
+  for (int i = 0; i < BENCH_SAMPLES * 2; i++) {
+    srcBuffer[i] = (int32_t)esp_random() & 0xFFFFFF00;
+  }
+}
+
+// run the kernel on BENCH_BLOCKS blocks, return samples per second
+typedef void (*BenchFn)();
+float benchRun(BenchFn fn, int samplesPerBlock) {
+  unsigned long start = micros();
+  for (int i = 0; i < BENCH_BLOCKS; i++) {
+    fn();
+  }
+  unsigned long elapsed = micros() - start;
+  return (float)samplesPerBlock * BENCH_BLOCKS * 1000000.0 / (elapsed ? elapsed : 1);
+}
+
+void benchPrint(const char *name, float baseline, float kernel) {
+  Serial.printf("%-28s baseline %10.0f S/s, kernel %10.0f S/s, speedup x%.2f\n", name, baseline, kernel, kernel / baseline);
+}
+
+/**
+ * Conversion kernels (audioCONV.h)
+ */
+
+// the original recordWav() loop: per sample shift with a branchy sign extension, wraps around
+void convLegacyMic() {
+  int16_t *out = (int16_t *)dstBuffer;
+  for (int i = 0; i < BENCH_SAMPLES; i++) {
+    int32_t temp = srcBuffer[i] >> 11;
+    if (temp & 0x8000) {
+      temp |= 0xFFFF0000;
+    }
+    out[i] = (int16_t)temp;
+  }
+}
+
+void convKernelMic() {
+  convBlock<FmtS32, FmtS16, 1, 1, 5>(dstBuffer, srcBuffer, BENCH_SAMPLES * sizeof(int32_t));
+}
+
+// per sample format dispatch, i.e. deciding the format inside the loop
+void convLegacyDispatch24() {
+  uint8_t *in = (uint8_t *)srcBuffer;
+  int32_t *out = dstBuffer;
+  volatile int bits = 24;
+  for (int i = 0; i < BENCH_SAMPLES; i++) {
+    switch (bits) {
+      case 8: out[i] = ((int32_t)in[i] - 128) << 24; break;
+      case 16: out[i] = (int32_t)((int16_t *)in)[i] << 16; break;
+      case 24: out[i] = (int32_t)((in[3 * i] << 8) | (in[3 * i + 1] << 16) | (in[3 * i + 2] << 24)); break;
+      default: out[i] = ((int32_t *)in)[i]; break;
+    }
+  }
+}
+
+ConvFn selected24 = NULL;
+void convKernel24() {
+  selected24(dstBuffer, srcBuffer, BENCH_SAMPLES * 3);
+}
+
+void convKernelStereoToMono() {
+  convBlock<FmtS16, FmtS16, 2, 1>(dstBuffer, srcBuffer, BENCH_SAMPLES * 2 * sizeof(int16_t));
+}
+
+void convKernelInPlace8() {
+  convBlock<FmtU8, FmtS16, 1, 1>(srcBuffer, srcBuffer, BENCH_SAMPLES);
+}
+
+void benchConv() {
+  Serial.println("\n*** audioCONV.h ***");
+  benchFillNoise();
+  selected24 = convSelect(24, 1, 32, 1);  // once per stream
+  benchPrint("mic 32->16 (gain x32)", benchRun(convLegacyMic, BENCH_SAMPLES), benchRun(convKernelMic, BENCH_SAMPLES));
+  benchPrint("wav 24->32", benchRun(convLegacyDispatch24, BENCH_SAMPLES), benchRun(convKernel24, BENCH_SAMPLES));
+  float stereo = benchRun(convKernelStereoToMono, BENCH_SAMPLES);
+  float inplace = benchRun(convKernelInPlace8, BENCH_SAMPLES);
+  Serial.printf("%-28s kernel %10.0f S/s\n", "stereo->mono 16-bit", stereo);
+  Serial.printf("%-28s kernel %10.0f S/s\n", "in place u8->16", inplace);
+}
+
+/**
+ * Sample-rate converter (audioSRC.h)
+ */
+
+Resampler resampler;
+
+// resample one second of a 1 kHz sine, measure the SNR against the ideal sine and the throughput
+void benchSrcPair(uint32_t inRate, uint32_t outRate) {
+  const float freq = 1000.0;
+  const int amplitude = 16000;
+  int16_t *in = (int16_t *)srcBuffer;
+  int16_t *out = (int16_t *)dstBuffer;
+
+  unsigned long initStart = micros();
+  srcInit(&resampler, inRate, outRate, 1);
+  unsigned long initTime = micros() - initStart;
+
+  double signal = 0, noise = 0;
+  unsigned long busy = 0;
+  uint32_t produced = 0;
+  uint32_t block = BENCH_SAMPLES * inRate / (outRate > inRate ? outRate : inRate);  // the output must fit dstBuffer
+  for (uint32_t n = 0; n < inRate; n += block) {
+    for (uint32_t i = 0; i < block; i++) {
+      in[i] = (int16_t)(amplitude * sinf(2 * PI * freq * (n + i) / inRate));
+    }
+    unsigned long start = micros();
+    size_t frames = srcProcess(&resampler, in, block, out);
+    busy += micros() - start;
+
+    // the output k is the input instant k*in/out, delayed by half of the filter
+    for (size_t k = 0; k < frames; k++, produced++) {
+      if (produced < outRate / 10) {
+        continue;  // skip the start, the history is still filling up
+      }
+      double t = (double)produced * inRate / outRate - resampler.taps / 2.0;
+      double ideal = amplitude * sin(2 * PI * freq * t / inRate);
+      signal += ideal * ideal;
+      noise += (out[k] - ideal) * (out[k] - ideal);
+    }
+  }
+
+  Serial.printf("%6u -> %6u Hz: SNR %5.1f dB, %8.0f out S/s, real-time x%.1f, init %lu us, %d taps\n",
+                inRate, outRate, 10 * log10(signal / noise), produced * 1000000.0 / busy, 1000000.0 / busy, initTime, resampler.taps);
+}
+
+// the level of a quarter second of a tone resampled, in dB of the tone
+float benchSrcLevel(uint32_t inRate, uint32_t outRate, float freq) {
+  const int amplitude = 16000;
+  int16_t *in = (int16_t *)srcBuffer;
+  int16_t *out = (int16_t *)dstBuffer;
+  srcInit(&resampler, inRate, outRate, 1);
+
+  double energy = 0;
+  uint32_t produced = 0, counted = 0;
+  uint32_t block = BENCH_SAMPLES * inRate / (outRate > inRate ? outRate : inRate);
+  for (uint32_t n = 0; n < inRate / 4; n += block) {
+    for (uint32_t i = 0; i < block; i++) {
+      in[i] = (int16_t)(amplitude * sinf(2 * PI * freq * (n + i) / inRate));
+    }
+    size_t frames = srcProcess(&resampler, in, block, out);
+    for (size_t k = 0; k < frames; k++, produced++) {
+      if (produced >= outRate / 20) {  // after the history filled up
+        energy += (double)out[k] * out[k];
+        counted++;
+      }
+    }
+  }
+  return 10 * log10(energy / counted / (amplitude * amplitude / 2.0));
+}
+
+// downsampling: the loudest alias of the tones between 1.1 and 3 times the output Nyquist frequency
+void benchSrcAlias(uint32_t inRate, uint32_t outRate) {
+  float nyquist = outRate / 2.0;
+  float worst = -120;
+  for (float freq = 1.1 * nyquist; freq < 3 * nyquist && freq < inRate / 2.0; freq += nyquist / 10) {
+    worst = max(worst, benchSrcLevel(inRate, outRate, freq));
+  }
+  Serial.printf("%6u -> %6u Hz: passband (0.5 Nyquist) %5.2f dB, worst alias %5.1f dB\n",
+                inRate, outRate, benchSrcLevel(inRate, outRate, 0.5 * nyquist), worst);
+}
+
+void benchSrc() {
+  Serial.println("\n*** audioSRC.h ***");
+  benchSrcPair(44100, 48000);
+  benchSrcPair(22050, 48000);
+  benchSrcPair(16000, 48000);
+  benchSrcPair(8000, 48000);
+  benchSrcPair(44100, 16000);
+  benchSrcPair(48000, 8000);
+  benchSrcPair(8000, 16000);
+  benchSrcAlias(48000, 16000);
+  benchSrcAlias(44100, 16000);
+  benchSrcAlias(48000, 8000);
+}
+
+/**
+ * Recording codecs (audioCODEC.h)
+ */
+
+CodecEncoder benchEncoder;
+uint8_t codedBuffer[BENCH_SAMPLES * 2];
+int benchSamplesPerBlock = 0;
+
+// a speech-like signal: two tones with some noise, 16-bit mono
+void benchFillVoice(uint32_t rate) {
+  int16_t *in = (int16_t *)srcBuffer;
+  for (int i = 0; i < BENCH_SAMPLES * 2; i++) {
+    in[i] = (int16_t)(6000 * sinf(2 * PI * 220 * i / rate) + 3000 * sinf(2 * PI * 1800 * i / rate) + (int16_t)(esp_random() & 0x3FF) - 512);
+  }
+}
+
+void codecKernelAdpcmEncode() {
+  codecEncode(&benchEncoder, codedBuffer, (int16_t *)srcBuffer, BENCH_SAMPLES);
+}
+
+void codecKernelAdpcmDecode() {
+  adpcmDecodeBlock((int16_t *)dstBuffer, codedBuffer, 1, benchSamplesPerBlock);
+}
+
+void codecKernelUlawEncode() {
+  ulawEncode(codedBuffer, srcBuffer, BENCH_SAMPLES * sizeof(int16_t));
+}
+
+void codecKernelUlawDecode() {
+  ulawDecode(dstBuffer, codedBuffer, BENCH_SAMPLES);
+}
+
+// the share of one core a mono stream of the rate takes
+void benchPrintLoad(const char *name, float rate, float kernel) {
+  Serial.printf("%-28s kernel %10.0f S/s, CPU %5.2f%% of a core\n", name, kernel, rate * 100 / kernel);
+}
+
+void benchCodecRate(uint32_t rate) {
+  char name[40];
+  Serial.printf("%u Hz mono:\n", rate);
+  benchFillVoice(rate);
+
+  codecEncoderInit(&benchEncoder, WAV_FORMAT_IMA_ADPCM, rate, 1);
+  benchSamplesPerBlock = benchEncoder.layout.samplesPerBlock;
+  snprintf(name, sizeof(name), "ima-adpcm encode (%d B)", benchEncoder.layout.blockAlign);
+  benchPrintLoad(name, rate, benchRun(codecKernelAdpcmEncode, BENCH_SAMPLES));
+  codecEncoderEnd(&benchEncoder);
+
+  // one block to decode, and its SNR against the input
+  AdpcmChannel state = { 0, 0 };
+  adpcmEncodeBlock(codedBuffer, (int16_t *)srcBuffer, 1, benchSamplesPerBlock, &state);
+  snprintf(name, sizeof(name), "ima-adpcm decode (%d B)", benchEncoder.layout.blockAlign);
+  benchPrintLoad(name, rate, benchRun(codecKernelAdpcmDecode, benchSamplesPerBlock));
+  double signal = 0, noise = 0;
+  for (int i = 0; i < benchSamplesPerBlock; i++) {
+    double s = ((int16_t *)srcBuffer)[i];
+    double e = ((int16_t *)dstBuffer)[i] - s;
+    signal += s * s;
+    noise += e * e;
+  }
+  Serial.printf("%-28s SNR %5.1f dB\n", "ima-adpcm round trip", 10 * log10(signal / (noise ? noise : 1)));
+
+  benchPrintLoad("u-law encode", rate, benchRun(codecKernelUlawEncode, BENCH_SAMPLES));
+  benchPrintLoad("u-law decode", rate, benchRun(codecKernelUlawDecode, BENCH_SAMPLES));
+}
+
+void benchCodec() {
+  Serial.println("\n*** audioCODEC.h ***");
+  benchCodecRate(16000);
+  benchCodecRate(44100);
+}
+
+/**
+ * DSP chain (audioDSP.h)
+ */
+
+DspChain benchChain;
+
+void dspKernelChain() {
+  dspProcess(&benchChain, (uint8_t *)srcBuffer, BENCH_SAMPLES * sizeof(int16_t));
+}
+
+// every profile on the 16-bit voice signal, with the gain of the microphone like a recording
+void benchDspRate(uint32_t rate) {
+  Serial.printf("%u Hz mono:\n", rate);
+  for (int p = 1; p < dspNumProfiles; p++) {
+    benchFillVoice(rate);
+    dspChainInit(&benchChain, p, rate, 16, 1, 5);
+    float kernel = benchRun(dspKernelChain, BENCH_SAMPLES);
+    benchPrintLoad(dspProfiles[p].name, rate, kernel);
+    Serial.println(dspGetStats(&benchChain));
+  }
+}
+
+void benchDsp() {
+  Serial.println("\n*** audioDSP.h ***");
+  benchDspRate(16000);
+  benchDspRate(44100);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  Serial.printf("\nDSP benchmark, CPU %u MHz, %d blocks of %d samples\n", ESP.getCpuFreqMHz(), BENCH_BLOCKS, BENCH_SAMPLES);
+  benchConv();
+  benchSrc();
+  benchCodec();
+  benchDsp();
+}
+
+void loop() {
+  // Empty loop, the benchmark runs once
+}
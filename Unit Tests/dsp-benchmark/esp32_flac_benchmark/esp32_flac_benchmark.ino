@@ -0,0 +1,178 @@
+/*
+Benchmark the lossless FLAC coder of esp32-audio-recorder on the sample files, no peripherals needed.
+Our infrastructure encapsulates the common functionality for FileSystem and the FLAC coder
+
+Test setup:
+  - ESP32 (CH9102)
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+  - Upload the .wav files of Assets/audio to SPIFFS (e.g. through the GUI of esp32-audio-recorder)
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. Each .wav file is coded to /bench.flac the way a recording is, then decoded back and compared.
+     32-bit files are coded as their top 24 bits, like a hires recording.
+  4. Watch the compression ratio, the encode/decode speed (x real time) and that every file is lossless.
+*/
+
+#include <fsFLASH.h>  // from Diana-audio-utils, with audioFLAC.h
+
+#define BENCH_FRAMES (1024)            // frames per read, like a block of the recording writer
+#define BENCH_FLAC_FILE "/bench.flac"  // removed at the end
+#define BENCH_MAX_FILES (16)
+
+uint8_t pcmBuffer[BENCH_FRAMES * 8];  // up to 32-bit stereo
+uint8_t refBuffer[BENCH_FRAMES * 8];
+
+// read frames of the WAV file as packed 16/24-bit, a 32-bit sample keeps its top 24 bits
+size_t benchReadPcm(File &wav, WAVHeader *header, uint8_t *dest, size_t frames) {
+  size_t bytes = wav.read(dest, frames * header->blockAlign);
+  if (header->bitsPerSample != 32) {
+    return bytes;
+  }
+  size_t samples = bytes / 4;
+  for (size_t i = 0; i < samples; i++) {
+    memmove(dest + i * 3, dest + i * 4 + 1, 3);
+  }
+  return samples * 3;
+}
+
+void benchFlacFile(String path) {
+  File wav = FS_TYPE.open(path);
+  WAVHeader header;
+  if (!wav || !fsEnsureWavHeader(wav, &header) || header.audioFormat != WAV_FORMAT_PCM || header.bitsPerSample == 8) {
+    Serial.printf("%-28s skipped, not a 16/24/32-bit PCM file\n", path.c_str());
+    wav.close();
+    return;
+  }
+  int bits = header.bitsPerSample == 32 ? 24 : header.bitsPerSample;
+  int frameSize = bits / 8 * header.numChannels;
+  uint32_t totalFrames = header.dataSize / header.blockAlign;
+
+  // encode, the way recordWav() does: header with placeholders, frames, the last block, header again
+  FlacEncoder enc;
+  if (!flacEncoderInit(&enc, header.sampleRate, header.numChannels, bits, totalFrames)) {
+    Serial.println("Failed to allocate the encoder");
+    wav.close();
+    return;
+  }
+  uint8_t *coded = (uint8_t *)malloc(flacEncodeBound(&enc, BENCH_FRAMES));
+  File out = FS_TYPE.open(BENCH_FLAC_FILE, FILE_WRITE);
+  fsWriteFlacHeader(out, &enc);
+  unsigned long encodeTime = 0;
+  size_t pcmBytes = 0;
+  for (;;) {
+    size_t bytes = benchReadPcm(wav, &header, pcmBuffer, BENCH_FRAMES);
+    if (bytes == 0) {
+      break;
+    }
+    pcmBytes += bytes;
+    unsigned long start = micros();
+    size_t len = flacEncode(&enc, coded, pcmBuffer, bytes / frameSize);
+    encodeTime += micros() - start;
+    out.write(coded, len);
+  }
+  unsigned long start = micros();
+  size_t len = flacEncoderFlush(&enc, coded);
+  encodeTime += micros() - start;
+  out.write(coded, len);
+  fsWriteFlacHeader(out, &enc);
+  size_t flacBytes = out.size();
+  out.close();
+  flacEncoderEnd(&enc);
+  free(coded);
+
+  // decode the whole file, the way the prefetch reader of the player does, and compare with the WAV
+  File in = FS_TYPE.open(BENCH_FLAC_FILE);
+  FlacStreamInfo info;
+  uint64_t sample;
+  FlacDecoder dec;
+  if (!fsFlacSeek(in, &info, 0, &sample) || !flacDecoderInit(&dec, &info)) {
+    Serial.println("Failed to open the FLAC file");
+    in.close();
+    wav.close();
+    return;
+  }
+  size_t size = flacDecoderFrameBytes(&dec);
+  uint8_t *input = (uint8_t *)malloc(size);
+  size_t have = 0;
+  bool eof = false;
+  unsigned long decodeTime = 0;
+  uint64_t decoded = 0;
+  uint32_t mismatches = 0;
+  wav.seek(header.dataOffset);
+  for (;;) {
+    if (!eof && have < size) {
+      have += in.read(input + have, size - have);
+      eof = in.available() == 0;
+    }
+    size_t consumed;
+    start = micros();
+    int frames = flacDecodeFrame(&dec, input, have, !eof && have < size, &consumed);
+    decodeTime += micros() - start;
+    if (frames == 0 && consumed == 0) {
+      break;
+    }
+    memmove(input, input + consumed, have - consumed);
+    have -= consumed;
+    if (frames == 0) {
+      mismatches++;  // a broken frame, can't happen on a file we just wrote
+      continue;
+    }
+    for (int i = 0; i < frames; i += BENCH_FRAMES) {
+      int n = min(BENCH_FRAMES, frames - i);
+      start = micros();
+      size_t bytes = flacDecoderRead(&dec, pcmBuffer, i, n);
+      decodeTime += micros() - start;
+      if (benchReadPcm(wav, &header, refBuffer, n) != bytes || memcmp(pcmBuffer, refBuffer, bytes) != 0) {
+        mismatches++;
+      }
+    }
+    decoded += frames;
+  }
+  free(input);
+  flacDecoderEnd(&dec);
+  in.close();
+  wav.close();
+  FS_TYPE.remove(BENCH_FLAC_FILE);
+
+  float seconds = (float)totalFrames / header.sampleRate;
+  float encodeRate = totalFrames * 1000000.0 / (encodeTime ? encodeTime : 1);
+  float decodeRate = totalFrames * 1000000.0 / (decodeTime ? decodeTime : 1);
+  Serial.printf("%-28s %5u Hz %d-bit %d-ch %5.1f s: ratio %.2fx, encode %8.0f S/s (x%.1f), decode %8.0f S/s (x%.1f), %s\n",
+                path.c_str(), header.sampleRate, bits, header.numChannels, seconds, (float)pcmBytes / flacBytes,
+                encodeRate, encodeRate / header.sampleRate, decodeRate, decodeRate / header.sampleRate,
+                mismatches == 0 && decoded == totalFrames ? "lossless" : "MISMATCH");
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  fsInit();
+
+  Serial.printf("\nFLAC benchmark, CPU %u MHz, blocks of %d frames\n", ESP.getCpuFreqMHz(), FLAC_BLOCK_SIZE);
+  // list the files first, the benchmark writes and removes one meanwhile
+  String paths[BENCH_MAX_FILES];
+  int count = 0;
+  File root = FS_TYPE.open("/");
+  File file = root.openNextFile();
+  while (file && count < BENCH_MAX_FILES) {
+    String path = "/" + String(file.name());
+    file.close();
+    if (path.endsWith(".wav")) {
+      paths[count++] = path;
+    }
+    file = root.openNextFile();
+  }
+  root.close();
+
+  for (int i = 0; i < count; i++) {
+    benchFlacFile(paths[i]);
+  }
+}
+
+void loop() {
+  // Empty loop, the benchmark runs once
+}
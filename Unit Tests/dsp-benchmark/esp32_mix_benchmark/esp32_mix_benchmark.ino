@@ -0,0 +1,102 @@
+/*
+Benchmark the playback mixer of esp32-audio-recorder, no peripherals and no files needed.
+Our infrastructure encapsulates the common functionality for the conversion, the resampler and the mixer
+
+Test setup:
+  - ESP32 (CH9102)
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. The DAC blocks of a playback (48kHz/16-bit stereo, 1024 B) go through the mixer with 1 to 4 sources:
+     the playback alone at unity (bypassed), at a lower volume, and with 1-3 overlays in the DAC format
+     or as 16kHz mono clips (converted and resampled on the way), with a master fade over all of them.
+  4. Compare the cycles per block, and the CPU load against the 5.3 ms a block plays.
+*/
+
+#include <audioCONV.h> // from Diana-audio-utils
+#include <audioSRC.h>  // from Diana-audio-utils
+#include <audioMIX.h>  // from Diana-audio-utils, after audioCONV.h and audioSRC.h
+
+#define BENCH_RATE (48000)
+#define BENCH_BLOCK (1024) // PLAY_DAC_BLOCK, 256 stereo frames
+#define BENCH_BLOCKS (20)  // the overlays of the DAC format are in RAM, 20 KB each
+
+Mixer mixer;
+int16_t block[BENCH_BLOCK / 2];
+
+// a clip of a tone, rate and channels of its file, freed by the mixer when it ends
+uint8_t *benchClip(uint32_t rate, int channels, float freq, uint32_t *bytes) {
+  uint32_t frames = (uint64_t)BENCH_BLOCKS * (BENCH_BLOCK / 4) * rate / BENCH_RATE + 64;
+  *bytes = frames * channels * sizeof(int16_t);
+  int16_t *clip = (int16_t *)malloc(*bytes);
+  if (clip == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < frames * channels; i++) {
+    clip[i] = (int16_t)(8000 * sinf(2 * PI * freq * (i / channels) / rate));
+  }
+  return (uint8_t *)clip;
+}
+
+// the playback at volume, with overlays of the rate and channels, returns the cycles per block
+void benchMix(const char *name, float volume, int overlays, uint32_t rate, int channels) {
+  mixInit(&mixer, 1.0);
+  mixStart(&mixer, BENCH_RATE, 16, 2);
+  if (volume < 1) {
+    mixGainSet(&mixer.sources[0].volume, volume, 0);
+  }
+  for (int s = 0; s < overlays; s++) {
+    uint32_t bytes;
+    uint8_t *clip = benchClip(rate, channels, 660 + 220 * s, &bytes);
+    if (clip == NULL || mixAddClip(&mixer, clip, bytes, rate, 16, channels, 0.5, 0, "bench") < 0) {
+      Serial.println("Not enough RAM");
+      free(clip);
+      mixStop(&mixer);
+      return;
+    }
+  }
+  if (overlays > 0) {
+    mixGainSet(&mixer.master, 0.5, 50); // a fade over the whole run
+  }
+
+  unsigned long elapsed = 0;
+  for (int b = 0; b < BENCH_BLOCKS; b++) {
+    for (int i = 0; i < BENCH_BLOCK / 2; i++) {
+      block[i] = (int16_t)(esp_random() & 0x3FFF) - 0x2000;
+    }
+    unsigned long start = micros();
+    mixProcess(&mixer, (uint8_t *)block, BENCH_BLOCK);
+    elapsed += micros() - start;
+  }
+  float blockUs = (float)elapsed / BENCH_BLOCKS;
+  float playUs = (BENCH_BLOCK / 4) * 1e6f / BENCH_RATE;
+  Serial.printf("%-34s %7u cycles, %6.1f us per block, CPU %5.2f%% of a core\n", name,
+                mixer.blocks ? (uint32_t)(mixer.cycles / mixer.blocks) : 0, blockUs, blockUs * 100 / playUs);
+  mixStop(&mixer);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  Serial.printf("\nMixer benchmark, CPU %u MHz, %d blocks of %d B at %d Hz stereo\n", ESP.getCpuFreqMHz(), BENCH_BLOCKS, BENCH_BLOCK, BENCH_RATE);
+
+  benchMix("1 source, unity (bypass)", 1.0, 0, 0, 0);
+  benchMix("1 source, volume 50%", 0.5, 0, 0, 0);
+  char name[40];
+  for (int overlays = 1; overlays < MIX_MAX_SOURCES; overlays++) {
+    snprintf(name, sizeof(name), "%d sources, 48kHz stereo overlays", overlays + 1);
+    benchMix(name, 0.5, overlays, BENCH_RATE, 2);
+  }
+  for (int overlays = 1; overlays < MIX_MAX_SOURCES; overlays++) {
+    snprintf(name, sizeof(name), "%d sources, 16kHz mono overlays", overlays + 1);
+    benchMix(name, 0.5, overlays, 16000, 1);
+  }
+}
+
+void loop() {
+  // Empty loop, the benchmark runs once
+}
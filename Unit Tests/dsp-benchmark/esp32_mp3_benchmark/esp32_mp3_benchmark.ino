@@ -0,0 +1,101 @@
+/*
+Measure the CPU load of the streaming MP3 decoder of esp32-audio-recorder on the sample files, no peripherals needed.
+Our infrastructure encapsulates the common functionality for FileSystem and the MP3 decoder
+
+Test setup:
+  - ESP32 (CH9102)
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - arduino-libhelix 0.8.6 by pschatzmann (~/Arduino/libraries)
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+  - Upload the .mp3 files of Assets/audio to SPIFFS (e.g. through the GUI of esp32-audio-recorder)
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. Each .mp3 file is decoded the way the player does (a couple of frames in RAM), on core 0 like the player.
+  4. Watch the average and the peak load per frame, the player needs them well below 100% next to the web server.
+*/
+
+#define FS_MP3 true   // fsFLASH.h with audioMP3.h
+#include <fsFLASH.h>  // from Diana-audio-utils
+
+#define BENCH_MAX_FILES (16)
+#define BENCH_TASK_STACK (6 * 1024)  // MP3_DECODE_TASK_STACK of main.cpp
+
+String paths[BENCH_MAX_FILES];
+int count = 0;
+
+void benchMp3File(String path) {
+  File file = FS_TYPE.open(path);
+  WAVHeader header;
+  if (!file || !fsEnsureWavHeader(file, &header) || header.audioFormat != WAV_FORMAT_MP3) {
+    Serial.printf("%-28s skipped, not an MP3 file\n", path.c_str());
+    file.close();
+    return;
+  }
+
+  Mp3Decoder dec;
+  if (!mp3DecoderInit(&dec, header.sampleRate, header.numChannels)) {
+    Serial.println("Failed to allocate the MP3 decoder");
+    mp3DecoderEnd(&dec);
+    file.close();
+    return;
+  }
+  bool eof = false;
+  uint32_t decoded = 0;
+  for (;;) {
+    size_t space;
+    uint8_t *input = mp3DecoderInput(&dec, &space);
+    if (!eof && space > 0) {
+      mp3DecoderFilled(&dec, file.read(input, space));
+      eof = file.available() == 0;
+    }
+    int frames = mp3DecodeFrame(&dec, !eof);
+    if (frames == 0) {
+      if (eof) {
+        break;
+      }
+      continue;
+    }
+    decoded += frames;
+  }
+  file.close();
+
+  Serial.printf("%-28s %5u Hz %d-ch %6.1f s (estimated %6.1f s): %s\n", path.c_str(), header.sampleRate, header.numChannels,
+                (float)decoded / header.sampleRate, fsWavDurationMs(&header) / 1000.0, mp3GetLoad(&dec.load).c_str());
+  mp3DecoderEnd(&dec);
+}
+
+void benchTask(void *param) {
+  for (int i = 0; i < count; i++) {
+    benchMp3File(paths[i]);
+  }
+  Serial.println("Done");
+  vTaskDelete(NULL);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  fsInit();
+
+  Serial.printf("\nMP3 decoder benchmark, CPU %u MHz, free heap %u B\n", ESP.getCpuFreqMHz(), ESP.getFreeHeap());
+  File root = FS_TYPE.open("/");
+  File file = root.openNextFile();
+  while (file && count < BENCH_MAX_FILES) {
+    String path = "/" + String(file.name());
+    file.close();
+    if (path.endsWith(".mp3")) {
+      paths[count++] = path;
+    }
+    file = root.openNextFile();
+  }
+  root.close();
+
+  xTaskCreatePinnedToCore(benchTask, "Decode MP3", BENCH_TASK_STACK, NULL, 2, NULL, 0);
+}
+
+void loop() {
+  // Empty loop, the benchmark runs in its task
+}
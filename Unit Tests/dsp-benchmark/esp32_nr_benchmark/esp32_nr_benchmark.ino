@@ -0,0 +1,101 @@
+/*
+Benchmark the noise suppression of esp32-audio-recorder at 16kHz, no peripherals and no files needed.
+Our infrastructure encapsulates the common functionality for the noise suppression
+
+Test setup:
+  - ESP32 (CH9102)
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. A 2 s test signal is made block by block: a hum and a hiss (the noise), and after 0.5 s of noise only
+     a 440 Hz tone in bursts (the sound). It goes through the suppression in blocks of 1024 samples, like /denoise.
+  4. Watch the real-time factor (the processing time / the audio time, below 1 keeps up with the microphone),
+     the SNR before and after, and the noise left where there is no sound.
+*/
+
+#include <audioNR.h>  // from Diana-audio-utils
+
+#define BENCH_RATE (16000)
+#define BENCH_SECONDS (2)
+#define BENCH_BLOCK (1024)
+
+NrState nr;
+int32_t block[BENCH_BLOCK];
+
+// the tone in bursts after 0.5 s, left-justified 32-bit like the recording chain
+int32_t benchSound(int i) {
+  if (i < BENCH_RATE / 2) {
+    return 0;
+  }
+  return (int32_t)(0.2 * sin(2 * M_PI * 440 * i / BENCH_RATE) * sin(2 * M_PI * 3 * i / BENCH_RATE) * 2147483647.0);
+}
+
+// the hum and the hiss, a hash of the position, so the same sample can be made again for the SNR
+int32_t benchNoise(int i) {
+  uint32_t h = (uint32_t)i * 2654435761u;
+  h ^= h >> 15;
+  h *= 2246822519u;
+  h ^= h >> 13;
+  double hiss = ((double)h / 4294967295.0 - 0.5) * 2;
+  return (int32_t)((0.02 * sin(2 * M_PI * 120 * i / BENCH_RATE) + 0.03 * hiss) * 2147483647.0);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  if (!nrInit(&nr, BENCH_RATE, NR_LEARN_MS)) {
+    Serial.println("Not enough RAM");
+    return;
+  }
+  Serial.printf("\nNoise suppression benchmark, CPU %u MHz, FFT of %d, %d Hz\n", ESP.getCpuFreqMHz(), NR_FFT_SIZE, BENCH_RATE);
+
+  // the output is late by NR_FFT_SIZE samples: out[i] is the sample i - NR_FFT_SIZE of the input
+  int n = BENCH_RATE * BENCH_SECONDS;
+  double signal = 0, before = 0, after = 0, quietIn = 0, quietOut = 0;
+  unsigned long elapsed = 0;
+  unsigned long maxTime = 0;
+  for (int at = 0; at < n; at += BENCH_BLOCK) {
+    int len = min(BENCH_BLOCK, n - at);
+    for (int i = 0; i < len; i++) {
+      block[i] = benchSound(at + i) + benchNoise(at + i);
+    }
+    unsigned long start = micros();
+    nrProcess(&nr, block, len);
+    unsigned long time = micros() - start;
+    elapsed += time;
+    maxTime = max(maxTime, time);
+
+    for (int i = 0; i < len; i++) {
+      int t = at + i - NR_FFT_SIZE;
+      if (t < 0) {
+        continue;
+      }
+      double c = benchSound(t);
+      double in = benchNoise(t);
+      double left = block[i] - c;
+      if (t >= BENCH_RATE / 4 && t < BENCH_RATE / 2) {
+        // the noise alone, after the learning
+        quietIn += in * in;
+        quietOut += left * left;
+      } else if (t >= BENCH_RATE) {
+        signal += c * c;
+        before += in * in;
+        after += left * left;
+      }
+    }
+  }
+
+  Serial.printf("%d ms in %lu us: RTF %.4f, %lu us max per block of %d ms\n", BENCH_SECONDS * 1000, elapsed,
+                elapsed / (BENCH_SECONDS * 1e6), maxTime, BENCH_BLOCK * 1000 / BENCH_RATE);
+  Serial.printf("SNR %.1f dB -> %.1f dB, the noise alone %.1f dB lower, the last frame %.1f dB\n", 10 * log10(signal / before),
+                10 * log10(signal / after), 10 * log10(quietIn / quietOut), nrGetReductionDb(&nr));
+  nrEnd(&nr);
+}
+
+void loop() {
+  // Empty loop, the benchmark runs once
+}
@@ -0,0 +1,96 @@
+/*
+Benchmark the voice activity detection of esp32-audio-recorder on the sample files, no peripherals needed.
+Our infrastructure encapsulates the common functionality for FileSystem and the VAD
+
+Test setup:
+  - ESP32 (CH9102)
+  - Arduino IDE 2.3.3
+  - Board manager: esp32 v3.0.6 by Espressif Systems
+  - Copy the .h files from esp32-audio-recorder/src to the Diana-audio-utils library folder
+  - Upload the .wav files of Assets/audio to SPIFFS (e.g. through the GUI of esp32-audio-recorder)
+
+Test scenario:
+  1. Upload the sketch and open Serial Monitor.
+  2. Press the RESET button on your esp32.
+  3. Each 16/32-bit .wav file goes through the VAD in blocks of the recording writer, the way recProcessBlock does.
+     The files are already recordings, they are measured without the gain of the microphone.
+  4. Watch the share of the audio that is kept, the cost per block, and the voiced segments.
+*/
+
+#include <fsFLASH.h>   // from Diana-audio-utils
+#include <audioVAD.h>  // from Diana-audio-utils
+
+#define BENCH_BLOCK (4096)  // REC_WRITE_BLOCK of esp32-audio-recorder
+#define BENCH_MAX_FILES (16)
+
+uint8_t block[BENCH_BLOCK];
+VadState vad;
+
+void benchVadFile(String path) {
+  File wav = FS_TYPE.open(path);
+  WAVHeader header;
+  if (!wav || !fsEnsureWavHeader(wav, &header) || header.audioFormat != WAV_FORMAT_PCM ||
+      (header.bitsPerSample != 16 && header.bitsPerSample != 32)) {
+    Serial.printf("%-28s skipped, not a 16/32-bit PCM file\n", path.c_str());
+    wav.close();
+    return;
+  }
+
+  vadInit(&vad, true, header.sampleRate, header.bitsPerSample, header.numChannels, 0);
+  size_t len = BENCH_BLOCK / header.blockAlign * header.blockAlign;
+  size_t total = 0;
+  size_t kept = 0;
+  uint32_t blocks = 0;
+  unsigned long vadTime = 0;
+  unsigned long maxTime = 0;
+  for (;;) {
+    size_t bytes = wav.read(block, len);
+    if (bytes == 0) {
+      break;
+    }
+    unsigned long start = micros();
+    kept += vadFilter(&vad, block, bytes);
+    unsigned long elapsed = micros() - start;
+    vadTime += elapsed;
+    maxTime = max(maxTime, elapsed);
+    total += bytes;
+    blocks++;
+  }
+  wav.close();
+
+  float blockMs = (float)len / header.blockAlign * 1000 / header.sampleRate;
+  float avgUs = blocks ? (float)vadTime / blocks : 0;
+  Serial.printf("%-28s %5u Hz %d-bit %d-ch: kept %3.0f%%, %6.1f us per block (max %lu us) of %.1f ms, load %.2f%%\n",
+                path.c_str(), header.sampleRate, header.bitsPerSample, header.numChannels, total ? kept * 100.0 / total : 0,
+                avgUs, maxTime, blockMs, avgUs / 10 / blockMs);
+  Serial.println(vadGetState(&vad));
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+  fsInit();
+
+  Serial.printf("\nVAD benchmark, CPU %u MHz, decisions of %d ms\n", ESP.getCpuFreqMHz(), VAD_FRAME_MS);
+  String paths[BENCH_MAX_FILES];
+  int count = 0;
+  File root = FS_TYPE.open("/");
+  File file = root.openNextFile();
+  while (file && count < BENCH_MAX_FILES) {
+    String path = "/" + String(file.name());
+    file.close();
+    if (path.endsWith(".wav")) {
+      paths[count++] = path;
+    }
+    file = root.openNextFile();
+  }
+  root.close();
+
+  for (int i = 0; i < count; i++) {
+    benchVadFile(paths[i]);
+  }
+}
+
+void loop() {
+  // Empty loop, the benchmark runs once
+}
@@ -2,6 +2,10 @@ const uploadButton = document.getElementById('submit-form');
 const recordButton = document.getElementById('record-button');
 const playButton = document.getElementById('play-button');
 const deleteButton = document.getElementById('delete-button');
+const pauseButton = document.getElementById('pause-button');
+const stopButton = document.getElementById('stop-button');
+const playProgress = document.getElementById('play-progress');
+const playTime = document.getElementById('play-time');
 // const statusDiv = document.getElementById('status');
 
 let filepath = ""; // for play or delete
@@ -12,6 +16,8 @@ let isUploading = false;
 let isRecording = false;
 let isPlaying = false;
 let isDeleting = false;
+let isPaused = false;
+let progressTimer = null;
 let isBusy = false;
 let isUploadAvailable = false
 let isRecordAvailable = false;
@@ -65,6 +71,12 @@ function updateButtonState() {
 
     deleteButton.textContent = isDeleting ? 'Deleting...' : 'Delete from FS';
     deleteButton.disabled = isBusy || !isDeleteAvailable;
+
+    // the transport is available only while playing
+    pauseButton.textContent = isPaused ? 'Resume' : 'Pause';
+    pauseButton.disabled = !isPlaying;
+    stopButton.disabled = !isPlaying;
+    playProgress.disabled = !isPlaying;
 }
 
 function sleep(ms) {
@@ -83,6 +95,7 @@ function getPlaylist() {
                 row = table.insertRow();
                 row.insertCell(0).textContent = audio_file.name;
                 row.insertCell(1).textContent = audio_file.size;
+                drawPeaks(row.insertCell(2), audio_file.path);
 
                 let option = document.createElement("option");
                 option.setAttribute('value', audio_file.path);
@@ -94,6 +107,51 @@ function getPlaylist() {
         });
 }
 
+// the waveform thumbnail of a file: the min/max peaks of /peaks, the layout is in audioPEAK.h
+async function drawPeaks(cell, path) {
+    const res = await fetch('/peaks?file=' + encodeURIComponent(path));
+    if (!res.ok)
+        return; // recorded or uploaded before the peaks, or not a PCM .wav file
+    const view = new DataView(await res.arrayBuffer());
+    if (view.getUint32(0, true) != 0x4B414550) // 'PEAK'
+        return;
+    const canvas = document.createElement('canvas');
+    canvas.className = 'peaks-canvas';
+    canvas.width = 200;
+    canvas.height = 32;
+    cell.appendChild(canvas);
+
+    // the coarsest level with a bucket per pixel at least, or the finest one that is there
+    const levels = view.getUint16(12, true);
+    let offset = 16 + 8 * levels;
+    let best = null;
+    for (let l = 0; l < levels; l++) {
+        const buckets = view.getUint32(20 + 8 * l, true);
+        if (buckets > 0 && (best == null || best.buckets < canvas.width))
+            best = { offset: offset, buckets: buckets };
+        offset += buckets * 2;
+    }
+    if (best == null)
+        return;
+
+    const ctx = canvas.getContext('2d');
+    ctx.fillStyle = '#4CAF50';
+    const mid = canvas.height / 2;
+    for (let x = 0; x < canvas.width; x++) {
+        const from = Math.floor(x * best.buckets / canvas.width);
+        const to = Math.max(from + 1, Math.floor((x + 1) * best.buckets / canvas.width));
+        let low = 127, high = -128;
+        for (let i = from; i < to && i < best.buckets; i++) {
+            low = Math.min(low, view.getInt8(best.offset + 2 * i));
+            high = Math.max(high, view.getInt8(best.offset + 2 * i + 1));
+        }
+        if (high < low)
+            continue;
+        const top = mid - (high + 1) / 128 * mid;
+        ctx.fillRect(x, top, 1, Math.max(1, (high - low + 1) / 128 * mid));
+    }
+}
+
 function getSpace() {
     fetch('/space')
         .then(response => response.json())
@@ -151,7 +209,7 @@ async function deleteAudio() {
 
 async function playAudio() {
     console.log('Playing: wait until ready...');
-    await waitForReady(); // wait until ready
+    await waitForReady('dac'); // wait until the speaker is ready, recording may go on
     if (!isPlaying) {
         try {
             setPlaying(true);
@@ -167,13 +225,15 @@ async function playAudio() {
             const data = await res.text(); // don't forget to wait for data
             console.log('[response data]', data);
 
-            await waitForReady(); // Start checking playback status
+            startProgress();
+            await waitForReady('dac'); // Start checking playback status
             console.log('[play back from status]');
         }
         catch (error) {
             console.error('[play request failed]', error.message);
         }
         finally {
+            stopProgress();
             setPlaying(false);
             //location.replace("/"); // goto home with no 'go back' option
         }
@@ -182,7 +242,7 @@ async function playAudio() {
 
 async function startRecording() {
     console.log('Recording: wait until ready...');
-    await waitForReady(); // wait until ready
+    await waitForReady('mic'); // wait until the microphone is ready, playback may go on
     if (!isRecording) {
         try {
             setRecording(true);
@@ -190,6 +250,7 @@ async function startRecording() {
             console.log('[record_time]', record_time);
             var formData = new FormData();
             formData.append("record_time", record_time);
+            formData.append("preset", document.getElementById("preset-select").value);
             console.log('[record request]');
             const res = await fetch('/record', {
                 method: 'post',
@@ -199,7 +260,7 @@ async function startRecording() {
             const data = await res.text(); // don't forget to wait for data
             console.log('[response data]', data);
 
-            await waitForReady(); // Start checking playback status
+            await waitForReady('mic'); // Start checking recording status
             console.log('[record back from status]');
         }
         catch (error) {
@@ -212,11 +273,77 @@ async function startRecording() {
     }
 }
 
-async function checkPlaybackStatus() {
+function formatTime(ms) {
+    const sec = Math.floor(ms / 1000);
+    return Math.floor(sec / 60) + ':' + String(sec % 60).padStart(2, '0');
+}
+
+// poll the playback position, for the progress bar
+async function updateProgress() {
+    try {
+        const res = await fetch('/position');
+        const data = await res.json();
+        isPaused = (data.state == 'paused');
+        playProgress.max = data.duration;
+        if (document.activeElement !== playProgress) // don't fight the user dragging the slider
+            playProgress.value = data.position;
+        playTime.textContent = formatTime(data.position) + ' / ' + formatTime(data.duration);
+        updateButtonState();
+    }
+    catch (error) {
+        console.error('[position request failed]', error.message);
+    }
+}
+
+function startProgress() {
+    stopProgress();
+    progressTimer = setInterval(updateProgress, 500);
+}
+
+function stopProgress() {
+    if (progressTimer) {
+        clearInterval(progressTimer);
+        progressTimer = null;
+    }
+    isPaused = false;
+}
+
+async function sendTransport(action, position) {
+    var formData = new FormData();
+    formData.append("action", action);
+    if (position !== undefined)
+        formData.append("position", position);
+    try {
+        const res = await fetch('/transport', {
+            method: 'post',
+            body: formData
+        });
+        console.log('[transport response status]', action, res.status);
+    }
+    catch (error) {
+        console.error('[transport request failed]', error.message);
+    }
+    updateProgress();
+}
+
+function pauseAudio() {
+    sendTransport(isPaused ? 'resume' : 'pause');
+}
+
+function stopAudio() {
+    sendTransport('stop');
+}
+
+function seekAudio(position) {
+    sendTransport('seek', position);
+}
+
+// device: 'mic', 'dac' or undefined for both
+async function checkPlaybackStatus(device) {
     let ready = false;
     try {
         //console.log('[status request]', new Date());
-        const res = await fetch('/status');
+        const res = await fetch(device ? '/status?device=' + device : '/status');
         //console.log('[response status]', res.status);
         const data = await res.text(); // don't forget to wait for data
         //console.log('[response data]', data);
@@ -236,7 +363,7 @@ async function checkPlaybackStatus() {
     }
 }
 
-async function waitForReady() {
+async function waitForReady(device) {
     let ready = false;
     const maxTries = 60;
     let currTry = 0;
@@ -246,7 +373,7 @@ async function waitForReady() {
             console.log('[exit waiting due to max tries]', new Date());
             break;
         }
-        ready = await checkPlaybackStatus();
+        ready = await checkPlaybackStatus(device);
         if (!ready)
             await sleep(10000); // wait for 10 seconds before next try
     }
@@ -305,6 +432,52 @@ async function uploadFile(file, currTry = 1, retries = 3) {
 };
 */
 
+// the live level and spectrum of the mic: binary frames of /ws/spectrum, the layout is in audioSPEC.h
+let meterSocket = null;
+
+function drawMeter(frame) {
+    const view = new DataView(frame);
+    if (view.getUint8(0) != 0x53) // 'S'
+        return;
+    const bins = view.getUint8(1);
+    const rms = view.getInt16(6, true) / 10;
+    const peak = view.getInt16(8, true) / 10;
+    document.getElementById('meter-level').textContent = 'RMS ' + rms.toFixed(1) + ' dBFS, peak ' + peak.toFixed(1) + ' dBFS';
+
+    // the bands from -120 dBFS (0) to full scale (120)
+    const canvas = document.getElementById('meter-canvas');
+    const ctx = canvas.getContext('2d');
+    const width = canvas.width / bins;
+    ctx.clearRect(0, 0, canvas.width, canvas.height);
+    ctx.fillStyle = peak > -1 ? '#f44336' : '#4CAF50';
+    for (let i = 0; i < bins; i++) {
+        const height = view.getUint8(12 + i) / 120 * canvas.height;
+        ctx.fillRect(i * width, canvas.height - height, width - 1, height);
+    }
+}
+
+function toggleMeter() {
+    const button = document.getElementById('meter-button');
+    const canvas = document.getElementById('meter-canvas');
+    if (meterSocket) {
+        meterSocket.close();
+        meterSocket = null;
+        button.textContent = 'Show Mic Level';
+        canvas.style.display = 'none';
+        document.getElementById('meter-level').textContent = '';
+        return;
+    }
+    meterSocket = new WebSocket('ws://' + location.host + '/ws/spectrum');
+    meterSocket.binaryType = 'arraybuffer';
+    meterSocket.onmessage = e => drawMeter(e.data);
+    meterSocket.onclose = () => {
+        if (meterSocket)
+            toggleMeter(); // closed by the server, reset the button
+    };
+    button.textContent = 'Hide Mic Level';
+    canvas.style.display = 'block';
+}
+
 function loadBody() {
     // disable the page while loading
     updateButtonState();
@@ -0,0 +1,131 @@
+/**
+ * Armed recording: the microphone captures all the time into a RAM ring holding the last seconds (the pre-roll),
+ * and nothing is written to the flash until a trigger, either the level of the audio or a call of the API.
+ * The trigger commits the pre-roll and the live audio after it to the recording file, so the recording starts
+ * before the event that triggered it. The pre-roll keeps the raw I2S blocks, the recording codes them like live ones.
+ * The capture and the file are the recording pipeline of main.cpp (armJob).
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <math.h>
+#include <esp_heap_caps.h>
+
+// the last seconds of raw capture, the oldest bytes are overwritten
+struct PreRoll
+{
+  uint8_t *data;
+  size_t size;   // a whole number of blocks (and of frames)
+  size_t head;   // the next byte to write
+  size_t filled; // bytes held, up to size
+};
+
+// the state of the armed mode, json ready (armGetState)
+struct ArmState
+{
+  bool armed;                 // capturing into the pre-roll
+  bool triggered;             // committed, recording to the file
+  int prerollSec;             // the length of the pre-roll
+  int liveSec;                // recorded after the trigger
+  float thresholdDb;          // dBFS of the level trigger, 0 - API only
+  float levelDb;              // the peak of the last block
+  float maxLevelDb;           // the loudest block since armed
+  uint32_t heldMs;            // of pre-roll at the trigger (less than prerollSec when it came early)
+  const char *source;         // what triggered: "level" or "api"
+  unsigned long droppedBytes; // lost in the full capture ring since armed
+};
+
+ArmState armState;
+volatile bool armTriggerRequested = false; // set by /arm action=trigger
+
+// PSRAM when there is some, the internal heap otherwise
+bool prerollCreate(PreRoll *ring, size_t size)
+{
+  ring->data = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (ring->data == NULL)
+    ring->data = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+  ring->size = size;
+  ring->head = 0;
+  ring->filled = 0;
+  return ring->data != NULL;
+}
+
+void prerollDestroy(PreRoll *ring)
+{
+  heap_caps_free(ring->data);
+  ring->data = NULL;
+  ring->filled = 0;
+}
+
+// the largest pre-roll that can be allocated right now
+size_t prerollAvailable()
+{
+  return max(heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+// add a block, over the oldest bytes when the ring is full
+void prerollPush(PreRoll *ring, const uint8_t *src, size_t len)
+{
+  if (len > ring->size)
+  {
+    src += len - ring->size;
+    len = ring->size;
+  }
+  size_t first = min(len, ring->size - ring->head);
+  memcpy(ring->data + ring->head, src, first);
+  memcpy(ring->data, src + first, len - first);
+  ring->head = (ring->head + len) % ring->size;
+  ring->filled = min(ring->filled + len, ring->size);
+}
+
+// take the oldest bytes, returns how many
+size_t prerollPop(PreRoll *ring, uint8_t *dest, size_t len)
+{
+  len = min(len, ring->filled);
+  size_t tail = (ring->head + ring->size - ring->filled) % ring->size;
+  size_t first = min(len, ring->size - tail);
+  memcpy(dest, ring->data + tail, first);
+  memcpy(dest + first, ring->data, len - first);
+  ring->filled -= len;
+  return len;
+}
+
+// The peak of a block of raw I2S samples (16 or 32-bit) in dBFS of the recording, after its gain of 2^gainShift
+float armLevelDb(const uint8_t *raw, size_t len, int captureBits, int gainShift)
+{
+  uint32_t peak = 0;
+  if (captureBits == 16)
+  {
+    const int16_t *s = (const int16_t *)raw;
+    for (size_t i = 0; i < len / 2; i++)
+      peak = max(peak, (uint32_t)abs(s[i]) << 16); // left-justified like the 32-bit ones
+  }
+  else
+  {
+    const int32_t *s = (const int32_t *)raw;
+    for (size_t i = 0; i < len / 4; i++)
+      peak = max(peak, s[i] == INT32_MIN ? (uint32_t)INT32_MAX : (uint32_t)abs(s[i]));
+  }
+  if (peak == 0)
+    return -120.0;
+  return min(0.0f, 20.0f * log10f(peak / 2147483648.0f) + 6.0206f * gainShift);
+}
+
+// json ready format
+String armGetState(ArmState *state)
+{
+  String output = "{\"armed\":";
+  output += state->armed ? "true" : "false";
+  output += ",\"triggered\":";
+  output += state->triggered ? "true" : "false";
+  output += ",\"preroll\":" + String(state->prerollSec);
+  output += ",\"time\":" + String(state->liveSec);
+  output += ",\"threshold\":" + String(state->thresholdDb, 1);
+  output += ",\"level\":" + String(state->levelDb, 1);
+  output += ",\"maxLevel\":" + String(state->maxLevelDb, 1);
+  output += ",\"heldMs\":" + String(state->heldMs);
+  output += ",\"source\":\"" + String(state->source) + "\"";
+  output += ",\"droppedBytes\":" + String(state->droppedBytes) + "}";
+  return output;
+}
@@ -0,0 +1,302 @@
+/**
+ * Audio input and output on the channel-based I2S driver (driver/i2s_std.h, standard Philips mode).
+ * The RX (mic) and TX (DAC) channels are allocated independently, each one on its own port.
+ * A channel is reclocked in place (disable -> reconfig -> enable), it is never deleted for a new format.
+ * The TX DMA can be preloaded before the channel is enabled, so a playback starts with its first sample
+ * instead of the zeros that were already queued in the DMA.
+ * Included by audioSTD.h when I2S_LEGACY_DRIVER is false, the mic*Std/dac*Std functions are adapters to this.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <driver/i2s_std.h>
+#include <freertos/queue.h>
+
+i2s_chan_handle_t micChan = NULL;
+i2s_chan_handle_t dacChan = NULL;
+QueueHandle_t micChanEvents = NULL; // AudioDmaEvent, posted by the driver callbacks
+QueueHandle_t dacChanEvents = NULL;
+bool micChanRunning = false;
+bool dacChanRunning = false; // enabled, false - the writes go into the DMA as a preload
+
+// the slot configuration of a format, mono takes a single slot (mask), stereo takes both
+i2s_std_slot_config_t chanSlotConfig(int bitsPerSample, int numChannels, i2s_std_slot_mask_t monoMask)
+{
+  i2s_std_slot_config_t slot = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG((i2s_data_bit_width_t)bitsPerSample,
+                                                                   numChannels == 2 ? I2S_SLOT_MODE_STEREO : I2S_SLOT_MODE_MONO);
+  if (numChannels != 2)
+    slot.slot_mask = monoMask;
+  return slot;
+}
+
+i2s_std_clk_config_t chanClkConfig(uint32_t sampleRate, bool useApll)
+{
+  i2s_std_clk_config_t clk = I2S_STD_CLK_DEFAULT_CONFIG(sampleRate);
+  if (useApll)
+    clk.clk_src = I2S_CLK_SRC_APLL; // accurate clock, a single APLL on the esp32 (see MIC_USE_APLL)
+  return clk;
+}
+
+// the driver callbacks run in the ISR, they only pass the event to the task that owns the device
+static bool IRAM_ATTR chanOnOverrun(i2s_chan_handle_t handle, i2s_event_data_t *event, void *ctx)
+{
+  AudioDmaEvent dmaEvent = DMA_EVENT_OVERRUN;
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR((QueueHandle_t)ctx, &dmaEvent, &woken);
+  return woken == pdTRUE;
+}
+
+static bool IRAM_ATTR chanOnUnderrun(i2s_chan_handle_t handle, i2s_event_data_t *event, void *ctx)
+{
+  AudioDmaEvent dmaEvent = DMA_EVENT_UNDERRUN;
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR((QueueHandle_t)ctx, &dmaEvent, &woken);
+  return woken == pdTRUE;
+}
+
+// create the event queue of a channel and register the callbacks, before the channel is enabled
+esp_err_t chanRegisterEvents(i2s_chan_handle_t chan, QueueHandle_t *events, bool rx)
+{
+  *events = xQueueCreate(I2S_EVENT_QUEUE_LEN, sizeof(AudioDmaEvent));
+  if (*events == NULL)
+    return ESP_ERR_NO_MEM;
+
+  i2s_event_callbacks_t callbacks = {};
+  if (rx)
+    callbacks.on_recv_q_ovf = chanOnOverrun; // the DMA overwrote a buffer that was not read
+  else
+    callbacks.on_send_q_ovf = chanOnUnderrun; // the DMA sent a buffer again, nothing new was written
+  return i2s_channel_register_event_callback(chan, &callbacks, *events);
+}
+
+void chanDelete(i2s_chan_handle_t *chan, QueueHandle_t *events, bool running)
+{
+  if (*chan != NULL)
+  {
+    if (running)
+      i2s_channel_disable(*chan); // a channel is deleted in the ready state
+    i2s_del_channel(*chan);
+    *chan = NULL;
+  }
+  if (*events != NULL)
+  {
+    vQueueDelete(*events);
+    *events = NULL;
+  }
+}
+
+/**
+ * Input for recording/sampling audio
+ */
+
+esp_err_t micChanDelete()
+{
+  chanDelete(&micChan, &micChanEvents, micChanRunning);
+  micChanRunning = false;
+  return ESP_OK;
+}
+
+// allocate the RX channel only, initialize it in the standard mode and start it
+esp_err_t micChanInit(uint32_t sampleRate, int bitsPerSample, int numChannels, int bufCount, int bufLen, bool useApll, QueueHandle_t *events)
+{
+  i2s_chan_config_t chan_config = I2S_CHANNEL_DEFAULT_CONFIG(MIC_I2S_PORT, I2S_ROLE_MASTER);
+  chan_config.dma_desc_num = bufCount; // number of DMA buffers
+  chan_config.dma_frame_num = bufLen;  // frames per DMA buffer
+  esp_err_t res = i2s_new_channel(&chan_config, NULL, &micChan);
+  if (res != ESP_OK)
+    return res;
+
+  i2s_std_config_t std_config = {
+      .clk_cfg = chanClkConfig(sampleRate, useApll),
+      .slot_cfg = chanSlotConfig(bitsPerSample, numChannels, MIC_STD_SLOT), // stereo - two mics, L/R select
+      .gpio_cfg = {
+          .mclk = I2S_GPIO_UNUSED,
+          .bclk = (gpio_num_t)MIC_I2S_SCK,
+          .ws = (gpio_num_t)MIC_I2S_WS,
+          .dout = I2S_GPIO_UNUSED,
+          .din = (gpio_num_t)MIC_I2S_SD,
+          .invert_flags = {.mclk_inv = false, .bclk_inv = false, .ws_inv = false}}};
+  res = i2s_channel_init_std_mode(micChan, &std_config);
+  if (res == ESP_OK && events != NULL)
+    res = chanRegisterEvents(micChan, &micChanEvents, true);
+  if (res == ESP_OK)
+    res = i2s_channel_enable(micChan);
+  if (res != ESP_OK)
+  {
+    micChanDelete();
+    return res;
+  }
+  micChanRunning = true;
+
+  if (events != NULL)
+    *events = micChanEvents;
+  return ESP_OK;
+}
+
+esp_err_t micChanRead(void *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms)
+{
+  return i2s_channel_read(micChan, dest, size, bytes_read, timeout_ms);
+}
+
+// Change the format of the running channel, without deleting it
+esp_err_t micChanReconfig(uint32_t sampleRate, int bitsPerSample, int numChannels, bool useApll)
+{
+  i2s_channel_disable(micChan);
+  micChanRunning = false;
+  i2s_std_clk_config_t clk = chanClkConfig(sampleRate, useApll);
+  i2s_std_slot_config_t slot = chanSlotConfig(bitsPerSample, numChannels, MIC_STD_SLOT);
+  esp_err_t res = i2s_channel_reconfig_std_clock(micChan, &clk);
+  if (res == ESP_OK)
+    res = i2s_channel_reconfig_std_slot(micChan, &slot);
+  esp_err_t started = i2s_channel_enable(micChan);
+  micChanRunning = (started == ESP_OK);
+  return res != ESP_OK ? res : started;
+}
+
+/**
+ * Output for playing audio
+ */
+
+esp_err_t dacChanDelete()
+{
+  chanDelete(&dacChan, &dacChanEvents, dacChanRunning);
+  dacChanRunning = false;
+  return ESP_OK;
+}
+
+// allocate the TX channel only, initialize it in the standard mode and start it
+esp_err_t dacChanInit(uint32_t sampleRate, int bitsPerSample, int numChannels, int bufCount, int bufLen, bool useApll, QueueHandle_t *events)
+{
+  i2s_chan_config_t chan_config = I2S_CHANNEL_DEFAULT_CONFIG(DAC_I2S_PORT, I2S_ROLE_MASTER);
+  chan_config.dma_desc_num = bufCount;
+  chan_config.dma_frame_num = bufLen;
+  chan_config.auto_clear = true; // send zeros when there is no data, instead of repeating the last buffers
+  esp_err_t res = i2s_new_channel(&chan_config, &dacChan, NULL);
+  if (res != ESP_OK)
+    return res;
+
+  i2s_std_config_t std_config = {
+      .clk_cfg = chanClkConfig(sampleRate, useApll),
+      .slot_cfg = chanSlotConfig(bitsPerSample, numChannels, I2S_STD_SLOT_BOTH), // mono goes to both slots
+      .gpio_cfg = {
+          .mclk = I2S_GPIO_UNUSED,
+          .bclk = (gpio_num_t)DAC_BCLK_SCK,
+          .ws = (gpio_num_t)DAC_LRC_WS,
+          .dout = (gpio_num_t)DAC_DIN_SD,
+          .din = I2S_GPIO_UNUSED,
+          .invert_flags = {.mclk_inv = false, .bclk_inv = false, .ws_inv = false}}};
+  res = i2s_channel_init_std_mode(dacChan, &std_config);
+  if (res == ESP_OK && events != NULL)
+    res = chanRegisterEvents(dacChan, &dacChanEvents, false);
+  if (res == ESP_OK)
+    res = i2s_channel_enable(dacChan);
+  if (res != ESP_OK)
+  {
+    dacChanDelete();
+    return res;
+  }
+
+  dacChanRunning = true;
+  if (events != NULL)
+    *events = dacChanEvents;
+  return ESP_OK;
+}
+
+// the channel must be stopped to preload it or to change its clock
+void dacChanStop()
+{
+  if (dacChanRunning)
+    i2s_channel_disable(dacChan); // rewinds the DMA to its first buffer
+  dacChanRunning = false;
+}
+
+esp_err_t dacChanStart()
+{
+  if (dacChanRunning)
+    return ESP_OK;
+  esp_err_t res = i2s_channel_enable(dacChan);
+  dacChanRunning = (res == ESP_OK);
+  return res;
+}
+
+// Change the format of the running channel, the channel and its DMA buffers stay allocated.
+esp_err_t dacChanReconfig(uint32_t sampleRate, int bitsPerSample, int numChannels, bool useApll)
+{
+  dacChanStop();
+  i2s_std_clk_config_t clk = chanClkConfig(sampleRate, useApll);
+  i2s_std_slot_config_t slot = chanSlotConfig(bitsPerSample, numChannels, I2S_STD_SLOT_BOTH);
+  esp_err_t res = i2s_channel_reconfig_std_clock(dacChan, &clk);
+  if (res == ESP_OK)
+    res = i2s_channel_reconfig_std_slot(dacChan, &slot);
+  esp_err_t started = dacChanStart();
+  return res != ESP_OK ? res : started;
+}
+
+// Stop the channel, the next writes fill its DMA (preload) and it starts once the DMA is full.
+// The first sample of the playback is the first one on the wire, there are no queued zeros before it.
+void dacChanPreload()
+{
+  dacChanStop();
+}
+
+// Write a block, while preloading it goes straight into the DMA buffers (the DMA is not running yet).
+// The channel is started when the DMA is full, and the rest of the block is written as usual.
+esp_err_t dacChanWrite(const void *src, size_t size, size_t *bytes_written, uint32_t timeout_ms)
+{
+  size_t loaded = 0;
+  if (!dacChanRunning)
+  {
+    esp_err_t res = i2s_channel_preload_data(dacChan, src, size, &loaded);
+    if (res != ESP_OK)
+      return res;
+    if (loaded == size)
+    {
+      *bytes_written = loaded;
+      return ESP_OK; // room for more
+    }
+    res = dacChanStart(); // the DMA is full
+    if (res != ESP_OK)
+      return res;
+  }
+
+  size_t written = 0;
+  esp_err_t res = i2s_channel_write(dacChan, (const uint8_t *)src + loaded, size - loaded, &written, timeout_ms);
+  *bytes_written = loaded + written;
+  return res;
+}
+
+// fill the rest of a stopped DMA with zeros, returns false on an error
+bool dacChanPadZeros()
+{
+  uint8_t zeros[256] = {0};
+  size_t loaded;
+  do
+  {
+    if (i2s_channel_preload_data(dacChan, zeros, sizeof(zeros), &loaded) != ESP_OK)
+      return false;
+  } while (loaded == sizeof(zeros));
+  return true;
+}
+
+// Start a DMA that is still preloading (less than a DMA of audio was written),
+// the buffers after the preloaded audio may hold a stale one, they are zeroed first.
+esp_err_t dacChanCommit()
+{
+  if (dacChanRunning)
+    return ESP_OK;
+  dacChanPadZeros();
+  return dacChanStart();
+}
+
+// Silence the DAC right away: rewind the DMA, fill it with zeros and start again.
+// The DMA buffers that were not sent yet would play their stale audio otherwise.
+esp_err_t dacChanClear()
+{
+  // a DMA that is still preloading is rewound by starting and stopping it
+  if (!dacChanRunning)
+    dacChanStart();
+  dacChanStop();
+  dacChanPadZeros();
+  return dacChanStart();
+}
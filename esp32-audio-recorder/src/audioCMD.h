@@ -0,0 +1,124 @@
+/**
+ * Commands of the audio engine, passed by value through FreeRTOS queues.
+ * The web handlers only fill a command and post it, the engine task owns the I2S devices.
+ * Everything a job needs is copied into the command, nothing points back into the request.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <string.h>
+
+#define CMD_PATH_LEN (32) // File path can be 31 characters maximum in SPIFFS, + NUL
+
+enum AudioCmdType
+{
+  CMD_PLAY,     // play a file, the handler already checked that the DAC is free
+  CMD_ENQUEUE,  // play a file after whatever is playing or waiting
+  CMD_RECORD,   // record for recordTime seconds
+  CMD_STOP,     // stop the current jobs of the devices, and drop their waiting jobs
+  CMD_MONITOR,  // mic -> speaker until stopped
+  CMD_LOOPBACK, // measure the acoustic loopback latency
+  CMD_CALIBRATE, // sweep the DMA geometry of both devices (audioTUNE.h)
+  CMD_ARM,       // capture into the pre-roll until a trigger, then record (audioARM.h)
+  CMD_DENOISE,   // suppress the noise of a stored file into another one, on the mic worker (audioNR.h)
+  CMD_SPECTROGRAM, // the spectrogram of a stored file into its sidecar, on the mic worker (audioSPEC.h)
+  CMD_OVERLAY,     // mix a short file into the current playback (audioMIX.h), or play it when nothing plays
+  CMD_OVERLAY_READY // the clip of a CMD_OVERLAY is in RAM, posted back to the engine by its loader
+};
+
+enum AudioCmdPriority
+{
+  CMD_PRIO_NORMAL, // waits in line
+  CMD_PRIO_URGENT  // jumps the line and interrupts the current job of the device (e.g. an alert)
+};
+
+// devices of CMD_STOP
+#define CMD_DEV_DAC (1)
+#define CMD_DEV_MIC (2)
+#define CMD_DEV_ALL (CMD_DEV_DAC | CMD_DEV_MIC)
+
+struct AudioCmd
+{
+  AudioCmdType type;
+  AudioCmdPriority priority;
+  uint8_t devices;         // CMD_STOP: CMD_DEV_xxx mask
+  int recordTime;          // CMD_RECORD: seconds, CMD_ARM: seconds after the trigger
+  int prerollSec;          // CMD_ARM: seconds kept before the trigger
+  float thresholdDb;       // CMD_ARM: dBFS of the level trigger, 0 - triggered by the API only
+  bool vad;                // CMD_RECORD/CMD_ARM: drop the silence (audioVAD.h)
+  bool nr;                 // CMD_RECORD/CMD_ARM: suppress the noise (audioNR.h)
+  uint8_t dspProfile;      // CMD_RECORD/CMD_ARM/CMD_PLAY: the filters, index of dspProfiles (audioDSP.h), 0 - none
+  uint32_t sampleRate;     // CMD_RECORD/CMD_ARM: format of the WAV file, CMD_CALIBRATE: format of the trials
+  uint8_t bitsPerSample;
+  uint8_t numChannels;
+  uint16_t audioFormat;    // CMD_RECORD/CMD_ARM: WAV_FORMAT_xxx (audioCODEC.h), PCM or coded
+  int trialMs;             // CMD_CALIBRATE: the length of each trial
+  uint8_t volume;          // CMD_OVERLAY: % of the full scale
+  uint32_t fadeMs;         // CMD_OVERLAY: the fade in
+  int64_t requestTime;     // us, when the request arrived, 0 - queued, the latency counts from the job start
+  char path[CMD_PATH_LEN]; // CMD_PLAY/CMD_ENQUEUE/CMD_DENOISE/CMD_SPECTROGRAM/CMD_OVERLAY: a copy, the request is long gone by the time it plays
+};
+
+AudioCmd cmdMake(AudioCmdType type, AudioCmdPriority priority = CMD_PRIO_NORMAL)
+{
+  AudioCmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = type;
+  cmd.priority = priority;
+  cmd.devices = CMD_DEV_ALL;
+  cmd.requestTime = esp_timer_get_time();
+  return cmd;
+}
+
+// copy the path into the command, false if it doesn't fit
+bool cmdSetPath(AudioCmd *cmd, const char *path)
+{
+  if (strlen(path) >= CMD_PATH_LEN)
+    return false;
+  strcpy(cmd->path, path);
+  return true;
+}
+
+// post a copy of the command, urgent commands go to the front of the queue
+bool cmdPost(QueueHandle_t queue, const AudioCmd *cmd, TickType_t wait = 0)
+{
+  if (cmd->priority == CMD_PRIO_URGENT)
+    return xQueueSendToFront(queue, cmd, wait) == pdTRUE;
+  return xQueueSendToBack(queue, cmd, wait) == pdTRUE;
+}
+
+const char *cmdName(AudioCmdType type)
+{
+  switch (type)
+  {
+  case CMD_PLAY:
+    return "play";
+  case CMD_ENQUEUE:
+    return "enqueue";
+  case CMD_RECORD:
+    return "record";
+  case CMD_STOP:
+    return "stop";
+  case CMD_MONITOR:
+    return "monitor";
+  case CMD_LOOPBACK:
+    return "loopback";
+  case CMD_CALIBRATE:
+    return "calibrate";
+  case CMD_ARM:
+    return "arm";
+  case CMD_DENOISE:
+    return "denoise";
+  case CMD_SPECTROGRAM:
+    return "spectrogram";
+  case CMD_OVERLAY:
+    return "overlay";
+  case CMD_OVERLAY_READY:
+    return "overlay ready";
+  }
+  return "unknown";
+}
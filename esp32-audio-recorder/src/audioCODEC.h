@@ -0,0 +1,373 @@
+/**
+ * Compressed sample formats of the WAV files: IMA-ADPCM (format 0x11, 4 bits per sample)
+ * and G.711 u-law (format 7, 8 bits per sample), both from and to 16-bit PCM.
+ * IMA-ADPCM is coded in blocks (blockAlign bytes), each one starts with the predictor and the step index
+ * of every channel, so a block decodes on its own (and a seek lands on a block boundary).
+ * The encoder of a recording takes blocks of any size, and keeps the frames of an unfinished ADPCM block.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the audio format of the WAV fmt chunk
+#define WAV_FORMAT_PCM (0x0001)
+#define WAV_FORMAT_MULAW (0x0007)
+#define WAV_FORMAT_IMA_ADPCM (0x0011)
+#define WAV_FORMAT_EXTENSIBLE (0xFFFE) // the sub-format is in a GUID, we only play PCM that way
+#define WAV_FORMAT_FLAC (0xF1AC)       // the tag of FLAC in WAV, here it marks a native .flac file (audioFLAC.h)
+#define WAV_FORMAT_MP3 (0x0055)        // MPEG Layer III in WAV, here it marks a native .mp3 file (audioMP3.h)
+
+const int16_t adpcmStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+const int8_t adpcmIndexTable[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+// the state of one channel, the same on both sides: the encoder tracks what the decoder will compute
+struct AdpcmChannel
+{
+  int32_t predictor;
+  int index;
+};
+
+// the usual block sizes: 256 bytes per channel up to 11kHz, 512 up to 22kHz, 1024 above
+int adpcmBlockAlign(uint32_t sampleRate, int numChannels)
+{
+  return (sampleRate <= 11025 ? 256 : sampleRate <= 22050 ? 512 : 1024) * numChannels;
+}
+
+// the header sample, then 2 samples per byte of every channel
+int adpcmSamplesPerBlock(int blockAlign, int numChannels)
+{
+  return (blockAlign - 4 * numChannels) * 2 / numChannels + 1;
+}
+
+// decode a nibble and update the channel, the encoder runs exactly this too
+static inline int16_t adpcmStep(AdpcmChannel *ch, uint8_t code)
+{
+  int step = adpcmStepTable[ch->index];
+  int diff = step >> 3;
+  if (code & 4)
+    diff += step;
+  if (code & 2)
+    diff += step >> 1;
+  if (code & 1)
+    diff += step >> 2;
+  int32_t predictor = ch->predictor + ((code & 8) ? -diff : diff);
+  if (predictor > 32767)
+    predictor = 32767;
+  else if (predictor < -32768)
+    predictor = -32768;
+  ch->predictor = predictor;
+
+  int index = ch->index + adpcmIndexTable[code];
+  ch->index = index < 0 ? 0 : index > 88 ? 88 : index;
+  return (int16_t)predictor;
+}
+
+// the nibble closest to the sample
+static inline uint8_t adpcmEncodeSample(AdpcmChannel *ch, int16_t sample)
+{
+  int diff = sample - ch->predictor;
+  uint8_t code = 0;
+  if (diff < 0)
+  {
+    code = 8;
+    diff = -diff;
+  }
+  int step = adpcmStepTable[ch->index];
+  if (diff >= step)
+  {
+    code |= 4;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+  {
+    code |= 2;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+    code |= 1;
+  adpcmStep(ch, code);
+  return code;
+}
+
+// Encode a block of samplesPerBlock interleaved frames. The first frame goes into the block header,
+// the step index carries over from the previous block (state).
+void adpcmEncodeBlock(uint8_t *dest, const int16_t *src, int numChannels, int samplesPerBlock, AdpcmChannel *state)
+{
+  for (int c = 0; c < numChannels; c++)
+  {
+    state[c].predictor = src[c];
+    dest[4 * c] = (uint8_t)(src[c] & 0xFF);
+    dest[4 * c + 1] = (uint8_t)((src[c] >> 8) & 0xFF);
+    dest[4 * c + 2] = (uint8_t)state[c].index;
+    dest[4 * c + 3] = 0;
+  }
+  uint8_t *out = dest + 4 * numChannels;
+
+  // then groups of 8 samples (4 bytes) of each channel in turn, the low nibble first
+  for (int frame = 1; frame < samplesPerBlock; frame += 8)
+  {
+    for (int c = 0; c < numChannels; c++)
+    {
+      for (int k = 0; k < 8; k += 2)
+      {
+        uint8_t lo = adpcmEncodeSample(&state[c], src[(frame + k) * numChannels + c]);
+        uint8_t hi = adpcmEncodeSample(&state[c], src[(frame + k + 1) * numChannels + c]);
+        *out++ = lo | (hi << 4);
+      }
+    }
+  }
+}
+
+// Decode a block into samplesPerBlock interleaved 16-bit frames
+void adpcmDecodeBlock(int16_t *dest, const uint8_t *src, int numChannels, int samplesPerBlock)
+{
+  AdpcmChannel state[2];
+  for (int c = 0; c < numChannels; c++)
+  {
+    state[c].predictor = (int16_t)(src[4 * c] | (src[4 * c + 1] << 8));
+    state[c].index = src[4 * c + 2] > 88 ? 88 : src[4 * c + 2];
+    dest[c] = (int16_t)state[c].predictor;
+  }
+  const uint8_t *in = src + 4 * numChannels;
+
+  for (int frame = 1; frame < samplesPerBlock; frame += 8)
+  {
+    for (int c = 0; c < numChannels; c++)
+    {
+      for (int k = 0; k < 8; k += 2)
+      {
+        uint8_t b = *in++;
+        dest[(frame + k) * numChannels + c] = adpcmStep(&state[c], b & 0x0F);
+        dest[(frame + k + 1) * numChannels + c] = adpcmStep(&state[c], b >> 4);
+      }
+    }
+  }
+}
+
+// Decode whole blocks of srcBytes, returns the number of bytes written to dest (16-bit PCM)
+size_t adpcmDecode(void *dest, const void *src, size_t srcBytes, int blockAlign, int numChannels)
+{
+  int samplesPerBlock = adpcmSamplesPerBlock(blockAlign, numChannels);
+  size_t blocks = srcBytes / blockAlign;
+  for (size_t b = 0; b < blocks; b++)
+    adpcmDecodeBlock((int16_t *)dest + b * samplesPerBlock * numChannels, (const uint8_t *)src + b * blockAlign, numChannels, samplesPerBlock);
+  return blocks * samplesPerBlock * numChannels * sizeof(int16_t);
+}
+
+// G.711 u-law: a sign, a 3-bit exponent and a 4-bit mantissa, all bits inverted
+#define ULAW_BIAS (0x84)
+#define ULAW_CLIP (32635)
+
+static inline uint8_t ulawEncodeSample(int16_t sample)
+{
+  int sign = (sample >> 8) & 0x80;
+  int magnitude = sign ? -(int)sample : sample;
+  if (magnitude > ULAW_CLIP)
+    magnitude = ULAW_CLIP;
+  magnitude += ULAW_BIAS;
+
+  // the exponent is the position of the highest bit above the bias
+  int exponent = 7;
+  for (int mask = 0x4000; (magnitude & mask) == 0 && exponent > 0; mask >>= 1)
+    exponent--;
+  int mantissa = (magnitude >> (exponent + 3)) & 0x0F;
+  return (uint8_t)~(sign | (exponent << 4) | mantissa);
+}
+
+static inline int16_t ulawDecodeSample(uint8_t code)
+{
+  code = ~code;
+  int exponent = (code >> 4) & 0x07;
+  int magnitude = (((code & 0x0F) << 3) + ULAW_BIAS) << exponent;
+  return (int16_t)((code & 0x80) ? ULAW_BIAS - magnitude : magnitude - ULAW_BIAS);
+}
+
+// 16-bit PCM -> u-law, works in place (it only narrows)
+size_t ulawEncode(void *dest, const void *src, size_t srcBytes)
+{
+  size_t n = srcBytes / sizeof(int16_t);
+  const int16_t *in = (const int16_t *)src;
+  uint8_t *out = (uint8_t *)dest;
+  for (size_t i = 0; i < n; i++)
+    out[i] = ulawEncodeSample(in[i]);
+  return n;
+}
+
+// u-law -> 16-bit PCM, works in place (backwards, it widens)
+size_t ulawDecode(void *dest, const void *src, size_t srcBytes)
+{
+  const uint8_t *in = (const uint8_t *)src;
+  int16_t *out = (int16_t *)dest;
+  for (size_t i = srcBytes; i > 0; i--)
+    out[i - 1] = ulawDecodeSample(in[i - 1]);
+  return srcBytes * sizeof(int16_t);
+}
+
+const char *codecName(int format)
+{
+  switch (format)
+  {
+  case WAV_FORMAT_PCM:
+    return "pcm";
+  case WAV_FORMAT_IMA_ADPCM:
+    return "ima-adpcm";
+  case WAV_FORMAT_MULAW:
+    return "mulaw";
+  case WAV_FORMAT_FLAC:
+    return "flac";
+  case WAV_FORMAT_MP3:
+    return "mp3";
+  }
+  return "unknown";
+}
+
+// The coded layout of a format: bytes per block and frames per block (1 for u-law)
+struct CodecLayout
+{
+  int format; // WAV_FORMAT_xxx
+  int numChannels;
+  int blockAlign;
+  int samplesPerBlock;
+  int bitsPerSample; // of the fmt chunk: 4 or 8
+};
+
+bool codecLayout(CodecLayout *layout, int format, uint32_t sampleRate, int numChannels)
+{
+  layout->format = format;
+  layout->numChannels = numChannels;
+  if (format == WAV_FORMAT_IMA_ADPCM)
+  {
+    layout->blockAlign = adpcmBlockAlign(sampleRate, numChannels);
+    layout->samplesPerBlock = adpcmSamplesPerBlock(layout->blockAlign, numChannels);
+    layout->bitsPerSample = 4;
+    return true;
+  }
+  if (format == WAV_FORMAT_MULAW)
+  {
+    layout->blockAlign = numChannels;
+    layout->samplesPerBlock = 1;
+    layout->bitsPerSample = 8;
+    return true;
+  }
+  return false;
+}
+
+// bytes of frames in whole blocks
+uint32_t codecDataSize(CodecLayout *layout, uint32_t frames)
+{
+  return (frames + layout->samplesPerBlock - 1) / layout->samplesPerBlock * layout->blockAlign;
+}
+
+// Decode whole blocks of a coded file to 16-bit PCM, returns the number of bytes written to dest
+size_t codecDecode(CodecLayout *layout, void *dest, const void *src, size_t srcBytes)
+{
+  if (layout->format == WAV_FORMAT_IMA_ADPCM)
+    return adpcmDecode(dest, src, srcBytes, layout->blockAlign, layout->numChannels);
+  return ulawDecode(dest, src, srcBytes);
+}
+
+// The streaming encoder of a recording: 16-bit PCM blocks of any size in, whole coded blocks out
+struct CodecEncoder
+{
+  CodecLayout layout;
+  AdpcmChannel state[2];
+  int16_t *pending;   // ADPCM: the frames of the unfinished block
+  int pendingFrames;
+  uint32_t frames;    // frames coded so far, without the padding of the last block (the fact chunk)
+};
+
+bool codecEncoderInit(CodecEncoder *enc, int format, uint32_t sampleRate, int numChannels)
+{
+  memset(enc, 0, sizeof(CodecEncoder));
+  if (!codecLayout(&enc->layout, format, sampleRate, numChannels))
+    return false;
+  if (format == WAV_FORMAT_IMA_ADPCM)
+  {
+    enc->pending = (int16_t *)malloc(enc->layout.samplesPerBlock * numChannels * sizeof(int16_t));
+    return enc->pending != NULL;
+  }
+  return true;
+}
+
+void codecEncoderEnd(CodecEncoder *enc)
+{
+  free(enc->pending);
+  enc->pending = NULL;
+}
+
+// Code the frames of src into dest, returns the number of bytes written.
+// dest takes ceil((frames + samplesPerBlock) / samplesPerBlock) blocks at most.
+size_t codecEncode(CodecEncoder *enc, uint8_t *dest, const int16_t *src, size_t frames)
+{
+  CodecLayout *layout = &enc->layout;
+  int ch = layout->numChannels;
+  if (layout->format == WAV_FORMAT_MULAW)
+  {
+    enc->frames += frames;
+    return ulawEncode(dest, src, frames * ch * sizeof(int16_t));
+  }
+
+  size_t written = 0;
+  int spb = layout->samplesPerBlock;
+  while (frames > 0)
+  {
+    // whole blocks straight from src, the rest waits for the next call
+    if (enc->pendingFrames == 0 && frames >= (size_t)spb)
+    {
+      adpcmEncodeBlock(dest + written, src, ch, spb, enc->state);
+      src += spb * ch;
+      frames -= spb;
+    }
+    else
+    {
+      size_t n = spb - enc->pendingFrames;
+      if (n > frames)
+        n = frames;
+      memcpy(enc->pending + enc->pendingFrames * ch, src, n * ch * sizeof(int16_t));
+      enc->pendingFrames += n;
+      src += n * ch;
+      frames -= n;
+      if (enc->pendingFrames < spb)
+        break;
+      adpcmEncodeBlock(dest + written, enc->pending, ch, spb, enc->state);
+      enc->pendingFrames = 0;
+    }
+    written += layout->blockAlign;
+    enc->frames += spb;
+  }
+  return written;
+}
+
+// the end of the recording: the last frames in a block padded with their last frame, returns its size (0 - none)
+size_t codecEncoderFlush(CodecEncoder *enc, uint8_t *dest)
+{
+  if (enc->pendingFrames == 0)
+    return 0;
+  int ch = enc->layout.numChannels;
+  for (int f = enc->pendingFrames; f < enc->layout.samplesPerBlock; f++)
+    memcpy(enc->pending + f * ch, enc->pending + (enc->pendingFrames - 1) * ch, ch * sizeof(int16_t));
+  adpcmEncodeBlock(dest, enc->pending, ch, enc->layout.samplesPerBlock, enc->state);
+  enc->frames += enc->pendingFrames;
+  enc->pendingFrames = 0;
+  return enc->layout.blockAlign;
+}
+
+// the frames of the file (the fact chunk), when dataSize bytes of the coded stream were written
+uint32_t codecSampleLength(CodecEncoder *enc, uint32_t dataSize)
+{
+  uint32_t frames = dataSize / enc->layout.blockAlign * enc->layout.samplesPerBlock;
+  return frames < enc->frames ? frames : enc->frames;
+}
@@ -0,0 +1,164 @@
+/**
+ * Sample format conversion kernels, specialized at compile time on source and destination format.
+ * Select a kernel once per stream (convSelect), then run it on every block.
+ * Every kernel also works in place (dest == src), widening kernels walk the block backwards.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Each format loads a sample as a left-justified 32-bit value, and stores it back.
+// Buffers of 16/32-bit samples must be aligned, the packed 24-bit is accessed byte by byte.
+
+// unsigned 8-bit (WAV 8-bit is unsigned, 128 is silence)
+struct FmtU8
+{
+  static const int bytes = 1;
+  static inline int32_t load(const uint8_t *p) { return ((int32_t)p[0] - 128) << 24; }
+  static inline void store(uint8_t *p, int32_t v) { p[0] = (uint8_t)((v >> 24) + 128); }
+};
+
+// signed 16-bit
+struct FmtS16
+{
+  static const int bytes = 2;
+  static inline int32_t load(const uint8_t *p) { return (int32_t)(*(const int16_t *)p) << 16; }
+  static inline void store(uint8_t *p, int32_t v) { *(int16_t *)p = (int16_t)(v >> 16); }
+};
+
+// signed 24-bit, packed into 3 bytes (WAV 24-bit)
+struct FmtS24
+{
+  static const int bytes = 3;
+  static inline int32_t load(const uint8_t *p) { return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)); }
+  static inline void store(uint8_t *p, int32_t v)
+  {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 24);
+  }
+};
+
+// signed 32-bit, also the I2S container of 24-bit samples (left-justified, e.g. INMP441)
+struct FmtS32
+{
+  static const int bytes = 4;
+  static inline int32_t load(const uint8_t *p) { return *(const int32_t *)p; }
+  static inline void store(uint8_t *p, int32_t v) { *(int32_t *)p = v; }
+};
+
+// saturate a left-justified sample after a digital gain of 2^shift
+static inline int32_t convGain(int32_t v, int shift)
+{
+  if (shift <= 0)
+    return v;
+  int32_t limit = INT32_MAX >> shift;
+  if (v > limit)
+    return INT32_MAX;
+  if (v < -limit - 1)
+    return INT32_MIN;
+  return v << shift;
+}
+
+// Convert a block of srcBytes, returns the number of bytes written to dest.
+// Src/Dst - sample formats, SrcCh/DstCh - 1 (mono) or 2 (stereo), GainShift - digital gain as a power of 2.
+template <class Src, class Dst, int SrcCh, int DstCh, int GainShift = 0>
+size_t convBlock(void *dest, const void *src, size_t srcBytes)
+{
+  const int srcFrame = Src::bytes * SrcCh;
+  const int dstFrame = Dst::bytes * DstCh;
+  size_t frames = srcBytes / srcFrame;
+  const uint8_t *in = (const uint8_t *)src;
+  uint8_t *out = (uint8_t *)dest;
+
+  // widening kernels go backwards, so dest == src doesn't overwrite what wasn't read yet
+  const bool backwards = dstFrame > srcFrame;
+  for (size_t n = 0; n < frames; n++)
+  {
+    size_t i = backwards ? frames - 1 - n : n;
+    const uint8_t *s = in + i * srcFrame;
+    uint8_t *d = out + i * dstFrame;
+
+    if (SrcCh == 2 && DstCh == 1)
+    {
+      // downmix, average the two channels
+      int32_t v = (Src::load(s) >> 1) + (Src::load(s + Src::bytes) >> 1);
+      Dst::store(d, convGain(v, GainShift));
+    }
+    else if (SrcCh == 1 && DstCh == 2)
+    {
+      // upmix, the same sample on both channels
+      int32_t v = convGain(Src::load(s), GainShift);
+      Dst::store(d, v);
+      Dst::store(d + Dst::bytes, v);
+    }
+    else
+    {
+      for (int c = 0; c < SrcCh; c++)
+        Dst::store(d + c * Dst::bytes, convGain(Src::load(s + c * Src::bytes), GainShift));
+    }
+  }
+  return frames * dstFrame;
+}
+
+// a kernel picked once per stream
+typedef size_t (*ConvFn)(void *dest, const void *src, size_t srcBytes);
+
+template <class Src, class Dst>
+ConvFn convSelectCh(int srcCh, int dstCh)
+{
+  if (srcCh == 1 && dstCh == 1)
+    return convBlock<Src, Dst, 1, 1>;
+  if (srcCh == 1 && dstCh == 2)
+    return convBlock<Src, Dst, 1, 2>;
+  if (srcCh == 2 && dstCh == 1)
+    return convBlock<Src, Dst, 2, 1>;
+  if (srcCh == 2 && dstCh == 2)
+    return convBlock<Src, Dst, 2, 2>;
+  return NULL;
+}
+
+template <class Src>
+ConvFn convSelectDst(int dstBits, int srcCh, int dstCh)
+{
+  switch (dstBits)
+  {
+  case 8:
+    return convSelectCh<Src, FmtU8>(srcCh, dstCh);
+  case 16:
+    return convSelectCh<Src, FmtS16>(srcCh, dstCh);
+  case 24:
+    return convSelectCh<Src, FmtS24>(srcCh, dstCh);
+  case 32:
+    return convSelectCh<Src, FmtS32>(srcCh, dstCh);
+  }
+  return NULL;
+}
+
+// Pick the kernel for a stream, returns NULL for an unsupported combination.
+// Bits: 8 (unsigned), 16, 24 (packed), 32 (or 24 left-justified in 32); channels: 1 or 2
+ConvFn convSelect(int srcBits, int srcCh, int dstBits, int dstCh)
+{
+  switch (srcBits)
+  {
+  case 8:
+    return convSelectDst<FmtU8>(dstBits, srcCh, dstCh);
+  case 16:
+    return convSelectDst<FmtS16>(dstBits, srcCh, dstCh);
+  case 24:
+    return convSelectDst<FmtS24>(dstBits, srcCh, dstCh);
+  case 32:
+    return convSelectDst<FmtS32>(dstBits, srcCh, dstCh);
+  }
+  return NULL;
+}
+
+// The I2S driver takes 16 or 32-bit containers: 8-bit goes out as 16-bit, packed 24-bit as 32-bit
+int convDacBits(int bitsPerSample)
+{
+  if (bitsPerSample == 8)
+    return 16;
+  if (bitsPerSample == 24)
+    return 32;
+  return bitsPerSample;
+}
@@ -0,0 +1,324 @@
+/**
+ * Persistent audio-device manager, on top of audioSTD.h.
+ * The I2S drivers stay installed between requests: they are only reclocked when the format changes,
+ * and the microphone keeps its clock running (primed), so the INMP441 startup time is paid once.
+ * Also measures the latency from a request to its first sample,
+ * and counts the DMA overruns/underruns of a session from the I2S driver events.
+ * The DMA geometry of each device is set at runtime (audioTUNE.h), and applied on its next install.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <esp_timer.h>
+#include <string.h>
+
+#define MIC_STARTUP_BLOCKS (2) // INMP441 startup time is up to 83ms, discard that much after a cold start
+#define DEV_EVENT_LOG_LEN (16)  // gap events of a session kept with their time, the counters go on
+#define DEV_DMA_MAX_BYTES (4092) // the largest DMA buffer of the esp32 I2S
+
+// DMA gaps of one session (a recording or a playback), from the I2S driver events
+struct DevSession
+{
+  int64_t startTime;   // us
+  uint32_t overruns;   // buffers lost on capture
+  uint32_t underruns;  // buffers of silence on playback
+  uint32_t dmaErrors;
+  uint32_t eventMs[DEV_EVENT_LOG_LEN]; // ms from the session start, to one DMA buffer (when it was polled)
+  uint8_t eventType[DEV_EVENT_LOG_LEN]; // AudioDmaEvent
+  int logged;
+};
+
+struct AudioDevice
+{
+  bool installed;
+  uint32_t sampleRate;
+  int bitsPerSample;
+  int numChannels;
+  int64_t requestTime;  // us, set when a request arrives, cleared on its first sample
+  int64_t lastLatency;  // us, from the last request to its first sample
+  uint32_t installs;    // cold starts, full driver install
+  uint32_t reclocks;    // format changes on an installed driver
+  uint32_t reuses;      // requests served by a warm driver as is
+  QueueHandle_t events; // I2S driver events, owned by the driver (gone with the uninstall)
+  DevSession session;
+  int dmaBufCount;      // DMA geometry of the next install, 0 - DMA_BUF_COUNT
+  int dmaBufLen;        // frames per DMA buffer, 0 - DMA_BUF_LEN
+  int activeBufLen;     // frames per DMA buffer of the installed driver, devFormatBufLen of its format
+};
+
+AudioDevice micDevice;
+AudioDevice dacDevice;
+
+void devReleaseMic()
+{
+  if (micDevice.installed)
+    micDestroyStd();
+  micDevice.installed = false;
+  micDevice.events = NULL;
+}
+
+void devReleaseDac()
+{
+  if (dacDevice.installed)
+    dacDestroyStd();
+  dacDevice.installed = false;
+  dacDevice.events = NULL;
+}
+
+int devBufCount(AudioDevice *dev)
+{
+  return dev->dmaBufCount > 0 ? dev->dmaBufCount : DMA_BUF_COUNT;
+}
+
+int devBufLen(AudioDevice *dev)
+{
+  return dev->dmaBufLen > 0 ? dev->dmaBufLen : DMA_BUF_LEN;
+}
+
+// Frames per DMA buffer of a format: the geometry, shortened when the buffer of wider frames wouldn't fit the DMA.
+// A geometry calibrated for 16-bit mono may be too long for 32-bit stereo.
+int devFormatBufLen(AudioDevice *dev, int bitsPerSample, int numChannels)
+{
+  int frameBytes = (bitsPerSample == 16 ? 2 : 4) * numChannels; // the I2S slots
+  return min(devBufLen(dev), DEV_DMA_MAX_BYTES / frameBytes);
+}
+
+// Change the DMA geometry of the device, an installed driver with another geometry is released,
+// the next acquire installs it again (the DMA buffers are allocated on install only)
+void devSetGeometry(AudioDevice *dev, int bufCount, int bufLen)
+{
+  if (devBufCount(dev) == bufCount && devBufLen(dev) == bufLen)
+    return;
+  if (dev == &micDevice)
+    devReleaseMic();
+  else
+    devReleaseDac();
+  dev->dmaBufCount = bufCount;
+  dev->dmaBufLen = bufLen;
+}
+
+bool devSameFormat(AudioDevice *dev, uint32_t sampleRate, int bitsPerSample, int numChannels)
+{
+  return dev->sampleRate == sampleRate && dev->bitsPerSample == bitsPerSample && dev->numChannels == numChannels;
+}
+
+// get the DAC ready for the format, install it only when it is not installed yet
+esp_err_t devAcquireDac(uint32_t sampleRate, int bitsPerSample, int numChannels)
+{
+  // a shared I2S port is either a receiver or a transmitter
+  if (!AUDIO_FULL_DUPLEX)
+    devReleaseMic();
+
+  esp_err_t res = ESP_OK;
+  if (dacDevice.installed && devSameFormat(&dacDevice, sampleRate, bitsPerSample, numChannels))
+  {
+    dacDevice.reuses++;
+    return ESP_OK;
+  }
+
+  // the DMA buffers keep their frame count on a reclock, another count needs a new install
+  int bufLen = devFormatBufLen(&dacDevice, bitsPerSample, numChannels);
+  if (dacDevice.installed && bufLen != dacDevice.activeBufLen)
+    devReleaseDac();
+
+  if (dacDevice.installed)
+  {
+    res = dacSetClkStd(sampleRate, bitsPerSample, numChannels); // audioSTD.h
+    dacDevice.reclocks++;
+  }
+  else
+  {
+    res = dacInitStd(sampleRate, bitsPerSample, numChannels, devBufCount(&dacDevice), bufLen, DAC_USE_APLL, &dacDevice.events); // audioSTD.h
+    dacDevice.installs++;
+  }
+
+  dacDevice.installed = (res == ESP_OK);
+  dacDevice.activeBufLen = bufLen;
+  dacDevice.sampleRate = sampleRate;
+  dacDevice.bitsPerSample = bitsPerSample;
+  dacDevice.numChannels = numChannels;
+  return res;
+}
+
+// get the microphone ready, a warm one only drops the stale DMA blocks
+esp_err_t devAcquireMic(uint32_t sampleRate, int bitsPerSample, int numChannels)
+{
+  if (!AUDIO_FULL_DUPLEX)
+    devReleaseDac();
+
+  if (micDevice.installed && devSameFormat(&micDevice, sampleRate, bitsPerSample, numChannels))
+  {
+    micFlushStd(devBufCount(&micDevice) * devBufLen(&micDevice) * 8); // audioSTD.h
+    micDevice.reuses++;
+    return ESP_OK;
+  }
+
+  // a new format restarts the clock of the installed driver, the microphone is primed again below
+  // (the DMA buffers keep their frame count on a reclock, another count needs a new install)
+  int bufLen = devFormatBufLen(&micDevice, bitsPerSample, numChannels);
+  if (micDevice.installed && bufLen != micDevice.activeBufLen)
+    devReleaseMic();
+  esp_err_t res;
+  if (micDevice.installed)
+  {
+    res = micSetClkStd(sampleRate, bitsPerSample, numChannels, MIC_USE_APLL); // audioSTD.h
+    micDevice.reclocks++;
+  }
+  else
+  {
+    res = micInitStd(sampleRate, bitsPerSample, devBufCount(&micDevice), bufLen, MIC_USE_APLL, numChannels, &micDevice.events); // audioSTD.h
+    micDevice.installs++;
+  }
+  micDevice.installed = (res == ESP_OK);
+  micDevice.activeBufLen = bufLen;
+  micDevice.sampleRate = sampleRate;
+  micDevice.bitsPerSample = bitsPerSample;
+  micDevice.numChannels = numChannels;
+  if (res != ESP_OK)
+    return res;
+
+  // prime: the microphone may have startup time (i.e. INMP441 up to 83ms), MIC_STARTUP_BLOCKS DMA buffers of any format
+  uint8_t dump[BUFF_SIZE];
+  size_t bytes_read;
+  int frameSize = (bitsPerSample == 16 ? 2 : 4) * numChannels;
+  micDiscardBlocks((void *)dump, sizeof(dump), &bytes_read, MIC_STARTUP_BLOCKS * bufLen * frameSize / sizeof(dump)); // audioSTD.h
+  return ESP_OK;
+}
+
+// a request for the device has just arrived
+void devMarkRequest(AudioDevice *dev)
+{
+  dev->requestTime = esp_timer_get_time();
+}
+
+// the first sample of the request went to (or came from) the DMA
+void devMarkFirstSample(AudioDevice *dev, const char *name)
+{
+  if (dev->requestTime == 0)
+    return;
+  dev->lastLatency = esp_timer_get_time() - dev->requestTime;
+  dev->requestTime = 0;
+  printf("%s: %lld us from request to the first sample\n", name, dev->lastLatency);
+}
+
+// Start counting the gaps of a session. The idle warm devices overrun (mic) and underrun (DAC) all the time,
+// so the events queued before the session are dropped.
+void devStartSession(AudioDevice *dev)
+{
+  if (dev->events != NULL)
+    xQueueReset(dev->events);
+  memset(&dev->session, 0, sizeof(dev->session));
+  dev->session.startTime = esp_timer_get_time();
+}
+
+// drop the events of an intended pause (e.g. a paused playback underruns on purpose)
+void devSkipEvents(AudioDevice *dev)
+{
+  if (dev->events != NULL)
+    xQueueReset(dev->events);
+}
+
+// Poll the driver events without waiting, called by the task that owns the device after each read/write.
+// The queue keeps the latest I2S_EVENT_QUEUE_LEN events. Returns the new gaps.
+int devPollEvents(AudioDevice *dev)
+{
+  if (dev->events == NULL)
+    return 0;
+
+  int gaps = 0;
+  AudioDmaEvent type;
+  while ((type = i2sPollEventStd(dev->events)) != DMA_EVENT_NONE) // audioSTD.h, either backend
+  {
+    if (type == DMA_EVENT_OVERRUN)
+      dev->session.overruns++;
+    else if (type == DMA_EVENT_UNDERRUN)
+      dev->session.underruns++;
+    else
+      dev->session.dmaErrors++;
+
+    gaps++;
+    DevSession *session = &dev->session;
+    if (session->logged < DEV_EVENT_LOG_LEN)
+    {
+      session->eventMs[session->logged] = (uint32_t)((esp_timer_get_time() - session->startTime) / 1000);
+      session->eventType[session->logged] = type;
+      session->logged++;
+    }
+  }
+  return gaps;
+}
+
+// no audio was lost or repeated by the DMA during the session
+bool devSessionComplete(AudioDevice *dev)
+{
+  return dev->session.overruns == 0 && dev->session.underruns == 0 && dev->session.dmaErrors == 0;
+}
+
+const char *devGapName(uint8_t type)
+{
+  switch (type)
+  {
+  case DMA_EVENT_OVERRUN:
+    return "overrun";
+  case DMA_EVENT_UNDERRUN:
+    return "underrun";
+  case DMA_EVENT_ERROR:
+    return "dmaError";
+  }
+  return "unknown";
+}
+
+// json ready format, the gap counters of the last session and the first DEV_EVENT_LOG_LEN gaps
+String devGetSession(AudioDevice *dev)
+{
+  DevSession *session = &dev->session;
+  String output = "{\"overruns\":";
+  output += session->overruns;
+  output += ",\"underruns\":";
+  output += session->underruns;
+  output += ",\"dmaErrors\":";
+  output += session->dmaErrors;
+  output += ",\"events\":[";
+  for (int i = 0; i < session->logged; i++)
+  {
+    if (i > 0)
+      output += ',';
+    output += "{\"ms\":";
+    output += session->eventMs[i];
+    output += ",\"type\":\"";
+    output += devGapName(session->eventType[i]);
+    output += "\"}";
+  }
+  output += "]}";
+  return output;
+}
+
+// json ready format
+String devGetStats(AudioDevice *dev)
+{
+  String output = "{\"installed\":";
+  output += dev->installed ? "true" : "false";
+  output += ",\"sampleRate\":";
+  output += dev->sampleRate;
+  output += ",\"bitsPerSample\":";
+  output += dev->bitsPerSample;
+  output += ",\"numChannels\":";
+  output += dev->numChannels;
+  output += ",\"lastLatency\":";
+  output += (long)dev->lastLatency;
+  output += ",\"installs\":";
+  output += dev->installs;
+  output += ",\"reclocks\":";
+  output += dev->reclocks;
+  output += ",\"reuses\":";
+  output += dev->reuses;
+  output += ",\"dmaBufCount\":";
+  output += devBufCount(dev);
+  output += ",\"dmaBufLen\":";
+  output += devBufLen(dev);
+  output += ",\"session\":";
+  output += devGetSession(dev);
+  output += "}";
+  return output;
+}
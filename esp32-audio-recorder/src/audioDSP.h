@@ -0,0 +1,452 @@
+/**
+ * A block-based fixed-point DSP chain for the recording and the playback: DC removal, gain, biquad high-pass,
+ * low-pass and band-pass filters, AGC and a peak limiter, in the order of a named profile (dspProfiles).
+ * The coefficients are computed once per stream (dspChainInit, in float), a block only runs integer loops.
+ * The samples are left-justified 32-bit on the way through (16-bit ones are widened in chunks of DSP_CHUNK),
+ * every stage saturates, and counts its CPU cycles per sample.
+ * The noise suppression of audioNR.h can join any profile as a stage of a mono stream, right before its AGC.
+ * A playback may start with a fixed gain of its file (DSP_LEVEL), the loudness normalisation of audioLOUD.h.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define DSP_MAX_STAGES (8)
+#define DSP_CHUNK (256)        // samples of a 16-bit block widened at a time
+#define DSP_Q (28)             // biquad coefficients, up to +-8
+#define DSP_AGC_GATE_DB (-50)  // the AGC holds its gain below that level, it doesn't pump the noise up
+#define DSP_LIMITER_DB (-1)    // the ceiling of the limiter of every profile
+
+enum DspStageType
+{
+  DSP_DC,       // one-pole DC removal, value - the cutoff in Hz
+  DSP_GAIN,     // the gain of the stream as a power of 2 (MIC_GAIN_SHIFT), added by dspChainInit
+  DSP_HIGHPASS, // biquads, value - Hz, param - Q
+  DSP_LOWPASS,
+  DSP_BANDPASS, // 0 dB at the center
+  DSP_AGC,      // value - the target peak in dBFS, param - the largest gain in dB
+  DSP_LIMITER,  // value - the ceiling in dBFS, param - the release in ms
+  DSP_NR,       // the spectral noise suppression (audioNR.h), added by dspChainInit, late by NR_FFT_SIZE samples
+  DSP_LEVEL     // a fixed gain, value - dB, Q16 in coef[0], first in the chain (dspSetLevel)
+};
+
+struct DspStageSpec
+{
+  DspStageType type;
+  float value;
+  float param;
+};
+
+struct DspProfile
+{
+  const char *name;
+  int numStages;
+  DspStageSpec stages[DSP_MAX_STAGES];
+};
+
+// index 0 is no processing at all, the samples go through untouched
+const DspProfile dspProfiles[] = {
+    {"none", 0, {}},
+    // heart sounds: S1/S2 are 20-150 Hz, a 4th order low-pass keeps the breath and the voice out
+    {"heart", 6, {{DSP_DC, 5, 0}, {DSP_HIGHPASS, 20, 0.707}, {DSP_LOWPASS, 200, 0.541}, {DSP_LOWPASS, 200, 1.307}, {DSP_AGC, -12, 30}, {DSP_LIMITER, DSP_LIMITER_DB, 100}}},
+    // heart murmurs: 100-600 Hz
+    {"murmur", 4, {{DSP_DC, 5, 0}, {DSP_BANDPASS, 250, 0.6}, {DSP_AGC, -12, 30}, {DSP_LIMITER, DSP_LIMITER_DB, 100}}},
+    // lung sounds: 100-1000 Hz, the heart below is cut by a 4th order high-pass
+    {"lung", 6, {{DSP_DC, 5, 0}, {DSP_HIGHPASS, 100, 0.541}, {DSP_HIGHPASS, 100, 1.307}, {DSP_LOWPASS, 1000, 0.707}, {DSP_AGC, -12, 24}, {DSP_LIMITER, DSP_LIMITER_DB, 100}}},
+    // speech: the telephone band and a steady level
+    {"speech", 5, {{DSP_DC, 5, 0}, {DSP_HIGHPASS, 80, 0.707}, {DSP_LOWPASS, 3800, 0.707}, {DSP_AGC, -16, 20}, {DSP_LIMITER, DSP_LIMITER_DB, 50}}}};
+const int dspNumProfiles = sizeof(dspProfiles) / sizeof(dspProfiles[0]);
+
+struct DspStage
+{
+  DspStageType type;
+  float value; // of the spec, for the stats
+  int32_t coef[5]; // biquad: b0, b1, b2, a1, a2 in Q28; DC: the pole in Q30; AGC/limiter: levels and steps
+  int32_t state[2][4]; // per channel: x1, x2, y1, y2 (AGC: the gain, Q16; limiter: the gain, Q30)
+  uint64_t cycles;
+  uint32_t samples;
+};
+
+struct DspChain
+{
+  int profile;
+  uint32_t sampleRate;
+  int bits; // 16, or 32 (left-justified)
+  int numChannels;
+  int numStages;
+  DspStage stages[DSP_MAX_STAGES + 3]; // and the gain, the noise suppression and the level
+  NrState *nr;                         // of DSP_NR, the caller owns it
+  int32_t work[DSP_CHUNK];
+};
+
+static inline int32_t dspSat(int64_t v)
+{
+  if (v > INT32_MAX)
+    return INT32_MAX;
+  if (v < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)v;
+}
+
+// the index of a profile by name, -1 if there is none
+int dspFindProfile(const char *name)
+{
+  for (int i = 0; i < dspNumProfiles; i++)
+    if (strcmp(dspProfiles[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+const char *dspStageName(DspStageType type)
+{
+  switch (type)
+  {
+  case DSP_DC:
+    return "dc";
+  case DSP_GAIN:
+    return "gain";
+  case DSP_HIGHPASS:
+    return "highpass";
+  case DSP_LOWPASS:
+    return "lowpass";
+  case DSP_BANDPASS:
+    return "bandpass";
+  case DSP_AGC:
+    return "agc";
+  case DSP_LIMITER:
+    return "limiter";
+  case DSP_NR:
+    return "nr";
+  case DSP_LEVEL:
+    return "level";
+  }
+  return "unknown";
+}
+
+// the biquad of the Audio EQ Cookbook (R. Bristow-Johnson), false if the frequency is out of the band of the rate
+bool dspDesignBiquad(DspStage *stage, DspStageType type, float freq, float q, uint32_t sampleRate)
+{
+  if (freq <= 0 || freq >= 0.45 * sampleRate)
+    return false;
+  double w0 = 2 * M_PI * freq / sampleRate;
+  double alpha = sin(w0) / (2 * q);
+  double c = cos(w0);
+  double b0, b1, b2;
+  if (type == DSP_LOWPASS)
+  {
+    b0 = (1 - c) / 2;
+    b1 = 1 - c;
+    b2 = b0;
+  }
+  else if (type == DSP_HIGHPASS)
+  {
+    b0 = (1 + c) / 2;
+    b1 = -(1 + c);
+    b2 = b0;
+  }
+  else
+  {
+    b0 = alpha;
+    b1 = 0;
+    b2 = -alpha;
+  }
+  double a0 = 1 + alpha;
+  double k = (double)(1 << DSP_Q) / a0;
+  stage->coef[0] = lround(b0 * k);
+  stage->coef[1] = lround(b1 * k);
+  stage->coef[2] = lround(b2 * k);
+  stage->coef[3] = lround(-2 * c * k);
+  stage->coef[4] = lround((1 - alpha) * k);
+  return true;
+}
+
+void dspAddGain(DspChain *chain, int gainShift)
+{
+  DspStage *gain = &chain->stages[chain->numStages++];
+  gain->type = DSP_GAIN;
+  gain->value = gainShift;
+  gain->coef[0] = gainShift;
+}
+
+void dspAddNr(DspChain *chain, NrState *nr)
+{
+  DspStage *stage = &chain->stages[chain->numStages++];
+  stage->type = DSP_NR;
+  stage->value = NR_FFT_SIZE;
+  chain->nr = nr;
+}
+
+// The fixed gain of the stream in dB, ahead of the filters of the profile (its AGC still has the last word).
+// Set again when a chained file starts, 0 dB on a chain without one adds nothing.
+void dspSetLevel(DspChain *chain, float gainDb)
+{
+  DspStage *stage = &chain->stages[0];
+  if (chain->numStages == 0 || stage->type != DSP_LEVEL)
+  {
+    if (gainDb == 0)
+      return;
+    memmove(chain->stages + 1, chain->stages, chain->numStages * sizeof(DspStage));
+    memset(stage, 0, sizeof(DspStage));
+    stage->type = DSP_LEVEL;
+    chain->numStages++;
+  }
+  stage->value = gainDb;
+  stage->coef[0] = lround(pow(10, gainDb / 20) * 65536);
+}
+
+// Configure the chain of a profile for a stream, gainShift - the gain of the stream (2^shift), after the DC removal.
+// Stages that don't fit the rate (a low-pass above it) are left out. Profile 0 (or an unknown one) is no chain.
+// nr - the noise suppression (nrInit done) before the AGC and the limiter, NULL for none, a stereo stream has none.
+void dspChainInit(DspChain *chain, int profile, uint32_t sampleRate, int bits, int numChannels, int gainShift, NrState *nr = NULL)
+{
+  memset(chain, 0, sizeof(DspChain));
+  chain->profile = profile > 0 && profile < dspNumProfiles ? profile : 0;
+  chain->sampleRate = sampleRate;
+  chain->bits = bits;
+  chain->numChannels = numChannels;
+  const DspProfile *spec = &dspProfiles[chain->profile];
+  bool addNr = nr != NULL && numChannels == 1;
+  if (spec->numStages == 0 && !addNr)
+    return; // the gain stays with the conversion
+  if (spec->numStages == 0 && gainShift > 0)
+    dspAddGain(chain, gainShift); // the chain takes the samples before the gain, see startRecordingPipeline
+
+  for (int i = 0; i < spec->numStages; i++)
+  {
+    const DspStageSpec *s = &spec->stages[i];
+    if (addNr && (s->type == DSP_AGC || s->type == DSP_LIMITER))
+    {
+      // the AGC would lift the noise between the sounds, the suppression goes first
+      dspAddNr(chain, nr);
+      addNr = false;
+    }
+    DspStage *stage = &chain->stages[chain->numStages];
+    stage->type = s->type;
+    stage->value = s->value;
+    switch (s->type)
+    {
+    case DSP_DC:
+      stage->coef[0] = lround((1 - 2 * M_PI * s->value / sampleRate) * (1 << 30));
+      break;
+    case DSP_GAIN:
+      continue;
+    case DSP_HIGHPASS:
+    case DSP_LOWPASS:
+    case DSP_BANDPASS:
+      if (!dspDesignBiquad(stage, s->type, s->value, s->param, sampleRate))
+        continue;
+      break;
+    case DSP_AGC:
+      stage->coef[0] = lround(pow(10, s->value / 20) * INT32_MAX);         // the target peak
+      stage->coef[1] = lround(pow(10, s->param / 20) * 65536);             // the largest gain, Q16
+      stage->coef[2] = lround(pow(10, DSP_AGC_GATE_DB / 20.0) * INT32_MAX); // the gate
+      for (int c = 0; c < 2; c++)
+        stage->state[c][0] = 65536; // unity
+      break;
+    case DSP_NR:
+    case DSP_LEVEL:
+      continue;
+    case DSP_LIMITER:
+      stage->coef[0] = lround(pow(10, s->value / 20) * INT32_MAX); // the ceiling
+      // the release of the gain per sample, Q30 of the distance to unity
+      stage->coef[1] = max(1L, lround((double)(1 << 30) / (s->param * sampleRate / 1000)));
+      for (int c = 0; c < 2; c++)
+        stage->state[c][0] = 1 << 30;
+      break;
+    }
+    chain->numStages++;
+
+    // the gain right after the DC removal, before a DC offset gets amplified
+    if (s->type == DSP_DC && gainShift > 0)
+      dspAddGain(chain, gainShift);
+  }
+  if (addNr)
+    dspAddNr(chain, nr);
+}
+
+// a stage over n interleaved samples, left-justified 32-bit
+void dspRunStage(DspStage *stage, int32_t *x, int n, int numChannels)
+{
+  switch (stage->type)
+  {
+  case DSP_DC:
+  {
+    // y = x - x1 + p * y1
+    int32_t p = stage->coef[0];
+    for (int c = 0; c < numChannels; c++)
+    {
+      int32_t x1 = stage->state[c][0];
+      int32_t y1 = stage->state[c][2];
+      for (int i = c; i < n; i += numChannels)
+      {
+        int32_t v = x[i];
+        y1 = dspSat((int64_t)v - x1 + (((int64_t)p * y1) >> 30));
+        x1 = v;
+        x[i] = y1;
+      }
+      stage->state[c][0] = x1;
+      stage->state[c][2] = y1;
+    }
+    break;
+  }
+  case DSP_GAIN:
+  {
+    int shift = stage->coef[0];
+    for (int i = 0; i < n; i++)
+      x[i] = convGain(x[i], shift); // audioCONV.h
+    break;
+  }
+  case DSP_HIGHPASS:
+  case DSP_LOWPASS:
+  case DSP_BANDPASS:
+  {
+    // direct form I, a 64-bit accumulator, the coefficients up to +-8 leave the headroom
+    int32_t b0 = stage->coef[0], b1 = stage->coef[1], b2 = stage->coef[2], a1 = stage->coef[3], a2 = stage->coef[4];
+    for (int c = 0; c < numChannels; c++)
+    {
+      int32_t x1 = stage->state[c][0], x2 = stage->state[c][1], y1 = stage->state[c][2], y2 = stage->state[c][3];
+      for (int i = c; i < n; i += numChannels)
+      {
+        int32_t v = x[i];
+        int64_t acc = (int64_t)b0 * v + (int64_t)b1 * x1 + (int64_t)b2 * x2 - (int64_t)a1 * y1 - (int64_t)a2 * y2;
+        int32_t y = dspSat(acc >> DSP_Q);
+        x2 = x1;
+        x1 = v;
+        y2 = y1;
+        y1 = y;
+        x[i] = y;
+      }
+      stage->state[c][0] = x1;
+      stage->state[c][1] = x2;
+      stage->state[c][2] = y1;
+      stage->state[c][3] = y2;
+    }
+    break;
+  }
+  case DSP_AGC:
+  {
+    // the gain of a chunk from its peak: down in 2 chunks, up in 32, ramped over the chunk
+    uint32_t peak = 0;
+    for (int i = 0; i < n; i++)
+    {
+      uint32_t a = x[i] < 0 ? (uint32_t)(-(int64_t)x[i]) : (uint32_t)x[i];
+      if (a > peak)
+        peak = a;
+    }
+    int32_t from = stage->state[0][0];
+    int32_t to = from;
+    if (peak > (uint32_t)stage->coef[2])
+    {
+      int64_t want = ((int64_t)stage->coef[0] << 16) / peak;
+      want = want > stage->coef[1] ? stage->coef[1] : want;
+      to = from + (int32_t)((want - from) / (want < from ? 2 : 32));
+    }
+    stage->state[0][0] = to;
+    int32_t step = (to - from) / (n ? n : 1);
+    int32_t g = from;
+    for (int i = 0; i < n; i++)
+    {
+      g += step;
+      x[i] = dspSat(((int64_t)x[i] * g) >> 16);
+    }
+    break;
+  }
+  case DSP_LIMITER:
+  {
+    // no look-ahead: the gain drops at once to keep a peak under the ceiling, then releases towards unity
+    int32_t ceiling = stage->coef[0];
+    int32_t release = stage->coef[1];
+    for (int c = 0; c < numChannels; c++)
+    {
+      int32_t g = stage->state[c][0];
+      for (int i = c; i < n; i += numChannels)
+      {
+        int64_t a = x[i] < 0 ? -(int64_t)x[i] : x[i];
+        if (((a * g) >> 30) > ceiling)
+          g = (int32_t)(((int64_t)ceiling << 30) / a);
+        x[i] = (int32_t)(((int64_t)x[i] * g) >> 30);
+        g += (int32_t)(((int64_t)((1 << 30) - g) * release) >> 30) + (g < (1 << 30));
+      }
+      stage->state[c][0] = g;
+    }
+    break;
+  }
+  case DSP_NR:
+    break; // the state is in the NrState of the chain, see dspRunChunk
+  case DSP_LEVEL:
+  {
+    int32_t g = stage->coef[0];
+    for (int i = 0; i < n; i++)
+      x[i] = dspSat(((int64_t)x[i] * g) >> 16);
+    break;
+  }
+  }
+}
+
+void dspRunChunk(DspChain *chain, int32_t *x, int n)
+{
+  for (int s = 0; s < chain->numStages; s++)
+  {
+    DspStage *stage = &chain->stages[s];
+    uint32_t start = ESP.getCycleCount();
+    if (stage->type == DSP_NR)
+      nrProcess(chain->nr, x, n); // audioNR.h, mono
+    else
+      dspRunStage(stage, x, n, chain->numChannels);
+    stage->cycles += ESP.getCycleCount() - start;
+    stage->samples += n;
+  }
+}
+
+// Run the chain over a block of 16-bit or 32-bit interleaved samples, in place
+void dspProcess(DspChain *chain, uint8_t *data, size_t len)
+{
+  if (chain->numStages == 0)
+    return;
+  if (chain->bits == 32)
+  {
+    // whole frames, the AGC sees the same chunks as in 16-bit
+    int chunk = DSP_CHUNK / chain->numChannels * chain->numChannels;
+    int32_t *x = (int32_t *)data;
+    int samples = len / sizeof(int32_t);
+    for (int at = 0; at < samples; at += chunk)
+      dspRunChunk(chain, x + at, min(chunk, samples - at));
+    return;
+  }
+  int16_t *s = (int16_t *)data;
+  int samples = len / sizeof(int16_t);
+  int chunk = DSP_CHUNK / chain->numChannels * chain->numChannels;
+  for (int at = 0; at < samples; at += chunk)
+  {
+    int n = min(chunk, samples - at);
+    for (int i = 0; i < n; i++)
+      chain->work[i] = (int32_t)s[at + i] << 16;
+    dspRunChunk(chain, chain->work, n);
+    for (int i = 0; i < n; i++)
+      s[at + i] = (int16_t)(chain->work[i] >> 16);
+  }
+}
+
+// json ready format: the stages with their CPU cycles per sample
+String dspGetStats(DspChain *chain)
+{
+  String output = "{\"profile\":\"" + String(dspProfiles[chain->profile].name) + "\",\"stages\":[";
+  float total = 0;
+  for (int s = 0; s < chain->numStages; s++)
+  {
+    DspStage *stage = &chain->stages[s];
+    float cycles = stage->samples ? (float)stage->cycles / stage->samples : 0;
+    total += cycles;
+    output += s ? ",{" : "{";
+    output += "\"stage\":\"" + String(dspStageName(stage->type)) + "\"";
+    output += ",\"value\":" + String(stage->value, 0);
+    output += ",\"cyclesPerSample\":" + String(cycles, 1) + "}";
+  }
+  output += "],\"cyclesPerSample\":" + String(total, 1) + "}";
+  return output;
+}
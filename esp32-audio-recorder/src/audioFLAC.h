@@ -0,0 +1,1043 @@
+/**
+ * Lossless streams in the FLAC format (https://xiph.org/flac/format.html), both ways, 1-2 channels of 16 or 24 bits.
+ * The encoder codes independent frames of FLAC_BLOCK_SIZE frames: the fixed linear predictor (order 0-4) with the
+ * smallest residual, and the residual in partitioned Rice codes. Low bits that are 0 in a whole block (a recording
+ * with a lower resolution than its file) are left out. A stereo frame takes the best pair of
+ * left/right, left/side, right/side and mid/side. Every frame starts with a sync code and its number and ends with a CRC-16,
+ * so a frame decodes on its own (a seek point per frame, see the seek table in fsFLASH.h).
+ * The decoder takes the LPC subframes of other encoders too (libFLAC), so an uploaded .flac plays as well.
+ * The container (the fLaC marker, the STREAMINFO and SEEKTABLE blocks) is written and read in fsFLASH.h.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FLAC_BLOCK_SIZE
+#define FLAC_BLOCK_SIZE (1152) // frames per coded frame of the encoder, longer blocks compress a bit better and take more RAM
+#endif
+#define FLAC_MAX_BLOCK_SIZE (4608)   // the decoder takes blocks up to the largest one of the FLAC subset
+#define FLAC_MAX_PARTITION_ORDER (6) // the encoder splits the residual in up to 64 Rice partitions
+#define FLAC_MAX_FIXED_ORDER (4)
+#define FLAC_MAX_LPC_ORDER (32)
+#define FLAC_STREAMINFO_SIZE (34)
+#define FLAC_SEEKPOINT_SIZE (18)
+#define FLAC_PLACEHOLDER (0xFFFFFFFFFFFFFFFFULL) // the sample number of an unused seek point
+
+// subframe types
+#define FLAC_SUBFRAME_CONSTANT (0)
+#define FLAC_SUBFRAME_VERBATIM (1)
+#define FLAC_SUBFRAME_FIXED (8) // + the order
+#define FLAC_SUBFRAME_LPC (32)  // + the order - 1
+
+// channel assignments of a stereo frame
+#define FLAC_CH_INDEPENDENT (1)
+#define FLAC_CH_LEFT_SIDE (8)
+#define FLAC_CH_RIGHT_SIDE (9)
+#define FLAC_CH_MID_SIDE (10)
+
+// the format of the whole stream, as in its STREAMINFO block
+struct FlacStreamInfo
+{
+  uint16_t minBlockSize;
+  uint16_t maxBlockSize;
+  uint32_t minFrameSize; // bytes, 0 - unknown
+  uint32_t maxFrameSize;
+  uint32_t sampleRate;
+  int numChannels;
+  int bitsPerSample;
+  uint64_t totalSamples; // frames of the stream, 0 - unknown
+};
+
+/**
+ * CRC-8 of the frame header (polynomial 0x07) and CRC-16 of the whole frame (polynomial 0x8005)
+ */
+
+uint8_t flacCrc8Table[256];
+uint16_t flacCrc16Table[256];
+bool flacTablesReady = false;
+
+void flacInitTables()
+{
+  if (flacTablesReady)
+    return;
+  for (int i = 0; i < 256; i++)
+  {
+    uint8_t crc8 = i;
+    uint16_t crc16 = i << 8;
+    for (int b = 0; b < 8; b++)
+    {
+      crc8 = (crc8 & 0x80) ? (crc8 << 1) ^ 0x07 : crc8 << 1;
+      crc16 = (crc16 & 0x8000) ? (crc16 << 1) ^ 0x8005 : crc16 << 1;
+    }
+    flacCrc8Table[i] = crc8;
+    flacCrc16Table[i] = crc16;
+  }
+  flacTablesReady = true;
+}
+
+uint8_t flacCrc8(const uint8_t *data, size_t len)
+{
+  uint8_t crc = 0;
+  for (size_t i = 0; i < len; i++)
+    crc = flacCrc8Table[crc ^ data[i]];
+  return crc;
+}
+
+uint16_t flacCrc16(const uint8_t *data, size_t len)
+{
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++)
+    crc = (crc << 8) ^ flacCrc16Table[(crc >> 8) ^ data[i]];
+  return crc;
+}
+
+/**
+ * Metadata blocks, big endian
+ */
+
+void flacPutBE(uint8_t *dest, uint64_t value, int bytes)
+{
+  for (int i = bytes - 1; i >= 0; i--, value >>= 8)
+    dest[i] = (uint8_t)value;
+}
+
+uint64_t flacGetBE(const uint8_t *src, int bytes)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++)
+    value = (value << 8) | src[i];
+  return value;
+}
+
+// the 34 bytes of STREAMINFO, the MD5 of the samples is left 0 (unknown), every frame has its own CRC-16
+void flacPutStreamInfo(uint8_t *dest, const FlacStreamInfo *info)
+{
+  flacPutBE(dest, info->minBlockSize, 2);
+  flacPutBE(dest + 2, info->maxBlockSize, 2);
+  flacPutBE(dest + 4, info->minFrameSize, 3);
+  flacPutBE(dest + 7, info->maxFrameSize, 3);
+  flacPutBE(dest + 10, ((uint64_t)info->sampleRate << 44) | ((uint64_t)(info->numChannels - 1) << 41) |
+                           ((uint64_t)(info->bitsPerSample - 1) << 36) | (info->totalSamples & 0xFFFFFFFFFULL),
+            8);
+  memset(dest + 18, 0, 16);
+}
+
+// false if the stream is not one we decode: 1-2 channels, 16 or 24 bits, blocks up to FLAC_MAX_BLOCK_SIZE
+bool flacParseStreamInfo(const uint8_t *src, FlacStreamInfo *info)
+{
+  info->minBlockSize = (uint16_t)flacGetBE(src, 2);
+  info->maxBlockSize = (uint16_t)flacGetBE(src + 2, 2);
+  info->minFrameSize = (uint32_t)flacGetBE(src + 4, 3);
+  info->maxFrameSize = (uint32_t)flacGetBE(src + 7, 3);
+  uint64_t packed = flacGetBE(src + 10, 8);
+  info->sampleRate = (uint32_t)(packed >> 44);
+  info->numChannels = (int)((packed >> 41) & 0x07) + 1;
+  info->bitsPerSample = (int)((packed >> 36) & 0x1F) + 1;
+  info->totalSamples = packed & 0xFFFFFFFFFULL;
+  return info->sampleRate > 0 && info->numChannels <= 2 && (info->bitsPerSample == 16 || info->bitsPerSample == 24) &&
+         info->minBlockSize >= 16 && info->maxBlockSize <= FLAC_MAX_BLOCK_SIZE && info->minBlockSize <= info->maxBlockSize;
+}
+
+void flacPutSeekPoint(uint8_t *dest, uint64_t sample, uint64_t offset, uint16_t frames)
+{
+  flacPutBE(dest, sample, 8);
+  flacPutBE(dest + 8, offset, 8);
+  flacPutBE(dest + 16, frames, 2);
+}
+
+// the largest frame of a block: a verbatim subframe per channel (a side channel has one more bit), the header and the CRC
+uint32_t flacMaxFrameBytes(int blockSize, int numChannels, int bitsPerSample)
+{
+  return 18 + numChannels * ((blockSize * (bitsPerSample + 1) + 7) / 8 + 2);
+}
+
+/**
+ * Bit writer, MSB first
+ */
+
+struct FlacBitWriter
+{
+  uint8_t *data;
+  size_t pos;   // bytes written
+  uint64_t acc; // the bits not written yet are the low count bits
+  int count;
+};
+
+static inline void flacPutBits(FlacBitWriter *w, uint32_t value, int n)
+{
+  w->acc = (w->acc << n) | (n == 32 ? value : value & ((1u << n) - 1));
+  w->count += n;
+  while (w->count >= 8)
+  {
+    w->count -= 8;
+    w->data[w->pos++] = (uint8_t)(w->acc >> w->count);
+  }
+}
+
+static inline void flacAlignWriter(FlacBitWriter *w)
+{
+  if (w->count > 0)
+    flacPutBits(w, 0, 8 - w->count);
+}
+
+// the residual folded to unsigned (0, -1, 1, -2...), the quotient in unary (zeros and a one), then k low bits
+static inline void flacPutRice(FlacBitWriter *w, int32_t residual, int k)
+{
+  uint32_t u = ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+  uint32_t q = u >> k;
+  if (q + 1 + k <= 32)
+  {
+    flacPutBits(w, (1u << k) | (u & ((1u << k) - 1)), q + 1 + k);
+    return;
+  }
+  for (; q >= 32; q -= 32)
+    flacPutBits(w, 0, 32);
+  flacPutBits(w, 1, q + 1);
+  flacPutBits(w, u, k);
+}
+
+// the frame number of a fixed block size stream, in the UTF-8 like coding of FLAC
+void flacPutUtf8(FlacBitWriter *w, uint32_t value)
+{
+  if (value < 0x80)
+  {
+    flacPutBits(w, value, 8);
+    return;
+  }
+  int bytes = value < 0x800 ? 2 : value < 0x10000 ? 3 : value < 0x200000 ? 4 : value < 0x4000000 ? 5 : 6;
+  flacPutBits(w, ((0xFF00 >> bytes) & 0xFF) | (value >> (6 * (bytes - 1))), 8);
+  for (int i = bytes - 2; i >= 0; i--)
+    flacPutBits(w, 0x80 | ((value >> (6 * i)) & 0x3F), 8);
+}
+
+/**
+ * Encoder
+ */
+
+// how a subframe is coded, the residual of a fixed predictor in 2^partitionOrder Rice partitions
+struct FlacPlan
+{
+  int type; // FLAC_SUBFRAME_xxx
+  int wasted; // low bits that are 0 in every sample, shifted out
+  int order;
+  int partitionOrder;
+  bool rice2; // 5-bit Rice parameters, some partition needs more than 14 bits
+  uint8_t params[1 << FLAC_MAX_PARTITION_ORDER];
+  uint32_t bits; // of the whole subframe
+};
+
+// the order of the fixed predictor with the smallest residual (sum of the absolute values)
+int flacBestFixedOrder(const int32_t *x, int n)
+{
+  uint64_t sum[FLAC_MAX_FIXED_ORDER + 1] = {0};
+  int32_t last0 = x[3];
+  int32_t last1 = x[3] - x[2];
+  int32_t last2 = last1 - (x[2] - x[1]);
+  int32_t last3 = last2 - (x[2] - 2 * x[1] + x[0]);
+  for (int i = FLAC_MAX_FIXED_ORDER; i < n; i++)
+  {
+    // the differences of increasing order are the residuals of the fixed predictors
+    int32_t e0 = x[i];
+    int32_t e1 = e0 - last0;
+    int32_t e2 = e1 - last1;
+    int32_t e3 = e2 - last2;
+    int32_t e4 = e3 - last3;
+    sum[0] += (uint32_t)abs(e0);
+    sum[1] += (uint32_t)abs(e1);
+    sum[2] += (uint32_t)abs(e2);
+    sum[3] += (uint32_t)abs(e3);
+    sum[4] += (uint32_t)abs(e4);
+    last0 = e0;
+    last1 = e1;
+    last2 = e2;
+    last3 = e3;
+  }
+
+  int order = 0;
+  for (int o = 1; o <= FLAC_MAX_FIXED_ORDER; o++)
+  {
+    if (sum[o] < sum[order])
+      order = o;
+  }
+  return order;
+}
+
+// residual[i] for i = order..n-1, the first order samples are the warm-up
+void flacFixedResidual(const int32_t *x, int n, int order, int32_t *residual)
+{
+  for (int i = order; i < n; i++)
+  {
+    switch (order)
+    {
+    case 0: residual[i] = x[i]; break;
+    case 1: residual[i] = x[i] - x[i - 1]; break;
+    case 2: residual[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+    case 3: residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+    default: residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+    }
+  }
+}
+
+// the Rice parameter of a partition with the sum of its folded residuals, and the bits it takes
+static inline int flacRiceParam(uint64_t sum, uint32_t count, uint32_t *bits)
+{
+  if (count == 0)
+  {
+    *bits = 0;
+    return 0;
+  }
+  // 2^k about the mean, then the neighbours
+  uint64_t mean = sum / count;
+  int k = 0;
+  while (k < 30 && (mean >> (k + 1)) > 0)
+    k++;
+  int best = k;
+  uint64_t bestBits = UINT64_MAX;
+  for (int p = (k > 0 ? k - 1 : 0); p <= k + 1 && p <= 30; p++)
+  {
+    uint64_t b = (uint64_t)count * (p + 1) + (sum >> p);
+    if (b < bestBits)
+    {
+      bestBits = b;
+      best = p;
+    }
+  }
+  *bits = (uint32_t)bestBits;
+  return best;
+}
+
+// the partition order and the Rice parameters of the residual with the fewest bits, returns the bits of the residual
+uint32_t flacPlanResidual(const int32_t *residual, int n, int order, FlacPlan *plan)
+{
+  // the finest partitions: the block size must split evenly, and the first one must be longer than the warm-up
+  int maxOrder = 0;
+  while (maxOrder < FLAC_MAX_PARTITION_ORDER && n % (2 << maxOrder) == 0 && (n >> (maxOrder + 1)) > order)
+    maxOrder++;
+
+  uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+  int parts = 1 << maxOrder;
+  int i = order;
+  for (int p = 0; p < parts; p++)
+  {
+    uint64_t sum = 0;
+    for (int end = (p + 1) * (n >> maxOrder); i < end; i++)
+      sum += ((uint32_t)residual[i] << 1) ^ (uint32_t)(residual[i] >> 31);
+    sums[p] = sum;
+  }
+
+  // from the finest partitions to a single one, merging the sums in pairs
+  uint32_t bestBits = UINT32_MAX;
+  for (int po = maxOrder; po >= 0; po--)
+  {
+    parts = 1 << po;
+    uint32_t bits = 2 + 4; // coding method, partition order
+    uint8_t params[1 << FLAC_MAX_PARTITION_ORDER];
+    int maxParam = 0;
+    for (int p = 0; p < parts; p++)
+    {
+      uint32_t partBits;
+      uint32_t count = (n >> po) - (p == 0 ? order : 0);
+      params[p] = flacRiceParam(sums[p], count, &partBits);
+      maxParam = max(maxParam, (int)params[p]);
+      bits += 4 + partBits;
+    }
+    if (maxParam > 14)
+      bits += parts; // 5-bit parameters
+    if (bits < bestBits)
+    {
+      bestBits = bits;
+      plan->partitionOrder = po;
+      plan->rice2 = maxParam > 14;
+      memcpy(plan->params, params, parts);
+    }
+    for (int p = 0; p < parts / 2; p++)
+      sums[p] = sums[2 * p] + sums[2 * p + 1];
+  }
+  return bestBits;
+}
+
+// The cheapest coding of a subframe: constant, fixed predictor or verbatim (when nothing is smaller).
+// The wasted bits are shifted out of x in place, flacWriteSubframe takes it that way.
+void flacPlanSubframe(int32_t *x, int n, int bps, int32_t *residual, FlacPlan *plan)
+{
+  plan->wasted = 0;
+  int i = 1;
+  while (i < n && x[i] == x[0])
+    i++;
+  if (i == n)
+  {
+    plan->type = FLAC_SUBFRAME_CONSTANT;
+    plan->bits = 8 + bps;
+    return;
+  }
+
+  uint32_t ored = 0;
+  for (i = 0; i < n; i++)
+    ored |= x[i];
+  plan->wasted = __builtin_ctz(ored); // not all 0, that is a constant
+  if (plan->wasted > 0)
+  {
+    for (i = 0; i < n; i++)
+      x[i] >>= plan->wasted;
+    bps -= plan->wasted;
+  }
+
+  plan->type = FLAC_SUBFRAME_VERBATIM;
+  plan->bits = 8 + plan->wasted + n * bps;
+  if (n <= 2 * FLAC_MAX_FIXED_ORDER)
+    return;
+
+  FlacPlan fixed;
+  fixed.wasted = plan->wasted;
+  fixed.order = flacBestFixedOrder(x, n);
+  flacFixedResidual(x, n, fixed.order, residual);
+  fixed.bits = 8 + fixed.wasted + fixed.order * bps + flacPlanResidual(residual, n, fixed.order, &fixed);
+  if (fixed.bits < plan->bits)
+  {
+    fixed.type = FLAC_SUBFRAME_FIXED + fixed.order;
+    *plan = fixed;
+  }
+}
+
+void flacWriteSubframe(FlacBitWriter *w, const int32_t *x, int n, int bps, FlacPlan *plan, int32_t *residual)
+{
+  flacPutBits(w, (plan->type << 1) | (plan->wasted > 0), 8); // zero padding bit, the type, the wasted bits flag
+  if (plan->wasted > 0)
+  {
+    flacPutBits(w, 1, plan->wasted); // wasted - 1 in unary
+    bps -= plan->wasted;
+  }
+  if (plan->type == FLAC_SUBFRAME_CONSTANT)
+  {
+    flacPutBits(w, x[0], bps);
+    return;
+  }
+  if (plan->type == FLAC_SUBFRAME_VERBATIM)
+  {
+    for (int i = 0; i < n; i++)
+      flacPutBits(w, x[i], bps);
+    return;
+  }
+
+  // fixed: the warm-up samples, then the residual
+  for (int i = 0; i < plan->order; i++)
+    flacPutBits(w, x[i], bps);
+  flacFixedResidual(x, n, plan->order, residual);
+  flacPutBits(w, plan->rice2 ? 1 : 0, 2);
+  flacPutBits(w, plan->partitionOrder, 4);
+  int parts = 1 << plan->partitionOrder;
+  int i = plan->order;
+  for (int p = 0; p < parts; p++)
+  {
+    int k = plan->params[p];
+    flacPutBits(w, k, plan->rice2 ? 5 : 4);
+    for (int end = (p + 1) * (n >> plan->partitionOrder); i < end; i++)
+      flacPutRice(w, residual[i], k);
+  }
+}
+
+// the 4-bit codes of the frame header, 0 - the value is in STREAMINFO (sample rate) or at the end of the header (block size)
+int flacBlockSizeCode(int n)
+{
+  if (n == 192)
+    return 1;
+  for (int c = 2; c <= 5; c++)
+  {
+    if (n == 576 << (c - 2))
+      return c;
+  }
+  for (int c = 8; c <= 15; c++)
+  {
+    if (n == 256 << (c - 8))
+      return c;
+  }
+  return n <= 256 ? 6 : 7;
+}
+
+int flacSampleRateCode(uint32_t rate)
+{
+  const uint32_t rates[] = {0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000};
+  for (int c = 1; c < (int)(sizeof(rates) / sizeof(rates[0])); c++)
+  {
+    if (rate == rates[c])
+      return c;
+  }
+  return 0;
+}
+
+// The streaming encoder of a recording: packed PCM blocks of any size in, whole frames out
+struct FlacEncoder
+{
+  FlacStreamInfo info; // the frame sizes and the total grow with the frames
+  int blockSize;
+  int32_t *pending; // the unfinished block, a channel after the other
+  int32_t *work;    // mid, side and the residual
+  int pendingFrames;
+  uint32_t frameNumber;
+  uint32_t bytes;        // of the frames so far, the offset of the next one after the header
+  uint32_t *seekOffsets; // the offset of every frame, for the seek table
+  int seekPoints;        // as many as the longest recording has frames
+};
+
+// maxFrames - the length of the recording (the seek table has a point for every frame of it)
+bool flacEncoderInit(FlacEncoder *enc, uint32_t sampleRate, int numChannels, int bitsPerSample, uint32_t maxFrames)
+{
+  flacInitTables();
+  enc->blockSize = FLAC_BLOCK_SIZE;
+  enc->info.minBlockSize = enc->info.maxBlockSize = FLAC_BLOCK_SIZE;
+  enc->info.minFrameSize = 0;
+  enc->info.maxFrameSize = 0;
+  enc->info.sampleRate = sampleRate;
+  enc->info.numChannels = numChannels;
+  enc->info.bitsPerSample = bitsPerSample;
+  enc->info.totalSamples = 0;
+  enc->pendingFrames = 0;
+  enc->frameNumber = 0;
+  enc->bytes = 0;
+  enc->seekPoints = (maxFrames + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE;
+  enc->pending = (int32_t *)malloc(numChannels * FLAC_BLOCK_SIZE * sizeof(int32_t));
+  enc->work = (int32_t *)malloc((numChannels == 2 ? 3 : 1) * FLAC_BLOCK_SIZE * sizeof(int32_t));
+  enc->seekOffsets = (uint32_t *)malloc(max(enc->seekPoints, 1) * sizeof(uint32_t));
+  if (enc->pending == NULL || enc->work == NULL || enc->seekOffsets == NULL)
+  {
+    free(enc->pending);
+    free(enc->work);
+    free(enc->seekOffsets);
+    enc->pending = enc->work = NULL;
+    enc->seekOffsets = NULL;
+    return false;
+  }
+  return true;
+}
+
+void flacEncoderEnd(FlacEncoder *enc)
+{
+  free(enc->pending);
+  free(enc->work);
+  free(enc->seekOffsets);
+  enc->pending = enc->work = NULL;
+  enc->seekOffsets = NULL;
+}
+
+// Code the pending block as a frame, returns its size
+size_t flacEncodeFrame(FlacEncoder *enc, uint8_t *dest)
+{
+  int n = enc->pendingFrames;
+  int bps = enc->info.bitsPerSample;
+  int32_t *left = enc->pending;
+  int32_t *right = enc->pending + enc->blockSize;
+  int32_t *residual = enc->work;
+  int32_t *channels[2] = {left, right};
+  int channelBits[2] = {bps, bps};
+  FlacPlan plans[2];
+  int assignment = enc->info.numChannels - 1; // independent
+
+  if (enc->info.numChannels == 1)
+    flacPlanSubframe(left, n, bps, residual, &plans[0]);
+  else
+  {
+    // the best pair of the four channels, side has one more bit
+    int32_t *mid = enc->work;
+    int32_t *side = enc->work + enc->blockSize;
+    residual = enc->work + 2 * enc->blockSize;
+    for (int i = 0; i < n; i++)
+    {
+      mid[i] = (left[i] + right[i]) >> 1;
+      side[i] = left[i] - right[i];
+    }
+    FlacPlan l, r, m, s;
+    flacPlanSubframe(left, n, bps, residual, &l);
+    flacPlanSubframe(right, n, bps, residual, &r);
+    flacPlanSubframe(mid, n, bps, residual, &m);
+    flacPlanSubframe(side, n, bps + 1, residual, &s);
+    uint32_t bits = l.bits + r.bits;
+    plans[0] = l;
+    plans[1] = r;
+    if (l.bits + s.bits < bits)
+    {
+      bits = l.bits + s.bits;
+      assignment = FLAC_CH_LEFT_SIDE;
+    }
+    if (r.bits + s.bits < bits)
+    {
+      bits = r.bits + s.bits;
+      assignment = FLAC_CH_RIGHT_SIDE;
+    }
+    if (m.bits + s.bits < bits)
+      assignment = FLAC_CH_MID_SIDE;
+
+    if (assignment == FLAC_CH_LEFT_SIDE)
+    {
+      plans[1] = s;
+      channels[1] = side;
+      channelBits[1] = bps + 1;
+    }
+    else if (assignment == FLAC_CH_RIGHT_SIDE)
+    {
+      plans[0] = s;
+      channels[0] = side;
+      channelBits[0] = bps + 1;
+    }
+    else if (assignment == FLAC_CH_MID_SIDE)
+    {
+      plans[0] = m;
+      plans[1] = s;
+      channels[0] = mid;
+      channels[1] = side;
+      channelBits[1] = bps + 1;
+    }
+  }
+
+  // the header: sync code (fixed block size), block size, sample rate, channels, bits, frame number, CRC-8
+  FlacBitWriter w = {dest, 0, 0, 0};
+  int blockCode = flacBlockSizeCode(n);
+  flacPutBits(&w, 0xFFF8, 16);
+  flacPutBits(&w, blockCode, 4);
+  flacPutBits(&w, flacSampleRateCode(enc->info.sampleRate), 4);
+  flacPutBits(&w, assignment, 4);
+  flacPutBits(&w, bps == 16 ? 4 : 6, 3);
+  flacPutBits(&w, 0, 1);
+  flacPutUtf8(&w, enc->frameNumber);
+  if (blockCode == 6)
+    flacPutBits(&w, n - 1, 8);
+  else if (blockCode == 7)
+    flacPutBits(&w, n - 1, 16);
+  flacPutBits(&w, flacCrc8(dest, w.pos), 8);
+
+  for (int c = 0; c < enc->info.numChannels; c++)
+    flacWriteSubframe(&w, channels[c], n, channelBits[c], &plans[c], residual);
+
+  flacAlignWriter(&w);
+  flacPutBits(&w, flacCrc16(dest, w.pos), 16);
+
+  // the stream so far
+  uint32_t size = w.pos;
+  if (enc->frameNumber < (uint32_t)enc->seekPoints)
+    enc->seekOffsets[enc->frameNumber] = enc->bytes;
+  if (enc->info.minFrameSize == 0 || size < enc->info.minFrameSize)
+    enc->info.minFrameSize = size;
+  if (size > enc->info.maxFrameSize)
+    enc->info.maxFrameSize = size;
+  enc->info.totalSamples += n;
+  enc->bytes += size;
+  enc->frameNumber++;
+  enc->pendingFrames = 0;
+  return size;
+}
+
+// the most bytes flacEncode may return for that many frames
+size_t flacEncodeBound(FlacEncoder *enc, size_t frames)
+{
+  return ((frames + enc->blockSize - 1) / enc->blockSize + 1) *
+         flacMaxFrameBytes(enc->blockSize, enc->info.numChannels, enc->info.bitsPerSample);
+}
+
+// Code packed PCM (16 or 24-bit, little endian), returns the bytes of the whole frames written to dest.
+// The frames of an unfinished block wait for the next call (or flacEncoderFlush).
+size_t flacEncode(FlacEncoder *enc, uint8_t *dest, const uint8_t *src, size_t frames)
+{
+  size_t out = 0;
+  int bytes = enc->info.bitsPerSample / 8;
+  int numChannels = enc->info.numChannels;
+  for (size_t f = 0; f < frames; f++)
+  {
+    for (int c = 0; c < numChannels; c++, src += bytes)
+    {
+      int32_t v = bytes == 2 ? (int16_t)(src[0] | (src[1] << 8)) : ((int32_t)((src[0] << 8) | (src[1] << 16) | (src[2] << 24)) >> 8);
+      enc->pending[c * enc->blockSize + enc->pendingFrames] = v;
+    }
+    if (++enc->pendingFrames == enc->blockSize)
+      out += flacEncodeFrame(enc, dest + out);
+  }
+  return out;
+}
+
+// the last block, shorter than the others
+size_t flacEncoderFlush(FlacEncoder *enc, uint8_t *dest)
+{
+  if (enc->pendingFrames == 0)
+    return 0;
+  if (enc->frameNumber == 0)
+    enc->info.minBlockSize = enc->info.maxBlockSize = enc->pendingFrames; // a single block, short as well
+  return flacEncodeFrame(enc, dest);
+}
+
+/**
+ * Bit reader, MSB first. Reads beyond the data give zeros, flacReaderOverrun tells it happened.
+ */
+
+struct FlacBitReader
+{
+  const uint8_t *data;
+  size_t len;
+  size_t pos;     // the next byte to load
+  uint64_t cache; // the loaded bits, MSB aligned
+  int bits;
+};
+
+static inline void flacRefill(FlacBitReader *r)
+{
+  while (r->bits <= 56)
+  {
+    r->cache |= (uint64_t)(r->pos < r->len ? r->data[r->pos] : 0) << (56 - r->bits);
+    r->pos++;
+    r->bits += 8;
+  }
+}
+
+static inline uint32_t flacGetBits(FlacBitReader *r, int n)
+{
+  if (n == 0)
+    return 0;
+  flacRefill(r);
+  uint32_t value = (uint32_t)(r->cache >> (64 - n));
+  r->cache <<= n;
+  r->bits -= n;
+  return value;
+}
+
+static inline int32_t flacGetSigned(FlacBitReader *r, int n)
+{
+  if (n == 0)
+    return 0;
+  return (int32_t)(flacGetBits(r, n) << (32 - n)) >> (32 - n);
+}
+
+static inline uint32_t flacGetUnary(FlacBitReader *r)
+{
+  uint32_t q = 0;
+  for (;;)
+  {
+    flacRefill(r);
+    if (r->cache == 0)
+    {
+      q += r->bits;
+      r->bits = 0;
+      if (r->pos > r->len + 8)
+        return q; // nothing but zeros past the data, the caller sees the overrun
+      continue;
+    }
+    int zeros = __builtin_clzll(r->cache);
+    q += zeros;
+    r->cache <<= zeros;
+    r->cache <<= 1;
+    r->bits -= zeros + 1;
+    return q;
+  }
+}
+
+// bytes consumed, the partial one counts
+static inline size_t flacReaderBytes(FlacBitReader *r)
+{
+  return r->pos - r->bits / 8;
+}
+
+static inline bool flacReaderOverrun(FlacBitReader *r)
+{
+  return r->pos * 8 - r->bits > r->len * 8;
+}
+
+static inline void flacAlignReader(FlacBitReader *r)
+{
+  flacGetBits(r, r->bits % 8);
+}
+
+uint32_t flacGetUtf8(FlacBitReader *r, bool *valid)
+{
+  uint32_t value = flacGetBits(r, 8);
+  if (value < 0x80)
+    return value;
+  int bytes = 0;
+  while (bytes < 8 && (value & (0x80 >> bytes)))
+    bytes++;
+  if (bytes < 2 || bytes > 7)
+  {
+    *valid = false;
+    return 0;
+  }
+  value &= 0x7F >> bytes;
+  for (int i = 1; i < bytes; i++)
+  {
+    uint32_t next = flacGetBits(r, 8);
+    if ((next & 0xC0) != 0x80)
+      *valid = false;
+    value = (value << 6) | (next & 0x3F);
+  }
+  return value;
+}
+
+/**
+ * Decoder
+ */
+
+struct FlacDecoder
+{
+  FlacStreamInfo info;
+  int32_t *samples;     // the last decoded block, a channel after the other (maxBlockSize each)
+  int blockSize;        // frames of the last decoded block
+  uint64_t firstSample; // its position in the stream
+};
+
+bool flacDecoderInit(FlacDecoder *dec, const FlacStreamInfo *info)
+{
+  flacInitTables();
+  dec->info = *info;
+  dec->blockSize = 0;
+  dec->firstSample = 0;
+  dec->samples = (int32_t *)malloc(info->numChannels * info->maxBlockSize * sizeof(int32_t));
+  return dec->samples != NULL;
+}
+
+void flacDecoderEnd(FlacDecoder *dec)
+{
+  free(dec->samples);
+  dec->samples = NULL;
+}
+
+// the input buffer of a frame, from STREAMINFO or the worst case
+size_t flacDecoderFrameBytes(FlacDecoder *dec)
+{
+  if (dec->info.maxFrameSize > 0)
+    return dec->info.maxFrameSize;
+  return flacMaxFrameBytes(dec->info.maxBlockSize, dec->info.numChannels, dec->info.bitsPerSample);
+}
+
+// the residual of a subframe into x[order..n-1]
+bool flacDecodeResidual(FlacBitReader *r, int32_t *x, int n, int order)
+{
+  int method = flacGetBits(r, 2);
+  if (method > 1)
+    return false;
+  int paramBits = method == 0 ? 4 : 5;
+  int escape = method == 0 ? 15 : 31;
+  int po = flacGetBits(r, 4);
+  if (n % (1 << po) != 0 || (n >> po) < order)
+    return false;
+
+  int parts = 1 << po;
+  int i = order;
+  for (int p = 0; p < parts; p++)
+  {
+    int k = flacGetBits(r, paramBits);
+    int end = (p + 1) * (n >> po);
+    if (k == escape)
+    {
+      int bits = flacGetBits(r, 5);
+      for (; i < end; i++)
+        x[i] = flacGetSigned(r, bits);
+    }
+    else
+    {
+      for (; i < end; i++)
+      {
+        uint32_t u = (flacGetUnary(r) << k) | flacGetBits(r, k);
+        x[i] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+      }
+    }
+    if (r->pos > r->len + 8)
+      return false;
+  }
+  return true;
+}
+
+bool flacDecodeSubframe(FlacBitReader *r, int32_t *x, int n, int bps)
+{
+  if (flacGetBits(r, 1) != 0)
+    return false;
+  int type = flacGetBits(r, 6);
+  int wasted = 0;
+  if (flacGetBits(r, 1))
+  {
+    wasted = flacGetUnary(r) + 1;
+    bps -= wasted;
+    if (bps <= 0)
+      return false;
+  }
+
+  if (type == FLAC_SUBFRAME_CONSTANT)
+  {
+    int32_t value = flacGetSigned(r, bps);
+    for (int i = 0; i < n; i++)
+      x[i] = value;
+  }
+  else if (type == FLAC_SUBFRAME_VERBATIM)
+  {
+    for (int i = 0; i < n; i++)
+      x[i] = flacGetSigned(r, bps);
+  }
+  else if (type >= FLAC_SUBFRAME_FIXED && type <= FLAC_SUBFRAME_FIXED + FLAC_MAX_FIXED_ORDER)
+  {
+    int order = type - FLAC_SUBFRAME_FIXED;
+    if (order > n)
+      return false;
+    for (int i = 0; i < order; i++)
+      x[i] = flacGetSigned(r, bps);
+    if (!flacDecodeResidual(r, x, n, order))
+      return false;
+    for (int i = order; i < n; i++)
+    {
+      switch (order)
+      {
+      case 0: break;
+      case 1: x[i] += x[i - 1]; break;
+      case 2: x[i] += 2 * x[i - 1] - x[i - 2]; break;
+      case 3: x[i] += 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3]; break;
+      default: x[i] += 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4]; break;
+      }
+    }
+  }
+  else if (type >= FLAC_SUBFRAME_LPC)
+  {
+    int order = type - FLAC_SUBFRAME_LPC + 1;
+    if (order > n)
+      return false;
+    for (int i = 0; i < order; i++)
+      x[i] = flacGetSigned(r, bps);
+    int precision = flacGetBits(r, 4) + 1;
+    int shift = flacGetSigned(r, 5);
+    if (precision == 16 || shift < 0)
+      return false;
+    int32_t coefs[FLAC_MAX_LPC_ORDER];
+    for (int j = 0; j < order; j++)
+      coefs[j] = flacGetSigned(r, precision);
+    if (!flacDecodeResidual(r, x, n, order))
+      return false;
+    for (int i = order; i < n; i++)
+    {
+      int64_t sum = 0;
+      for (int j = 0; j < order; j++)
+        sum += (int64_t)coefs[j] * x[i - 1 - j];
+      x[i] += (int32_t)(sum >> shift);
+    }
+  }
+  else
+    return false; // reserved
+
+  if (wasted > 0)
+  {
+    for (int i = 0; i < n; i++)
+      x[i] <<= wasted;
+  }
+  return true;
+}
+
+// the offset of the next sync code after the start, where decoding may go on after a broken frame
+size_t flacNextSync(const uint8_t *src, size_t len)
+{
+  for (size_t i = 1; i + 1 < len; i++)
+  {
+    if (src[i] == 0xFF && (src[i + 1] & 0xFE) == 0xF8)
+      return i;
+  }
+  return len > 1 ? len - 1 : len;
+}
+
+// Decode the frame at the start of src into dec->samples, returns the frames of its block.
+// 0 with *consumed = 0: src doesn't hold the whole frame yet (more - more data may follow, otherwise it is broken),
+// 0 with *consumed > 0: not a valid frame there, skip the bytes, a sync code follows.
+int flacDecodeFrame(FlacDecoder *dec, const uint8_t *src, size_t len, bool more, size_t *consumed)
+{
+  *consumed = 0;
+  if (len < 2 || (more && len < 16))
+    return 0; // at least a whole header
+
+  FlacBitReader r = {src, len, 0, 0, 0};
+  bool valid = flacGetBits(&r, 15) == (0xFFF8 >> 1);
+  bool variable = flacGetBits(&r, 1);
+  int blockCode = flacGetBits(&r, 4);
+  int rateCode = flacGetBits(&r, 4);
+  int assignment = flacGetBits(&r, 4);
+  int bitsCode = flacGetBits(&r, 3);
+  valid = valid && flacGetBits(&r, 1) == 0 && blockCode != 0 && rateCode != 15 && assignment <= FLAC_CH_MID_SIDE;
+  uint32_t number = flacGetUtf8(&r, &valid);
+  int n = blockCode == 1 ? 192 : blockCode <= 5 ? 576 << (blockCode - 2) : blockCode >= 8 ? 256 << (blockCode - 8) : 0;
+  if (blockCode == 6)
+    n = flacGetBits(&r, 8) + 1;
+  else if (blockCode == 7)
+    n = flacGetBits(&r, 16) + 1;
+  if (rateCode == 12)
+    flacGetBits(&r, 8);
+  else if (rateCode == 13 || rateCode == 14)
+    flacGetBits(&r, 16);
+  size_t headerBytes = flacReaderBytes(&r);
+  valid = valid && !flacReaderOverrun(&r) && flacGetBits(&r, 8) == flacCrc8(src, headerBytes);
+
+  const int bitsCodes[] = {0, 8, 12, 0, 16, 20, 24, 32};
+  int numChannels = assignment < FLAC_CH_LEFT_SIDE ? assignment + 1 : 2;
+  int bps = bitsCode == 0 ? dec->info.bitsPerSample : bitsCodes[bitsCode];
+  if (!valid || n > dec->info.maxBlockSize || numChannels != dec->info.numChannels || bps != dec->info.bitsPerSample)
+  {
+    *consumed = flacNextSync(src, len);
+    return 0;
+  }
+
+  for (int c = 0; c < numChannels; c++)
+  {
+    bool side = (assignment == FLAC_CH_LEFT_SIDE && c == 1) || (assignment == FLAC_CH_RIGHT_SIDE && c == 0) ||
+                (assignment == FLAC_CH_MID_SIDE && c == 1);
+    valid = flacDecodeSubframe(&r, dec->samples + c * dec->info.maxBlockSize, n, side ? bps + 1 : bps);
+    if (!valid)
+      break;
+  }
+  flacAlignReader(&r);
+  size_t frameBytes = flacReaderBytes(&r) + 2;
+  if (frameBytes > len || flacReaderOverrun(&r))
+  {
+    if (more)
+      return 0; // wait for the rest of the frame
+    *consumed = flacNextSync(src, len);
+    return 0;
+  }
+  if (!valid || flacGetBits(&r, 16) != flacCrc16(src, frameBytes - 2))
+  {
+    *consumed = flacNextSync(src, len);
+    return 0;
+  }
+
+  // back to left/right
+  int32_t *left = dec->samples;
+  int32_t *right = dec->samples + dec->info.maxBlockSize;
+  for (int i = 0; assignment >= FLAC_CH_LEFT_SIDE && i < n; i++)
+  {
+    if (assignment == FLAC_CH_LEFT_SIDE)
+      right[i] = left[i] - right[i];
+    else if (assignment == FLAC_CH_RIGHT_SIDE)
+      left[i] += right[i];
+    else
+    {
+      int32_t mid = (left[i] << 1) | (right[i] & 1);
+      int32_t side = right[i];
+      left[i] = (mid + side) >> 1;
+      right[i] = (mid - side) >> 1;
+    }
+  }
+
+  dec->blockSize = n;
+  dec->firstSample = variable ? number : (uint64_t)number * dec->info.maxBlockSize;
+  *consumed = frameBytes;
+  return n;
+}
+
+// frames first..first+frames-1 of the last decoded block as packed PCM, returns the bytes written
+size_t flacDecoderRead(FlacDecoder *dec, uint8_t *dest, int first, int frames)
+{
+  int bytes = dec->info.bitsPerSample / 8;
+  uint8_t *out = dest;
+  for (int i = first; i < first + frames; i++)
+  {
+    for (int c = 0; c < dec->info.numChannels; c++)
+    {
+      int32_t v = dec->samples[c * dec->info.maxBlockSize + i];
+      *out++ = (uint8_t)v;
+      *out++ = (uint8_t)(v >> 8);
+      if (bytes == 3)
+        *out++ = (uint8_t)(v >> 16);
+    }
+  }
+  return out - dest;
+}
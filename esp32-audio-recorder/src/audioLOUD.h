@@ -0,0 +1,247 @@
+/**
+ * The loudness of a file, measured on its way to the flash with its waveform (audioPEAK.h), so there is no second pass:
+ * the integrated loudness in the manner of ITU-R BS.1770 (K-weighting, 400 ms blocks every 100 ms, the absolute
+ * gate at -70 and the relative one 10 below), the plain RMS, the sample peak, the true peak (4x oversampled),
+ * and the count of clipped samples. The filters and the interpolation are fixed point on the high 16 bits
+ * of the samples, the blocks go into a histogram of 0.25 dB, the integration is done once at the end (in float).
+ * The playback turns the loudness into a fixed gain towards PLAY_TARGET_LUFS (loudGainDb, the DSP_LEVEL stage).
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define LOUD_STEP_MS (100)       // a block is the last 4 steps (400 ms, 75% overlap)
+#define LOUD_BLOCK_STEPS (4)
+#define LOUD_ABS_GATE (-70)      // LUFS, the blocks below are silence
+#define LOUD_REL_GATE (-10)      // LU below the loudness of the blocks above the absolute gate
+#define LOUD_HIST_BINS (300)     // 0.25 dB from LOUD_ABS_GATE up to +5
+#define LOUD_FLOOR_DB (-99)      // the level of digital silence in the results
+#define LOUD_Q (29)              // K-weighting coefficients, up to +-4
+#define LOUD_TP_TAPS (8)         // per phase of the true peak interpolation, Q13
+#define LOUD_MAX_GAIN_DB (20)    // the playback doesn't lift a quiet file more, the noise of the room comes up too
+#define LOUD_TP_CEILING_DB (-1)  // the playback gain keeps the true peak under it
+
+struct LoudState
+{
+  uint32_t sampleRate;
+  int numChannels;
+  int32_t shelf[5];    // the K-weighting: a high shelf of +4 dB and a high-pass at 38 Hz, b0 b1 b2 a1 a2 in Q29
+  int32_t highpass[5];
+  int32_t filter[2][8]; // per channel: x1 x2 y1 y2 of both, 24-bit (16-bit << 8)
+  int16_t taps[3][LOUD_TP_TAPS]; // the points 1/4, 2/4, 3/4 after the middle sample of the history
+  int16_t history[2][LOUD_TP_TAPS]; // per channel, the newest at historyPos
+  int historyPos;
+  uint32_t framesPerStep;
+  uint32_t stepFrames;
+  uint64_t stepEnergy;  // K-weighted, all channels, of the step in progress
+  uint64_t steps[LOUD_BLOCK_STEPS];
+  uint32_t numSteps;
+  uint16_t histogram[LOUD_HIST_BINS]; // blocks above the absolute gate
+  uint64_t weighted;    // all the K-weighted energy, for a file shorter than a block
+  uint64_t energy;      // all the plain energy
+  uint32_t frames;
+  int32_t samplePeak;   // 16-bit
+  int32_t truePeak;
+  uint32_t clipped;     // samples at full scale
+  // the results, loudFinish
+  float lufs;
+  float rmsDb;
+  float peakDb;
+  float truePeakDb;
+};
+
+// a biquad of the K-weighting into Q29
+void loudSetBiquad(int32_t *coef, double b0, double b1, double b2, double a1, double a2)
+{
+  double k = (double)(1 << LOUD_Q);
+  coef[0] = lround(b0 * k);
+  coef[1] = lround(b1 * k);
+  coef[2] = lround(b2 * k);
+  coef[3] = lround(a1 * k);
+  coef[4] = lround(a2 * k);
+}
+
+void loudInit(LoudState *loud, uint32_t sampleRate, int numChannels)
+{
+  memset(loud, 0, sizeof(LoudState));
+  loud->sampleRate = sampleRate;
+  loud->numChannels = numChannels;
+  loud->framesPerStep = sampleRate * LOUD_STEP_MS / 1000;
+
+  // the filters of BS.1770 at any rate, from their analog prototypes (the 48 kHz ones of the standard come out)
+  double k = tan(M_PI * 1681.974450955533 / sampleRate);
+  double q = 0.7071752369554196;
+  double vh = pow(10, 3.999843853973347 / 20);
+  double vb = pow(vh, 0.4996667741545416);
+  double a0 = 1 + k / q + k * k;
+  loudSetBiquad(loud->shelf, (vh + vb * k / q + k * k) / a0, 2 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0,
+                2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0);
+  k = tan(M_PI * 38.13547087602444 / sampleRate);
+  q = 0.5003270373238773;
+  a0 = 1 + k / q + k * k;
+  loudSetBiquad(loud->highpass, 1, -2, 1, 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0);
+
+  // windowed sinc, the point p/4 after the middle sample (LOUD_TP_TAPS / 2 back)
+  for (int p = 1; p < 4; p++)
+    for (int j = 0; j < LOUD_TP_TAPS; j++)
+    {
+      double t = j - LOUD_TP_TAPS / 2 + p / 4.0; // from the sample j back to the point
+      double w = 0.5 + 0.5 * cos(M_PI * t / (LOUD_TP_TAPS / 2 + 0.5));
+      loud->taps[p - 1][j] = (int16_t)lround(sin(M_PI * t) / (M_PI * t) * w * 8192);
+    }
+}
+
+static inline int32_t loudBiquad(const int32_t *coef, int32_t *state, int32_t x)
+{
+  int64_t acc = (int64_t)coef[0] * x + (int64_t)coef[1] * state[0] + (int64_t)coef[2] * state[1] -
+                (int64_t)coef[3] * state[2] - (int64_t)coef[4] * state[3];
+  int32_t y = (int32_t)(acc >> LOUD_Q);
+  state[1] = state[0];
+  state[0] = x;
+  state[3] = state[2];
+  state[2] = y;
+  return y;
+}
+
+// the loudness of a block of mean square ms (full scale 1), LUFS
+static inline float loudOf(double ms)
+{
+  return -0.691f + 10 * log10f(ms);
+}
+
+// A step is done: a block of the last LOUD_BLOCK_STEPS steps into the histogram
+void loudStep(LoudState *loud)
+{
+  loud->steps[loud->numSteps++ % LOUD_BLOCK_STEPS] = loud->stepEnergy;
+  loud->stepEnergy = 0;
+  loud->stepFrames = 0;
+  if (loud->numSteps < LOUD_BLOCK_STEPS)
+    return;
+  uint64_t sum = 0;
+  for (int i = 0; i < LOUD_BLOCK_STEPS; i++)
+    sum += loud->steps[i];
+  if (sum == 0)
+    return;
+  float lufs = loudOf((double)sum / ((uint64_t)LOUD_BLOCK_STEPS * loud->framesPerStep) / (32768.0 * 32768.0));
+  if (lufs < LOUD_ABS_GATE)
+    return;
+  int bin = min((int)((lufs - LOUD_ABS_GATE) * 4), LOUD_HIST_BINS - 1);
+  if (loud->histogram[bin] < UINT16_MAX)
+    loud->histogram[bin]++;
+}
+
+// The inter-sample peaks around the middle of the history. A real signal peaks between two samples by a few dB
+// at most, so the interpolation runs only when they are above half of the true peak so far.
+void loudTruePeak(LoudState *loud, int c)
+{
+  const int16_t *h = loud->history[c];
+  int mid = (loud->historyPos + LOUD_TP_TAPS / 2) % LOUD_TP_TAPS; // LOUD_TP_TAPS / 2 back, the sample before the points
+  int next = (mid + 1) % LOUD_TP_TAPS;
+  if (abs(h[mid]) < loud->truePeak / 2 && abs(h[next]) < loud->truePeak / 2)
+    return;
+  for (int p = 0; p < 3; p++)
+  {
+    int32_t acc = 0;
+    for (int j = 0; j < LOUD_TP_TAPS; j++)
+      acc += (int32_t)h[(loud->historyPos + LOUD_TP_TAPS - j) % LOUD_TP_TAPS] * loud->taps[p][j];
+    loud->truePeak = max(loud->truePeak, abs(acc >> 13));
+  }
+}
+
+// A frame, the samples of its channels as 16-bit
+void loudFrame(LoudState *loud, const int16_t *v)
+{
+  loud->historyPos = (loud->historyPos + 1) % LOUD_TP_TAPS;
+  for (int c = 0; c < loud->numChannels; c++)
+  {
+    int32_t a = abs((int32_t)v[c]);
+    loud->samplePeak = max(loud->samplePeak, a);
+    loud->truePeak = max(loud->truePeak, a);
+    if (a >= INT16_MAX)
+      loud->clipped++;
+    loud->energy += (uint32_t)(a * a);
+
+    int32_t *state = loud->filter[c];
+    int32_t y = loudBiquad(loud->highpass, state + 4, loudBiquad(loud->shelf, state, (int32_t)v[c] << 8)) >> 8;
+    loud->stepEnergy += (uint64_t)((int64_t)y * y);
+
+    loud->history[c][loud->historyPos] = v[c];
+    loudTruePeak(loud, c);
+  }
+  loud->frames++;
+  if (++loud->stepFrames == loud->framesPerStep)
+  {
+    loud->weighted += loud->stepEnergy;
+    loudStep(loud);
+  }
+}
+
+// the energy of the blocks of the histogram at or above a bin, and their count
+static void loudSum(LoudState *loud, int from, double *sum, uint32_t *count)
+{
+  *sum = 0;
+  *count = 0;
+  for (int b = max(from, 0); b < LOUD_HIST_BINS; b++)
+  {
+    *sum += loud->histogram[b] * pow(10, (LOUD_ABS_GATE + (b + 0.5) / 4 + 0.691) / 10);
+    *count += loud->histogram[b];
+  }
+}
+
+static inline float loudDb(double ms)
+{
+  return ms > 0 ? 10 * log10(ms) : LOUD_FLOOR_DB;
+}
+
+// The results, once the file is done
+void loudFinish(LoudState *loud)
+{
+  loud->weighted += loud->stepEnergy;
+  uint64_t samples = (uint64_t)loud->frames * loud->numChannels;
+  double fullScale = 32768.0 * 32768.0;
+  loud->rmsDb = samples ? loudDb(loud->energy / fullScale / samples) : LOUD_FLOOR_DB;
+  loud->peakDb = loudDb((double)loud->samplePeak * loud->samplePeak / fullScale);
+  loud->truePeakDb = loudDb((double)loud->truePeak * loud->truePeak / fullScale);
+
+  double sum;
+  uint32_t count;
+  loudSum(loud, 0, &sum, &count);
+  if (count == 0)
+  {
+    // shorter than a block, or silence: the whole of it, ungated
+    double ms = loud->frames ? loud->weighted / fullScale / loud->frames : 0;
+    loud->lufs = ms > 0 ? max(loudOf(ms), (float)LOUD_FLOOR_DB) : LOUD_FLOOR_DB;
+    return;
+  }
+  float gate = loudOf(sum / count) + LOUD_REL_GATE;
+  loudSum(loud, (int)ceil((gate - LOUD_ABS_GATE) * 4), &sum, &count);
+  loud->lufs = count ? loudOf(sum / count) : gate - LOUD_REL_GATE;
+}
+
+// The gain of the playback towards targetLufs, the true peak stays under LOUD_TP_CEILING_DB.
+// A file of silence gets none.
+float loudGainDb(float lufs, float truePeakDb, float targetLufs)
+{
+  if (lufs <= LOUD_ABS_GATE)
+    return 0;
+  float gain = targetLufs - lufs;
+  gain = min(gain, LOUD_TP_CEILING_DB - truePeakDb);
+  return min(gain, (float)LOUD_MAX_GAIN_DB);
+}
+
+// json ready format
+String loudGetState(LoudState *loud)
+{
+  String output = "{\"lufs\":" + String(loud->lufs, 1);
+  output += ",\"rms\":" + String(loud->rmsDb, 1);
+  output += ",\"peak\":" + String(loud->peakDb, 1);
+  output += ",\"truePeak\":" + String(loud->truePeakDb, 1);
+  output += ",\"clipped\":" + String(loud->clipped);
+  output += ",\"gain\":" + String(loudGainDb(loud->lufs, loud->truePeakDb, PLAY_TARGET_LUFS), 1) + "}";
+  return output;
+}
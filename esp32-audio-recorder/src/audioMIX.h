@@ -0,0 +1,402 @@
+/**
+ * The mixer of the playback: the file that plays (source 0) and up to MIX_MAX_SOURCES - 1 overlays (a chime,
+ * a prompt over an instruction) summed into the DAC block, each with its own volume, and a master volume over all.
+ * A volume change is a linear ramp (a fade) of at least MIX_DECLICK_MS, set per block and stepped per frame.
+ * An overlay is a short PCM clip held in RAM in the format of its file, converted (audioCONV.h) and resampled
+ * (audioSRC.h) to the DAC format a chunk at a time, so it costs a few KB of state besides its samples.
+ * The sum is 32-bit, saturated once into the DAC samples (16-bit, or 32-bit with 2 bits of headroom).
+ * At unity with no overlay and no ramp the block is left as it is, the playback stays bit-exact and costs nothing.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define MIX_MAX_SOURCES (4)        // the playback and 3 overlays
+#define MIX_UNITY (1 << 30)        // gains, Q30
+#define MIX_DECLICK_MS (10)        // the shortest ramp, a step of the volume clicks
+#define MIX_CHUNK (128)            // frames summed at a time
+#define MIX_FIFO_FRAMES (2 * MIX_CHUNK) // an overlay in the DAC format, the resampler gives a few frames more
+#define MIX_CLIP_MAX_BYTES (65536) // an overlay in RAM, 2 s of 16kHz/16-bit mono
+
+// A volume, and its ramp. A new one comes from the web handlers (mixGainSet), the DAC task takes it
+// at its next block: pending is cleared before the values are read, a request in between is taken again.
+struct MixGain
+{
+  int32_t gain;   // Q30, at the start of the next block
+  int32_t target;
+  int32_t step;   // per frame, towards the target
+  volatile int32_t request;
+  volatile uint32_t requestMs;
+  volatile bool pending;
+};
+
+// An overlay: its samples in the format of its file, and what turns them into the DAC format
+struct MixClip
+{
+  uint8_t *data;      // owned, freed with the source
+  uint32_t bytes;
+  uint32_t pos;
+  int frameBytes;     // of the file
+  ConvFn convert;     // file -> DAC format (audioCONV.h), NULL when they are the same
+  Resampler *src;     // file rate -> DAC rate (audioSRC.h), NULL when they are the same
+  uint8_t *scratch;   // MIX_CHUNK converted frames, ahead of the resampler
+  uint8_t *fifo;      // MIX_FIFO_FRAMES frames ready for the sum
+  uint32_t fifoFrames;
+};
+
+struct MixSource
+{
+  volatile bool active; // an overlay: set by mixAddClip, cleared by the DAC task when it ends
+  MixGain volume;
+  MixClip clip;
+  char name[32];
+};
+
+struct Mixer
+{
+  volatile bool running; // a playback is on, overlays can join it
+  uint32_t sampleRate;   // of the DAC
+  int bits;              // 16, or 32 (left-justified)
+  int numChannels;
+  MixGain master;
+  MixSource sources[MIX_MAX_SOURCES];
+  int32_t acc[MIX_CHUNK * 2];
+  uint64_t cycles;       // of the blocks that were mixed
+  uint32_t blocks;
+  uint32_t clipped;      // samples saturated by the sum
+};
+
+// volume - 0..1 of the full scale, reached in fadeMs (MIX_DECLICK_MS at least)
+void mixGainSet(MixGain *g, float volume, uint32_t fadeMs)
+{
+  volume = volume < 0 ? 0 : volume > 1 ? 1 : volume;
+  g->request = lround(volume * MIX_UNITY);
+  g->requestMs = fadeMs > MIX_DECLICK_MS ? fadeMs : MIX_DECLICK_MS;
+  g->pending = true;
+}
+
+// the gain over the next block: where it starts and where it ends, the ramp moves on by the frames of the block
+void mixGainBlock(MixGain *g, uint32_t sampleRate, uint32_t frames, int32_t *from, int32_t *to)
+{
+  if (g->pending)
+  {
+    g->pending = false;
+    g->target = g->request;
+    uint32_t rampFrames = (uint64_t)g->requestMs * sampleRate / 1000;
+    g->step = (int32_t)(((int64_t)g->target - g->gain) / (rampFrames ? rampFrames : 1));
+    if (g->step == 0)
+      g->step = g->target > g->gain ? 1 : -1;
+  }
+  *from = g->gain;
+  if (g->gain != g->target)
+  {
+    int64_t next = (int64_t)g->gain + (int64_t)g->step * frames;
+    if ((g->step > 0 && next >= g->target) || (g->step < 0 && next <= g->target))
+      next = g->target;
+    g->gain = (int32_t)next;
+  }
+  *to = g->gain;
+}
+
+static inline bool mixGainUnity(MixGain *g)
+{
+  return !g->pending && g->gain == MIX_UNITY && g->target == MIX_UNITY;
+}
+
+static inline int32_t mixMul(int32_t a, int32_t b)
+{
+  return (int32_t)(((int64_t)a * b) >> 30);
+}
+
+// a sample of a source scaled by a Q30 gain, into the scale of the sum
+static inline int32_t mixTerm(int16_t v, int32_t g)
+{
+  return (v * (g >> 15)) >> 15;
+}
+
+static inline int32_t mixTerm(int32_t v, int32_t g)
+{
+  return (int32_t)(((int64_t)v * g) >> 32); // a quarter, 4 full scale sources still fit
+}
+
+// the sum back into a sample, true if it saturated
+static inline bool mixOut(int16_t *out, int32_t v)
+{
+  if (v > INT16_MAX || v < INT16_MIN)
+  {
+    *out = v > 0 ? INT16_MAX : INT16_MIN;
+    return true;
+  }
+  *out = (int16_t)v;
+  return false;
+}
+
+static inline bool mixOut(int32_t *out, int32_t v)
+{
+  if (v > INT32_MAX / 4 || v < INT32_MIN / 4)
+  {
+    *out = v > 0 ? INT32_MAX : INT32_MIN;
+    return true;
+  }
+  *out = v * 4;
+  return false;
+}
+
+// n frames of a source into the sum (the first one sets it), the gain steps per frame
+template <class T>
+void mixTerms(int32_t *acc, const T *x, int n, int numChannels, int32_t *gain, int32_t step, bool first)
+{
+  int32_t g = *gain;
+  if (numChannels == 2)
+  {
+    for (int i = 0; i < 2 * n; i += 2, g += step)
+    {
+      acc[i] = (first ? 0 : acc[i]) + mixTerm(x[i], g);
+      acc[i + 1] = (first ? 0 : acc[i + 1]) + mixTerm(x[i + 1], g);
+    }
+  }
+  else
+  {
+    for (int i = 0; i < n; i++, g += step)
+      acc[i] = (first ? 0 : acc[i]) + mixTerm(x[i], g);
+  }
+  *gain = g;
+}
+
+void mixEndSource(MixSource *source)
+{
+  MixClip *clip = &source->clip;
+  free(clip->data);
+  free(clip->src);
+  free(clip->scratch);
+  free(clip->fifo);
+  memset(clip, 0, sizeof(MixClip));
+  memset(&source->volume, 0, sizeof(MixGain));
+  source->name[0] = 0;
+  source->active = false;
+}
+
+// Fill the FIFO of an overlay up to want frames, or to the end of its clip
+void mixClipFill(Mixer *mix, MixClip *clip, uint32_t want)
+{
+  int dacFrame = mix->bits / 8 * mix->numChannels;
+  while (clip->fifoFrames < want && clip->pos + clip->frameBytes <= clip->bytes)
+  {
+    uint32_t in = want - clip->fifoFrames;
+    if (clip->src != NULL)
+    {
+      // enough input for the frames still missing, and no more than the FIFO has room for
+      uint32_t need = (uint32_t)(((uint64_t)in * clip->src->M + clip->src->L - 1) / clip->src->L);
+      uint32_t room = (uint32_t)((uint64_t)(MIX_FIFO_FRAMES - clip->fifoFrames - 2) * clip->src->M / clip->src->L);
+      in = max((uint32_t)1, min(need, room));
+    }
+    in = min(in, (uint32_t)MIX_CHUNK);
+    in = min(in, (clip->bytes - clip->pos) / clip->frameBytes);
+    const uint8_t *samples = clip->data + clip->pos;
+    uint8_t *dest = clip->src != NULL ? clip->scratch : clip->fifo + clip->fifoFrames * dacFrame;
+    if (clip->convert != NULL)
+      clip->convert(dest, samples, in * clip->frameBytes);
+    else
+      memcpy(dest, samples, in * clip->frameBytes);
+    clip->pos += in * clip->frameBytes;
+    if (clip->src != NULL)
+      clip->fifoFrames += srcProcess(clip->src, (int16_t *)clip->scratch, in, (int16_t *)(clip->fifo + clip->fifoFrames * dacFrame));
+    else
+      clip->fifoFrames += in;
+  }
+}
+
+// Add a clip as an overlay, it takes the data (PCM in the given format) when it succeeds.
+// It fades in to volume (0..1) in fadeMs. Returns the source, -1 when none is free or the format can't be mixed.
+int mixAddClip(Mixer *mix, uint8_t *data, uint32_t bytes, uint32_t sampleRate, int bitsPerSample, int numChannels,
+               float volume, uint32_t fadeMs, const char *name)
+{
+  int s = 1;
+  while (s < MIX_MAX_SOURCES && mix->sources[s].active)
+    s++;
+  if (s == MIX_MAX_SOURCES || !mix->running)
+    return -1;
+  MixSource *source = &mix->sources[s];
+  mixEndSource(source); // the leftovers of a playback that ended under it
+  MixClip *clip = &source->clip;
+  clip->frameBytes = bitsPerSample / 8 * numChannels;
+  if (bitsPerSample != mix->bits || numChannels != mix->numChannels)
+  {
+    clip->convert = convSelect(bitsPerSample, numChannels, mix->bits, mix->numChannels); // audioCONV.h
+    if (clip->convert == NULL)
+      return -1;
+  }
+  int dacFrame = mix->bits / 8 * mix->numChannels;
+  bool resample = sampleRate != mix->sampleRate;
+  if (resample && mix->bits != 16)
+    return -1; // the resampler is 16-bit
+  clip->fifo = (uint8_t *)malloc(MIX_FIFO_FRAMES * dacFrame);
+  if (resample)
+  {
+    clip->src = (Resampler *)malloc(sizeof(Resampler));
+    clip->scratch = (uint8_t *)malloc(MIX_CHUNK * dacFrame);
+  }
+  if (clip->fifo == NULL || (resample && (clip->src == NULL || clip->scratch == NULL ||
+                                          !srcInit(clip->src, sampleRate, mix->sampleRate, mix->numChannels)))) // audioSRC.h
+  {
+    mixEndSource(source);
+    return -1;
+  }
+  clip->data = data;
+  clip->bytes = bytes;
+  snprintf(source->name, sizeof(source->name), "%s", name);
+  source->volume.gain = 0;
+  source->volume.target = 0;
+  mixGainSet(&source->volume, volume, fadeMs);
+  source->active = true;
+  return s;
+}
+
+// at boot: the master at volume (0..1), the playback at full scale
+void mixInit(Mixer *mix, float volume)
+{
+  memset(mix, 0, sizeof(Mixer));
+  mix->master.gain = mix->master.target = lround(volume * MIX_UNITY);
+  mix->sources[0].volume.gain = mix->sources[0].volume.target = MIX_UNITY;
+}
+
+// A playback starts, in the format of the DAC. The volumes of the master and of the playback stay as they were.
+void mixStart(Mixer *mix, uint32_t sampleRate, int bits, int numChannels)
+{
+  for (int s = 1; s < MIX_MAX_SOURCES; s++)
+    mixEndSource(&mix->sources[s]);
+  mix->sampleRate = sampleRate;
+  mix->bits = bits;
+  mix->numChannels = numChannels;
+  mix->sources[0].active = true;
+  mix->cycles = 0;
+  mix->blocks = 0;
+  mix->clipped = 0;
+  mix->running = true;
+}
+
+// the playback is over, and so are its overlays
+void mixStop(Mixer *mix)
+{
+  mix->running = false;
+  mix->sources[0].active = false;
+  for (int s = 1; s < MIX_MAX_SOURCES; s++)
+    mixEndSource(&mix->sources[s]);
+}
+
+// nothing to mix, the block goes out as it is
+bool mixIdle(Mixer *mix)
+{
+  for (int s = 1; s < MIX_MAX_SOURCES; s++)
+    if (mix->sources[s].active)
+      return false;
+  return mixGainUnity(&mix->master) && mixGainUnity(&mix->sources[0].volume);
+}
+
+template <class T>
+void mixBlock(Mixer *mix, T *x, uint32_t frames)
+{
+  int ch = mix->numChannels;
+  int32_t gain[MIX_MAX_SOURCES];
+  int32_t step[MIX_MAX_SOURCES];
+  int32_t masterFrom, masterTo;
+  mixGainBlock(&mix->master, mix->sampleRate, frames, &masterFrom, &masterTo);
+  for (int s = 0; s < MIX_MAX_SOURCES; s++)
+  {
+    MixSource *source = &mix->sources[s];
+    if (!source->active)
+      continue;
+    int32_t from, to;
+    mixGainBlock(&source->volume, mix->sampleRate, frames, &from, &to);
+    gain[s] = mixMul(from, masterFrom);
+    step[s] = (mixMul(to, masterTo) - gain[s]) / (int32_t)frames;
+  }
+
+  for (uint32_t done = 0; done < frames; done += MIX_CHUNK)
+  {
+    int n = min(frames - done, (uint32_t)MIX_CHUNK);
+    T *out = x + done * ch;
+    mixTerms(mix->acc, out, n, ch, &gain[0], step[0], true);
+    for (int s = 1; s < MIX_MAX_SOURCES; s++)
+    {
+      MixSource *source = &mix->sources[s];
+      if (!source->active)
+        continue;
+      MixClip *clip = &source->clip;
+      mixClipFill(mix, clip, n);
+      int got = min((uint32_t)n, clip->fifoFrames);
+      mixTerms(mix->acc, (T *)clip->fifo, got, ch, &gain[s], step[s], false);
+      clip->fifoFrames -= got;
+      memmove(clip->fifo, clip->fifo + got * ch * sizeof(T), clip->fifoFrames * ch * sizeof(T));
+      gain[s] += step[s] * (n - got);
+    }
+    for (int i = 0; i < n * ch; i++)
+      mix->clipped += mixOut(out + i, mix->acc[i]);
+  }
+
+  // an overlay ends with its clip, or once it faded out
+  for (int s = 1; s < MIX_MAX_SOURCES; s++)
+  {
+    MixSource *source = &mix->sources[s];
+    MixClip *clip = &source->clip;
+    bool drained = clip->fifoFrames == 0 && clip->pos + clip->frameBytes > clip->bytes;
+    bool silent = !source->volume.pending && source->volume.gain == 0 && source->volume.target == 0;
+    if (source->active && (drained || silent))
+      mixEndSource(source);
+  }
+}
+
+// Mix a block of the playback in the DAC format, in place
+void mixProcess(Mixer *mix, uint8_t *data, size_t len)
+{
+  if (mixIdle(mix))
+    return;
+  uint32_t start = ESP.getCycleCount();
+  uint32_t frames = len / (mix->bits / 8 * mix->numChannels);
+  if (frames == 0)
+    return;
+  if (mix->bits == 16)
+    mixBlock(mix, (int16_t *)data, frames);
+  else
+    mixBlock(mix, (int32_t *)data, frames);
+  mix->cycles += ESP.getCycleCount() - start;
+  mix->blocks++;
+}
+
+// a volume in % of the full scale, for the json
+static inline String mixPercent(int32_t gain)
+{
+  return String(gain * 100.0 / MIX_UNITY, 1);
+}
+
+// json ready format
+String mixGetState(Mixer *mix)
+{
+  String output = "{\"running\":";
+  output += mix->running ? "true" : "false";
+  output += ",\"master\":" + mixPercent(mix->master.gain);
+  output += ",\"masterTarget\":" + mixPercent(mix->master.pending ? mix->master.request : mix->master.target);
+  output += ",\"sources\":[";
+  for (int s = 0; s < MIX_MAX_SOURCES; s++)
+  {
+    MixSource *source = &mix->sources[s];
+    MixGain *g = &source->volume;
+    output += s > 0 ? ",{" : "{";
+    output += "\"source\":" + String(s);
+    output += ",\"active\":" + String(source->active ? "true" : "false");
+    output += ",\"file\":\"" + String(source->name) + "\"";
+    output += ",\"volume\":" + mixPercent(g->gain);
+    output += ",\"target\":" + mixPercent(g->pending ? g->request : g->target) + "}";
+  }
+  output += "],\"cyclesPerBlock\":" + String(mix->blocks ? (uint32_t)(mix->cycles / mix->blocks) : 0);
+  output += ",\"blocks\":" + String(mix->blocks);
+  output += ",\"clipped\":" + String(mix->clipped) + "}";
+  return output;
+}
@@ -0,0 +1,216 @@
+/**
+ * Streaming MP3 (MPEG-1/2/2.5 Layer III) decoding for playback, with the fixed-point Helix decoder of arduino-libhelix.
+ * Nothing is buffered beyond a couple of frames: the input holds 2 x MAINBUF_SIZE bytes of the file, the output a single
+ * frame of 16-bit PCM (up to 1152 frames of stereo), and the Helix state is ~23 KB of heap.
+ * The decoder measures itself: the time of every frame against its duration is the CPU load of the decoding task.
+ * The frame header parser is our own, the format and the length of a file are known before it is decoded (fsFLASH.h).
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libhelix-mp3/mp3dec.h" // arduino-libhelix, the Helix fixed-point decoder
+
+#define MP3_INPUT_SIZE (2 * MAINBUF_SIZE)                     // bytes of the file in the decoder, a frame is up to MAINBUF_SIZE
+#define MP3_MAX_FRAME_SAMPLES (MAX_NCHAN * MAX_NGRAN * MAX_NSAMP) // 16-bit samples of the largest frame
+#define MP3_HEADER_SCAN (4096)                                // the first frame must be that close to the start (after the ID3 tag)
+
+// the format of a frame, from its 4-byte header
+struct Mp3FrameHeader
+{
+  uint32_t sampleRate;
+  int numChannels;
+  uint32_t bitrate; // bits per second
+  int samples;      // frames of PCM per channel: 1152 (MPEG-1) or 576
+  int frameBytes;   // with the padding
+  int sideInfo;     // bytes of side information after the header (and the CRC)
+};
+
+// the CPU load of the decoding, per frame
+struct Mp3Load
+{
+  uint32_t frames;
+  uint32_t errors;    // frames that were skipped (broken, or of another format)
+  uint64_t decodeUs;  // the sum of the decoding times
+  uint32_t maxUs;     // the longest frame
+  uint32_t frameUs;   // the duration of a frame
+};
+
+struct Mp3Decoder
+{
+  HMP3Decoder helix;
+  uint8_t *input; // MP3_INPUT_SIZE bytes of the file
+  int have;       // bytes in the input
+  int pos;        // the next byte to decode
+  int16_t *pcm;   // the last decoded frame, interleaved
+  uint32_t sampleRate; // of the stream, frames of another format are dropped (the DAC is set for the first one)
+  int numChannels;
+  Mp3Load load;
+};
+
+const uint16_t mp3Bitrates[2][15] = {
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}, // MPEG-1
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}};    // MPEG-2 and 2.5
+const uint16_t mp3SampleRates[3] = {44100, 48000, 32000};             // MPEG-1, halved for MPEG-2, quartered for 2.5
+
+// Parse the header of a Layer III frame, false if it isn't one (free bitrate isn't supported)
+bool mp3ParseHeader(const uint8_t *h, Mp3FrameHeader *header)
+{
+  if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+    return false;
+  int version = (h[1] >> 3) & 3; // 0 - MPEG-2.5, 2 - MPEG-2, 3 - MPEG-1
+  int layer = (h[1] >> 1) & 3;   // 1 - Layer III
+  int bitrateIndex = h[2] >> 4;
+  int rateIndex = (h[2] >> 2) & 3;
+  if (version == 1 || layer != 1 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3)
+    return false;
+
+  bool mpeg1 = version == 3;
+  bool mono = (h[3] >> 6) == 3;
+  header->sampleRate = mp3SampleRates[rateIndex] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+  header->numChannels = mono ? 1 : 2;
+  header->bitrate = mp3Bitrates[mpeg1 ? 0 : 1][bitrateIndex] * 1000UL;
+  header->samples = mpeg1 ? 1152 : 576;
+  header->frameBytes = header->samples / 8 * header->bitrate / header->sampleRate + ((h[2] >> 1) & 1);
+  header->sideInfo = (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17)) + ((h[1] & 1) ? 0 : 2);
+  return true;
+}
+
+// the size of an ID3v2 tag at the start of a file, 0 if there is none
+uint32_t mp3Id3Size(const uint8_t *h)
+{
+  if (h[0] != 'I' || h[1] != 'D' || h[2] != '3')
+    return 0;
+  uint32_t size = ((uint32_t)(h[6] & 0x7F) << 21) | ((uint32_t)(h[7] & 0x7F) << 14) | ((h[8] & 0x7F) << 7) | (h[9] & 0x7F);
+  return 10 + size + ((h[5] & 0x10) ? 10 : 0); // the header, the tag and the footer
+}
+
+// The number of frames of a VBR file, from the Xing/Info header in its first frame, 0 if there is none
+uint32_t mp3XingFrames(const uint8_t *frame, size_t len, Mp3FrameHeader *header)
+{
+  size_t at = 4 + header->sideInfo;
+  if (len < at + 12 || (memcmp(frame + at, "Xing", 4) != 0 && memcmp(frame + at, "Info", 4) != 0))
+    return 0;
+  if ((frame[at + 7] & 1) == 0)
+    return 0; // no frame count
+  return ((uint32_t)frame[at + 8] << 24) | ((uint32_t)frame[at + 9] << 16) | (frame[at + 10] << 8) | frame[at + 11];
+}
+
+bool mp3DecoderInit(Mp3Decoder *dec, uint32_t sampleRate, int numChannels)
+{
+  dec->helix = MP3InitDecoder();
+  dec->input = (uint8_t *)malloc(MP3_INPUT_SIZE);
+  dec->pcm = (int16_t *)malloc(MP3_MAX_FRAME_SAMPLES * sizeof(int16_t));
+  dec->have = 0;
+  dec->pos = 0;
+  dec->sampleRate = sampleRate;
+  dec->numChannels = numChannels;
+  memset(&dec->load, 0, sizeof(dec->load));
+  return dec->helix != NULL && dec->input != NULL && dec->pcm != NULL;
+}
+
+void mp3DecoderEnd(Mp3Decoder *dec)
+{
+  if (dec->helix != NULL)
+    MP3FreeDecoder(dec->helix);
+  free(dec->input);
+  free(dec->pcm);
+  dec->helix = NULL;
+  dec->input = NULL;
+  dec->pcm = NULL;
+}
+
+// Where the next bytes of the file go, *space of them. The decoded bytes make room first.
+uint8_t *mp3DecoderInput(Mp3Decoder *dec, size_t *space)
+{
+  if (dec->pos > 0)
+  {
+    memmove(dec->input, dec->input + dec->pos, dec->have - dec->pos);
+    dec->have -= dec->pos;
+    dec->pos = 0;
+  }
+  *space = MP3_INPUT_SIZE - dec->have;
+  return dec->input + dec->have;
+}
+
+void mp3DecoderFilled(Mp3Decoder *dec, size_t bytes)
+{
+  dec->have += bytes;
+}
+
+// Decode the next frame into dec->pcm, returns its frames (per channel), 0 when it needs more input.
+// more - more input may follow, otherwise the end of the file: 0 is the end of the stream.
+// A broken frame is skipped, decoding goes on at the next sync word.
+int mp3DecodeFrame(Mp3Decoder *dec, bool more)
+{
+  for (;;)
+  {
+    int offset = MP3FindSyncWord(dec->input + dec->pos, dec->have - dec->pos);
+    if (offset < 0)
+    {
+      // no sync word, keep the last byte, it may be the first one of the next
+      dec->pos = dec->have > 0 && more ? dec->have - 1 : dec->have;
+      return 0;
+    }
+    dec->pos += offset;
+    int left = dec->have - dec->pos;
+    if (more && left < MAINBUF_SIZE)
+      return 0; // a whole frame first
+
+    unsigned char *ptr = dec->input + dec->pos;
+    unsigned long start = micros();
+    int err = MP3Decode(dec->helix, &ptr, &left, dec->pcm, 0);
+    uint32_t elapsed = micros() - start;
+    int consumed = ptr - (dec->input + dec->pos);
+    dec->pos += consumed;
+
+    if (err == ERR_MP3_INDATA_UNDERFLOW)
+    {
+      if (!more)
+        dec->pos = dec->have; // a truncated last frame
+      return 0;
+    }
+    if (err == ERR_MP3_MAINDATA_UNDERFLOW)
+      continue; // the bit reservoir of a frame before the start (or a seek), the next ones have it
+    if (err != ERR_MP3_NONE)
+    {
+      if (consumed == 0)
+        dec->pos++; // not a frame after all, look for the next sync word
+      dec->load.errors++;
+      continue;
+    }
+
+    MP3FrameInfo info;
+    MP3GetLastFrameInfo(dec->helix, &info);
+    if ((uint32_t)info.samprate != dec->sampleRate || info.nChans != dec->numChannels)
+    {
+      dec->load.errors++;
+      continue;
+    }
+    int frames = info.outputSamps / info.nChans;
+    dec->load.frames++;
+    dec->load.decodeUs += elapsed;
+    if (elapsed > dec->load.maxUs)
+      dec->load.maxUs = elapsed;
+    dec->load.frameUs = (uint64_t)frames * 1000000 / info.samprate;
+    return frames;
+  }
+}
+
+// json ready format, the load in percent of a core: on average and of the longest frame
+String mp3GetLoad(Mp3Load *load)
+{
+  uint32_t avgUs = load->frames ? load->decodeUs / load->frames : 0;
+  String output = "{\"frames\":" + String(load->frames);
+  output += ",\"errors\":" + String(load->errors);
+  output += ",\"avgUs\":" + String(avgUs);
+  output += ",\"maxUs\":" + String(load->maxUs);
+  output += ",\"frameUs\":" + String(load->frameUs);
+  output += ",\"load\":" + String(load->frameUs ? avgUs * 100.0 / load->frameUs : 0, 1);
+  output += ",\"peakLoad\":" + String(load->frameUs ? load->maxUs * 100.0 / load->frameUs : 0, 1) + "}";
+  return output;
+}
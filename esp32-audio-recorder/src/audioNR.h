@@ -0,0 +1,277 @@
+/**
+ * Noise suppression of a mono stream by magnitude spectral subtraction (Boll), in fixed point.
+ * Frames of NR_FFT_SIZE samples with a hop of half of it, a sqrt-Hann window on both the analysis and the synthesis,
+ * so the overlap-add gives the input back when the gains are 1. The FFT is our own radix-2 one, in place,
+ * 20-bit samples with Q15 twiddles: the forward one grows into 28 bits, the inverse one halves every pass.
+ * The noise spectrum is the average of the first frames (the pre-roll of an armed recording), then it follows the
+ * frames that are close to it. The output is late by NR_FFT_SIZE samples, the same count comes out as went in.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NR_FFT_BITS (8)
+#define NR_FFT_SIZE (1 << NR_FFT_BITS) // 16 ms at 16kHz
+#define NR_HOP (NR_FFT_SIZE / 2)
+#define NR_BINS (NR_FFT_SIZE / 2 + 1)
+#define NR_LEARN_MS (250)   // the noise of a recording that isn't armed: its start, nobody talks yet
+#define NR_OVERSUB (2)      // the noise is subtracted twice, against the musical noise of the peaks left
+#define NR_FLOOR_DB (-18)   // the deepest suppression, a bit of the noise stays and sounds natural
+#define NR_CREEP (0.05)     // the noise estimate rises by 5% a second under a louder sound (a fan that speeds up)
+#define NR_INPUT_SHIFT (12) // left-justified 32-bit -> 20-bit samples of the FFT
+
+struct NrState
+{
+  uint32_t sampleRate;
+  int16_t *window;  // sqrt-Hann, Q15
+  int16_t *cosine;  // twiddles, Q15, NR_FFT_SIZE / 2
+  int16_t *sine;
+  int32_t *re;      // the FFT, in place
+  int32_t *im;
+  int32_t *frame;   // the last NR_FFT_SIZE input samples, 20-bit
+  int32_t *overlap; // the second half of the previous output frame
+  int32_t *output;  // NR_HOP samples ready, the input of the same positions goes into frame
+  uint32_t *noise;  // the magnitude of the noise per bin
+  int16_t *gain;    // the last gain per bin, Q15
+  int pos;          // in the hop
+  uint32_t frames;
+  uint32_t learnFrames; // averaged into the noise
+  int32_t floorQ15;
+  uint32_t creepQ16; // the rise of the noise per hop, NR_CREEP a second at the sample rate
+};
+
+// reverse the low bits of i
+static inline int nrReverse(int i, int bits)
+{
+  int r = 0;
+  for (int b = 0; b < bits; b++, i >>= 1)
+    r = (r << 1) | (i & 1);
+  return r;
+}
+
+// Radix-2 decimation in time of 2^bits points, in place. cosine/sine - the Q15 twiddles, 2^bits / 2 of each.
+// inverse - the conjugate twiddles, and halved every pass (1/N in total). Also the FFT of audioSPEC.h.
+void nrFft(int32_t *re, int32_t *im, int bits, const int16_t *cosine, const int16_t *sine, bool inverse)
+{
+  const int size = 1 << bits;
+  for (int i = 0; i < size; i++)
+  {
+    int j = nrReverse(i, bits);
+    if (j > i)
+    {
+      int32_t t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+  int shift = inverse ? 1 : 0;
+  for (int half = 1, step = size / 2; half < size; half <<= 1, step >>= 1)
+  {
+    for (int k = 0; k < half; k++)
+    {
+      int32_t wr = cosine[k * step];
+      int32_t wi = inverse ? sine[k * step] : -sine[k * step];
+      for (int i = k; i < size; i += half << 1)
+      {
+        int j = i + half;
+        int32_t tr = (int32_t)(((int64_t)re[j] * wr - (int64_t)im[j] * wi) >> 15);
+        int32_t ti = (int32_t)(((int64_t)re[j] * wi + (int64_t)im[j] * wr) >> 15);
+        re[j] = (re[i] - tr) >> shift;
+        im[j] = (im[i] - ti) >> shift;
+        re[i] = (re[i] + tr) >> shift;
+        im[i] = (im[i] + ti) >> shift;
+      }
+    }
+  }
+}
+
+// |re + j im| within 4% (alpha max plus beta min), no square root
+static inline uint32_t nrMagnitude(int32_t re, int32_t im)
+{
+  uint32_t a = abs(re);
+  uint32_t b = abs(im);
+  uint32_t hi = a > b ? a : b;
+  uint32_t lo = a > b ? b : a;
+  return hi - (hi >> 5) + (lo * 3 >> 3) - (hi >> 7);
+}
+
+void nrEnd(NrState *nr)
+{
+  free(nr->window);
+  free(nr->cosine);
+  free(nr->sine);
+  free(nr->re);
+  free(nr->im);
+  free(nr->frame);
+  free(nr->overlap);
+  free(nr->output);
+  free(nr->noise);
+  free(nr->gain);
+  memset(nr, 0, sizeof(NrState));
+}
+
+// the noise is learned from the first learnMs of the stream, set before the first samples go in
+void nrSetLearning(NrState *nr, uint32_t learnMs)
+{
+  nr->learnFrames = max(1U, (uint32_t)((uint64_t)learnMs * nr->sampleRate / 1000 / NR_HOP));
+}
+
+// learnMs - the start of the stream that is only noise, false if the buffers can't be allocated (~7 KB)
+bool nrInit(NrState *nr, uint32_t sampleRate, uint32_t learnMs)
+{
+  memset(nr, 0, sizeof(NrState));
+  nr->sampleRate = sampleRate;
+  nr->window = (int16_t *)malloc(NR_FFT_SIZE * sizeof(int16_t));
+  nr->cosine = (int16_t *)malloc(NR_FFT_SIZE / 2 * sizeof(int16_t));
+  nr->sine = (int16_t *)malloc(NR_FFT_SIZE / 2 * sizeof(int16_t));
+  nr->re = (int32_t *)malloc(NR_FFT_SIZE * sizeof(int32_t));
+  nr->im = (int32_t *)malloc(NR_FFT_SIZE * sizeof(int32_t));
+  nr->frame = (int32_t *)calloc(NR_FFT_SIZE, sizeof(int32_t));
+  nr->overlap = (int32_t *)calloc(NR_HOP, sizeof(int32_t));
+  nr->output = (int32_t *)calloc(NR_HOP, sizeof(int32_t));
+  nr->noise = (uint32_t *)calloc(NR_BINS, sizeof(uint32_t));
+  nr->gain = (int16_t *)malloc(NR_BINS * sizeof(int16_t));
+  if (nr->window == NULL || nr->cosine == NULL || nr->sine == NULL || nr->re == NULL || nr->im == NULL || nr->frame == NULL ||
+      nr->overlap == NULL || nr->output == NULL || nr->noise == NULL || nr->gain == NULL)
+  {
+    nrEnd(nr);
+    return false;
+  }
+  for (int i = 0; i < NR_FFT_SIZE; i++)
+    nr->window[i] = (int16_t)lround(sin(M_PI * (i + 0.5) / NR_FFT_SIZE) * 32767); // sqrt of the periodic Hann
+  for (int i = 0; i < NR_FFT_SIZE / 2; i++)
+  {
+    nr->cosine[i] = (int16_t)lround(cos(2 * M_PI * i / NR_FFT_SIZE) * 32767);
+    nr->sine[i] = (int16_t)lround(sin(2 * M_PI * i / NR_FFT_SIZE) * 32767);
+  }
+  for (int k = 0; k < NR_BINS; k++)
+    nr->gain[k] = 32767;
+  nrSetLearning(nr, learnMs);
+  nr->floorQ15 = lround(pow(10, NR_FLOOR_DB / 20.0) * 32767);
+  nr->creepQ16 = lround((pow(1 + NR_CREEP, (double)NR_HOP / sampleRate) - 1) * 65536);
+  return true;
+}
+
+// a hop of input is in: analyse the frame, suppress, synthesise, and the next hop of output is ready
+void nrRunFrame(NrState *nr)
+{
+  for (int i = 0; i < NR_FFT_SIZE; i++)
+  {
+    nr->re[i] = (int32_t)(((int64_t)nr->frame[i] * nr->window[i]) >> 15);
+    nr->im[i] = 0;
+  }
+  nrFft(nr->re, nr->im, NR_FFT_BITS, nr->cosine, nr->sine, false);
+
+  bool learning = nr->frames < nr->learnFrames;
+  for (int k = 0; k < NR_BINS; k++)
+  {
+    uint32_t mag = nrMagnitude(nr->re[k], nr->im[k]);
+    uint32_t noise = nr->noise[k];
+    int32_t g = 32767;
+    if (learning)
+    {
+      // the average of the first frames
+      nr->noise[k] = noise + (int32_t)(mag - noise) / (int32_t)(nr->frames + 1);
+    }
+    else
+    {
+      // close to the noise: follow it in ~30 frames, above it: creep up by NR_CREEP a second, whatever the rate
+      if (mag < 2 * noise)
+        nr->noise[k] = noise + ((int32_t)(mag - noise) >> 5);
+      else
+        nr->noise[k] = noise + max(1U, (uint32_t)(((uint64_t)noise * nr->creepQ16) >> 16));
+      if (mag > 0)
+      {
+        uint64_t sub = (uint64_t)noise * NR_OVERSUB * 32768 / mag;
+        g = sub >= 32768 ? 0 : 32767 - (int32_t)sub;
+      }
+      if (g < nr->floorQ15)
+        g = nr->floorQ15;
+      // half of the previous gain, a bin doesn't flicker on and off from frame to frame
+      g = (g + nr->gain[k]) >> 1;
+    }
+    nr->gain[k] = g;
+    nr->re[k] = (int32_t)(((int64_t)nr->re[k] * g) >> 15);
+    nr->im[k] = (int32_t)(((int64_t)nr->im[k] * g) >> 15);
+    if (k > 0 && k < NR_FFT_SIZE / 2)
+    {
+      // the mirror bin of a real signal
+      nr->re[NR_FFT_SIZE - k] = nr->re[k];
+      nr->im[NR_FFT_SIZE - k] = -nr->im[k];
+    }
+  }
+  nr->frames++;
+
+  nrFft(nr->re, nr->im, NR_FFT_BITS, nr->cosine, nr->sine, true);
+  for (int i = 0; i < NR_HOP; i++)
+  {
+    nr->output[i] = nr->overlap[i] + (int32_t)(((int64_t)nr->re[i] * nr->window[i]) >> 15);
+    nr->overlap[i] = (int32_t)(((int64_t)nr->re[i + NR_HOP] * nr->window[i + NR_HOP]) >> 15);
+  }
+  memmove(nr->frame, nr->frame + NR_HOP, NR_HOP * sizeof(int32_t));
+}
+
+// Suppress the noise of n mono samples, left-justified 32-bit, in place
+void nrProcess(NrState *nr, int32_t *x, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    int32_t v = x[i];
+    int64_t out = (int64_t)nr->output[nr->pos] << NR_INPUT_SHIFT;
+    x[i] = out > INT32_MAX ? INT32_MAX : out < INT32_MIN ? INT32_MIN : (int32_t)out;
+    nr->frame[NR_HOP + nr->pos] = v >> NR_INPUT_SHIFT;
+    if (++nr->pos == NR_HOP)
+    {
+      nrRunFrame(nr);
+      nr->pos = 0;
+    }
+  }
+}
+
+// the average suppression of the last frame in dB, for the logs
+float nrGetReductionDb(NrState *nr)
+{
+  int64_t sum = 0;
+  for (int k = 0; k < NR_BINS; k++)
+    sum += nr->gain[k];
+  return 20 * log10f((float)(sum ? sum : 1) / NR_BINS / 32768);
+}
+
+// the suppression of a stored file (/denoise), json ready (nrGetJobState)
+struct NrJob
+{
+  bool running;
+  char source[32];
+  char output[32];
+  uint32_t durationMs; // of the source
+  uint32_t doneMs;     // processed so far
+  float rtf;           // the time of the processing / the duration of the audio, the suppression alone
+  float reductionDb;   // of the last frame
+  const char *error;   // empty when fine
+};
+
+NrJob nrJob;
+
+// json ready format
+String nrGetJobState(NrJob *job)
+{
+  String output = "{\"running\":";
+  output += job->running ? "true" : "false";
+  output += ",\"file\":\"" + String(job->source) + "\"";
+  output += ",\"output\":\"" + String(job->output) + "\"";
+  output += ",\"duration\":" + String(job->durationMs);
+  output += ",\"done\":" + String(job->doneMs);
+  output += ",\"rtf\":" + String(job->rtf, 4);
+  output += ",\"reduction\":" + String(job->reductionDb, 1);
+  output += ",\"error\":\"" + String(job->error ? job->error : "") + "\"}";
+  return output;
+}
@@ -0,0 +1,209 @@
+/**
+ * The waveform of a file for the thumbnails of the GUI: the min/max envelope at PEAK_LEVELS resolutions,
+ * PEAK_BASE_FRAMES frames per bucket and 4x coarser at every next level (256, 1024, 4096).
+ * It is made on the way to the flash, from the PCM of a recording (before a coder) or of an uploaded PCM WAV file,
+ * and saved next to the file ("<name>.pk"), so a thumbnail costs a few KB instead of reading the audio.
+ * A bucket is the lowest and the highest sample of all channels, 8-bit. The buckets are kept in RAM until the end,
+ * within PEAK_MAX_BYTES: the coarse levels are always there, the finest ones of a long file are left out.
+ * The same frames are measured for the loudness of the file (audioLOUD.h).
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PEAK_LEVELS (3)
+#define PEAK_BASE_FRAMES (256) // the finest level, 16 ms at 16kHz
+#define PEAK_LEVEL_SHIFT (2)   // 4 buckets of a level make a bucket of the next one
+#define PEAK_MAX_BYTES (32768) // the buckets of all levels, a 60 s recording at 16kHz needs ~10 KB
+#define PEAK_HEADER_BYTES (16 + 8 * PEAK_LEVELS)
+#define PEAK_PROBE_BYTES (4096) // an upload: its WAV header is read back once that much is on the flash
+
+/*
+ * The sidecar, little-endian:
+ *   0  char[4] "PEAK"
+ *   4  uint32  sample rate
+ *   8  uint32  frames
+ *  12  uint16  PEAK_LEVELS
+ *  14  uint16  channels
+ *  16  per level: uint32 frames per bucket, uint32 buckets (0 - left out, the RAM was short)
+ *  PEAK_HEADER_BYTES  the buckets of each level in turn: int8 min, int8 max (the high byte of a sample)
+ */
+
+struct PeakLevel
+{
+  uint32_t framesPerBucket;
+  uint32_t capacity; // buckets, 0 - left out
+  uint32_t count;    // buckets done, beyond the capacity they are dropped
+  int8_t *buckets;   // min, max pairs
+  int16_t min;       // of the bucket in progress
+  int16_t max;
+  uint32_t filled;   // frames of the bucket in progress (level 0), buckets of the level below (the others)
+};
+
+struct PeakState
+{
+  uint32_t sampleRate;
+  int bitsPerSample; // 8 (unsigned), 16, 24 (packed), 32
+  int numChannels;
+  int frameBytes;
+  uint32_t frames;
+  uint32_t bytesLeft; // of the samples, what comes after them is not audio (the chunks after the data of a WAV)
+  uint8_t partial[8]; // a frame split between two blocks (the chunks of an upload)
+  int partialBytes;
+  PeakLevel levels[PEAK_LEVELS];
+  LoudState loud; // audioLOUD.h
+};
+
+// the bucket of a level is done: into the list, and into the bucket of the next level
+void peakClose(PeakState *peak, int l)
+{
+  PeakLevel *level = &peak->levels[l];
+  if (level->count < level->capacity)
+  {
+    level->buckets[level->count * 2] = level->min >> 8;
+    level->buckets[level->count * 2 + 1] = level->max >> 8;
+  }
+  level->count++;
+  if (l + 1 < PEAK_LEVELS)
+  {
+    PeakLevel *next = &peak->levels[l + 1];
+    next->min = min(next->min, level->min);
+    next->max = max(next->max, level->max);
+    if (++next->filled == (1 << PEAK_LEVEL_SHIFT))
+      peakClose(peak, l + 1);
+  }
+  level->min = INT16_MAX;
+  level->max = INT16_MIN;
+  level->filled = 0;
+}
+
+// Allocate the state with the buckets of up to maxFrames, in a single block: free() releases it all.
+// The samples after maxFrames are ignored.
+// NULL for a format of no peaks, or when not even the coarsest level fits.
+PeakState *peakCreate(uint32_t sampleRate, int bitsPerSample, int numChannels, uint32_t maxFrames)
+{
+  if ((bitsPerSample != 8 && bitsPerSample != 16 && bitsPerSample != 24 && bitsPerSample != 32) ||
+      (numChannels != 1 && numChannels != 2))
+    return NULL;
+
+  // the coarse levels first, they are the small ones
+  uint32_t capacity[PEAK_LEVELS];
+  size_t bytes = 0;
+  for (int l = PEAK_LEVELS - 1; l >= 0; l--)
+  {
+    uint32_t framesPerBucket = PEAK_BASE_FRAMES << (PEAK_LEVEL_SHIFT * l);
+    uint32_t need = maxFrames / framesPerBucket + 1;
+    capacity[l] = bytes + need * 2 <= PEAK_MAX_BYTES ? need : 0;
+    bytes += capacity[l] * 2;
+  }
+  if (bytes == 0)
+    return NULL;
+  PeakState *peak = (PeakState *)malloc(sizeof(PeakState) + bytes);
+  if (peak == NULL)
+    return NULL;
+
+  memset(peak, 0, sizeof(PeakState));
+  peak->sampleRate = sampleRate;
+  peak->bitsPerSample = bitsPerSample;
+  peak->numChannels = numChannels;
+  peak->frameBytes = bitsPerSample / 8 * numChannels;
+  peak->bytesLeft = (uint64_t)maxFrames * peak->frameBytes > UINT32_MAX ? UINT32_MAX : maxFrames * peak->frameBytes;
+  int8_t *buckets = (int8_t *)(peak + 1);
+  for (int l = 0; l < PEAK_LEVELS; l++)
+  {
+    PeakLevel *level = &peak->levels[l];
+    level->framesPerBucket = PEAK_BASE_FRAMES << (PEAK_LEVEL_SHIFT * l);
+    level->capacity = capacity[l];
+    level->buckets = buckets;
+    level->min = INT16_MAX;
+    level->max = INT16_MIN;
+    buckets += capacity[l] * 2;
+  }
+  loudInit(&peak->loud, sampleRate, numChannels); // audioLOUD.h
+  return peak;
+}
+
+// a sample as 16-bit, the high bytes of a wider one
+static inline int16_t peakSample(const uint8_t *p, int bytes)
+{
+  if (bytes == 1)
+    return (int16_t)((p[0] - 128) << 8);
+  return (int16_t)(p[bytes - 2] | (p[bytes - 1] << 8));
+}
+
+void peakFrame(PeakState *peak, const uint8_t *frame)
+{
+  PeakLevel *level = &peak->levels[0];
+  int bytes = peak->bitsPerSample / 8;
+  int16_t v[2];
+  for (int c = 0; c < peak->numChannels; c++, frame += bytes)
+  {
+    v[c] = peakSample(frame, bytes);
+    level->min = min(level->min, v[c]);
+    level->max = max(level->max, v[c]);
+  }
+  loudFrame(&peak->loud, v); // audioLOUD.h
+  peak->frames++;
+  if (++level->filled == PEAK_BASE_FRAMES)
+    peakClose(peak, 0);
+}
+
+// Measure a block of PCM in the format of the state, it may end in the middle of a frame
+void peakFeed(PeakState *peak, const uint8_t *data, size_t len)
+{
+  if (peak == NULL)
+    return;
+  len = min(len, (size_t)peak->bytesLeft);
+  peak->bytesLeft -= len;
+  if (peak->partialBytes > 0)
+  {
+    size_t take = min(len, (size_t)(peak->frameBytes - peak->partialBytes));
+    memcpy(peak->partial + peak->partialBytes, data, take);
+    peak->partialBytes += take;
+    data += take;
+    len -= take;
+    if (peak->partialBytes < peak->frameBytes)
+      return;
+    peakFrame(peak, peak->partial);
+    peak->partialBytes = 0;
+  }
+  for (; len >= (size_t)peak->frameBytes; data += peak->frameBytes, len -= peak->frameBytes)
+    peakFrame(peak, data);
+  memcpy(peak->partial, data, len);
+  peak->partialBytes = len;
+}
+
+// the buckets in progress are done, the last ones are shorter, and the loudness is integrated
+void peakFinish(PeakState *peak)
+{
+  for (int l = 0; l < PEAK_LEVELS; l++)
+    if (peak->levels[l].filled > 0)
+      peakClose(peak, l);
+  loudFinish(&peak->loud);
+}
+
+// the buckets of a level that are in the sidecar, 0 when the level is left out
+uint32_t peakBuckets(PeakLevel *level)
+{
+  return min(level->count, level->capacity);
+}
+
+// the header of the sidecar, the buckets of each level follow it
+void peakHeader(PeakState *peak, uint8_t *header)
+{
+  memcpy(header, "PEAK", 4);
+  specPut32(header + 4, peak->sampleRate); // audioSPEC.h
+  specPut32(header + 8, peak->frames);
+  specPut16(header + 12, PEAK_LEVELS);
+  specPut16(header + 14, peak->numChannels);
+  for (int l = 0; l < PEAK_LEVELS; l++)
+  {
+    specPut32(header + 16 + 8 * l, peak->levels[l].framesPerBucket);
+    specPut32(header + 20 + 8 * l, peakBuckets(&peak->levels[l]));
+  }
+}
@@ -0,0 +1,139 @@
+/**
+ * Ring buffer between the audio tasks, e.g. capture -> flash writer.
+ * A thin wrapper around the FreeRTOS stream buffer (single producer, single consumer),
+ * with counters that help to tune the ring depth.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/stream_buffer.h>
+
+struct AudioRing
+{
+  StreamBufferHandle_t stream; // NULL when not allocated
+  size_t size;                 // capacity in bytes
+  size_t blockSize;            // the consumer wakes up when a whole block is waiting
+  size_t highWater;            // max bytes ever waiting in the ring (the closer to size, the deeper ring you need)
+  size_t droppedBytes;         // bytes the producer failed to push, the ring was full
+  uint32_t overflows;          // number of pushes that didn't fit entirely
+  uint32_t underruns;          // number of times a real-time consumer found the ring short
+  volatile bool eof;           // the producer is done, whatever is left is the tail of the stream
+};
+
+// allocate the ring for numBlocks blocks of blockSize bytes each, and reset its counters
+bool ringCreate(AudioRing *ring, size_t blockSize, int numBlocks)
+{
+  ring->size = blockSize * numBlocks;
+  ring->blockSize = blockSize;
+  ring->highWater = 0;
+  ring->droppedBytes = 0;
+  ring->overflows = 0;
+  ring->underruns = 0;
+  ring->eof = false;
+
+  // trigger level of a whole block, so the consumer reads the flash-friendly chunks
+  ring->stream = xStreamBufferCreate(ring->size, blockSize);
+  return ring->stream != NULL;
+}
+
+// release the memory, but keep the counters for the report
+void ringDestroy(AudioRing *ring)
+{
+  if (ring->stream != NULL)
+    vStreamBufferDelete(ring->stream);
+  ring->stream = NULL;
+}
+
+// bytes waiting to be consumed
+size_t ringAvailable(AudioRing *ring)
+{
+  return xStreamBufferBytesAvailable(ring->stream);
+}
+
+// push from the producer task, use wait=0 in real-time producers (never block the I2S reader)
+// a block that doesn't fit without waiting is dropped entirely, to keep the samples aligned
+size_t ringPush(AudioRing *ring, const void *src, size_t len, TickType_t wait)
+{
+  size_t pushed = 0;
+  if (wait > 0 || xStreamBufferSpacesAvailable(ring->stream) >= len)
+    pushed = xStreamBufferSend(ring->stream, src, len, wait);
+  if (pushed < len)
+  {
+    ring->overflows++;
+    ring->droppedBytes += len - pushed;
+  }
+
+  size_t used = xStreamBufferBytesAvailable(ring->stream);
+  if (used > ring->highWater)
+    ring->highWater = used;
+
+  return pushed;
+}
+
+// pop from the consumer task, collects len bytes unless the producer is done or wait expires
+size_t ringPop(AudioRing *ring, void *dest, size_t len, TickType_t wait)
+{
+  size_t popped = 0;
+  while (popped < len)
+  {
+    // an empty stream buffer blocks the receiver until blockSize bytes (trigger level) arrive
+    size_t n = xStreamBufferReceive(ring->stream, (uint8_t *)dest + popped, len - popped, ring->eof ? 0 : wait);
+    if (n == 0)
+      break;
+    popped += n;
+  }
+  return popped;
+}
+
+// pop for a real-time consumer (e.g. the DAC): counts an underrun when the producer is late
+size_t ringPopRealtime(AudioRing *ring, void *dest, size_t len, TickType_t wait)
+{
+  if (!ring->eof && xStreamBufferBytesAvailable(ring->stream) < len)
+    ring->underruns++;
+  return ringPop(ring, dest, len, wait);
+}
+
+// drop whatever is waiting and reopen the stream (e.g. on a seek), only when no task is blocked on the ring
+void ringReset(AudioRing *ring)
+{
+  xStreamBufferReset(ring->stream);
+  ring->eof = false;
+}
+
+// the producer has nothing more to push
+void ringClose(AudioRing *ring)
+{
+  ring->eof = true;
+}
+
+// the producer is done and the consumer took everything
+bool ringDrained(AudioRing *ring)
+{
+  return ring->eof && xStreamBufferIsEmpty(ring->stream) == pdTRUE;
+}
+
+void ringPrintStats(AudioRing *ring, const char *name)
+{
+  printf("%s ring: size %u B, high-water %u B (%u%%), overflows %u, dropped %u B, underruns %u\n",
+         name, ring->size, ring->highWater, ring->size ? (unsigned)(ring->highWater * 100 / ring->size) : 0,
+         ring->overflows, ring->droppedBytes, ring->underruns);
+}
+
+// json ready format
+String ringGetStats(AudioRing *ring)
+{
+  String output = "{\"size\":";
+  output += ring->size;
+  output += ",\"highWater\":";
+  output += ring->highWater;
+  output += ",\"overflows\":";
+  output += ring->overflows;
+  output += ",\"droppedBytes\":";
+  output += ring->droppedBytes;
+  output += ",\"underruns\":";
+  output += ring->underruns;
+  output += "}";
+  return output;
+}
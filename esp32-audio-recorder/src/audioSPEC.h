@@ -0,0 +1,349 @@
+/**
+ * The live level and spectrum of the microphone, for the meter of the GUI (the /ws/spectrum WebSocket).
+ * Every captured block is measured (RMS and peak with the gain of the recording), and every SPEC_FRAME_MS
+ * the last SPEC_FFT_SIZE samples of the first channel go through a Hann window and the FFT of audioNR.h,
+ * folded into SPEC_BINS log-spaced bands from SPEC_MIN_HZ to the Nyquist frequency (the loudest bin of a band).
+ * All in fixed point. The result is a small binary frame (SpecState.frame), handed over to the sender by a flag.
+ * The spectrogram of a stored file (/spectrogram) is the same analysis, column by column, with linear bins.
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <esp_timer.h>
+
+#define SPEC_FFT_BITS (9)
+#define SPEC_FFT_SIZE (1 << SPEC_FFT_BITS) // 32 ms at 16kHz, bins of 31 Hz
+#define SPEC_BINS (64)
+#define SPEC_MIN_HZ (50)
+#define SPEC_FRAME_MS (200)            // 5 frames per second
+#define SPEC_HEADER_BYTES (12)
+#define SPEC_FRAME_BYTES (SPEC_HEADER_BYTES + SPEC_BINS) // 76 B, 380 B/s per client
+#define SPEC_FLOOR_DB (-120)
+#define SPEC_IDLE_POLL_MS (250)        // an idle mic starts capturing for the meter that late after a client comes
+
+#define SPGM_FFT_BITS (8)
+#define SPGM_FFT_SIZE (1 << SPGM_FFT_BITS) // 16 ms at 16kHz, bins of 62.5 Hz
+#define SPGM_BINS (SPGM_FFT_SIZE / 2)      // from 0 Hz, the Nyquist bin is left out
+#define SPGM_MIN_HOP (SPGM_FFT_SIZE / 2)   // a short file: columns that overlap by half
+#define SPGM_MAX_COLUMNS (512)             // a long file: columns further apart, 64 KB at most
+#define SPGM_HEADER_BYTES (24)
+#define SPGM_WRITE_COLUMNS (8)             // written to the flash 1 KB at a time
+
+/*
+ * The frame, little-endian:
+ *   0  uint8   'S'
+ *   1  uint8   SPEC_BINS
+ *   2  uint16  sequence, a gap is a frame the client missed
+ *   4  uint16  sample rate
+ *   6  int16   RMS of the frame interval, 0.1 dBFS
+ *   8  int16   peak of the frame interval, 0.1 dBFS
+ *  10  uint16  SPEC_MIN_HZ, band i starts at min * (rate / 2 / min) ^ (i / SPEC_BINS)
+ *  12  uint8   per band: dBFS - SPEC_FLOOR_DB (0 is SPEC_FLOOR_DB or below, a full-scale sine is 120)
+ */
+
+struct SpecState
+{
+  bool ready;        // the buffers are allocated (specInit)
+  uint32_t sampleRate;
+  int captureBits;   // 16, or 32 left-justified
+  int numChannels;
+  int gainShift;
+  int16_t *window;   // Hann, Q15
+  int16_t *cosine;   // twiddles, Q15
+  int16_t *sine;
+  int32_t *re;
+  int32_t *im;
+  int32_t *history;  // the last SPEC_FFT_SIZE samples of the first channel, 20-bit, a ring
+  int pos;           // the oldest sample of the history
+  uint16_t edges[SPEC_BINS + 1]; // the FFT bins of the bands
+  uint64_t energy;   // of the interval, 16-bit samples squared
+  uint32_t count;
+  uint32_t peak;     // of the interval, left-justified
+  int64_t nextUs;    // the time of the next frame
+  uint16_t sequence;
+  uint8_t frame[SPEC_FRAME_BYTES];
+  volatile bool frameReady; // set by specFeed, cleared by the sender once it took the frame
+};
+
+// the Hann window and the twiddles of an FFT of size points, Q15
+void specTables(int16_t *window, int16_t *cosine, int16_t *sine, int size)
+{
+  for (int i = 0; i < size; i++)
+    window[i] = (int16_t)lround((0.5 - 0.5 * cos(2 * M_PI * i / size)) * 32767);
+  for (int i = 0; i < size / 2; i++)
+  {
+    cosine[i] = (int16_t)lround(cos(2 * M_PI * i / size) * 32767);
+    sine[i] = (int16_t)lround(sin(2 * M_PI * i / size) * 32767);
+  }
+}
+
+// the interval and the bands of the format from the start
+void specReset(SpecState *spec)
+{
+  memset(spec->history, 0, SPEC_FFT_SIZE * sizeof(int32_t));
+  spec->pos = 0;
+  spec->energy = 0;
+  spec->count = 0;
+  spec->peak = 0;
+  spec->nextUs = esp_timer_get_time() + SPEC_FRAME_MS * 1000;
+
+  // log-spaced, the low bands are narrower than an FFT bin and share it with their neighbours
+  double first = (double)SPEC_MIN_HZ * SPEC_FFT_SIZE / spec->sampleRate;
+  double ratio = SPEC_FFT_SIZE / 2 / first;
+  for (int i = 0; i <= SPEC_BINS; i++)
+    spec->edges[i] = min((int)lround(first * pow(ratio, (double)i / SPEC_BINS)), SPEC_FFT_SIZE / 2);
+}
+
+// The format of the blocks that come next, called when a capture starts (with or without a client)
+void specConfigure(SpecState *spec, uint32_t sampleRate, int captureBits, int numChannels, int gainShift)
+{
+  spec->sampleRate = sampleRate;
+  spec->captureBits = captureBits;
+  spec->numChannels = numChannels;
+  spec->gainShift = gainShift;
+  if (spec->ready)
+    specReset(spec);
+}
+
+// Allocate the buffers and the tables (~7 KB), once: the capture tasks may run specFeed any time after it.
+bool specInit(SpecState *spec)
+{
+  if (spec->ready)
+    return true;
+  spec->window = (int16_t *)malloc(SPEC_FFT_SIZE * sizeof(int16_t));
+  spec->cosine = (int16_t *)malloc(SPEC_FFT_SIZE / 2 * sizeof(int16_t));
+  spec->sine = (int16_t *)malloc(SPEC_FFT_SIZE / 2 * sizeof(int16_t));
+  spec->re = (int32_t *)malloc(SPEC_FFT_SIZE * sizeof(int32_t));
+  spec->im = (int32_t *)malloc(SPEC_FFT_SIZE * sizeof(int32_t));
+  spec->history = (int32_t *)calloc(SPEC_FFT_SIZE, sizeof(int32_t));
+  if (spec->window == NULL || spec->cosine == NULL || spec->sine == NULL || spec->re == NULL || spec->im == NULL || spec->history == NULL)
+  {
+    free(spec->window);
+    free(spec->cosine);
+    free(spec->sine);
+    free(spec->re);
+    free(spec->im);
+    free(spec->history);
+    spec->window = NULL;
+    spec->cosine = NULL;
+    spec->sine = NULL;
+    spec->re = NULL;
+    spec->im = NULL;
+    spec->history = NULL;
+    return false;
+  }
+  specTables(spec->window, spec->cosine, spec->sine, SPEC_FFT_SIZE);
+  if (spec->sampleRate > 0)
+    specReset(spec); // a capture is already running
+  spec->ready = true;
+  return true;
+}
+
+// 20 log10 in 0.1 dB of x relative to 2^fullScaleLog2, x > 0 (log2 by vadLog2Q8 of audioVAD.h, within 0.3 dB)
+static inline int32_t specDeciDb(uint32_t x, int fullScaleLog2)
+{
+  // 60.206 deci-dB per unit of log2, 15413 = 60.206 / 256 in Q16
+  return ((vadLog2Q8(x) - (fullScaleLog2 << 8)) * 15413) >> 16;
+}
+
+static inline void specPut16(uint8_t *p, int32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+// the spectrum of the history into the frame
+void specAnalyse(SpecState *spec)
+{
+  for (int i = 0; i < SPEC_FFT_SIZE; i++)
+  {
+    spec->re[i] = (int32_t)(((int64_t)spec->history[(spec->pos + i) % SPEC_FFT_SIZE] * spec->window[i]) >> 15);
+    spec->im[i] = 0;
+  }
+  nrFft(spec->re, spec->im, SPEC_FFT_BITS, spec->cosine, spec->sine, false); // audioNR.h
+
+  // a full-scale sine of 20-bit samples through the Hann window peaks at 2^19 * 0.5 * SPEC_FFT_SIZE / 2
+  const int fullScaleLog2 = 19 - 1 + SPEC_FFT_BITS - 1;
+  uint8_t *bands = spec->frame + SPEC_HEADER_BYTES;
+  for (int b = 0; b < SPEC_BINS; b++)
+  {
+    uint32_t loudest = 0;
+    int last = max(spec->edges[b + 1], (uint16_t)(spec->edges[b] + 1));
+    for (int k = spec->edges[b]; k < last && k <= SPEC_FFT_SIZE / 2; k++)
+      loudest = max(loudest, nrMagnitude(spec->re[k], spec->im[k]));
+    int32_t db = loudest ? specDeciDb(loudest, fullScaleLog2) / 10 : SPEC_FLOOR_DB;
+    bands[b] = (uint8_t)constrain(db - SPEC_FLOOR_DB, 0, 255);
+  }
+
+  uint32_t meanSquare = spec->count ? spec->energy / spec->count : 0;
+  int32_t rms = meanSquare ? specDeciDb(meanSquare, 30) / 2 : SPEC_FLOOR_DB * 10; // a power, half of the dB of an amplitude
+  int32_t peak = spec->peak ? specDeciDb(spec->peak, 31) : SPEC_FLOOR_DB * 10;
+  spec->frame[0] = 'S';
+  spec->frame[1] = SPEC_BINS;
+  specPut16(spec->frame + 2, spec->sequence++);
+  specPut16(spec->frame + 4, spec->sampleRate);
+  specPut16(spec->frame + 6, min(rms, (int32_t)0));
+  specPut16(spec->frame + 8, min(peak, (int32_t)0));
+  specPut16(spec->frame + 10, SPEC_MIN_HZ);
+}
+
+// Measure a block of raw I2S samples (16 or 32-bit), and make a frame when it is due and the last one was taken.
+// Runs in the capture tasks, a frame costs one FFT of SPEC_FFT_SIZE.
+void specFeed(SpecState *spec, const uint8_t *raw, size_t len)
+{
+  if (!spec->ready || spec->sampleRate == 0)
+    return;
+  int samples = len / (spec->captureBits / 8);
+  for (int i = 0; i < samples; i++)
+  {
+    int32_t v = spec->captureBits == 16 ? (int32_t)((const int16_t *)raw)[i] << 16 : ((const int32_t *)raw)[i];
+    v = convGain(v, spec->gainShift); // audioCONV.h
+    uint32_t a = v == INT32_MIN ? (uint32_t)INT32_MAX : (uint32_t)abs(v);
+    spec->peak = max(spec->peak, a);
+    int32_t top = v >> 16;
+    spec->energy += top * top;
+    if (i % spec->numChannels == 0)
+    {
+      spec->history[spec->pos] = v >> 12;
+      spec->pos = (spec->pos + 1) % SPEC_FFT_SIZE;
+    }
+  }
+  spec->count += samples;
+
+  int64_t now = esp_timer_get_time();
+  if (now < spec->nextUs || spec->frameReady)
+    return;
+  specAnalyse(spec);
+  spec->nextUs = now + SPEC_FRAME_MS * 1000;
+  spec->energy = 0;
+  spec->count = 0;
+  spec->peak = 0;
+  spec->frameReady = true; // the frame is not touched again until the sender clears it
+}
+
+/*
+ * The spectrogram of a stored file, the sidecar "<name>.spg", little-endian:
+ *   0  char[4] "SPG1"
+ *   4  uint32  size of the source file, the sidecar is stale when it differs
+ *   8  uint32  sample rate
+ *  12  uint16  SPGM_FFT_SIZE
+ *  14  uint16  SPGM_BINS, bin k is at k * rate / SPGM_FFT_SIZE
+ *  16  uint32  hop in frames, column c starts at the frame c * hop
+ *  20  uint16  columns
+ *  22  uint16  0
+ *  24  uint8   columns * SPGM_BINS: dBFS - SPEC_FLOOR_DB, the way the bands of a frame are
+ */
+
+struct SpecGram
+{
+  int16_t window[SPGM_FFT_SIZE]; // Hann, Q15
+  int16_t cosine[SPGM_FFT_SIZE / 2];
+  int16_t sine[SPGM_FFT_SIZE / 2];
+  int32_t re[SPGM_FFT_SIZE];
+  int32_t im[SPGM_FFT_SIZE];
+};
+
+// the tables, the struct is ~3 KB: allocated by the job
+void specGramInit(SpecGram *gram)
+{
+  specTables(gram->window, gram->cosine, gram->sine, SPGM_FFT_SIZE);
+}
+
+// The column of SPGM_FFT_SIZE mono samples, left-justified 32-bit, into SPGM_BINS bytes
+void specGramColumn(SpecGram *gram, const int32_t *x, uint8_t *column)
+{
+  for (int i = 0; i < SPGM_FFT_SIZE; i++)
+  {
+    gram->re[i] = (int32_t)(((int64_t)(x[i] >> 12) * gram->window[i]) >> 15);
+    gram->im[i] = 0;
+  }
+  nrFft(gram->re, gram->im, SPGM_FFT_BITS, gram->cosine, gram->sine, false); // audioNR.h
+
+  const int fullScaleLog2 = 19 - 1 + SPGM_FFT_BITS - 1; // as in specAnalyse
+  for (int k = 0; k < SPGM_BINS; k++)
+  {
+    uint32_t mag = nrMagnitude(gram->re[k], gram->im[k]);
+    int32_t db = mag ? specDeciDb(mag, fullScaleLog2) / 10 : SPEC_FLOOR_DB;
+    column[k] = (uint8_t)constrain(db - SPEC_FLOOR_DB, 0, 255);
+  }
+}
+
+// the columns of a file of frames samples (per channel), they span all of it; 0 when it is shorter than a column
+int specGramColumns(uint32_t frames)
+{
+  if (frames < SPGM_FFT_SIZE)
+    return 0;
+  return min((uint32_t)SPGM_MAX_COLUMNS, (frames - SPGM_FFT_SIZE) / SPGM_MIN_HOP + 1);
+}
+
+uint32_t specGramHop(uint32_t frames, int columns)
+{
+  return columns > 1 ? (frames - SPGM_FFT_SIZE) / (columns - 1) : SPGM_FFT_SIZE;
+}
+
+static inline void specPut32(uint8_t *p, uint32_t v)
+{
+  specPut16(p, v & 0xFFFF);
+  specPut16(p + 2, v >> 16);
+}
+
+static inline uint32_t specGet32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void specGramHeader(uint8_t *header, uint32_t sourceSize, uint32_t sampleRate, uint32_t hop, int columns)
+{
+  memcpy(header, "SPG1", 4);
+  specPut32(header + 4, sourceSize);
+  specPut32(header + 8, sampleRate);
+  specPut16(header + 12, SPGM_FFT_SIZE);
+  specPut16(header + 14, SPGM_BINS);
+  specPut32(header + 16, hop);
+  specPut16(header + 20, columns);
+  specPut16(header + 22, 0);
+}
+
+// A sidecar is fresh when it is complete and made of this source. An unfinished one has no columns yet.
+bool specGramFresh(const uint8_t *header, size_t size, uint32_t sourceSize)
+{
+  int columns = header[20] | (header[21] << 8);
+  return size >= SPGM_HEADER_BYTES && memcmp(header, "SPG1", 4) == 0 && specGet32(header + 4) == sourceSize &&
+         (header[12] | (header[13] << 8)) == SPGM_FFT_SIZE && (header[14] | (header[15] << 8)) == SPGM_BINS &&
+         columns > 0 && size == SPGM_HEADER_BYTES + (size_t)columns * SPGM_BINS;
+}
+
+// the spectrogram being made by the mic worker, json ready (specGramGetJobState)
+struct SpecGramJob
+{
+  bool queued;       // posted, the mic worker may be busy with a recording
+  bool running;
+  char source[32];
+  char output[32];
+  int columns;
+  int doneColumns;
+  const char *error; // empty when fine
+};
+
+SpecGramJob specGramJob;
+
+// json ready format
+String specGramGetJobState(SpecGramJob *job)
+{
+  String output = "{\"queued\":";
+  output += job->queued ? "true" : "false";
+  output += ",\"running\":";
+  output += job->running ? "true" : "false";
+  output += ",\"file\":\"" + String(job->source) + "\"";
+  output += ",\"output\":\"" + String(job->output) + "\"";
+  output += ",\"columns\":" + String(job->columns);
+  output += ",\"done\":" + String(job->doneColumns);
+  output += ",\"error\":\"" + String(job->error ? job->error : "") + "\"}";
+  return output;
+}
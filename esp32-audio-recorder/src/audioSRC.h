@@ -0,0 +1,200 @@
+/**
+ * Streaming sample-rate converter, fixed-point polyphase FIR.
+ * The ratio is kept exact (out/in reduced to L/M), the filter bank holds SRC_PHASES phases
+ * and the output is interpolated linearly between two neighbour phases.
+ * Downsampling lowers the cutoff with the output rate, so the filter gets longer by the decimation
+ * (keeping its transition band narrow to the output rate), with as many fewer phases (the same bank size).
+ * The coefficients are computed once in srcInit, processing is integer only.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef SRC_TAPS
+#define SRC_TAPS (24) // taps per phase, more taps -> sharper anti-aliasing, more CPU
+#endif
+#ifndef SRC_PHASES
+#define SRC_PHASES (64) // phases in the filter bank, the rest is interpolated
+#endif
+#ifndef SRC_MAX_DECIMATION
+#define SRC_MAX_DECIMATION (8) // a power of 2 dividing SRC_PHASES, the filter grows up to that many times
+#endif
+#define SRC_MAX_TAPS (SRC_TAPS * SRC_MAX_DECIMATION)
+#define SRC_MAX_CHANNELS (2)
+#define SRC_KAISER_BETA (6.0f)
+#define SRC_ROLLOFF (0.92f) // cutoff relative to the lower Nyquist frequency
+#define SRC_COEFF_BITS (14)  // Q14 coefficients: the sum of |h| of a phase reaches ~2, a full-scale input stays within 32 bits
+
+struct Resampler
+{
+  uint32_t inRate;
+  uint32_t outRate;
+  uint32_t L;     // phase steps per input sample (out / gcd)
+  uint32_t M;     // phase advance per output sample (in / gcd)
+  uint32_t phase; // 0..L-1, position of the next output between two input samples
+  int channels;
+  int taps;   // per phase, SRC_TAPS times the decimation
+  int phases; // SRC_PHASES divided by the decimation
+  int pos;    // write position in the history
+  int16_t coeffs[SRC_PHASES * SRC_TAPS + SRC_MAX_TAPS]; // Q14, (phases + 1) * taps, one extra phase to interpolate the last one
+  int16_t history[SRC_MAX_CHANNELS][2 * SRC_MAX_TAPS];  // every sample is written twice, the window is always contiguous
+};
+
+uint32_t srcGcd(uint32_t a, uint32_t b)
+{
+  while (b != 0)
+  {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// zero-order modified Bessel function, for the Kaiser window
+float srcBesselI0(float x)
+{
+  float sum = 1.0f;
+  float term = 1.0f;
+  for (int k = 1; k < 25; k++)
+  {
+    term *= (x / (2.0f * k)) * (x / (2.0f * k));
+    sum += term;
+  }
+  return sum;
+}
+
+// the rates are equal, nothing to do
+bool srcBypass(Resampler *src)
+{
+  return src->inRate == src->outRate;
+}
+
+// restart the stream (clear the history), keep the coefficients
+void srcReset(Resampler *src)
+{
+  src->phase = 0;
+  src->pos = 0;
+  memset(src->history, 0, sizeof(src->history));
+}
+
+// a tap of the Kaiser-windowed sinc, x is the distance from the output instant in input samples
+float srcTap(float x, float fc, float half, float i0Beta)
+{
+  float sinc = (x == 0) ? 1.0f : sinf((float)M_PI * fc * x) / ((float)M_PI * fc * x);
+  float r = x / half;
+  float window = (r * r < 1.0f) ? srcBesselI0(SRC_KAISER_BETA * sqrtf(1.0f - r * r)) / i0Beta : 0.0f;
+  return fc * sinc * window;
+}
+
+// Compute the filter bank for the inRate -> outRate conversion, channels is 1 or 2
+bool srcInit(Resampler *src, uint32_t inRate, uint32_t outRate, int channels)
+{
+  if (inRate == 0 || outRate == 0 || channels < 1 || channels > SRC_MAX_CHANNELS)
+    return false;
+
+  uint32_t g = srcGcd(inRate, outRate);
+  src->inRate = inRate;
+  src->outRate = outRate;
+  src->L = outRate / g;
+  src->M = inRate / g;
+  src->channels = channels;
+  srcReset(src);
+  if (src->L >= (1UL << 17)) // an odd pair of rates, the fractions would overflow
+    return false;
+
+  // the decimation rounded up to a power of 2, a ratio within 10% of one below counts as that one
+  int decimation = 1;
+  while (decimation < SRC_MAX_DECIMATION && (uint64_t)decimation * src->L * 10 < (uint64_t)src->M * 9)
+    decimation *= 2;
+  src->taps = SRC_TAPS * decimation;
+  src->phases = SRC_PHASES / decimation;
+
+  // when downsampling, the cutoff follows the output Nyquist frequency
+  // single precision on purpose, the esp32 FPU has no double support
+  float fc = SRC_ROLLOFF * (outRate < inRate ? (float)outRate / inRate : 1.0f);
+  float half = src->taps / 2.0f;
+  float i0Beta = srcBesselI0(SRC_KAISER_BETA);
+
+  for (int j = 0; j <= src->phases; j++)
+  {
+    // phase j delays the output by j/phases of an input sample
+    float f = (float)j / src->phases;
+    float sum = 0;
+    for (int k = 0; k < src->taps; k++)
+      sum += srcTap(half - 1 - k + f, fc, half, i0Beta);
+
+    // normalize each phase to a unity DC gain, so the phases don't modulate the level
+    // (the taps are computed again, a row of floats would not fit the stack of the engine task)
+    for (int k = 0; k < src->taps; k++)
+      src->coeffs[j * src->taps + k] = (int16_t)lroundf(srcTap(half - 1 - k + f, fc, half, i0Beta) / sum * (1 << SRC_COEFF_BITS));
+  }
+  return true;
+}
+
+// max output frames that inFrames input frames can produce
+size_t srcMaxOutFrames(Resampler *src, size_t inFrames)
+{
+  return (size_t)(((uint64_t)inFrames * src->L + src->M - 1) / src->M) + 1;
+}
+
+static inline int32_t srcDot(const int16_t *h, const int16_t *x, int taps)
+{
+  int32_t acc = 0;
+  for (int k = 0; k < taps; k++)
+    acc += (int32_t)h[k] * x[k];
+  return acc;
+}
+
+// Resample interleaved 16-bit frames, returns the number of output frames.
+// out must hold srcMaxOutFrames(inFrames) frames, in and out must not overlap.
+size_t srcProcess(Resampler *src, const int16_t *in, size_t inFrames, int16_t *out)
+{
+  size_t outFrames = 0;
+  const int channels = src->channels;
+  const int taps = src->taps;
+
+  for (size_t n = 0; n < inFrames; n++)
+  {
+    // push the new frame into the history of each channel
+    int pos = src->pos;
+    for (int c = 0; c < channels; c++)
+    {
+      int16_t x = in[n * channels + c];
+      src->history[c][pos] = x;
+      src->history[c][pos + taps] = x;
+    }
+    pos = (pos + 1 == taps) ? 0 : pos + 1;
+    src->pos = pos;
+
+    // produce all the outputs that fall before the next input sample
+    while (src->phase < src->L)
+    {
+      // phase/L -> filter bank row + fraction between two rows (Q15)
+      uint32_t scaled = src->phase * src->phases;
+      uint32_t row = scaled / src->L;
+      int32_t frac = (int32_t)(((scaled % src->L) << 15) / src->L); // fits 32-bit, L < 2^17
+      const int16_t *h0 = &src->coeffs[row * taps];
+      const int16_t *h1 = h0 + taps;
+
+      for (int c = 0; c < channels; c++)
+      {
+        const int16_t *window = &src->history[c][pos]; // oldest to newest
+        int32_t y0 = srcDot(h0, window, taps) >> SRC_COEFF_BITS;
+        int32_t y1 = srcDot(h1, window, taps) >> SRC_COEFF_BITS;
+        int32_t y = y0 + (((y1 - y0) * frac) >> 15);
+        if (y > 32767)
+          y = 32767;
+        else if (y < -32768)
+          y = -32768;
+        out[outFrames * channels + c] = (int16_t)y;
+      }
+      outFrames++;
+      src->phase += src->M;
+    }
+    src->phase -= src->L;
+  }
+  return outFrames;
+}
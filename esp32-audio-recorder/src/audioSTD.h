@@ -1,32 +1,51 @@
 /**
  * Audio input and output using the standard built-in driver for I2S
+ * Two backends, chosen with I2S_LEGACY_DRIVER: the channel-based driver/i2s_std.h (audioCHAN.h),
+ * or the legacy driver/i2s.h. They can't be linked together, the mic*Std/dac*Std functions are the same for both.
  */
 
 // For PlatformIO need to begin with this include
 // #include <Arduino.h>
 
+#include "audioWIRE.h" // get the constants of audio wiring
+#include "audioCONV.h" // sample format conversion kernels
+
+// the DMA events of both backends, see i2sPollEventStd
+enum AudioDmaEvent
+{
+  DMA_EVENT_NONE,
+  DMA_EVENT_OVERRUN,  // RX: a buffer was overwritten before it was read
+  DMA_EVENT_UNDERRUN, // TX: a buffer was sent again (cleared), nothing new was written
+  DMA_EVENT_ERROR
+};
+
+#if I2S_LEGACY_DRIVER
 // this is a built-in espressif driver for I2S, no additional library for sound
 #include <driver/i2s.h>
-
-#include "audioWIRE.h" // get the constants of audio wiring
+#else
+// the channel-based driver, RX and TX allocated independently
+#include "audioCHAN.h"
+#endif
 
 /**
  * Input for recording/sampling audio
  */
+#if I2S_LEGACY_DRIVER
 esp_err_t micDestroyStd()
 {
   return i2s_driver_uninstall(MIC_I2S_PORT);
 }
 
 // install and start the standard I2S driver, using driver/i2s.h
-esp_err_t micInstallDriverStd(uint32_t sampleRate, int bitsPerSample, int bufCount = 64, int bufLen = 1024, bool useApll = true)
+// events - gets the queue of the driver events (DMA overflow, errors), NULL - the driver will not use an event queue
+esp_err_t micInstallDriverStd(uint32_t sampleRate, int bitsPerSample, int numChannels = 1, int bufCount = DMA_BUF_COUNT, int bufLen = DMA_BUF_LEN, bool useApll = true, QueueHandle_t *events = NULL)
 {
   // setup I2S processor configuration
   i2s_config_t mic_config = {
       .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX), // MASTER - controller mode, RX - receiver
       .sample_rate = sampleRate,
       .bits_per_sample = (i2s_bits_per_sample_t)(bitsPerSample),
-      .channel_format = MIC_CHANNEL_FMT,
+      .channel_format = numChannels == 2 ? I2S_CHANNEL_FMT_RIGHT_LEFT : MIC_CHANNEL_FMT, // stereo - two mics, L/R select
       //.communication_format = i2s_comm_format_t(I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB), // deprecated
       .communication_format = (i2s_comm_format_t)(I2S_COMM_FORMAT_STAND_I2S), // use this one instead, if fail to compile, then switch to an old version line above
       .intr_alloc_flags = 0,     // default interrupt priority
@@ -35,8 +54,8 @@ esp_err_t micInstallDriverStd(uint32_t sampleRate, int bitsPerSample, int bufCou
       .use_apll = useApll        // I2S using APLL as main I2S clock, enable it to get accurate clock
   };
 
-  // install and start I2S driver, i2s_queue=NULL driver will not use an event queue
-  return i2s_driver_install(MIC_I2S_PORT, &mic_config, 0, NULL);
+  // install and start I2S driver, with an event queue when asked for
+  return i2s_driver_install(MIC_I2S_PORT, &mic_config, events ? I2S_EVENT_QUEUE_LEN : 0, events);
 }
 
 esp_err_t micSetPinsStd()
@@ -51,11 +70,11 @@ esp_err_t micSetPinsStd()
   return i2s_set_pin(MIC_I2S_PORT, &mic_pin_config);
 }
 
-// init the microphone, using the driver/i2s.h
-esp_err_t micInitStd(uint32_t sampleRate, int bitsPerSample, int bufCount, int bufLen, bool useApll)
+// init the microphone, using the driver/i2s.h (the parameters after useApll are optional, older sketches leave them out)
+esp_err_t micInitStd(uint32_t sampleRate, int bitsPerSample, int bufCount, int bufLen, bool useApll, int numChannels = MIC_CHANNEL_NUM, QueueHandle_t *events = NULL)
 {
-  // install and start I2S driver, i2s_queue=NULL driver will not use an event queue
-  esp_err_t res = micInstallDriverStd(sampleRate, bitsPerSample, bufCount, bufLen, useApll);
+  // install and start I2S driver, events=NULL driver will not use an event queue
+  esp_err_t res = micInstallDriverStd(sampleRate, bitsPerSample, numChannels, bufCount, bufLen, useApll, events);
   if (res != ESP_OK)
   {
     // Serial.printf("Microphone install driver failed with error 0x%x", res);
@@ -83,36 +102,82 @@ esp_err_t micInitStd(uint32_t sampleRate, int bitsPerSample, int bufCount, int b
   return ESP_OK; // success
 }
 
+// change the format of an installed microphone driver, without reinstalling it
+esp_err_t micSetClkStd(int sampleRate, int bitsPerSample, int numChannels, bool useApll)
+{
+  return i2s_set_clk(MIC_I2S_PORT, sampleRate, bitsPerSample, i2s_channel_t(numChannels));
+}
+
 esp_err_t micReadBuff(void *dest, size_t size, size_t *bytes_read)
 {
   return i2s_read(MIC_I2S_PORT, dest, size, bytes_read, portMAX_DELAY);
 }
 
+// read whatever is ready without waiting (bytes_read may be 0)
+esp_err_t micReadNowStd(void *dest, size_t size, size_t *bytes_read)
+{
+  return i2s_read(MIC_I2S_PORT, dest, size, bytes_read, 0);
+}
+#else
+esp_err_t micDestroyStd()
+{
+  return micChanDelete(); // audioCHAN.h
+}
+
+// init the microphone: a RX channel only, events gets the queue of AudioDmaEvent (the parameters after useApll are optional)
+esp_err_t micInitStd(uint32_t sampleRate, int bitsPerSample, int bufCount, int bufLen, bool useApll, int numChannels = MIC_CHANNEL_NUM, QueueHandle_t *events = NULL)
+{
+  esp_err_t res = micChanInit(sampleRate, bitsPerSample, numChannels, bufCount, bufLen, useApll, events);
+  if (res != ESP_OK)
+    printf("Microphone channel init failed with error 0x%x\n", res);
+  return res;
+}
+
+// reclock the running channel, it is not deleted
+esp_err_t micSetClkStd(int sampleRate, int bitsPerSample, int numChannels, bool useApll)
+{
+  return micChanReconfig(sampleRate, bitsPerSample, numChannels, useApll);
+}
+
+esp_err_t micReadBuff(void *dest, size_t size, size_t *bytes_read)
+{
+  return micChanRead(dest, size, bytes_read, portMAX_DELAY);
+}
+
+esp_err_t micReadNowStd(void *dest, size_t size, size_t *bytes_read)
+{
+  return micChanRead(dest, size, bytes_read, 0);
+}
+#endif
+
 void micDiscardBlocks(void *dest, size_t size, size_t *bytes_read, int num_blocks)
 {
   for (int i = 0; i < num_blocks; i++)
     micReadBuff(dest, size, bytes_read);
 }
 
-// Scale data to 8bit for data from ADC.
-// Data from ADC are 12bit width by default.
-// DAC can only output 8 bit data.
-// Scale each 12bit ADC data to 8bit DAC data.
-void micDataScale(uint8_t *d_buff, uint8_t *s_buff, uint32_t len)
+// drop the blocks that piled up in the DMA while nobody was reading, without waiting for new ones
+// dmaBytes - never more than the DMA can hold, the default is 32-bit stereo of the default geometry
+void micFlushStd(size_t dmaBytes = DMA_BUF_COUNT * DMA_BUF_LEN * 8)
 {
-  uint32_t j = 0;
-  uint32_t dac_value = 0;
-  for (int i = 0; i < len; i += 2)
+  uint8_t dump[256];
+  size_t bytes_read;
+  int max_reads = dmaBytes / sizeof(dump);
+  for (int i = 0; i < max_reads; i++)
   {
-    dac_value = ((((uint16_t)(s_buff[i + 1] & 0xf) << 8) | ((s_buff[i + 0]))));
-    d_buff[j++] = 0;
-    // The bigger the stored value, it makes the louder the sound and noise as well.
-    // The default is dac_value * 256 / 4096 is a way to keep less noise and a little bit up the volume.
-    // In our case, we want to get almost the same volume so we use 2048 instead of 4096.
-    d_buff[j++] = dac_value * 256 / 2048;
+    if (micReadNowStd(dump, sizeof(dump), &bytes_read) != ESP_OK || bytes_read == 0)
+      break;
   }
 }
 
+// Scale the 16-bit samples from the microphone, with the same gain as the 32-bit path (MIC_GAIN_SHIFT).
+// This used to be a hand-written scaling of 12-bit ADC data to 8-bit (dac_value * 256 / 2048),
+// which is the same x32 gain, but wrapping around on loud sounds. Now it is a saturating kernel.
+void micDataScale(uint8_t *d_buff, uint8_t *s_buff, uint32_t len)
+{
+  convBlock<FmtS16, FmtS16, 1, 1, MIC_GAIN_SHIFT>(d_buff, s_buff, len);
+}
+
 // Print Average reading to serial plotter
 void micPrintSamplesAVG(int16_t src[], size_t len)
 {
@@ -137,14 +202,15 @@ void micPrintSamplesAVG(int16_t src[], size_t len)
 /**
  * Output for playing audio
  */
-
+#if I2S_LEGACY_DRIVER
 esp_err_t dacDestroyStd()
 {
   i2s_zero_dma_buffer(DAC_I2S_PORT);
   return i2s_driver_uninstall(DAC_I2S_PORT);
 }
 // install and start the standard I2S driver, using driver/i2s.h
-esp_err_t dacInstallDriverStd(uint32_t sampleRate, int bitsPerSample, int bufCount, int bufLen, bool useApll = true)
+// events - gets the queue of the driver events (DMA underflow, errors), NULL - the driver will not use an event queue
+esp_err_t dacInstallDriverStd(uint32_t sampleRate, int bitsPerSample, int bufCount, int bufLen, bool useApll = true, QueueHandle_t *events = NULL)
 {
   // setup I2S processor configuration
   i2s_config_t dac_config = {
@@ -161,8 +227,8 @@ esp_err_t dacInstallDriverStd(uint32_t sampleRate, int bitsPerSample, int bufCou
       .tx_desc_auto_clear = true                                            // helps in avoiding noise in case of data unavailability
   };
 
-  // install and start I2S driver, i2s_queue=NULL driver will not use an event queue
-  return i2s_driver_install(DAC_I2S_PORT, &dac_config, 0, NULL);
+  // install and start I2S driver, with an event queue when asked for
+  return i2s_driver_install(DAC_I2S_PORT, &dac_config, events ? I2S_EVENT_QUEUE_LEN : 0, events);
 }
 
 esp_err_t dacSetPinsStd()
@@ -179,10 +245,10 @@ esp_err_t dacSetPinsStd()
 }
 
 // init the speaker (DAC), using the driver/i2s.h
-esp_err_t dacInitStd(int sampleRate = MIC_SAMPLE_RATE, int bitsPerSample = MIC_SAMPLE_BITS, int numChannels = MIC_CHANNEL_NUM, int bufCount = DMA_BUF_COUNT, int bufLen = DMA_BUF_LEN, bool useApll = true)
+esp_err_t dacInitStd(int sampleRate = MIC_SAMPLE_RATE, int bitsPerSample = MIC_SAMPLE_BITS, int numChannels = MIC_CHANNEL_NUM, int bufCount = DMA_BUF_COUNT, int bufLen = DMA_BUF_LEN, bool useApll = true, QueueHandle_t *events = NULL)
 {
-  // install and start I2S driver, i2s_queue=NULL driver will not use an event queue
-  esp_err_t res = dacInstallDriverStd(sampleRate, bitsPerSample, bufCount, bufLen, useApll);
+  // install and start I2S driver, events=NULL driver will not use an event queue
+  esp_err_t res = dacInstallDriverStd(sampleRate, bitsPerSample, bufCount, bufLen, useApll, events);
   if (res != ESP_OK)
   {
     // Serial.printf("DAC install driver failed with error 0x%x", res);
@@ -209,7 +275,104 @@ esp_err_t dacInitStd(int sampleRate = MIC_SAMPLE_RATE, int bitsPerSample = MIC_S
   return ESP_OK; // success
 }
 
+// silence the DAC right away, drops the samples still queued in the DMA buffers
+esp_err_t dacClearStd()
+{
+  return i2s_zero_dma_buffer(DAC_I2S_PORT);
+}
+
+// change the format of an installed DAC driver, without reinstalling it
+esp_err_t dacSetClkStd(int sampleRate, int bitsPerSample, int numChannels)
+{
+  esp_err_t res = i2s_set_clk(DAC_I2S_PORT, sampleRate, bitsPerSample, i2s_channel_t(numChannels));
+  if (res != ESP_OK)
+    printf("DAC set clock failed with error 0x%x\n", res);
+  return res;
+}
+
 esp_err_t dacWriteBuff(void *src, size_t size, size_t *bytes_written)
 {
   return i2s_write(DAC_I2S_PORT, src, size, bytes_written, portMAX_DELAY);
 }
+
+// the legacy DMA can't be preloaded, the playback starts after the zeros already queued
+void dacPreloadStd()
+{
+}
+
+esp_err_t dacStartStd()
+{
+  return ESP_OK;
+}
+
+// next gap event of the driver queue, without waiting (the queue also has one DONE event per DMA buffer)
+AudioDmaEvent i2sPollEventStd(QueueHandle_t events)
+{
+  i2s_event_t event;
+  while (xQueueReceive(events, &event, 0) == pdTRUE)
+  {
+    if (event.type == I2S_EVENT_RX_Q_OVF)
+      return DMA_EVENT_OVERRUN;
+    if (event.type == I2S_EVENT_TX_Q_OVF)
+      return DMA_EVENT_UNDERRUN;
+    if (event.type == I2S_EVENT_DMA_ERROR)
+      return DMA_EVENT_ERROR;
+  }
+  return DMA_EVENT_NONE;
+}
+#else
+esp_err_t dacDestroyStd()
+{
+  return dacChanDelete(); // audioCHAN.h
+}
+
+// init the speaker (DAC): a TX channel only, events gets the queue of AudioDmaEvent
+esp_err_t dacInitStd(int sampleRate = MIC_SAMPLE_RATE, int bitsPerSample = MIC_SAMPLE_BITS, int numChannels = MIC_CHANNEL_NUM, int bufCount = DMA_BUF_COUNT, int bufLen = DMA_BUF_LEN, bool useApll = true, QueueHandle_t *events = NULL)
+{
+  esp_err_t res = dacChanInit(sampleRate, bitsPerSample, numChannels, bufCount, bufLen, useApll, events);
+  if (res != ESP_OK)
+    printf("DAC channel init failed with error 0x%x\n", res);
+  return res;
+}
+
+// silence the DAC right away, the DMA buffers that were not sent yet are zeroed
+esp_err_t dacClearStd()
+{
+  return dacChanClear();
+}
+
+// reclock the running channel, it is not deleted
+esp_err_t dacSetClkStd(int sampleRate, int bitsPerSample, int numChannels)
+{
+  esp_err_t res = dacChanReconfig(sampleRate, bitsPerSample, numChannels, DAC_USE_APLL);
+  if (res != ESP_OK)
+    printf("DAC set clock failed with error 0x%x\n", res);
+  return res;
+}
+
+esp_err_t dacWriteBuff(void *src, size_t size, size_t *bytes_written)
+{
+  return dacChanWrite(src, size, bytes_written, portMAX_DELAY);
+}
+
+// the next writes are preloaded into the stopped DMA, it starts once full (or on dacStartStd)
+void dacPreloadStd()
+{
+  dacChanPreload();
+}
+
+// start a DMA that is still preloading, e.g. a sound shorter than the DMA
+esp_err_t dacStartStd()
+{
+  return dacChanCommit();
+}
+
+// next gap event of the channel callbacks, without waiting
+AudioDmaEvent i2sPollEventStd(QueueHandle_t events)
+{
+  AudioDmaEvent event;
+  if (xQueueReceive(events, &event, 0) == pdTRUE)
+    return event;
+  return DMA_EVENT_NONE;
+}
+#endif
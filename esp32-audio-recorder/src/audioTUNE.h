@@ -0,0 +1,167 @@
+/**
+ * DMA geometry of the I2S devices (number of DMA buffers x frames per buffer), calibrated at runtime and kept in NVS.
+ * The calibration runs the candidates from the smallest DMA RAM up, each one for a trial that records and plays
+ * under load, and keeps for each device the first one without a single overrun (mic) or underrun (DAC).
+ * The result is loaded at boot, a device that was never calibrated keeps DMA_BUF_COUNT x DMA_BUF_LEN.
+ * The trial itself needs the tasks of the application, it is in main.cpp (tuneJob).
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <Preferences.h>
+
+#define TUNE_NVS_NAMESPACE "audio-dma" // the NVS namespace of the calibration
+#define TUNE_DMA_MAX_BYTES (DEV_DMA_MAX_BYTES) // audioDEV.h
+#define TUNE_DMA_MAX_LEN (1024)        // the legacy driver takes up to 1024 frames per buffer
+#define TUNE_MAX_CANDIDATES (40)
+
+const int tuneCounts[] = {2, 3, 4, 6, 8, 12, 16};
+const int tuneLens[] = {64, 128, 256, 512, 1024};
+
+struct DmaGeometry
+{
+  int bufCount;
+  int bufLen; // frames
+};
+
+// the state of the last (or running) calibration
+struct TuneState
+{
+  bool running;
+  uint32_t sampleRate; // the format of the trials (as a recording)
+  int bitsPerSample;
+  int numChannels;
+  int trialMs;
+  DmaGeometry candidates[TUNE_MAX_CANDIDATES]; // from the smallest DMA up
+  int numCandidates;
+  int tried;
+  DmaGeometry mic; // the result, bufCount 0 - not found (yet)
+  DmaGeometry dac;
+  uint32_t micOverruns;  // gaps of the last trial
+  uint32_t dacUnderruns;
+  bool saved;
+};
+
+TuneState tuneState;
+
+// Fill the candidates in the order of their DMA RAM (count x len), the same order for any frame size.
+// At the same RAM more (shorter) buffers go first, the driver refills the DMA at a finer grain.
+// maxFrame - the largest frame of the two devices in bytes, a buffer must fit in TUNE_DMA_MAX_BYTES
+int tuneMakeCandidates(DmaGeometry *candidates, int maxFrame)
+{
+  int n = 0;
+  for (int c = 0; c < (int)(sizeof(tuneCounts) / sizeof(tuneCounts[0])); c++)
+  {
+    for (int l = 0; l < (int)(sizeof(tuneLens) / sizeof(tuneLens[0])); l++)
+    {
+      if (tuneLens[l] > TUNE_DMA_MAX_LEN || tuneLens[l] * maxFrame > TUNE_DMA_MAX_BYTES || n == TUNE_MAX_CANDIDATES)
+        continue;
+      candidates[n].bufCount = tuneCounts[c];
+      candidates[n].bufLen = tuneLens[l];
+      n++;
+    }
+  }
+
+  // insertion sort, a few dozens at most
+  for (int i = 1; i < n; i++)
+  {
+    DmaGeometry g = candidates[i];
+    int j = i - 1;
+    while (j >= 0 && (candidates[j].bufCount * candidates[j].bufLen > g.bufCount * g.bufLen ||
+                      (candidates[j].bufCount * candidates[j].bufLen == g.bufCount * g.bufLen && candidates[j].bufCount < g.bufCount)))
+    {
+      candidates[j + 1] = candidates[j];
+      j--;
+    }
+    candidates[j + 1] = g;
+  }
+  return n;
+}
+
+bool tuneValid(int bufCount, int bufLen)
+{
+  return bufCount >= 2 && bufCount <= 128 && bufLen >= 8 && bufLen <= TUNE_DMA_MAX_LEN;
+}
+
+// Load the calibrated geometry of a device (prefix "mic" or "dac"), false if there is none.
+// It was calibrated for one format, devFormatBufLen (audioDEV.h) shortens its buffers for wider frames.
+bool tuneLoad(const char *prefix, DmaGeometry *geometry)
+{
+  Preferences prefs;
+  if (!prefs.begin(TUNE_NVS_NAMESPACE, true))
+    return false; // never calibrated, the namespace doesn't exist yet
+  String key = String(prefix);
+  int bufCount = prefs.getUShort((key + "Count").c_str(), 0);
+  int bufLen = prefs.getUShort((key + "Len").c_str(), 0);
+  prefs.end();
+
+  if (!tuneValid(bufCount, bufLen))
+    return false;
+  geometry->bufCount = bufCount;
+  geometry->bufLen = bufLen;
+  return true;
+}
+
+// Keep the geometry of a device, with the format it was calibrated for
+bool tuneSave(const char *prefix, DmaGeometry *geometry, uint32_t sampleRate, int bitsPerSample, int numChannels)
+{
+  Preferences prefs;
+  if (!prefs.begin(TUNE_NVS_NAMESPACE, false))
+    return false;
+  String key = String(prefix);
+  bool ok = prefs.putUShort((key + "Count").c_str(), geometry->bufCount) > 0 &&
+            prefs.putUShort((key + "Len").c_str(), geometry->bufLen) > 0;
+  prefs.putUInt("rate", sampleRate);
+  prefs.putUShort("bits", bitsPerSample);
+  prefs.putUShort("channels", numChannels);
+  prefs.end();
+  return ok;
+}
+
+// forget the calibration, the devices go back to DMA_BUF_COUNT x DMA_BUF_LEN on the next boot
+bool tuneClear()
+{
+  Preferences prefs;
+  if (!prefs.begin(TUNE_NVS_NAMESPACE, false))
+    return false;
+  bool ok = prefs.clear();
+  prefs.end();
+  return ok;
+}
+
+String tuneGeometryJson(DmaGeometry *geometry)
+{
+  if (geometry->bufCount == 0)
+    return "null";
+  return "{\"bufCount\":" + String(geometry->bufCount) + ",\"bufLen\":" + String(geometry->bufLen) + "}";
+}
+
+// json ready format
+String tuneGetState(TuneState *state)
+{
+  String output = "{\"running\":";
+  output += state->running ? "true" : "false";
+  output += ",\"sampleRate\":";
+  output += state->sampleRate;
+  output += ",\"bitsPerSample\":";
+  output += state->bitsPerSample;
+  output += ",\"numChannels\":";
+  output += state->numChannels;
+  output += ",\"trialMs\":";
+  output += state->trialMs;
+  output += ",\"tried\":";
+  output += state->tried;
+  output += ",\"candidates\":";
+  output += state->numCandidates;
+  output += ",\"micOverruns\":";
+  output += state->micOverruns;
+  output += ",\"dacUnderruns\":";
+  output += state->dacUnderruns;
+  output += ",\"mic\":" + tuneGeometryJson(&state->mic);
+  output += ",\"dac\":" + tuneGeometryJson(&state->dac);
+  output += ",\"saved\":";
+  output += state->saved ? "true" : "false";
+  output += "}";
+  return output;
+}
@@ -0,0 +1,226 @@
+/**
+ * Voice activity detection of the recording, in fixed point: the energy and the zero crossings of short frames.
+ * A frame is voiced when its energy is VAD_MARGIN_DB above the noise floor, or half of it with the zero crossings
+ * of a fricative (s, f, sh). The noise floor follows the quietest frames down at once and the others up slowly.
+ * The silent frames are dropped from the block before it is converted, so the writer and the coders never see them,
+ * and the voiced regions are kept as a list of segments: where they were in time and where they are in the file.
+ * Works on the raw I2S samples (16-bit, or 32-bit left-justified), levels are in dBFS of the recording (with its gain).
+ */
+
+// For PlatformIO need to begin with this include
+// #include <Arduino.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define VAD_FRAME_MS (16)      // the frame of a decision, a block of the writer holds a few of them
+#define VAD_MARGIN_DB (9)      // voiced above the noise floor by that much
+#define VAD_MIN_DB (-60)       // and above that level, digital silence is never voiced
+#define VAD_ZCR_MIN (3000)     // zero crossings per second of a fricative, voiced at half of the margin
+#define VAD_HANGOVER_MS (300)  // kept after the last voiced frame, the ends of the words are quiet
+#define VAD_MAX_SEGMENTS (64)  // voiced regions listed, the next ones are only counted
+
+// levels as log2 of the mean square, Q8: one unit of log2 is 3.01 dB of power
+#define VAD_DB_TO_Q8(db) ((int32_t)((db) * 256 * 100) / 301)
+
+// a voiced region, in frames of the recording
+struct VadSegment
+{
+  uint32_t start;  // in time, from the start of the recording
+  uint32_t frames;
+  uint32_t offset; // in the file, the silence before it is gone
+};
+
+struct VadState
+{
+  bool enabled;
+  uint32_t sampleRate;
+  int captureBits; // 16, or 32 left-justified
+  int numChannels;
+  int gainQ8;      // the gain of the recording, in the levels
+  int frameLen;    // frames of a decision
+  int hangover;    // decisions kept after the last voiced one
+  int32_t floorQ8; // the noise floor, -1 until the first frame
+  int holdLeft;    // decisions still kept by the hangover
+  bool voiced;     // the last decision
+  bool listed;     // the voiced region goes on in the last segment
+  uint32_t inFrames;  // frames seen
+  uint32_t outFrames; // frames kept
+  uint32_t decisions;
+  uint32_t voicedDecisions;
+  VadSegment segments[VAD_MAX_SEGMENTS];
+  int numSegments;
+  uint32_t moreSegments; // not listed, VAD_MAX_SEGMENTS was reached
+};
+
+void vadInit(VadState *vad, bool enabled, uint32_t sampleRate, int captureBits, int numChannels, int gainShift)
+{
+  memset(vad, 0, sizeof(VadState));
+  vad->enabled = enabled;
+  vad->sampleRate = sampleRate;
+  vad->captureBits = captureBits;
+  vad->numChannels = numChannels;
+  vad->gainQ8 = gainShift * 2 * 256; // x2^shift in amplitude
+  vad->frameLen = sampleRate * VAD_FRAME_MS / 1000;
+  vad->hangover = VAD_HANGOVER_MS / VAD_FRAME_MS;
+  vad->floorQ8 = -1;
+}
+
+// log2 of x in Q8, the fraction interpolated linearly between the powers of 2 (within 0.09 of a unit, 0.26 dB)
+int32_t vadLog2Q8(uint32_t x)
+{
+  if (x == 0)
+    return 0;
+  int n = 31 - __builtin_clz(x);
+  uint32_t fraction = n >= 8 ? (x >> (n - 8)) & 0xFF : (x << (8 - n)) & 0xFF;
+  return (n << 8) + fraction;
+}
+
+// The level (log2 of the mean square of 16-bit samples, Q8, with the gain) and the zero crossings of a frame.
+// The energy is taken over all channels, the crossings on the first one.
+int32_t vadMeasure(VadState *vad, const uint8_t *src, int frames, int *crossings)
+{
+  uint64_t energy = 0;
+  int count = 0;
+  int samples = frames * vad->numChannels;
+  int16_t last = 0;
+  if (vad->captureBits == 16)
+  {
+    const int16_t *s = (const int16_t *)src;
+    for (int i = 0; i < samples; i++)
+      energy += (int32_t)s[i] * s[i];
+    for (int i = 0; i < samples; i += vad->numChannels)
+    {
+      count += (s[i] ^ last) < 0;
+      last = s[i];
+    }
+  }
+  else
+  {
+    // the top 16 bits are plenty for a level
+    const int32_t *s = (const int32_t *)src;
+    for (int i = 0; i < samples; i++)
+    {
+      int32_t v = s[i] >> 16;
+      energy += v * v;
+    }
+    for (int i = 0; i < samples; i += vad->numChannels)
+    {
+      int16_t v = s[i] >> 16;
+      count += (v ^ last) < 0;
+      last = v;
+    }
+  }
+  *crossings = count;
+  uint32_t meanSquare = energy / (samples ? samples : 1);
+  if (meanSquare == 0)
+    return 0;
+  return vadLog2Q8(meanSquare) + vad->gainQ8;
+}
+
+// the decision of a frame, it moves the noise floor
+bool vadDecide(VadState *vad, int32_t levelQ8, int crossings, int frames)
+{
+  // a full-scale sine is log2(2^30 / 2) = 29 units, 0 dBFS at 30
+  const int32_t fullScaleQ8 = 30 << 8;
+  if (vad->floorQ8 < 0)
+    vad->floorQ8 = levelQ8;
+
+  int32_t above = levelQ8 - vad->floorQ8;
+  uint32_t zcr = (uint32_t)crossings * vad->sampleRate / (frames ? frames : 1);
+  bool voiced = levelQ8 > fullScaleQ8 + VAD_DB_TO_Q8(VAD_MIN_DB) &&
+                (above > VAD_DB_TO_Q8(VAD_MARGIN_DB) || (above > VAD_DB_TO_Q8(VAD_MARGIN_DB) / 2 && zcr >= VAD_ZCR_MIN));
+
+  // the floor drops to a quieter frame at once, follows the noise up in 16 frames, and speech by 3 dB per second
+  if (levelQ8 < vad->floorQ8)
+    vad->floorQ8 = levelQ8;
+  else if (!voiced)
+    vad->floorQ8 += (above + 15) >> 4;
+  else
+    vad->floorQ8 += max(1, VAD_DB_TO_Q8(3) * VAD_FRAME_MS / 1000);
+
+  if (voiced)
+    vad->holdLeft = vad->hangover;
+  else if (vad->holdLeft > 0)
+  {
+    vad->holdLeft--;
+    voiced = true;
+  }
+  vad->decisions++;
+  vad->voicedDecisions += voiced;
+  return voiced;
+}
+
+// a voiced frame at in (time) -> out (file), extends the last segment or opens one
+void vadMark(VadState *vad, uint32_t in, uint32_t out, int frames)
+{
+  if (vad->voiced)
+  {
+    if (vad->listed)
+      vad->segments[vad->numSegments - 1].frames += frames;
+    return;
+  }
+  vad->listed = vad->numSegments < VAD_MAX_SEGMENTS;
+  if (!vad->listed)
+  {
+    vad->moreSegments++;
+    return;
+  }
+  VadSegment *segment = &vad->segments[vad->numSegments++];
+  segment->start = in;
+  segment->frames = frames;
+  segment->offset = out;
+}
+
+// Drop the silent frames of a block of raw samples, in place, returns the bytes kept (whole frames).
+// The decisions run on VAD_FRAME_MS frames, the last one of a block may be shorter.
+size_t vadFilter(VadState *vad, uint8_t *src, size_t len)
+{
+  if (!vad->enabled)
+    return len;
+  int frameSize = vad->captureBits / 8 * vad->numChannels;
+  int frames = len / frameSize;
+  size_t kept = 0;
+  for (int at = 0; at < frames; at += vad->frameLen)
+  {
+    int n = min(vad->frameLen, frames - at);
+    int crossings;
+    int32_t level = vadMeasure(vad, src + at * frameSize, n, &crossings);
+    bool voiced = vadDecide(vad, level, crossings, n);
+    if (voiced)
+    {
+      vadMark(vad, vad->inFrames, vad->outFrames, n);
+      if (kept != (size_t)at * frameSize)
+        memmove(src + kept, src + at * frameSize, n * frameSize);
+      kept += n * frameSize;
+      vad->outFrames += n;
+    }
+    vad->voiced = voiced;
+    vad->inFrames += n;
+  }
+  return kept;
+}
+
+// json ready format, the segments in ms: [start, length, offset in the file]
+String vadGetState(VadState *vad)
+{
+  uint32_t rate = vad->sampleRate ? vad->sampleRate : 1;
+  String output = "{\"decisions\":" + String(vad->decisions);
+  output += ",\"voiced\":" + String(vad->voicedDecisions);
+  output += ",\"inMs\":" + String((unsigned long)((uint64_t)vad->inFrames * 1000 / rate));
+  output += ",\"outMs\":" + String((unsigned long)((uint64_t)vad->outFrames * 1000 / rate));
+  output += ",\"floor\":" + String(vad->floorQ8 < 0 ? -120.0 : (vad->floorQ8 - (30 << 8)) * 3.0103 / 256, 1);
+  output += ",\"moreSegments\":" + String(vad->moreSegments);
+  output += ",\"segments\":[";
+  for (int i = 0; i < vad->numSegments; i++)
+  {
+    VadSegment *segment = &vad->segments[i];
+    output += i ? ",[" : "[";
+    output += String((unsigned long)((uint64_t)segment->start * 1000 / rate)) + ",";
+    output += String((unsigned long)((uint64_t)segment->frames * 1000 / rate)) + ",";
+    output += String((unsigned long)((uint64_t)segment->offset * 1000 / rate)) + "]";
+  }
+  output += "]}";
+  return output;
+}
@@ -13,14 +13,16 @@
 // LRC is grounded, hence only left channel
 #define MIC_CHANNEL_FMT I2S_CHANNEL_FMT_ONLY_LEFT
 //#define MIC_CHANNEL_FMT I2S_CHANNEL_FMT_ONLY_RIGHT
+#define MIC_STD_SLOT I2S_STD_SLOT_LEFT // the same for the channel-based driver
+//#define MIC_STD_SLOT I2S_STD_SLOT_RIGHT
 
 // define DAC pins (output via speakers)
 #define DAC_DIN_SD 14
 #define DAC_BCLK_SCK 27
 #define DAC_LRC_WS 26
 
-// Use I2S processor 0 for transmitter
-#define DAC_I2S_PORT I2S_NUM_0
+// Use I2S processor 1 for transmitter, so the microphone and the DAC can run at the same time
+#define DAC_I2S_PORT I2S_NUM_1
 #define DAC_CHANNEL_FMT I2S_CHANNEL_FMT_ONLY_LEFT
 //#define DAC_CHANNEL_FMT I2S_CHANNEL_FMT_ONLY_RIGHT
 // #define DAC_CHANNEL_FMT I2S_CHANNEL_FMT_RIGHT_LEFT - for stereo
@@ -30,9 +32,58 @@
 #define MIC_SAMPLE_BITS (16)    // 32 or 16 bits for bit depth // 32-bit doesn't work for me :(
 #define MIC_SAMPLE_BITS_HDR (16)    // 16 bits for bit depth for wav header of output file
 #define MIC_CHANNEL_NUM (1)     // one channel
+#define MIC_GAIN_SHIFT (5)      // digital gain of the recording as a power of 2 (x32), louder sounds may need less
+// the defaults of a recording, /record may ask for another rate, 24/32 bits, stereo or a codec (see recPresets in main.cpp)
+#define REC_MAX_TIME (30) // seconds of a PCM recording, IMA-ADPCM may be 4x longer, u-law and FLAC 2x
 
-// Increase these values if you experience distortion at higher sample rates
+// I2S driver: false - the channel-based driver/i2s_std.h (preloaded TX DMA, reclock in place), true - the legacy driver/i2s.h
+#ifndef I2S_LEGACY_DRIVER
+#define I2S_LEGACY_DRIVER false
+#endif
+
+// The DMA geometry until the devices are calibrated (POST /calibrate), the calibrated one is kept in NVS
 #define DMA_BUF_COUNT (8) // 64
 #define DMA_BUF_LEN (256)  // 64; 1024
+#define TUNE_TRIAL_MS (3000)          // each candidate geometry records and plays that long without a gap
+#define TUNE_LOAD_FILE "/tune.tmp"    // the flash load of the calibration, removed after each trial
+#define TUNE_LOAD_FILE_SIZE (64 * 1024) // rewritten from the start beyond that size
+#define TUNE_UDP_PORT (9)             // the network load, UDP broadcasts to the discard port
+#define TUNE_UDP_BURST (4)            // packets per flash block
+#define TUNE_UDP_PACKET (1024)
+
+// The esp32 has a single APLL, only one of the ports may use it (at its own rate)
+#define MIC_USE_APLL false
+#define DAC_USE_APLL true
+// two ports - record and play at the same time, a shared port - one at a time
+#define AUDIO_FULL_DUPLEX (MIC_I2S_PORT != DAC_I2S_PORT)
+#define I2S_EVENT_QUEUE_LEN (16) // driver events (one per DMA buffer) kept until the device owner polls them
+#define LOOPBACK_TIMEOUT_MS (500) // the loopback test gives up if the mic doesn't hear the click by then
+
+// Audio engine: the web handlers post commands, the engine task routes them to the device workers
+#define ENGINE_QUEUE_LEN (16) // commands waiting for the engine, a whole playlist may arrive at once
+#define PLAY_QUEUE_LEN (16)   // jobs waiting for the DAC (queue=true, /queue)
+#define REC_QUEUE_LEN (2)     // recordings waiting for the mic (queue=true)
+
+#define BUFF_SIZE (DMA_BUF_LEN * MIC_SAMPLE_BITS / 8) // size of buffer in bytes
+
+// Recording pipeline: capture task -> ring -> (optional DSP task -> ring) -> flash writer
+#define REC_WRITE_BLOCK (4096)   // the writer drains the ring in flash-sized blocks (16 SPIFFS pages of 256 B)
+#define REC_RING_BLOCKS (8)      // ring depth in writer blocks, increase it if the high-water mark gets close to the ring size
+#define REC_RING_TIMEOUT_MS (1000) // the writer gives up if no audio arrives for that long
+#define REC_DSP_TASK false       // true - run the DSP stage as a separate task on the other core, false - inline in the writer
+#define REC_VAD false           // true - drop the silent frames of every recording (audioVAD.h), /record vad= overrides it
+#define REC_NR false            // true - suppress the steady noise of every mono recording (audioNR.h), /record nr= overrides it
+
+// Armed recording (POST /arm): the mic captures into a RAM ring of the last seconds until a trigger commits it to the file
+#define ARM_PREROLL (2)     // seconds of pre-roll by default, 32 KB per second of 16kHz/16-bit mono
+#define ARM_MAX_PREROLL (5) // the pre-roll is in RAM (PSRAM when there is one)
 
-#define BUFF_SIZE (DMA_BUF_LEN * MIC_SAMPLE_BITS / 8) // size of buffer in bytes
\ No newline at end of file
+// Playback pipeline: prefetch reader task -> ring -> DAC task
+#define PLAY_READ_BLOCK (4096)  // the reader fetches aligned blocks of 16 SPIFFS pages
+#define PLAY_RING_BLOCKS (8)    // ring depth in read blocks, ~186ms of 44.1kHz/16-bit stereo
+#define PLAY_DAC_BLOCK (1024)   // the DAC task pulls this much from the ring on each write
+#define PLAY_PREFILL_BLOCKS (2) // DAC blocks waiting in the ring before the first write, more only delay the start
+#define DAC_FIXED_RATE (48000)  // the DAC keeps one clock (16-bit stereo), every file is resampled to it. 0 - follow the file
+#define PLAY_NORMALIZE true     // true - every file plays at PLAY_TARGET_LUFS, the gain from its loudness in the .json (audioLOUD.h)
+#define PLAY_TARGET_LUFS (-18)  // the integrated loudness of a normalized playback
+#define PLAY_VOLUME (100)       // the master volume at boot, % of the full scale (/volume, audioMIX.h)
@@ -3,6 +3,16 @@
 
 // TODO: need to test the code for both the libraries
 #include "fsDEFS.h"
+#include "audioCODEC.h" // the coded WAV formats (IMA-ADPCM, u-law)
+#include "audioFLAC.h"  // lossless recordings, .flac files
+
+// .mp3 files need arduino-libhelix, a sketch that plays them defines FS_MP3 true before this include
+#ifndef FS_MP3
+#define FS_MP3 false
+#endif
+#if FS_MP3 == true
+#include "audioMP3.h" // .mp3 files, played only
+#endif
 
 // use SPIFFS by default or LittleFS of your choice
 #ifndef USE_LITTLE
@@ -24,14 +34,26 @@
 
 // The header of a WAV (RIFF) file is 44 bytes long
 const int wavHeaderSize = 44;
+// a coded one has a longer fmt chunk and a fact chunk: 58 bytes (u-law), 60 bytes (IMA-ADPCM)
+const int wavCodecHeaderMax = 60;
 
 struct WAVHeader
 {
   uint32_t sampleRate;
   uint16_t numChannels;
   uint16_t bitsPerSample;
+  uint32_t dataOffset; // where the samples start in the file
+  uint32_t dataSize;   // bytes of samples
+  uint16_t audioFormat;     // WAV_FORMAT_xxx (audioCODEC.h), extensible files are PCM
+  uint16_t blockAlign;      // bytes of a frame, or of a coded block
+  uint16_t samplesPerBlock; // frames of a block, 1 for PCM and u-law
 };
 
+bool fsEnsureFlacHeader(File file, WAVHeader *wavHeader);
+#if FS_MP3 == true
+bool fsEnsureMp3Header(File file, WAVHeader *wavHeader);
+#endif
+
 // init the file system, using the chosen type
 void fsInit()
 {
@@ -170,9 +192,9 @@ String fsGetPlaylist(String path = "/")
     File file = root.openNextFile();
     while (file)
     {
-      // filter only audio files, e.g. ".wav" and ".mp3"
+      // filter only audio files, e.g. ".wav", ".flac" and ".mp3"
       String fileName = file.name();
-      if (fileName.endsWith(".wav") || fileName.endsWith(".mp3"))
+      if (fileName.endsWith(".wav") || fileName.endsWith(".flac") || fileName.endsWith(".mp3"))
       {
         if (output != "[")
         {
@@ -292,50 +314,130 @@ void fsGenerateWavHeader(byte *header, unsigned long wavSize, int sampleRate = 1
   header[43] = (byte)((wavSize >> 24) & 0xFF);
 }
 
-void fsUpdateWavHeader(File file, unsigned long dataSize)
+// little endian, as everything in a RIFF file
+void fsPutLE(byte *dest, uint32_t value, int bytes)
 {
+  for (int i = 0; i < bytes; i++)
+    dest[i] = (byte)((value >> (8 * i)) & 0xFF);
+}
+
+// The header of a coded WAV file (IMA-ADPCM, u-law): the fmt chunk has the extra size (cbSize),
+// and the samples per block for ADPCM, then a fact chunk with the number of frames.
+// Returns the size of the header, the data chunk follows it.
+int fsGenerateCodecWavHeader(byte *header, unsigned long wavSize, CodecLayout *layout, int sampleRate, uint32_t sampleLength)
+{
+  int fmtSize = layout->format == WAV_FORMAT_IMA_ADPCM ? 20 : 18;
+  int headerSize = 12 + 8 + fmtSize + 12 + 8;
+
+  memcpy(header, "RIFF", 4);
+  fsPutLE(header + 4, wavSize + headerSize - 8, 4);
+  memcpy(header + 8, "WAVE", 4);
+
+  memcpy(header + 12, "fmt ", 4);
+  fsPutLE(header + 16, fmtSize, 4);
+  fsPutLE(header + 20, layout->format, 2);
+  fsPutLE(header + 22, layout->numChannels, 2);
+  fsPutLE(header + 24, sampleRate, 4);
+  // ByteRate of whole blocks, blockAlign bytes every samplesPerBlock frames
+  fsPutLE(header + 28, (uint32_t)((uint64_t)sampleRate * layout->blockAlign / layout->samplesPerBlock), 4);
+  fsPutLE(header + 32, layout->blockAlign, 2);
+  fsPutLE(header + 34, layout->bitsPerSample, 2);
+  fsPutLE(header + 36, fmtSize - 18, 2); // cbSize, the bytes that follow
+  if (layout->format == WAV_FORMAT_IMA_ADPCM)
+    fsPutLE(header + 38, layout->samplesPerBlock, 2);
+
+  byte *fact = header + 20 + fmtSize;
+  memcpy(fact, "fact", 4);
+  fsPutLE(fact + 4, 4, 4);
+  fsPutLE(fact + 8, sampleLength, 4);
+
+  memcpy(fact + 12, "data", 4);
+  fsPutLE(fact + 16, wavSize, 4);
+  return headerSize;
+}
+
+// Fix the sizes up once the recording is done, headerSize - the size of the written header.
+// A coded header also gets the number of frames of its fact chunk (just before the data chunk).
+void fsUpdateWavHeader(File file, unsigned long dataSize, int headerSize = wavHeaderSize, uint32_t sampleLength = 0)
+{
+  byte value[4];
   file.seek(4);
-  unsigned long riffSize = dataSize + wavHeaderSize - 8;
-  file.write((byte)(riffSize & 0xFF));
-  file.write((byte)((riffSize >> 8) & 0xFF));
-  file.write((byte)((riffSize >> 16) & 0xFF));
-  file.write((byte)((riffSize >> 24) & 0xFF));
+  fsPutLE(value, dataSize + headerSize - 8, 4);
+  file.write(value, 4);
+
+  if (headerSize > wavHeaderSize)
+  {
+    file.seek(headerSize - 12);
+    fsPutLE(value, sampleLength, 4);
+    file.write(value, 4);
+  }
 
-  file.seek(40);
-  file.write((byte)(dataSize & 0xFF));
-  file.write((byte)((dataSize >> 8) & 0xFF));
-  file.write((byte)((dataSize >> 16) & 0xFF));
-  file.write((byte)((dataSize >> 24) & 0xFF));
+  file.seek(headerSize - 4);
+  fsPutLE(value, dataSize, 4);
+  file.write(value, 4);
 }
 
+// Read the RIFF chunks up to the data chunk: the fmt chunk has the format, the others (fact, LIST) are skipped.
+// The file is left at the first sample.
 // bool fsEnsureWavHeader(File file) // deprecated
+// A FLAC or MP3 file is described as the PCM it decodes to, see fsEnsureFlacHeader and fsEnsureMp3Header.
 bool fsEnsureWavHeader(File file, WAVHeader *wavHeader = NULL)
 {
-  char header[wavHeaderSize];
-  if (file.read((uint8_t *)header, wavHeaderSize) != wavHeaderSize)
+  uint8_t riff[12];
+  size_t got = file.read(riff, sizeof(riff));
+  if (got >= 4 && strncmp((char *)riff, "fLaC", 4) == 0)
+    return fsEnsureFlacHeader(file, wavHeader);
+#if FS_MP3 == true
+  if (got >= 4 && (strncmp((char *)riff, "ID3", 3) == 0 || (riff[0] == 0xFF && (riff[1] & 0xE0) == 0xE0)))
+    return fsEnsureMp3Header(file, wavHeader);
+#endif
+  if (got != sizeof(riff) || strncmp((char *)riff, "RIFF", 4) != 0 || strncmp((char *)riff + 8, "WAVE", 4) != 0)
   {
     Serial.println("Invalid WAV file");
     return false;
   }
 
-  // Check "RIFF" and "WAVE" chunks
-  if (strncmp(header, "RIFF", 4) != 0 || strncmp(header + 8, "WAVE", 4) != 0)
+  uint8_t fmt[20] = {0};
+  bool hasFmt = false;
+  uint32_t dataOffset = 0;
+  uint32_t dataSize = 0;
+  uint8_t chunk[8];
+  while (dataOffset == 0 && file.read(chunk, sizeof(chunk)) == sizeof(chunk))
+  {
+    uint32_t chunkSize = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | (chunk[7] << 24);
+    uint32_t next = file.position() + chunkSize + (chunkSize & 1); // chunks are word aligned
+    if (strncmp((char *)chunk, "fmt ", 4) == 0)
+    {
+      hasFmt = file.read(fmt, min(chunkSize, (uint32_t)sizeof(fmt))) >= 16;
+      file.seek(next);
+    }
+    else if (strncmp((char *)chunk, "data", 4) == 0)
+    {
+      dataOffset = file.position();
+      dataSize = chunkSize;
+    }
+    else if (!file.seek(next))
+      break;
+  }
+  if (!hasFmt || dataOffset == 0)
   {
     Serial.println("Invalid WAV file");
     return false;
   }
 
-  // This caused some troubles with playing pcm32bit_44k.wav, hence comment this out...
-  // // Check audio format (should be PCM)
-  // int audioFormat = header[20] | (header[21] << 8);
-  // if (audioFormat != 1)
-  // {
-  //   Serial.println("Unsupported WAV format");
-  //   return false;
-  // }
+  // This caused some troubles with playing pcm32bit_44k.wav (WAVE_FORMAT_EXTENSIBLE), hence PCM is the default.
+  // Check audio format (PCM, or one of the coded formats we decode)
+  int audioFormat = fmt[0] | (fmt[1] << 8);
+  if (audioFormat == WAV_FORMAT_EXTENSIBLE)
+    audioFormat = WAV_FORMAT_PCM;
+  if (audioFormat != WAV_FORMAT_PCM && audioFormat != WAV_FORMAT_MULAW && audioFormat != WAV_FORMAT_IMA_ADPCM)
+  {
+    Serial.println("Unsupported WAV format");
+    return false;
+  }
 
   // Check number of channels (should be 1 or 2)
-  int numChannels = header[22] | (header[23] << 8);
+  int numChannels = fmt[2] | (fmt[3] << 8);
   if (numChannels != 1 && numChannels != 2)
   {
     Serial.println("Unsupported number of channels");
@@ -343,20 +445,33 @@ bool fsEnsureWavHeader(File file, WAVHeader *wavHeader = NULL)
   }
 
   // Check sample rate
-  int sampleRate = header[24] | (header[25] << 8) | (header[26] << 16) | (header[27] << 24);
+  int sampleRate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
   if (sampleRate < 8000 || sampleRate > 192000)
   {
     Serial.println("Unsupported sample rate");
     return false;
   }
 
-  // Check bits per sample
-  int bitsPerSample = header[34] | (header[35] << 8);
-  if (bitsPerSample != 16 && bitsPerSample != 32 && bitsPerSample != 24 && bitsPerSample != 8)
+  // Check bits per sample, and the blocks of IMA-ADPCM (groups of 8 samples of each channel after the block header)
+  int blockAlign = fmt[12] | (fmt[13] << 8);
+  int bitsPerSample = fmt[14] | (fmt[15] << 8);
+  int samplesPerBlock = 1;
+  if (audioFormat == WAV_FORMAT_IMA_ADPCM)
+  {
+    if (bitsPerSample != 4 || blockAlign <= 4 * numChannels || (blockAlign / numChannels - 4) % 4 != 0)
+    {
+      Serial.println("Unsupported IMA-ADPCM blocks");
+      return false;
+    }
+    samplesPerBlock = adpcmSamplesPerBlock(blockAlign, numChannels); // audioCODEC.h
+  }
+  else if (audioFormat == WAV_FORMAT_MULAW ? bitsPerSample != 8 : (bitsPerSample != 16 && bitsPerSample != 32 && bitsPerSample != 24 && bitsPerSample != 8))
   {
     Serial.println("Unsupported bits per sample");
     return false;
   }
+  else
+    blockAlign = bitsPerSample / 8 * numChannels;
 
   // Extract relevant information - get the pointer to a struct
   if (wavHeader != NULL)
@@ -364,10 +479,332 @@ bool fsEnsureWavHeader(File file, WAVHeader *wavHeader = NULL)
     wavHeader->sampleRate = (uint32_t)sampleRate;
     wavHeader->numChannels = (uint16_t)numChannels;
     wavHeader->bitsPerSample = (uint16_t)bitsPerSample;
+    wavHeader->audioFormat = (uint16_t)audioFormat;
+    wavHeader->blockAlign = (uint16_t)blockAlign;
+    wavHeader->samplesPerBlock = (uint16_t)samplesPerBlock;
+
+    // trust the size of the data chunk only if the file is that long
+    // (i.e. a recording that was cut short still has the reserved size)
+    uint32_t available = file.size() - dataOffset;
+    wavHeader->dataOffset = dataOffset;
+    wavHeader->dataSize = dataSize <= available ? dataSize : available;
   }
+  file.seek(dataOffset);
   return true;
 }
 
+/**
+ * FLAC files (audioFLAC.h): the fLaC marker, the STREAMINFO block, then a SEEKTABLE block and the frames.
+ * A recording has a seek point for every frame, the seek table is written with placeholders and filled in at the end.
+ */
+
+// the header of a recording with that many seek points
+uint32_t fsFlacHeaderSize(int seekPoints)
+{
+  return 4 + 4 + FLAC_STREAMINFO_SIZE + 4 + seekPoints * FLAC_SEEKPOINT_SIZE;
+}
+
+// Write the header of a recording from the start of the file: the format and the frames so far
+// (the seek points of the frames not written yet are placeholders). Returns its size, 0 on a failed write.
+uint32_t fsWriteFlacHeader(File file, FlacEncoder *enc)
+{
+  uint8_t block[4 + 4 + FLAC_STREAMINFO_SIZE + 4];
+  memcpy(block, "fLaC", 4);
+  flacPutBE(block + 4, FLAC_STREAMINFO_SIZE, 4); // type 0, not the last block
+  flacPutStreamInfo(block + 8, &enc->info);
+  flacPutBE(block + 8 + FLAC_STREAMINFO_SIZE, (0x83UL << 24) | (enc->seekPoints * FLAC_SEEKPOINT_SIZE), 4); // the last one, type 3
+  file.seek(0);
+  size_t written = file.write(block, sizeof(block));
+
+  // the seek points in small groups
+  uint8_t points[16 * FLAC_SEEKPOINT_SIZE];
+  for (int i = 0; i < enc->seekPoints;)
+  {
+    int n = 0;
+    for (; n < 16 && i < enc->seekPoints; n++, i++)
+    {
+      if ((uint32_t)i < enc->frameNumber)
+        flacPutSeekPoint(points + n * FLAC_SEEKPOINT_SIZE, (uint64_t)i * enc->blockSize, enc->seekOffsets[i], enc->blockSize);
+      else
+        flacPutSeekPoint(points + n * FLAC_SEEKPOINT_SIZE, FLAC_PLACEHOLDER, 0, 0);
+    }
+    written += file.write(points, n * FLAC_SEEKPOINT_SIZE);
+  }
+  uint32_t headerSize = fsFlacHeaderSize(enc->seekPoints);
+  return written == headerSize ? headerSize : 0;
+}
+
+// Walk the metadata blocks: the format, where the first frame is and the seek table (seekPoints 0 - none)
+bool fsReadFlacMeta(File file, FlacStreamInfo *info, uint32_t *firstFrame, uint32_t *seekTable, int *seekPoints)
+{
+  uint8_t marker[4];
+  file.seek(0);
+  if (file.read(marker, 4) != 4 || strncmp((char *)marker, "fLaC", 4) != 0)
+    return false;
+
+  bool hasInfo = false;
+  bool last = false;
+  *seekPoints = 0;
+  while (!last)
+  {
+    uint8_t header[4];
+    if (file.read(header, 4) != 4)
+      return false;
+    last = header[0] & 0x80;
+    int type = header[0] & 0x7F;
+    uint32_t length = (uint32_t)flacGetBE(header + 1, 3);
+    uint32_t next = file.position() + length;
+    if (type == 0)
+    {
+      uint8_t streamInfo[FLAC_STREAMINFO_SIZE];
+      if (length < FLAC_STREAMINFO_SIZE || file.read(streamInfo, FLAC_STREAMINFO_SIZE) != FLAC_STREAMINFO_SIZE)
+        return false;
+      hasInfo = flacParseStreamInfo(streamInfo, info); // audioFLAC.h
+      if (!hasInfo)
+      {
+        Serial.println("Unsupported FLAC stream");
+        return false;
+      }
+    }
+    else if (type == 3)
+    {
+      *seekTable = file.position();
+      *seekPoints = length / FLAC_SEEKPOINT_SIZE;
+    }
+    if (!file.seek(next))
+      return false;
+  }
+  *firstFrame = file.position();
+  return hasInfo;
+}
+
+// The format of a FLAC file as the PCM it decodes to: dataOffset 0 and dataSize of the decoded samples,
+// so the positions of the player are offsets in that PCM (the prefetch reader decodes, see playReadFlac in main.cpp).
+// The file is left at the first frame.
+bool fsEnsureFlacHeader(File file, WAVHeader *wavHeader)
+{
+  FlacStreamInfo info;
+  uint32_t firstFrame;
+  uint32_t seekTable;
+  int seekPoints;
+  if (!fsReadFlacMeta(file, &info, &firstFrame, &seekTable, &seekPoints) || info.totalSamples == 0)
+  {
+    Serial.println("Invalid FLAC file");
+    return false;
+  }
+
+  if (wavHeader != NULL)
+  {
+    wavHeader->sampleRate = info.sampleRate;
+    wavHeader->numChannels = info.numChannels;
+    wavHeader->bitsPerSample = info.bitsPerSample;
+    wavHeader->audioFormat = WAV_FORMAT_FLAC;
+    wavHeader->blockAlign = info.bitsPerSample / 8 * info.numChannels;
+    wavHeader->samplesPerBlock = 1;
+    wavHeader->dataOffset = 0;
+    wavHeader->dataSize = (uint32_t)min(info.totalSamples * wavHeader->blockAlign, (uint64_t)UINT32_MAX);
+  }
+  file.seek(firstFrame);
+  return true;
+}
+
+// Move the file to the frame of a sample (the last seek point before it, or the first frame without a seek table).
+// landed - the first sample of that frame, the decoder drops the ones before the sample.
+bool fsFlacSeek(File file, FlacStreamInfo *info, uint64_t sample, uint64_t *landed)
+{
+  uint32_t firstFrame;
+  uint32_t seekTable;
+  int seekPoints;
+  if (!fsReadFlacMeta(file, info, &firstFrame, &seekTable, &seekPoints))
+    return false;
+
+  uint64_t offset = 0;
+  *landed = 0;
+  file.seek(seekTable);
+  for (int i = 0; i < seekPoints; i++)
+  {
+    uint8_t point[FLAC_SEEKPOINT_SIZE];
+    if (file.read(point, FLAC_SEEKPOINT_SIZE) != FLAC_SEEKPOINT_SIZE)
+      break;
+    uint64_t pointSample = flacGetBE(point, 8);
+    if (pointSample == FLAC_PLACEHOLDER || pointSample > sample)
+      break; // sorted, the placeholders come last
+    *landed = pointSample;
+    offset = flacGetBE(point + 8, 8);
+  }
+  return file.seek(firstFrame + offset);
+}
+
+#if FS_MP3 == true
+/**
+ * MP3 files (audioMP3.h): an optional ID3v2 tag, the frames, an optional ID3v1 tag (128 bytes, "TAG").
+ * The length is the frame count of a Xing/Info header (VBR), or the audio bytes over the frame size (CBR).
+ */
+
+// The format of the first frame, where the frames are and how many there are
+bool fsReadMp3Meta(File file, Mp3FrameHeader *header, uint32_t *audioStart, uint32_t *audioBytes, uint32_t *frames)
+{
+  uint8_t buf[512];
+  file.seek(0);
+  if (file.read(buf, 10) != 10)
+    return false;
+  uint32_t start = mp3Id3Size(buf);
+
+  // the first valid frame header, close to the start
+  bool found = false;
+  uint32_t at = start;
+  while (!found && at < start + MP3_HEADER_SCAN)
+  {
+    file.seek(at);
+    int len = file.read(buf, sizeof(buf));
+    if (len < 4)
+      return false;
+    int i = 0;
+    while (i <= len - 4 && !mp3ParseHeader(buf + i, header))
+      i++;
+    found = i <= len - 4;
+    at += found ? i : len - 3;
+  }
+  if (!found)
+    return false;
+
+  // the frame count of a VBR file, from the first frame (it starts the buffer now)
+  file.seek(at);
+  int len = file.read(buf, sizeof(buf));
+  uint32_t end = file.size();
+  uint8_t tag[3];
+  if (end >= at + 128 && file.seek(end - 128) && file.read(tag, 3) == 3 && strncmp((char *)tag, "TAG", 3) == 0)
+    end -= 128;
+  *audioStart = at;
+  *audioBytes = end - at;
+  *frames = mp3XingFrames(buf, len, header);
+  if (*frames == 0)
+    *frames = (*audioBytes + header->frameBytes - 1) / header->frameBytes; // CBR, a few frames off at most
+  return true;
+}
+
+// The format of an MP3 file as the 16-bit PCM it decodes to: dataOffset 0, and dataSize of its frames,
+// one frame more than it counts, the player ends when the decoder does. The file is left at the first frame.
+bool fsEnsureMp3Header(File file, WAVHeader *wavHeader)
+{
+  Mp3FrameHeader header;
+  uint32_t audioStart;
+  uint32_t audioBytes;
+  uint32_t frames;
+  if (!fsReadMp3Meta(file, &header, &audioStart, &audioBytes, &frames))
+  {
+    Serial.println("Invalid MP3 file");
+    return false;
+  }
+
+  if (wavHeader != NULL)
+  {
+    wavHeader->sampleRate = header.sampleRate;
+    wavHeader->numChannels = header.numChannels;
+    wavHeader->bitsPerSample = 16;
+    wavHeader->audioFormat = WAV_FORMAT_MP3;
+    wavHeader->blockAlign = 2 * header.numChannels;
+    wavHeader->samplesPerBlock = 1;
+    wavHeader->dataOffset = 0;
+    wavHeader->dataSize = (frames + 1) * header.samples * wavHeader->blockAlign;
+  }
+  file.seek(audioStart);
+  return true;
+}
+
+// Move the file to the byte of a PCM offset (see fsEnsureMp3Header), in proportion to the audio bytes:
+// exact for CBR, close for VBR. The decoder looks for the next frame from there.
+bool fsMp3Seek(File file, WAVHeader *wavHeader, uint32_t pcmOffset)
+{
+  Mp3FrameHeader header;
+  uint32_t audioStart;
+  uint32_t audioBytes;
+  uint32_t frames;
+  if (!fsReadMp3Meta(file, &header, &audioStart, &audioBytes, &frames))
+    return false;
+  return file.seek(audioStart + (uint64_t)pcmOffset * audioBytes / wavHeader->dataSize);
+}
+#endif // FS_MP3
+
+// IMA-ADPCM and u-law are decoded to 16-bit PCM on playback, FLAC and MP3 already by the prefetch reader
+bool fsWavIsCoded(WAVHeader *wavHeader)
+{
+  return wavHeader->audioFormat == WAV_FORMAT_IMA_ADPCM || wavHeader->audioFormat == WAV_FORMAT_MULAW;
+}
+
+// the layout of the blocks of a coded file, for codecDecode (audioCODEC.h)
+void fsWavCodecLayout(WAVHeader *wavHeader, CodecLayout *layout)
+{
+  layout->format = wavHeader->audioFormat;
+  layout->numChannels = wavHeader->numChannels;
+  layout->blockAlign = wavHeader->blockAlign;
+  layout->samplesPerBlock = wavHeader->samplesPerBlock;
+  layout->bitsPerSample = wavHeader->bitsPerSample;
+}
+
+// the same samples format, the files can be played back to back as a single stream
+bool fsWavSameFormat(WAVHeader *a, WAVHeader *b)
+{
+  return a->sampleRate == b->sampleRate && a->numChannels == b->numChannels && a->bitsPerSample == b->bitsPerSample &&
+         a->audioFormat == b->audioFormat && a->blockAlign == b->blockAlign;
+}
+
+// bytes of a single frame (one sample of every channel), or of a whole IMA-ADPCM block
+uint32_t fsWavFrameSize(WAVHeader *wavHeader)
+{
+  return wavHeader->blockAlign;
+}
+
+uint32_t fsWavDurationMs(WAVHeader *wavHeader)
+{
+  uint64_t frames = (uint64_t)(wavHeader->dataSize / fsWavFrameSize(wavHeader)) * wavHeader->samplesPerBlock;
+  return (uint32_t)(frames * 1000 / wavHeader->sampleRate);
+}
+
+// time position of a byte offset in the file
+uint32_t fsWavPositionMs(WAVHeader *wavHeader, uint32_t offset)
+{
+  if (offset <= wavHeader->dataOffset)
+    return 0;
+  uint64_t frames = (uint64_t)((offset - wavHeader->dataOffset) / fsWavFrameSize(wavHeader)) * wavHeader->samplesPerBlock;
+  return (uint32_t)(frames * 1000 / wavHeader->sampleRate);
+}
+
+// byte offset of a time position, on a frame (block) boundary and within the data chunk
+uint32_t fsWavSeekOffset(WAVHeader *wavHeader, uint32_t positionMs)
+{
+  uint32_t frameSize = fsWavFrameSize(wavHeader);
+  uint64_t block = (uint64_t)positionMs * wavHeader->sampleRate / 1000 / wavHeader->samplesPerBlock;
+  uint32_t blocks = wavHeader->dataSize / frameSize;
+  if (block > blocks)
+    block = blocks;
+  return wavHeader->dataOffset + (uint32_t)block * frameSize;
+}
+
+// a file that belongs to an audio file sits next to it, with another extension: "/recording.wav" -> "/recording.spg"
+String fsSidecarPath(String path, const char *extension)
+{
+  int dot = path.lastIndexOf('.');
+  return (dot < 0 ? path : path.substring(0, dot)) + extension;
+}
+
+// the metadata of an audio file sits next to it, in json format: "/recording.wav" -> "/recording.json"
+String fsMetaPath(String path)
+{
+  return fsSidecarPath(path, ".json");
+}
+
+// write a small text file in one go, it replaces the previous content
+bool fsWriteText(String path, const String &text)
+{
+  File file = FS_TYPE.open(path, FILE_WRITE);
+  if (!file)
+    return false;
+  size_t written = file.print(text);
+  file.close();
+  return written == text.length();
+}
+
 // For the debugging reason, let's print out the values on the buffer.
 void fsPrintBuffer(uint8_t *buf, int length)
 {
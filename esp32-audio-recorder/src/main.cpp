@@ -30,13 +30,28 @@ Test scenario:
 #include <ESPAsyncWebServer.h> // includes AsyncTCP and WiFi when ESP32 is defined
 #include <ESPmDNS.h>           // to find our device via host-name
 #include <AsyncJson.h>         // let's try sending messages in json format
+#include <WiFiUdp.h>           // the network load of the DMA calibration
 
 // #include <semphr.h> // limit concurrent requests
 
 // our definitions and wrappers from Diana-audio-utils
 #include "secrets.h"
+#define FS_MP3 true // .mp3 playback, arduino-libhelix is in the lib_deps of platformio.ini
 #include "fsFLASH.h"
-#include "audioSTD.h"
+#include "audioSTD.h" // includes audioWIRE.h and audioCONV.h
+#include "audioRING.h"
+#include "audioSRC.h"
+#include "audioMIX.h" // after audioSRC.h
+#include "audioDEV.h"
+#include "audioCMD.h"
+#include "audioTUNE.h"
+#include "audioARM.h"
+#include "audioVAD.h"
+#include "audioNR.h"
+#include "audioSPEC.h"
+#include "audioLOUD.h"
+#include "audioPEAK.h" // after audioSPEC.h and audioLOUD.h
+#include "audioDSP.h" // after audioNR.h
 #include <esp_wpa2.h>
 
 #define LED LED_BUILTIN
@@ -45,7 +60,31 @@ Test scenario:
 #define MIC_I2S_TASK_STACK (4 * 1024) // The size of the stack on this TASK is 4096 = 1024*4
 #define MIC_I2S_TASK_PRIORITY (1)     // Keep the priority 5 for now.
 #define DAC_I2S_TASK_STACK (4 * 1024)
-#define DAC_I2S_TASK_PRIORITY (1)
+#define DAC_I2S_TASK_PRIORITY (5)      // above the prefetch reader, the DAC must never run dry
+#define DAC_PREFETCH_TASK_STACK (3 * 1024)
+#define DAC_PREFETCH_TASK_PRIORITY (1)
+#define MP3_DECODE_TASK_STACK (6 * 1024) // the prefetch reader of an MP3 file decodes it, Helix needs more stack
+#define MP3_DECODE_TASK_PRIORITY (2)
+#define MP3_DECODE_TASK_CORE (0) // next to the web server, the DAC and the mic stay alone on core 1
+
+// Audio engine: routes the commands to the device workers, above them so a stop gets through while they run
+#define ENGINE_TASK_STACK (3 * 1024)
+#define ENGINE_TASK_PRIORITY (6)
+
+// Recording pipeline task definitions, the recording task itself is the flash writer
+#define MIC_CAPTURE_TASK_STACK (4 * 1024)
+#define MIC_CAPTURE_TASK_PRIORITY (10) // above the web server and the writer, the I2S DMA must never overflow
+#define REC_DSP_TASK_STACK (4 * 1024)
+#define REC_DSP_TASK_PRIORITY (5)
+
+// Overlay loader: reads the clip of an overlay into RAM next to the web server, off the core of the DAC
+#define OVERLAY_LOAD_TASK_STACK (3 * 1024)
+#define OVERLAY_LOAD_TASK_PRIORITY (1)
+#define OVERLAY_LOAD_TASK_CORE (0)
+
+// DMA calibration, the trial capture runs as MIC_CAPTURE_TASK, the load as the flash writer
+#define TUNE_LOAD_TASK_STACK (3 * 1024)
+#define TUNE_LOAD_TASK_PRIORITY (1)
 
 File file_out;        // holds the recent uploaded file
 int record_time = 20; // seconds
@@ -53,6 +92,7 @@ int record_time = 20; // seconds
 // File path can be 31 characters maximum in SPIFFS
 String audio_dir = "/";
 String filename_out = audio_dir + "recording.wav";
+String filename_flac = audio_dir + "recording.flac"; // the same recording in the lossless format
 String filename_in = audio_dir + "recording_spiffs.wav";
 
 // Replace with your network credentials, defined in secrets.h
@@ -66,15 +106,135 @@ int counter = 0;
 
 // Create AsyncWebServer object on port 80
 AsyncWebServer server(80);
-
-// PLAY: task for playing the audio, when done, backs to NULL
-TaskHandle_t playbackTaskHandle = NULL;
-TaskHandle_t recordingTaskHandle = NULL;
-// since the play is on esp itself, we allow only one at a time
-SemaphoreHandle_t audioMutex;
+// the live level and spectrum of the mic, binary frames of audioSPEC.h
+AsyncWebSocket spectrumWs("/ws/spectrum");
+SpecState micSpectrum;
+volatile int specClients = 0;     // connected to /ws/spectrum, the capture tasks measure only for them
+volatile bool meterYield = false; // the DAC worker waits for the mic, the meter of an idle mic gives it back
+
+// ENGINE: web handlers -> engineQueue -> engine task -> playQueue/recQueue -> device workers
+// the engine and its workers are created once, no task is created per request
+QueueHandle_t engineQueue;
+QueueHandle_t playQueue;                // jobs of the DAC worker (play, monitor), one at a time
+QueueHandle_t recQueue;                 // jobs of the mic worker
+volatile bool playerActive = false;     // the DAC worker runs a job
+volatile bool recorderActive = false;   // the mic worker runs a job
+volatile bool monitorActive = false;    // the DAC worker holds the mic too
+TaskHandle_t playerTaskHandle = NULL;   // the DAC worker, takes the transport commands as notifications
+volatile bool micStopRequested = false; // interrupt the current recording
+// each I2S device serves one task at a time, devices on a shared port share the mutex
+SemaphoreHandle_t micMutex;
+SemaphoreHandle_t dacMutex;
 // implement a semaphore to limit the number of concurrent uploads
 SemaphoreHandle_t uploadSemaphore;
 
+// RECORD: capture task -> recRing -> (DSP task -> recDspRing) -> writer
+AudioRing recRing;
+AudioRing recDspRing;
+uint8_t *recDspRawBuff = NULL; // the blocks of the DSP task, allocated before it starts (startRecordingPipeline)
+uint8_t *recDspOutBuff = NULL;
+volatile bool recStopRequested = false;
+TaskHandle_t recWriterHandle = NULL; // notified by each pipeline task on exit
+int recPipelineTasks = 0;            // number of pipeline tasks still running
+unsigned long recMaxWriteTime = 0;   // the longest flash write of the last recording, in us
+unsigned long recDroppedBytes = 0;   // audio lost in the rings (full) during the last recording
+ConvFn recConvert = NULL;            // the sample conversion kernel of the current recording
+
+// RECORDING FORMAT: chosen per request (/record rate, bits, channels or preset), the mic is clocked at the file rate
+struct RecFormat
+{
+  uint32_t sampleRate;
+  int bitsPerSample; // of the WAV file: 16, 24 (packed) or 32, of the samples before coding (16) for a coded one
+  int numChannels;   // 1, or 2 - two INMP441 on L/R
+  int audioFormat;   // WAV_FORMAT_PCM, or coded: WAV_FORMAT_IMA_ADPCM (4x smaller), WAV_FORMAT_MULAW (2x), WAV_FORMAT_FLAC (lossless, a .flac file)
+};
+struct RecPreset
+{
+  const char *name;
+  RecFormat format;
+};
+const RecPreset recPresets[] = {
+    {"low", {8000, 16, 1, WAV_FORMAT_PCM}},                                                 // voice notes, 16 KB/s
+    {"standard", {MIC_SAMPLE_RATE, MIC_SAMPLE_BITS_HDR, MIC_CHANNEL_NUM, WAV_FORMAT_PCM}}, // the default
+    {"hires", {48000, 24, 1, WAV_FORMAT_PCM}},                                              // clinical auscultation, 144 KB/s
+    {"stereo", {44100, 16, 2, WAV_FORMAT_PCM}},                                             // two microphones, 172 KB/s
+    {"long", {16000, 16, 1, WAV_FORMAT_IMA_ADPCM}},                                         // 4x longer, 8 KB/s
+    {"phone", {8000, 16, 1, WAV_FORMAT_MULAW}},                                             // G.711, 8 KB/s
+    {"archive", {48000, 24, 1, WAV_FORMAT_FLAC}}};                                          // lossless, about half of hires
+RecFormat recFormat = {MIC_SAMPLE_RATE, MIC_SAMPLE_BITS_HDR, MIC_CHANNEL_NUM, WAV_FORMAT_PCM}; // the current (or last) recording
+CodecEncoder recEncoder;              // the coder of a coded recording, audioCODEC.h
+FlacEncoder recFlac;                  // the coder of a FLAC recording, audioFLAC.h
+size_t recFramesLeft = 0;             // frames still to record, the end of a recording of unknown size (FLAC)
+bool recDspActive = false;            // REC_DSP_TASK, but not while armed (the pre-roll takes the raw blocks)
+bool recVadRequested = REC_VAD;       // vad= of the current recording
+VadState recVad;                      // the silence dropped from the current recording, audioVAD.h
+int recDspProfile = 0;                // dsp= of the current recording, dspProfiles of audioDSP.h
+DspChain recDspChain;                 // the filters of the current recording, on the raw samples
+bool recNrRequested = REC_NR;         // nr= of the current recording
+NrState recNr;                        // the noise suppression of the current recording, a stage of recDspChain
+PeakState *recPeaks = NULL;           // the waveform of the current recording, audioPEAK.h
+int recHeaderSize = wavHeaderSize;    // the WAV header of the current recording, longer for a coded one
+int recCaptureBits = MIC_SAMPLE_BITS; // I2S slot width of the current recording
+size_t recCaptureBlock = BUFF_SIZE;   // one DMA buffer of captured frames
+size_t recRawBlock = REC_WRITE_BLOCK; // captured bytes per written block (whole frames)
+size_t recOutBlock = REC_WRITE_BLOCK; // the same block in the file format
+size_t recProcessMax = REC_WRITE_BLOCK; // the largest output of recProcessBlock, more than recOutBlock for FLAC
+
+// PLAY: prefetch task -> playRing -> DAC task
+AudioRing playRing;
+TaskHandle_t playDacHandle = NULL; // notified by the prefetch task on exit
+volatile bool playReaderStop = false;  // the prefetch reader quits after its current block
+bool playReaderRunning = false;
+File playReaderFile;                   // owned by the reader while it runs
+WAVHeader playReaderHeader;            // the format of playReaderFile
+uint32_t playDataEnd = 0;              // the reader stops at the end of the data chunk
+uint32_t playReaderPcmPos = 0;         // where a FLAC or MP3 reader starts, in the PCM it decodes to (see playReaderSeek)
+Mp3Load playMp3Load;                   // the CPU load of the MP3 decoding, audioMP3.h
+int playDspProfile = 0;                // dsp= of the current playback, dspProfiles of audioDSP.h
+DspChain playDspChain;                 // the filters of the current playback, on the DAC samples
+// PLAY gapless: the reader chains the next queued file of the same format, one file ahead of the DAC
+AudioCmd playChainCmd;
+WAVHeader playChainHeader;
+float playChainLevelDb = 0;            // the normalisation of the chained file, dB
+volatile bool playChainPending = false; // the reader is in playChainCmd, the DAC didn't reach it yet
+volatile uint32_t playBytePos = 0;     // file offset of the next byte the DAC task takes from the ring
+
+// PLAY transport: the web handlers notify the DAC worker directly, nothing waits in a queue
+#define PLAY_NOTIFY_STOP (1 << 0)
+#define PLAY_NOTIFY_PAUSE (1 << 1)
+#define PLAY_NOTIFY_RESUME (1 << 2)
+#define PLAY_NOTIFY_SEEK (1 << 3)
+#define PLAY_NOTIFY_TRANSPORT (PLAY_NOTIFY_STOP | PLAY_NOTIFY_PAUSE | PLAY_NOTIFY_RESUME | PLAY_NOTIFY_SEEK)
+#define PLAY_NOTIFY_READER_DONE (1 << 4) // from the prefetch task
+volatile uint32_t playSeekMs = 0;      // the target of PLAY_NOTIFY_SEEK
+volatile bool playPaused = false;
+volatile uint32_t playPositionMs = 0;  // for the GUI progress bar
+volatile uint32_t playDurationMs = 0;
+char playFile[CMD_PATH_LEN] = "";      // the file on the DAC, empty when nothing plays
+Resampler playResampler;           // file rate -> DAC_FIXED_RATE
+Mixer playMixer;                   // the volumes, and the overlays over the playback (/volume, audioMIX.h)
+
+// the clip of an overlay read by overlayLoadTask, one at a time, handed to the mixer by the engine
+struct OverlayLoad
+{
+  AudioCmd cmd;
+  WAVHeader header;
+  uint8_t *data;
+  size_t bytes;
+};
+OverlayLoad overlayLoad;
+volatile bool overlayLoading = false;
+
+// MONITOR: mic -> DAC in small blocks, a job of the DAC worker
+Resampler monResampler;             // MIC_SAMPLE_RATE -> DAC rate
+unsigned long monMaxBlockTime = 0;  // the longest mic block -> DAC processing, in us
+int64_t monLoopbackLatency = -1;    // us, from the DAC driver to the mic driver (acoustic loopback), -1 - not measured
+
+// CALIBRATE: the DMA geometry sweep, a job of the DAC worker like the monitor (audioTUNE.h)
+volatile bool tuneTrialStop = false;    // the trial tasks quit
+SemaphoreHandle_t tuneTaskDone = NULL;  // given by each trial task on exit
+size_t tuneCaptureBlock = 0;            // one mic DMA buffer of the trial format
+
 // put function declarations here:
 
 // each POST request has 3 handlers - onRequest, onUpload and onBody
@@ -82,19 +242,86 @@ void onUpload(AsyncWebServerRequest *, String, size_t, uint8_t *, size_t, bool);
 void handleRecordingRequest(AsyncWebServerRequest *);
 void handlePlayRequest(AsyncWebServerRequest *);
 void handleDeleteRequest(AsyncWebServerRequest *);
+void handleMonitorRequest(AsyncWebServerRequest *);
+void handleCalibrateRequest(AsyncWebServerRequest *);
+void handleArmRequest(AsyncWebServerRequest *);
+void handleDenoiseRequest(AsyncWebServerRequest *);
+void handleSpectrogramRequest(AsyncWebServerRequest *);
+void handlePeaksRequest(AsyncWebServerRequest *);
+void handleVolumeRequest(AsyncWebServerRequest *);
+void handleStopRequest(AsyncWebServerRequest *);
+void handleTransportRequest(AsyncWebServerRequest *);
+void handleQueueRequest(AsyncWebServerRequest *, JsonVariant &);
+bool micBusy();
+bool dacBusy();
 
 String getAudioPath(String);
 String extractParam(AsyncWebServerRequest *, String, bool);
-String extractFilePath(AsyncWebServerRequest *);
+String extractFilePath(AsyncWebServerRequest *, bool post = true); // a GET route has file= in the query
+String extractOptionalParam(AsyncWebServerRequest *, String, bool);
+AudioCmdPriority extractPriority(AsyncWebServerRequest *);
 unsigned long getFlashRecordSize();
-
-void playingTask(void *);
+unsigned long recDataSize(RecFormat *, int);
+bool extractRecFormat(AsyncWebServerRequest *, AudioCmd *);
+bool recCheckSpace(AsyncWebServerRequest *, AudioCmd *);
+bool extractRecVad(AsyncWebServerRequest *);
+bool extractRecNr(AsyncWebServerRequest *);
+bool extractDspProfile(AsyncWebServerRequest *, AudioCmd *);
+
+void engineTask(void *);
+void playerTask(void *);
+void recorderTask(void *);
 void playWavRecording(String);
-void recordingTask(void *);
+void dacPrefetchTask(void *);
+void playReaderSeek(uint32_t);
+void playReadFlac(uint8_t *);
+void playReadMp3();
+uint32_t playTakeBits(uint32_t, TickType_t);
+bool playTransportPending();
+void playWriteDac(uint8_t *, size_t, int);
+bool playStartReader();
+void playStopReader();
+bool playReaderAt(WAVHeader);
+bool playChainNext();
+bool playTakeChained();
+void playLoadOverlay(AudioCmd *);
+void playAddOverlay();
+void overlayLoadTask(void *);
+void recordJob();
+void armJob(AudioCmd *);
+void denoiseJob(AudioCmd *);
+void spectrogramJob(AudioCmd *);
+bool spectrogramFresh(String, uint32_t);
+void removeSidecars(String);
+bool writePeaks(PeakState *, String);
+bool writeLoudness(PeakState *, String);
+float playLevelDb(String);
+void uploadPeaks(AsyncWebServerRequest *, String, size_t, size_t, bool);
+void meterJob();
+bool micTakeFromMeter(SemaphoreHandle_t);
+void onSpectrumEvent(AsyncWebSocket *, AsyncWebSocketClient *, AwsEventType, void *, uint8_t *, size_t);
+bool recAcquireMic();
+void recFinishFile(unsigned long, unsigned long);
 bool prepareForRecording();
-unsigned long recordWav();  // based on Tom's code
-unsigned long _recordWav(); // original
+String recPath();
+bool recWriteMeta(String, unsigned long);
+unsigned long recordWav(PreRoll *preroll = NULL); // the writer stage of the recording pipeline
+int recSelectCaptureBits(RecFormat *);
+ConvFn recSelectKernel(RecFormat *, int);
+size_t recProcessBlock(uint8_t *, uint8_t *, size_t);
+void micCaptureTask(void *);
+void recDspTask(void *);
+bool startRecordingPipeline();
+void stopRecordingPipeline();
 void cleanupRecording(bool, bool);
+void monitorJob(bool);
+void monitorLive();
+void monitorLoopback();
+void tuneJob(AudioCmd *);
+void tuneSweep(AudioCmd *);
+bool tuneTrial(RecFormat *, int, int);
+void tuneCaptureTask(void *);
+void tuneLoadTask(void *);
 
 void setup()
 {
@@ -115,10 +342,28 @@ void setup()
   // Before and After recording, check whether the file exists and size.
   fsListFiles();
 
-  // SETUP DAC and MIC on demand
+  // the calibrated DMA geometry (audioTUNE.h), the defaults until the devices are calibrated
+  DmaGeometry geometry;
+  if (tuneLoad("mic", &geometry))
+    devSetGeometry(&micDevice, geometry.bufCount, geometry.bufLen); // audioDEV.h
+  if (tuneLoad("dac", &geometry))
+    devSetGeometry(&dacDevice, geometry.bufCount, geometry.bufLen);
+  Serial.printf("DMA geometry: mic %d x %d, DAC %d x %d\n", devBufCount(&micDevice), devBufLen(&micDevice), devBufCount(&dacDevice), devBufLen(&dacDevice));
+
+  // SETUP MIC and DAC once, they stay installed and warm (on a shared port the mic wins)
   Serial.println("Init I2S...");
   // delay(1000);
-  Serial.println("I2S will we configured on demand only");
+  if (AUDIO_FULL_DUPLEX && DAC_FIXED_RATE > 0)
+  {
+    if (devAcquireDac(DAC_FIXED_RATE, 16, 2) == ESP_OK) // audioDEV.h
+      Serial.println("DAC I2S ready");
+    else
+      Serial.println("Failed to initialize DAC I2S, will retry on demand");
+  }
+  if (devAcquireMic(MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, MIC_CHANNEL_NUM) == ESP_OK) // audioDEV.h
+    Serial.println("Microphone I2S primed");
+  else
+    Serial.println("Failed to initialize MIC I2S, will retry on demand");
 
   // WIFI INIT
   Serial.println("\nInit WiFi...");
@@ -177,7 +422,17 @@ void setup()
   Serial.println("\nInit local web server...");
   // delay(1000);
   uploadSemaphore = xSemaphoreCreateCounting(3, 3); // Allow up to 3 concurrent uploads
-  audioMutex = xSemaphoreCreateMutex();
+  micMutex = xSemaphoreCreateMutex();
+  dacMutex = AUDIO_FULL_DUPLEX ? xSemaphoreCreateMutex() : micMutex;
+
+  // the audio engine and its device workers live as long as the device
+  engineQueue = xQueueCreate(ENGINE_QUEUE_LEN, sizeof(AudioCmd));
+  playQueue = xQueueCreate(PLAY_QUEUE_LEN, sizeof(AudioCmd));
+  recQueue = xQueueCreate(REC_QUEUE_LEN, sizeof(AudioCmd));
+  mixInit(&playMixer, PLAY_VOLUME / 100.0); // audioMIX.h
+  xTaskCreatePinnedToCore(engineTask, "Audio engine", ENGINE_TASK_STACK, NULL, ENGINE_TASK_PRIORITY, NULL, 1);
+  xTaskCreatePinnedToCore(playerTask, "Player", DAC_I2S_TASK_STACK, NULL, DAC_I2S_TASK_PRIORITY, &playerTaskHandle, 1);
+  xTaskCreatePinnedToCore(recorderTask, "Recorder", MIC_I2S_TASK_STACK, NULL, MIC_I2S_TASK_PRIORITY, NULL, 1);
 
   // CORS handlers
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
@@ -240,17 +495,107 @@ void setup()
 
   // Route to play on ESP using DAC module
   // we support only WAV files here, the filename must be provided
+  // queue=true waits in line instead of 409 when busy, priority=urgent interrupts the current playback
+  // overlay=true mixes a short PCM WAV file into the current playback (a chime), volume=0..100, fade=ms to fade in
   server.on("/play", HTTP_POST, handlePlayRequest);
 
-  // Route to record WAV file via a microphone attached to ESP
+  // Route to set a volume, volume=0..100 (%), source=0 the playback, 1-3 its overlays, none - the master
+  // fade=ms ramps to it, a fade of an overlay to 0 ends it
+  server.on("/volume", HTTP_POST, handleVolumeRequest);
+
+  // Route to get the volumes and the overlays of the playback, with the cost of the mixing, in json format
+  server.on("/volume", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", mixGetState(&playMixer)); }); // audioMIX.h
+
+  // Route to record WAV file via a microphone attached to ESP, same queue and priority as /play
   server.on("/record", HTTP_POST, handleRecordingRequest);
 
+  // Route to arm a recording: the mic fills a pre-roll until a trigger, the recording starts seconds before it
+  // action=start with the format of /record, time (after the trigger), preroll (seconds) and threshold (dBFS)
+  // action=trigger commits the pre-roll now, action=stop disarms
+  server.on("/arm", HTTP_POST, handleArmRequest);
+
+  // Route to get the state of the armed recording, with the level of the mic, in json format
+  server.on("/arm", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", armGetState(&armState)); }); // audioARM.h
+
+  // Route to suppress the steady noise of a stored mono PCM WAV file into "<name>-nr.wav", file=, on the mic worker
+  server.on("/denoise", HTTP_POST, handleDenoiseRequest);
+
+  // Route to get the state of the last /denoise, with its real-time factor, in json format
+  server.on("/denoise", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", nrGetJobState(&nrJob)); }); // audioNR.h
+
+  // Route to get the spectrogram of a stored PCM WAV file, file=, binary (audioSPEC.h), cached in "<name>.spg"
+  // 202 with the state of the job in json format while the mic worker makes it, try again later
+  server.on("/spectrogram", HTTP_GET, handleSpectrogramRequest);
+
+  // Route to get the waveform of a stored file, file=, min/max peaks at 3 resolutions, binary (audioPEAK.h)
+  // made while recording or uploading a PCM WAV file, kept in "<name>.pk"
+  server.on("/peaks", HTTP_GET, handlePeaksRequest);
+
+  // WebSocket of the live mic level and spectrum, 5 binary frames per second (audioSPEC.h)
+  // the mic runs for it while idle, and a recording, an armed mic or the monitor feed it too
+  spectrumWs.onEvent(onSpectrumEvent);
+  server.addHandler(&spectrumWs);
+
+  // Route to stop the current job and drop the waiting ones, device=mic|dac (both by default)
+  server.on("/stop", HTTP_POST, handleStopRequest);
+
+  // Route to play a list of WAV files back to back, in json format: {"files": ["/a.wav", "/b.wav"]}
+  // consecutive files of the same format are played gapless
+  server.addHandler(new AsyncCallbackJsonWebHandler("/queue", handleQueueRequest));
+
+  // Route to control the current playback, action=pause|resume|stop|seek, position=ms for seek
+  server.on("/transport", HTTP_POST, handleTransportRequest);
+
+  // Route to get the playback position and duration (ms), for the GUI progress bar
+  server.on("/position", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    String state = (playFile[0] == 0) ? "idle" : playPaused ? "paused" : "playing";
+    String output = "{\"file\":\"" + String(playFile) + "\",\"state\":\"" + state + "\"";
+    output += ",\"position\":" + String(playPositionMs);
+    output += ",\"duration\":" + String(playDurationMs);
+    if (String(playFile).endsWith(".mp3"))
+      output += ",\"decoder\":" + mp3GetLoad(&playMp3Load); // audioMP3.h
+    output += "}";
+    request->send(200, "application/json", output); });
+
+  // Route to listen to the microphone through the speaker, or to measure the loopback latency
+  // action=start|stop|loopback
+  server.on("/monitor", HTTP_POST, handleMonitorRequest);
+
+  // Route to calibrate the DMA geometry of the devices, and keep it in NVS
+  // action=start with the format of /record (preset, rate, bits, channels) and trial_ms, action=reset
+  server.on("/calibrate", HTTP_POST, handleCalibrateRequest);
+
+  // Route to get the state and the result of the calibration, in json format
+  server.on("/calibrate", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", tuneGetState(&tuneState)); }); // audioTUNE.h
+
   // Route to get the i2s status,
   // whether currently busy (playing/recording) or ready to accept the task
+  // device=mic|dac asks about a single device, they are independent in full duplex
   server.on("/status", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-    String status = (playbackTaskHandle != NULL || recordingTaskHandle != NULL) ? "busy" : "ready";
-    request->send(200, "text/plain", status); });
+    String device = request->hasParam("device") ? request->getParam("device")->value() : emptyString;
+    bool busy = (device == "mic") ? micBusy() : (device == "dac") ? dacBusy() : (micBusy() || dacBusy());
+    request->send(200, "text/plain", busy ? "busy" : "ready"); });
+
+  // Route to get the counters of the last recording and playback pipelines, in json format
+  server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    String stats = "{\"capture\":" + ringGetStats(&recRing);
+    stats += ",\"dsp\":" + ringGetStats(&recDspRing);
+    stats += ",\"maxWriteTime\":" + String(recMaxWriteTime);
+    stats += ",\"recordDsp\":" + dspGetStats(&recDspChain); // audioDSP.h
+    stats += ",\"playDsp\":" + dspGetStats(&playDspChain);
+    stats += ",\"playback\":" + ringGetStats(&playRing);
+    stats += ",\"mic\":" + devGetStats(&micDevice);
+    stats += ",\"dac\":" + devGetStats(&dacDevice);
+    stats += ",\"monitorMaxBlockTime\":" + String(monMaxBlockTime);
+    stats += ",\"loopbackLatency\":" + String((long)monLoopbackLatency) + "}";
+    request->send(200, "application/json", stats); });
 
   // // play in browser directly
   // server.on(filename_in.c_str(), HTTP_GET, [](AsyncWebServerRequest *request)
@@ -285,6 +630,16 @@ void setup()
 
 void loop()
 {
+  // the last spectrum frame to the /ws/spectrum clients, the capture tasks make them (audioSPEC.h)
+  if (micSpectrum.frameReady)
+  {
+    if (spectrumWs.availableForWriteAll())
+      spectrumWs.binaryAll(micSpectrum.frame, SPEC_FRAME_BYTES);
+    micSpectrum.frameReady = false;
+  }
+  spectrumWs.cleanupClients();
+  delay(20);
+
   // // put your main code here, to run repeatedly:
   // if (WiFi.status() == WL_CONNECTED)
   // {              // if we are connected to Eduroam network
@@ -363,7 +718,7 @@ void onUpload(AsyncWebServerRequest *request, String filename, size_t index, uin
 
     String path = getAudioPath(filename);
     // bool hasErrors = false;
-    if (!path.endsWith(".wav") && !path.endsWith(".mp3"))
+    if (!path.endsWith(".wav") && !path.endsWith(".flac") && !path.endsWith(".mp3"))
     {
       Serial.println("Unsupported file extension.");
       // hasErrors = true;
@@ -386,6 +741,7 @@ void onUpload(AsyncWebServerRequest *request, String filename, size_t index, uin
 
     // ensure to remove the file, if exists
     fsRemoveFile(path);
+    removeSidecars(path); // they are of the old content
 
     request->_tempFile = FS_TYPE.open(path, FILE_WRITE);
   }
@@ -403,6 +759,8 @@ void onUpload(AsyncWebServerRequest *request, String filename, size_t index, uin
     {
       // Stream the incoming chunk to the opened file
       request->_tempFile.write(data, len);
+      peakFeed((PeakState *)request->_tempObject, data, len); // audioPEAK.h, NULL until the header is read
+      uploadPeaks(request, filename, index, len, final);
     }
   }
 
@@ -412,6 +770,15 @@ void onUpload(AsyncWebServerRequest *request, String filename, size_t index, uin
     Serial.printf("Upload End: %s, %u B\n", filename.c_str(), request->_tempFile.size());
     // Close the file handle as the upload is now done
     request->_tempFile.close();
+    PeakState *peaks = (PeakState *)request->_tempObject;
+    if (peaks != NULL)
+    {
+      peakFinish(peaks); // audioPEAK.h
+      if (!writePeaks(peaks, getAudioPath(filename)) || !writeLoudness(peaks, getAudioPath(filename)))
+        Serial.println("Failed to write the waveform peaks");
+      free(peaks);
+      request->_tempObject = NULL;
+    }
 
     // IMPORTANT:
     // don't 'request->send' here, otherwise the response is sent before the last file is uploaded
@@ -434,7 +801,7 @@ void handleDeleteRequest(AsyncWebServerRequest *request)
   if (path.isEmpty())
     return;
 
-  if (!path.endsWith(".wav") && !path.endsWith(".mp3"))
+  if (!path.endsWith(".wav") && !path.endsWith(".flac") && !path.endsWith(".mp3"))
   {
     // 415 Unsupported Media Type
     request->send(415, "text/plain", "Cannot delete " + path + " due to unsupported extension");
@@ -442,7 +809,10 @@ void handleDeleteRequest(AsyncWebServerRequest *request)
   }
 
   if (fsRemoveFile(path))
+  {
+    removeSidecars(path); // the metadata and the spectrogram go with the file, if there are any
     request->send(200, "text/plain", "Removed from FS");
+  }
   else
     request->send(500, "text/plain", "Failed to delete " + path);
 }
@@ -456,24 +826,63 @@ void handlePlayRequest(AsyncWebServerRequest *request)
   if (path.isEmpty())
     return;
 
-  if (!path.endsWith(".wav"))
+  if (!path.endsWith(".wav") && !path.endsWith(".flac") && !path.endsWith(".mp3"))
   {
     // 415 Unsupported Media Type
     request->send(415, "text/plain", "Cannot play " + path + " due to unsupported extension");
     return;
   }
 
-  if (playbackTaskHandle == NULL && recordingTaskHandle == NULL)
+  AudioCmd cmd = cmdMake(CMD_PLAY, extractPriority(request)); // audioCMD.h
+  if (!cmdSetPath(&cmd, path.c_str()))
   {
-    // xTaskCreate(playingTask, "Play WAV", DAC_I2S_TASK_STACK, (void *)path.c_str(), DAC_I2S_TASK_PRIORITY, &playbackTaskHandle);
-    xTaskCreatePinnedToCore(playingTask, "Play WAV", DAC_I2S_TASK_STACK, (void *)path.c_str(), DAC_I2S_TASK_PRIORITY, &playbackTaskHandle, 1);
-    request->send(200, "text/plain", "Playing " + path);
+    request->send(400, "text/plain", "File name is too long");
+    return;
   }
-  else
+  if (!extractDspProfile(request, &cmd))
+    return;
+
+  // an overlay joins the playback right away, it never waits in line (the engine plays it when nothing plays)
+  if (extractOptionalParam(request, "overlay", true) == "true")
+  {
+    String volume = extractOptionalParam(request, "volume", true);
+    String fade = extractOptionalParam(request, "fade", true);
+    cmd.type = CMD_OVERLAY;
+    cmd.volume = volume.isEmpty() ? 100 : constrain((int)volume.toInt(), 0, 100);
+    cmd.fadeMs = fade.isEmpty() ? 0 : constrain((int)fade.toInt(), 0, 60000);
+    if (!path.endsWith(".wav"))
+    {
+      request->send(415, "text/plain", "Cannot overlay " + path + ", only a PCM WAV file");
+      return;
+    }
+    if (!cmdPost(engineQueue, &cmd)) // audioCMD.h
+    {
+      request->send(503, "text/plain", "The audio engine is overloaded");
+      return;
+    }
+    request->send(200, "text/plain", "Overlaying " + path);
+    return;
+  }
+
+  // an urgent play interrupts the current one, otherwise wait in line only when asked to
+  if (dacBusy() && cmd.priority != CMD_PRIO_URGENT)
+  {
+    if (extractOptionalParam(request, "queue", true) != "true")
+    {
+      Serial.println("Playback already in progress...");
+      request->send(409, "text/plain", "Playback already in progress");
+      return;
+    }
+    cmd.type = CMD_ENQUEUE;
+    cmd.requestTime = 0;
+  }
+
+  if (!cmdPost(engineQueue, &cmd)) // audioCMD.h
   {
-    Serial.println("Playback already in progress...");
-    request->send(409, "text/plain", "Playback already in progress");
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
   }
+  request->send(cmd.type == CMD_ENQUEUE ? 202 : 200, "text/plain", (cmd.type == CMD_ENQUEUE ? "Queued " : "Playing ") + path);
 }
 
 void handleRecordingRequest(AsyncWebServerRequest *request)
@@ -485,320 +894,2721 @@ void handleRecordingRequest(AsyncWebServerRequest *request)
   if (rec_time_str.isEmpty())
     return;
 
-  record_time = atoi(rec_time_str.c_str());
-  if (record_time < 5 || record_time > 30)
+  AudioCmd cmd = cmdMake(CMD_RECORD, extractPriority(request)); // audioCMD.h
+  if (!extractRecFormat(request, &cmd) || !extractDspProfile(request, &cmd))
+    return;
+
+  // a coded recording may be longer, as much as the same flash space allows (FLAC is at least 2x smaller on the mic recordings)
+  int rec_time = atoi(rec_time_str.c_str());
+  int max_time = cmd.audioFormat == WAV_FORMAT_IMA_ADPCM ? REC_MAX_TIME * 4 : cmd.audioFormat == WAV_FORMAT_PCM ? REC_MAX_TIME : REC_MAX_TIME * 2;
+  if (rec_time < 5 || rec_time > max_time)
   {
     // 415 Unsupported Media Type
     request->send(415, "text/plain", "Cannot record for " + rec_time_str + " seconds");
     return;
   }
+  cmd.recordTime = rec_time;
+  if (!recCheckSpace(request, &cmd))
+    return;
+  cmd.vad = extractRecVad(request);
+  cmd.nr = extractRecNr(request);
 
-  if (recordingTaskHandle == NULL && playbackTaskHandle == NULL)
+  if (micBusy() && cmd.priority != CMD_PRIO_URGENT)
   {
-    // Add code for creating a TASK using the FreeRTOS xTaskCreate API.
-    // xTaskCreate(recordingTask, "Record WAV", MIC_I2S_TASK_STACK, NULL, MIC_I2S_TASK_PRIORITY, &recordingTaskHandle);
-    xTaskCreatePinnedToCore(recordingTask, "Record WAV", MIC_I2S_TASK_STACK, NULL, MIC_I2S_TASK_PRIORITY, &recordingTaskHandle, 1);
-    request->send(200, "text/plain", "Recording started");
+    if (extractOptionalParam(request, "queue", true) != "true")
+    {
+      Serial.println("Recording already in progress...");
+      request->send(409, "text/plain", "Recording already in progress");
+      return;
+    }
+    cmd.requestTime = 0;
   }
-  else
+
+  if (!cmdPost(engineQueue, &cmd)) // audioCMD.h
   {
-    Serial.println("Playback already in progress...");
-    request->send(409, "text/plain", "Playback already in progress");
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
   }
+  request->send(cmd.requestTime == 0 ? 202 : 200, "text/plain", cmd.requestTime == 0 ? "Recording queued" : "Recording started");
 }
 
-void playWavRecording(String path)
+// Armed recording (audioARM.h): start arms the mic, trigger commits the pre-roll, stop disarms without a file
+void handleArmRequest(AsyncWebServerRequest *request)
 {
-  File audioFile = FS_TYPE.open(path);
-  if (!audioFile)
+  String action = extractParam(request, "action", true);
+  if (action.isEmpty())
+    return;
+
+  if (action == "trigger")
   {
-    Serial.println("Failed to open audio file");
+    if (!armState.armed || armState.triggered)
+    {
+      request->send(409, "text/plain", "Not armed");
+      return;
+    }
+    armTriggerRequested = true; // taken by armJob with the next block
+    request->send(200, "text/plain", "Triggered");
     return;
   }
-
-  // Read and validate WAV header, extract the values from the header
-  WAVHeader audioFileHeader;
-  if (!fsEnsureWavHeader(audioFile, &audioFileHeader))
+  if (action == "stop")
   {
-    Serial.println("Failed to validate WAV header");
-    audioFile.close();
+    if (!armState.armed)
+    {
+      request->send(409, "text/plain", "Not armed");
+      return;
+    }
+    // a triggered recording keeps what it wrote, like a stopped /record
+    AudioCmd cmd = cmdMake(CMD_STOP, CMD_PRIO_URGENT);
+    cmd.devices = CMD_DEV_MIC;
+    if (!cmdPost(engineQueue, &cmd))
+    {
+      request->send(503, "text/plain", "The audio engine is overloaded");
+      return;
+    }
+    request->send(200, "text/plain", "Disarmed");
     return;
   }
-  Serial.printf("WAV File: Sample Rate: %u, Channels: %u, Bits Per Sample: %u\n", audioFileHeader.sampleRate, audioFileHeader.numChannels, audioFileHeader.bitsPerSample);
-
-  // Init DAC for speakers, using the standard driver
-  esp_err_t res = dacInitStd(audioFileHeader.sampleRate, audioFileHeader.bitsPerSample, audioFileHeader.numChannels, DMA_BUF_COUNT, DMA_BUF_LEN, true);
-  if (res != ESP_OK)
+  if (action != "start")
   {
-    Serial.println("Failed to initialize DAC I2S");
-    audioFile.close();
+    request->send(400, "text/plain", "Unknown action " + action);
     return;
   }
-  Serial.println("DAC I2S initialized!");
 
-  // Buffer to hold audio data
-  int bufferLen = (int)(BUFF_SIZE / sizeof(char));
-  uint8_t buffer[bufferLen];
-  size_t bytesRead;
-  size_t bytesWritten;
+  // the armed mic is busy until the trigger and the recording after it, it doesn't wait in line
+  if (micBusy())
+  {
+    Serial.println("Recording already in progress...");
+    request->send(409, "text/plain", "Recording already in progress");
+    return;
+  }
+  AudioCmd cmd = cmdMake(CMD_ARM); // audioCMD.h
+  if (!extractRecFormat(request, &cmd) || !extractDspProfile(request, &cmd))
+    return;
 
-  // Play audio data through I2S
-  while (audioFile.available())
+  String time = extractParam(request, "time", true);
+  if (time.isEmpty())
+    return;
+  String preroll = extractOptionalParam(request, "preroll", true);
+  String threshold = extractOptionalParam(request, "threshold", true);
+  cmd.prerollSec = preroll.isEmpty() ? ARM_PREROLL : preroll.toInt();
+  cmd.thresholdDb = threshold.isEmpty() ? 0 : threshold.toFloat();
+  int max_time = cmd.audioFormat == WAV_FORMAT_IMA_ADPCM ? REC_MAX_TIME * 4 : cmd.audioFormat == WAV_FORMAT_PCM ? REC_MAX_TIME : REC_MAX_TIME * 2;
+  int live_time = time.toInt();
+  if (live_time < 1 || live_time + cmd.prerollSec > max_time || cmd.prerollSec < 1 || cmd.prerollSec > ARM_MAX_PREROLL ||
+      cmd.thresholdDb < -90 || cmd.thresholdDb > 0)
   {
-    bytesRead = audioFile.read(buffer, sizeof(buffer));
-    dacWriteBuff(buffer, bytesRead, &bytesWritten); // audioSTD.h
+    request->send(415, "text/plain", "Cannot arm for " + time + " seconds after " + String(cmd.prerollSec) + " seconds of pre-roll");
+    return;
   }
 
-  // Close file
-  audioFile.close();
+  // the whole pre-roll is in RAM, the I2S slots of the format (16 or 32-bit)
+  RecFormat format = {cmd.sampleRate, cmd.bitsPerSample, cmd.numChannels, cmd.audioFormat};
+  size_t size = (size_t)cmd.prerollSec * cmd.sampleRate * (recSelectCaptureBits(&format) / 8) * cmd.numChannels;
+  if (size + REC_WRITE_BLOCK > prerollAvailable()) // audioARM.h
+  {
+    request->send(503, "text/plain", "Not enough RAM for " + fsFormatBytes(size) + " of pre-roll, try a shorter one or a lower format");
+    return;
+  }
+  cmd.recordTime = cmd.prerollSec + live_time; // the file holds both
+  if (!recCheckSpace(request, &cmd))
+    return;
+  cmd.recordTime = live_time;
+  cmd.vad = extractRecVad(request);
+  cmd.nr = extractRecNr(request);
 
-  // cleanup - uninstall driver
-  dacDestroyStd();
+  if (!cmdPost(engineQueue, &cmd))
+  {
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
+  }
+  request->send(200, "text/plain", "Armed");
 }
 
-void playingTask(void *param)
+// Noise suppression of a stored file (audioNR.h): file=/name.wav -> /name-nr.wav, the format is checked by the job
+void handleDenoiseRequest(AsyncWebServerRequest *request)
 {
-  const char *path = (const char *)param;
+  String path = extractFilePath(request);
+  if (path.isEmpty())
+    return;
 
-  if (xSemaphoreTake(audioMutex, portMAX_DELAY) == pdTRUE)
+  if (!path.endsWith(".wav"))
   {
-    // play the file
-    digitalWrite(LED, HIGH); // working...
-    Serial.println(" *** Play WAV Start *** ");
-    playWavRecording(path);
-    Serial.println(" *** Play WAV Finished *** ");
-    digitalWrite(LED, LOW);     // done...
-    xSemaphoreGive(audioMutex); // release semaphore
+    // 415 Unsupported Media Type
+    request->send(415, "text/plain", "Cannot denoise " + path + ", only PCM .wav files");
+    return;
+  }
+  String output = path.substring(0, path.length() - 4) + "-nr.wav";
+  AudioCmd cmd = cmdMake(CMD_DENOISE); // audioCMD.h
+  if (output.length() >= CMD_PATH_LEN || !cmdSetPath(&cmd, path.c_str()))
+  {
+    request->send(400, "text/plain", "File name is too long");
+    return;
+  }
+  File file = FS_TYPE.open(path, "r");
+  size_t size = file ? file.size() : 0;
+  file.close();
+  if (size == 0)
+  {
+    request->send(404, "text/plain", "File not found");
+    return;
+  }
+  if (size > fsAvailableSpace()) // fsFLASH.h
+  {
+    request->send(507, "text/plain", "Not enough space for " + fsFormatBytes(size));
+    return;
   }
 
-  // if (playbackTaskHandle != NULL)
-  // {
-  //   vTaskDelete(playbackTaskHandle);
-  //   playbackTaskHandle = NULL;
-  // }
-  playbackTaskHandle = NULL;
-  vTaskDelete(NULL); // delete calling task
+  // it takes the mic worker, after the recording in progress
+  if (nrJob.running)
+  {
+    request->send(409, "text/plain", "Noise suppression already in progress");
+    return;
+  }
+  if (!cmdPost(engineQueue, &cmd))
+  {
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
+  }
+  request->send(202, "text/plain", "Denoising into " + output + ", see GET /denoise");
 }
 
-unsigned long recordWav()
+// The spectrogram of a stored PCM WAV file (audioSPEC.h): the sidecar when it is fresh, else the mic worker makes it
+void handleSpectrogramRequest(AsyncWebServerRequest *request)
 {
-  unsigned long flash_wr_size = 0;
-  unsigned long flash_record_size = getFlashRecordSize(); // in bytes
-  size_t bytes_read;
-  size_t bytes_written;
-  size_t size_read = sizeof(int32_t);
-  size_t size_write = sizeof(int16_t);
+  String path = extractFilePath(request, false);
+  if (path.isEmpty())
+    return;
 
-  int bufferLen = (int)(BUFF_SIZE / size_read);
-  int32_t sBuffer[bufferLen];
-  int16_t outputBuffer[bufferLen];
-  // int32_t outputBuffer[bufferLen];
+  String cache = fsSidecarPath(path, ".spg");
+  File file = path.endsWith(".wav") ? FS_TYPE.open(path, "r") : File();
+  WAVHeader header;
+  bool pcm = file && fsEnsureWavHeader(file, &header) && header.audioFormat == WAV_FORMAT_PCM &&
+             convSelect(header.bitsPerSample, header.numChannels, 32, 1) != NULL; // audioCONV.h
+  size_t size = file ? file.size() : 0;
+  file.close();
+  if (!pcm)
+  {
+    // 415 Unsupported Media Type
+    request->send(415, "text/plain", "No spectrogram of " + path + ", only 8/16/24/32-bit PCM .wav files");
+    return;
+  }
+  if (specGramColumns(header.dataSize / header.blockAlign) == 0)
+  {
+    request->send(400, "text/plain", "Too short for a spectrogram");
+    return;
+  }
 
-  Serial.printf("buffer len for recording %d samples\n", bufferLen);
-  Serial.printf("reserved file size: %u\n", flash_record_size);
+  // repeated views cost a file read
+  if (spectrogramFresh(cache, size))
+  {
+    request->send(FS_TYPE, cache, "application/octet-stream");
+    return;
+  }
 
-  while (flash_wr_size < flash_record_size)
+  AudioCmd cmd = cmdMake(CMD_SPECTROGRAM); // audioCMD.h
+  if (cache.length() >= CMD_PATH_LEN || !cmdSetPath(&cmd, path.c_str()))
   {
-    // read data from I2S bus, in this case, from ADC.
-    micReadBuff(&sBuffer, bufferLen * size_read, &bytes_read); // audioSTD.h
-    if (bytes_read > 0)
-    {
-      // save original data from I2S(ADC) into flash...
+    request->send(400, "text/plain", "File name is too long");
+    return;
+  }
+  if (specGramJob.queued || specGramJob.running)
+  {
+    if (path == specGramJob.source)
+      request->send(202, "application/json", specGramGetJobState(&specGramJob)); // audioSPEC.h
+    else
+      request->send(409, "text/plain", "Another spectrogram in progress");
+    return;
+  }
+  if (SPGM_HEADER_BYTES + SPGM_MAX_COLUMNS * SPGM_BINS > fsAvailableSpace()) // fsFLASH.h
+  {
+    request->send(507, "text/plain", "Not enough space for the spectrogram");
+    return;
+  }
+  if (uxQueueSpacesAvailable(recQueue) == 0)
+  {
+    request->send(503, "text/plain", "The mic worker queue is full");
+    return;
+  }
 
-      // Extract 24-bit samples from 32-bit variable and downscale to 16-bit
-      for (int i = 0; i < bufferLen; i++)
-      {
-        int32_t temp = sBuffer[i];
-        // Shift right by 11 bits. works for soft sounds, louder sounds may need more reduction
-        temp = (temp >> 11);
-        // Check the sign bit and extend it if necessary
-        if (temp & 0x8000)
-        {
-          temp |= 0xFFFF0000;
-        }
+  // it takes the mic worker, after the recording in progress; the job is marked before the post,
+  // a short one may finish before cmdPost returns
+  memset(&specGramJob, 0, sizeof(SpecGramJob));
+  specGramJob.queued = true; // the next requests wait for this one instead of queueing more
+  strcpy(specGramJob.source, cmd.path);
+  if (!cmdPost(engineQueue, &cmd))
+  {
+    specGramJob.queued = false;
+    specGramJob.source[0] = 0;
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
+  }
+  request->send(202, "application/json", specGramGetJobState(&specGramJob));
+}
 
-        outputBuffer[i] = (int16_t)temp;
-      }
-      bytes_written = file_out.write((const byte *)outputBuffer, bufferLen * size_write);
-      flash_wr_size += bytes_written;
+// The waveform of a stored file (audioPEAK.h), a file without one has no "<name>.pk": 404
+void handlePeaksRequest(AsyncWebServerRequest *request)
+{
+  String path = extractFilePath(request, false);
+  if (path.isEmpty())
+    return;
 
-      if (MONITORING)
-      {
-        Serial.printf("Recording written %d B\n", bytes_written);
-        Serial.printf("Never Used Stack Size: %u\n", uxTaskGetStackHighWaterMark(NULL));
-      }
-    }
-    else
-    {
-      Serial.println("I2S read error");
-    }
+  String peaks = fsSidecarPath(path, ".pk");
+  if (!fsExists(peaks))
+  {
+    request->send(404, "text/plain", "No peaks of " + path);
+    return;
   }
-  return flash_wr_size;
+  request->send(FS_TYPE, peaks, "application/octet-stream");
 }
 
-// old version
-unsigned long _recordWav()
+// stop the current job of a device (mic, dac or both by default), and drop its waiting jobs
+void handleStopRequest(AsyncWebServerRequest *request)
 {
-  unsigned long flash_wr_size = 0;
-  unsigned long flash_record_size = getFlashRecordSize(); // in bytes
-  size_t bytes_read;
-  size_t bytes_written;
-  size_t size_read = sizeof(char);
-  size_t size_write = sizeof(char);
-  int bufferLen = BUFF_SIZE; // each element is a byte
+  String device = extractOptionalParam(request, "device", true);
+  AudioCmd cmd = cmdMake(CMD_STOP, CMD_PRIO_URGENT); // audioCMD.h
+  cmd.devices = (device == "mic") ? CMD_DEV_MIC : (device == "dac") ? CMD_DEV_DAC : CMD_DEV_ALL;
 
-  char *i2s_read_buff = (char *)calloc(bufferLen, size_read);
-  uint8_t *flash_write_buff = (uint8_t *)calloc(bufferLen, size_write);
+  if (!cmdPost(engineQueue, &cmd))
+  {
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
+  }
+  request->send(200, "text/plain", "Stopped");
+}
 
-  // Discard the first two blocks, the microphone may have startup time (i.e. INMP441 up to 83ms)
-  Serial.println(" *** Discard the first two blocks *** ");
-  micDiscardBlocks((void *)i2s_read_buff, bufferLen * size_read, &bytes_read, 2); // audioSTD.h
+// Queue a playlist: every file goes to the end of the DAC queue, in order, after whatever plays or waits.
+// The reader chains consecutive files of the same format into one stream (see playChainNext).
+void handleQueueRequest(AsyncWebServerRequest *request, JsonVariant &json)
+{
+  JsonArray files = json["files"].as<JsonArray>();
+  if (files.isNull() || files.size() == 0)
+  {
+    request->send(400, "text/plain", "Missing files");
+    return;
+  }
+  if (files.size() > uxQueueSpacesAvailable(playQueue) || files.size() > uxQueueSpacesAvailable(engineQueue))
+  {
+    request->send(413, "text/plain", "Too many files, the queue has room for " + String(uxQueueSpacesAvailable(playQueue)));
+    return;
+  }
 
-  while (flash_wr_size < flash_record_size)
+  // validate the whole list first, so that it is queued entirely or not at all
+  for (JsonVariant file : files)
   {
-    // read data from I2S bus, in this case, from ADC.
-    micReadBuff((void *)i2s_read_buff, bufferLen * size_read, &bytes_read); // audioSTD.h
-    if (bytes_read > 0)
+    String path = getAudioPath(file.as<String>());
+    if ((!path.endsWith(".wav") && !path.endsWith(".flac") && !path.endsWith(".mp3")) || path.length() >= CMD_PATH_LEN || !FS_TYPE.exists(path))
     {
-      if (MONITORING)
-      {
-        // printing for debugging
-        fsPrintBuffer((uint8_t *)i2s_read_buff, 64); // moved to fsFLASH.h
-      }
-
-      // // save original data from I2S(ADC) into flash.
-      // // From the buffer, it's ready to write to file.
-      // bytes_written = file_out.write((const byte *)i2s_read_buff, bufferLen);
+      request->send(415, "text/plain", "Cannot play " + path);
+      return;
+    }
+  }
 
-      // Instead of writing directly from the buffer, go through micDataScale and write to the file.
-      // This allows to reduce or increase the overall volume including noise.
-      micDataScale(flash_write_buff, (uint8_t *)i2s_read_buff, bufferLen);
-      bytes_written = file_out.write((const byte *)flash_write_buff, bufferLen * size_write);
-      flash_wr_size += bytes_written;
+  for (JsonVariant file : files)
+  {
+    AudioCmd cmd = cmdMake(CMD_ENQUEUE); // audioCMD.h
+    cmd.requestTime = 0;
+    cmdSetPath(&cmd, getAudioPath(file.as<String>()).c_str());
+    cmdPost(engineQueue, &cmd);
+  }
+  request->send(202, "text/plain", "Queued " + String(files.size()) + " files");
+}
 
-      if (MONITORING)
-      {
-        Serial.printf("Recording written %d B\n", bytes_written);
-        // Serial.printf("Sound recording %u%%\n", flash_wr_size * 100 / flash_record_size);
+// Transport of the current playback, straight to the DAC worker as a notification (no queue to wait in)
+void handleTransportRequest(AsyncWebServerRequest *request)
+{
+  String action = extractParam(request, "action", true);
+  if (action.isEmpty())
+    return;
 
-        // Check the size of the stack in the TASK.
-        // uxTaskGetStackHighWaterMark() shows how much Stack was never used. The closer to 0, the better.
-        Serial.printf("Never Used Stack Size: %u\n", uxTaskGetStackHighWaterMark(NULL));
-        // We confirmed that the size of the Stack doesn't lack or make up a large proportion.
-      }
-    }
-    else
-    {
-      Serial.println("I2S read error");
-    }
+  uint32_t bit = 0;
+  if (action == "stop")
+    bit = PLAY_NOTIFY_STOP;
+  else if (action == "pause")
+    bit = PLAY_NOTIFY_PAUSE;
+  else if (action == "resume")
+    bit = PLAY_NOTIFY_RESUME;
+  else if (action == "seek")
+  {
+    String position = extractParam(request, "position", true);
+    if (position.isEmpty())
+      return;
+    playSeekMs = (uint32_t)atol(position.c_str());
+    bit = PLAY_NOTIFY_SEEK;
+  }
+  else
+  {
+    request->send(400, "text/plain", "Unknown action " + action);
+    return;
   }
 
-  // cleanup
-  free(i2s_read_buff);
-  i2s_read_buff = NULL;
+  if (playFile[0] == 0)
+  {
+    request->send(409, "text/plain", "Nothing is playing");
+    return;
+  }
+  xTaskNotify(playerTaskHandle, bit, eSetBits);
+  request->send(200, "text/plain", action);
+}
 
-  free(flash_write_buff);
-  flash_write_buff = NULL;
+// A volume of the playback mixer (audioMIX.h), straight to it, the DAC worker takes it at its next block
+void handleVolumeRequest(AsyncWebServerRequest *request)
+{
+  String volume = extractParam(request, "volume", true);
+  if (volume.isEmpty())
+    return;
+  String source = extractOptionalParam(request, "source", true);
+  String fade = extractOptionalParam(request, "fade", true);
+  int level = volume.toInt();
+  int fadeMs = fade.isEmpty() ? 0 : fade.toInt();
+  int s = source.isEmpty() ? -1 : source.toInt();
+  if (level < 0 || level > 100 || fadeMs < 0 || fadeMs > 60000 || s < -1 || s >= MIX_MAX_SOURCES)
+  {
+    request->send(400, "text/plain", "Cannot set the volume " + volume);
+    return;
+  }
 
-  return flash_wr_size;
+  if (s < 0)
+    mixGainSet(&playMixer.master, level / 100.0, fadeMs);
+  else if (s == 0 || playMixer.sources[s].active)
+    mixGainSet(&playMixer.sources[s].volume, level / 100.0, fadeMs);
+  else
+  {
+    request->send(409, "text/plain", "No overlay in source " + source);
+    return;
+  }
+  request->send(200, "text/plain", "Volume " + volume);
 }
 
-// This i2s_adc_dac is working on a TASK.
-// It should be running continuously without return anything.
-// If you have a case that you need to turn off, the you have to delete the working TASK by yourself.
-// Here, this is a one-time record for now.
-// After finishing the recording, the TASK should be done by vTaskDelete(NULL).
-void recordingTask(void *param)
+void handleMonitorRequest(AsyncWebServerRequest *request)
 {
-  if (xSemaphoreTake(audioMutex, portMAX_DELAY) == pdTRUE)
+  String action = extractParam(request, "action", true);
+  if (action.isEmpty())
+    return;
+
+  AudioCmd cmd;
+  if (action == "stop")
   {
-    // Init microphone for sampling, using the standard driver
-    esp_err_t resMic = micInitStd(MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, DMA_BUF_COUNT, DMA_BUF_LEN, true);
-    if (resMic != ESP_OK)
+    // the monitor is a job of the DAC worker
+    cmd = cmdMake(CMD_STOP, CMD_PRIO_URGENT);
+    cmd.devices = CMD_DEV_DAC;
+  }
+  else if (action == "start" || action == "loopback")
+  {
+    // the monitor needs both devices, it doesn't wait in line
+    if (micBusy() || dacBusy())
     {
-      Serial.println("Failed to initialize MIC I2S");
-      cleanupRecording(true, false);
+      Serial.println("Audio devices are busy...");
+      request->send(409, "text/plain", "Audio devices are busy");
+      return;
+    }
+    cmd = cmdMake(action == "loopback" ? CMD_LOOPBACK : CMD_MONITOR);
+  }
+  else
+  {
+    request->send(400, "text/plain", "Unknown action " + action);
+    return;
+  }
+
+  if (!cmdPost(engineQueue, &cmd))
+  {
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
+  }
+  request->send(200, "text/plain", String(cmdName(cmd.type)) + " " + action);
+}
+
+void handleCalibrateRequest(AsyncWebServerRequest *request)
+{
+  String action = extractParam(request, "action", true);
+  if (action.isEmpty())
+    return;
+
+  if (action == "reset")
+  {
+    // the installed drivers keep their DMA, the defaults are back after a restart
+    if (!tuneClear()) // audioTUNE.h
+    {
+      request->send(500, "text/plain", "Failed to clear the calibration");
+      return;
+    }
+    request->send(200, "text/plain", "Calibration cleared, restart to apply the defaults");
+    return;
+  }
+  if (action != "start")
+  {
+    request->send(400, "text/plain", "Unknown action " + action);
+    return;
+  }
+
+  // the calibration needs both devices, it doesn't wait in line
+  if (micBusy() || dacBusy())
+  {
+    Serial.println("Audio devices are busy...");
+    request->send(409, "text/plain", "Audio devices are busy");
+    return;
+  }
+  AudioCmd cmd = cmdMake(CMD_CALIBRATE); // audioCMD.h
+  if (!extractRecFormat(request, &cmd))
+    return;
+  String trial = extractOptionalParam(request, "trial_ms", true);
+  cmd.trialMs = trial.isEmpty() ? TUNE_TRIAL_MS : constrain((int)trial.toInt(), 500, 30000);
+
+  if (!cmdPost(engineQueue, &cmd))
+  {
+    request->send(503, "text/plain", "The audio engine is overloaded");
+    return;
+  }
+  request->send(202, "text/plain", "Calibrating, see GET /calibrate");
+}
+
+// the mic is taken by a recording (running or waiting), by the monitor, or by the DAC on a shared port
+bool micBusy()
+{
+  return recorderActive || monitorActive || uxQueueMessagesWaiting(recQueue) > 0 || uxQueueMessagesWaiting(engineQueue) > 0 ||
+         (!AUDIO_FULL_DUPLEX && (playerActive || uxQueueMessagesWaiting(playQueue) > 0));
+}
+
+bool dacBusy()
+{
+  return playerActive || uxQueueMessagesWaiting(playQueue) > 0 || uxQueueMessagesWaiting(engineQueue) > 0 ||
+         (!AUDIO_FULL_DUPLEX && (recorderActive || uxQueueMessagesWaiting(recQueue) > 0));
+}
+
+// The engine task: takes the commands of the web handlers in order, and routes them to the device workers.
+// It never blocks on audio, so a stop gets through while the workers are busy.
+void engineTask(void *param)
+{
+  AudioCmd cmd;
+  for (;;)
+  {
+    if (xQueueReceive(engineQueue, &cmd, portMAX_DELAY) != pdTRUE)
+      continue;
+    Serial.printf("Engine: %s %s\n", cmdName(cmd.type), cmd.path); // audioCMD.h
+
+    switch (cmd.type)
+    {
+    case CMD_PLAY:
+    case CMD_ENQUEUE:
+    case CMD_MONITOR:
+    case CMD_LOOPBACK:
+    case CMD_CALIBRATE:
+      if (cmd.priority == CMD_PRIO_URGENT && playerActive)
+        xTaskNotify(playerTaskHandle, PLAY_NOTIFY_STOP, eSetBits); // the urgent job is the next in line
+      if (!cmdPost(playQueue, &cmd))
+        Serial.println("Engine: the play queue is full, dropped");
+      break;
+    case CMD_RECORD:
+    case CMD_ARM:
+    case CMD_DENOISE:
+    case CMD_SPECTROGRAM:
+      if (cmd.priority == CMD_PRIO_URGENT && recorderActive)
+        micStopRequested = true;
+      if (!cmdPost(recQueue, &cmd))
+      {
+        Serial.println("Engine: the record queue is full, dropped");
+        if (cmd.type == CMD_SPECTROGRAM)
+        {
+          // audioSPEC.h, the next request may queue it again
+          specGramJob.queued = false;
+          specGramJob.source[0] = 0;
+          specGramJob.error = "the record queue is full";
+        }
+      }
+      break;
+    case CMD_OVERLAY:
+      if (playMixer.running)
+      {
+        playLoadOverlay(&cmd);
+        break;
+      }
+      cmd.type = CMD_PLAY; // nothing to mix it into, it plays on its own
+      if (!cmdPost(playQueue, &cmd))
+        Serial.println("Engine: the play queue is full, dropped");
+      break;
+    case CMD_OVERLAY_READY:
+      playAddOverlay();
+      break;
+    case CMD_STOP:
+      if (cmd.devices & CMD_DEV_DAC)
+      {
+        xQueueReset(playQueue);
+        if (playerActive)
+          xTaskNotify(playerTaskHandle, PLAY_NOTIFY_STOP, eSetBits);
+      }
+      if (cmd.devices & CMD_DEV_MIC)
+      {
+        xQueueReset(recQueue);
+        specGramJob.queued = false; // audioSPEC.h, dropped with the queue if it was waiting
+        micStopRequested = recorderActive;
+      }
+      break;
+    }
+  }
+}
+
+// The DAC worker: plays the files (and runs the monitor) one job at a time
+void playerTask(void *param)
+{
+  AudioCmd cmd;
+  for (;;)
+  {
+    // peek first, so the job is never out of the queue without being active (see dacBusy)
+    if (xQueuePeek(playQueue, &cmd, portMAX_DELAY) != pdTRUE)
+      continue;
+    playerActive = true;
+    if (xQueueReceive(playQueue, &cmd, 0) != pdTRUE)
+    {
+      playerActive = false; // dropped by a stop meanwhile
+      continue;
+    }
+    ulTaskNotifyValueClear(NULL, 0xFFFFFFFF); // a stop that came while idle is not for this job
+
+    if (cmd.type == CMD_MONITOR || cmd.type == CMD_LOOPBACK)
+    {
+      monitorJob(cmd.type == CMD_LOOPBACK);
+    }
+    else if (cmd.type == CMD_CALIBRATE)
+    {
+      tuneJob(&cmd);
+    }
+    else if (dacMutex == micMutex ? micTakeFromMeter(dacMutex) : xSemaphoreTake(dacMutex, portMAX_DELAY) == pdTRUE)
+    {
+      // a queued job measures its latency from now
+      dacDevice.requestTime = cmd.requestTime ? cmd.requestTime : esp_timer_get_time(); // audioDEV.h
+
+      // play the file
+      digitalWrite(LED, HIGH); // working...
+      Serial.println(" *** Play WAV Start *** ");
+      strcpy(playFile, cmd.path);
+      playDspProfile = cmd.dspProfile;
+      playWavRecording(cmd.path);
+      playFile[0] = 0;
+      Serial.println(" *** Play WAV Finished *** ");
+      digitalWrite(LED, LOW);   // done...
+      xSemaphoreGive(dacMutex); // release semaphore
+    }
+
+    playerActive = false;
+  }
+}
+
+// The mic worker: one recording at a time
+void recorderTask(void *param)
+{
+  AudioCmd cmd;
+  for (;;)
+  {
+    // idle with a /ws/spectrum client: the meter has the mic until the next job
+    if (xQueuePeek(recQueue, &cmd, pdMS_TO_TICKS(SPEC_IDLE_POLL_MS)) != pdTRUE)
+    {
+      if (specClients > 0)
+        meterJob();
+      continue;
+    }
+    recorderActive = true;
+    if (xQueueReceive(recQueue, &cmd, 0) != pdTRUE)
+    {
+      recorderActive = false;
+      continue;
+    }
+    micStopRequested = false;
+    if (cmd.type == CMD_DENOISE || cmd.type == CMD_SPECTROGRAM)
+    {
+      if (cmd.type == CMD_DENOISE)
+        denoiseJob(&cmd);
+      else
+        spectrogramJob(&cmd);
+      recorderActive = false;
+      continue;
+    }
+
+    record_time = cmd.recordTime;
+    recFormat.sampleRate = cmd.sampleRate;
+    recFormat.bitsPerSample = cmd.bitsPerSample;
+    recFormat.numChannels = cmd.numChannels;
+    recFormat.audioFormat = cmd.audioFormat;
+    recVadRequested = cmd.vad;
+    recNrRequested = cmd.nr;
+    recDspProfile = cmd.dspProfile;
+    micDevice.requestTime = cmd.requestTime ? cmd.requestTime : esp_timer_get_time(); // audioDEV.h
+    if (cmd.type == CMD_ARM)
+      armJob(&cmd);
+    else
+      recordJob();
+    nrEnd(&recNr); // audioNR.h
+
+    recorderActive = false;
+  }
+}
+
+void playWavRecording(String path)
+{
+  // the prefetch reader owns the file while it runs, it may chain the next ones (see playChainNext)
+  playReaderFile = FS_TYPE.open(path);
+  if (!playReaderFile)
+  {
+    Serial.println("Failed to open audio file");
+    return;
+  }
+
+  // Read and validate WAV header, extract the values from the header
+  WAVHeader audioFileHeader;
+  if (!fsEnsureWavHeader(playReaderFile, &audioFileHeader))
+  {
+    Serial.println("Failed to validate WAV header");
+    playReaderFile.close();
+    return;
+  }
+  Serial.printf("WAV File: Sample Rate: %u, Channels: %u, Bits Per Sample: %u, Codec: %s\n", audioFileHeader.sampleRate, audioFileHeader.numChannels, audioFileHeader.bitsPerSample, codecName(audioFileHeader.audioFormat));
+
+  // A coded file (IMA-ADPCM, u-law) is decoded to 16-bit PCM right after the ring, a whole block at a time,
+  // from there on it takes the same path as a PCM file
+  bool coded = fsWavIsCoded(&audioFileHeader); // fsFLASH.h
+  CodecLayout codec;
+  if (coded)
+    fsWavCodecLayout(&audioFileHeader, &codec);
+  int pcmBits = coded ? 16 : audioFileHeader.bitsPerSample;
+
+  // With DAC_FIXED_RATE the DAC keeps one clock and one format (16-bit stereo), and the audio is resampled.
+  // Otherwise the DAC follows the file, but the driver takes 16/32-bit containers only.
+  bool fixedClock = DAC_FIXED_RATE > 0;
+  int dacRate = fixedClock ? DAC_FIXED_RATE : audioFileHeader.sampleRate;
+  int dacBits = fixedClock ? 16 : convDacBits(pcmBits); // audioCONV.h
+  int dacChannels = fixedClock ? 2 : audioFileHeader.numChannels;
+  int srcFrame = fsWavFrameSize(&audioFileHeader); // a whole block of a coded file
+  int dacFrame = dacBits / 8 * dacChannels;
+
+  // pick the conversion kernel for this file once
+  ConvFn dacConvert = NULL;
+  if (dacBits != pcmBits || dacChannels != audioFileHeader.numChannels)
+  {
+    dacConvert = convSelect(pcmBits, audioFileHeader.numChannels, dacBits, dacChannels);
+    Serial.printf("Converting %d-bit/%u-ch to %d-bit/%d-ch samples\n", pcmBits, audioFileHeader.numChannels, dacBits, dacChannels);
+  }
+  // the filters run on what the DAC gets, after the conversion and the resampler
+  dspChainInit(&playDspChain, playDspProfile, dacRate, dacBits, dacChannels, 0); // audioDSP.h
+  if (PLAY_NORMALIZE)
+  {
+    // a fixed gain towards PLAY_TARGET_LUFS, measured when the file was made, no pass over the file here
+    float levelDb = playLevelDb(path);
+    dspSetLevel(&playDspChain, levelDb); // audioDSP.h
+    Serial.printf("Normalized by %.1f dB\n", levelDb);
+  }
+
+  // pop whole frames that fit the buffer both as they are and after the conversion (in place, it narrows or widens them),
+  // or whole blocks of a coded file, at least one even when it decodes to more than a DAC block
+  size_t popFrames = PLAY_DAC_BLOCK / (coded ? dacFrame : max(srcFrame, dacFrame));
+  size_t popLen = popFrames * srcFrame;
+  uint8_t *codedBuffer = NULL;
+  uint8_t *pcmBuffer = NULL;
+  if (coded)
+  {
+    size_t units = max((size_t)1, popFrames / codec.samplesPerBlock);
+    popFrames = units * codec.samplesPerBlock;
+    popLen = units * srcFrame;
+    codedBuffer = (uint8_t *)malloc(popLen);
+    pcmBuffer = (uint8_t *)malloc(popFrames * max(dacFrame, 2 * (int)audioFileHeader.numChannels));
+    if (codedBuffer == NULL || pcmBuffer == NULL)
+    {
+      Serial.println("Failed to allocate the decoder buffers");
+      free(codedBuffer);
+      free(pcmBuffer);
+      playReaderFile.close();
+      return;
+    }
+  }
+
+  // and the resampler, the filter bank is computed only when the rates differ from the previous file
+  bool resample = dacRate != audioFileHeader.sampleRate;
+  int16_t *resampled = NULL;
+  if (resample)
+  {
+    bool ready = playResampler.inRate == audioFileHeader.sampleRate && playResampler.outRate == (uint32_t)dacRate && playResampler.channels == dacChannels;
+    if (ready)
+      srcReset(&playResampler); // audioSRC.h
+    else
+      ready = srcInit(&playResampler, audioFileHeader.sampleRate, dacRate, dacChannels); // audioSRC.h
+    if (ready)
+      resampled = (int16_t *)malloc(srcMaxOutFrames(&playResampler, popFrames) * dacFrame);
+    if (resampled == NULL)
+    {
+      Serial.println("Failed to initialize the resampler");
+      free(codedBuffer);
+      free(pcmBuffer);
+      playReaderFile.close();
+      return;
+    }
+    Serial.printf("Resampling %u Hz to %d Hz\n", audioFileHeader.sampleRate, dacRate);
+  }
+
+  // Get the DAC for speakers, a warm driver is reused as is or only reclocked
+  esp_err_t res = devAcquireDac(dacRate, dacBits, dacChannels); // audioDEV.h
+  if (res != ESP_OK)
+  {
+    Serial.println("Failed to initialize DAC I2S");
+    free(resampled);
+    free(codedBuffer);
+    free(pcmBuffer);
+    playReaderFile.close();
+    return;
+  }
+  Serial.println("DAC I2S ready!");
+
+  // Start the prefetch reader, it fills the ring while the DAC is fed from RAM only
+  if (!ringCreate(&playRing, PLAY_DAC_BLOCK, PLAY_RING_BLOCKS * PLAY_READ_BLOCK / PLAY_DAC_BLOCK))
+  {
+    Serial.println("Failed to allocate the playback ring");
+    free(resampled);
+    free(codedBuffer);
+    free(pcmBuffer);
+    playReaderFile.close();
+    return;
+  }
+  playReaderHeader = audioFileHeader;
+  playReaderSeek(audioFileHeader.dataOffset);
+  memset(&playMp3Load, 0, sizeof(playMp3Load));
+  playChainPending = false;
+  playDataEnd = audioFileHeader.dataOffset + audioFileHeader.dataSize;
+  uint32_t heardEnd = playDataEnd; // the end of the file the DAC plays (the reader may be in the next one)
+  playBytePos = audioFileHeader.dataOffset;
+  playPositionMs = 0;
+  playDurationMs = fsWavDurationMs(&audioFileHeader); // fsFLASH.h
+  if (!playStartReader())
+  {
+    Serial.println("Failed to start the prefetch task");
+    ringDestroy(&playRing);
+    free(resampled);
+    free(codedBuffer);
+    free(pcmBuffer);
+    playReaderFile.close();
+    return;
+  }
+
+  // Prefill: let the reader get ahead before the first sample goes out,
+  // a few blocks are enough since the reader is faster than real time, more only delay the start
+  while (!playRing.eof && ringAvailable(&playRing) < PLAY_PREFILL_BLOCKS * PLAY_DAC_BLOCK)
+    vTaskDelay(pdMS_TO_TICKS(1));
+
+  // Buffer to hold audio data, aligned for the conversion kernels
+  uint32_t buffer[PLAY_DAC_BLOCK / sizeof(uint32_t)];
+  uint8_t *popBuffer = coded ? codedBuffer : (uint8_t *)buffer;
+  uint8_t *pcm = coded ? pcmBuffer : (uint8_t *)buffer;
+  size_t bytesRead;
+
+  // Play audio data through I2S, the transport commands are polled between the DMA buffers
+  bool paused = false;
+  bool skipEvents = true;      // the DAC was silent on purpose (idle, pause, seek), don't count it as underruns
+  devStartSession(&dacDevice); // audioDEV.h
+  dacPreloadStd();             // audioSTD.h, the first blocks go into the stopped DMA, no zeros before them
+  mixStart(&playMixer, dacRate, dacBits, dacChannels); // audioMIX.h, overlays can join from now on
+  for (;;)
+  {
+    uint32_t bits = playTakeBits(PLAY_NOTIFY_TRANSPORT, paused ? portMAX_DELAY : 0);
+    if (bits & PLAY_NOTIFY_STOP)
+    {
+      dacClearStd(); // audioSTD.h, silence now, don't wait for the queued DMA buffers
+      Serial.println("Playback stopped");
+      break;
+    }
+    if (bits & PLAY_NOTIFY_SEEK)
+    {
+      uint32_t offset = fsWavSeekOffset(&audioFileHeader, playSeekMs); // fsFLASH.h
+      playStopReader();
+      if (!playReaderAt(audioFileHeader))
+        break;
+      playReaderSeek(offset);
+      ringReset(&playRing); // audioRING.h
+      playBytePos = offset;
+      playPositionMs = fsWavPositionMs(&audioFileHeader, offset);
+      if (resample)
+        srcReset(&playResampler);
+      dacPreloadStd(); // silent until the DMA is full of the new position
+      if (!playStartReader())
+        break;
+      Serial.printf("Playback seek to %u ms\n", playPositionMs);
+    }
+    if (bits & PLAY_NOTIFY_PAUSE)
+    {
+      if (!paused)
+        dacClearStd();
+      paused = true;
+    }
+    if ((bits & PLAY_NOTIFY_RESUME) && paused)
+    {
+      dacPreloadStd();
+      paused = false;
+    }
+    if (bits & (PLAY_NOTIFY_SEEK | PLAY_NOTIFY_RESUME))
+      skipEvents = true;
+    playPaused = paused;
+    if (paused)
+      continue;
+
+    // end of the file the DAC plays: go on with the chained one (same format, no gap), or finish
+    if (playBytePos + srcFrame > heardEnd)
+    {
+      if (playChainPending)
+      {
+        if (!playTakeChained())
+          break;
+        audioFileHeader = playChainHeader;
+        if (PLAY_NORMALIZE)
+          dspSetLevel(&playDspChain, playChainLevelDb); // audioDSP.h, read by the reader ahead of time
+        heardEnd = audioFileHeader.dataOffset + audioFileHeader.dataSize;
+        playBytePos = audioFileHeader.dataOffset;
+        playPositionMs = 0;
+        playDurationMs = fsWavDurationMs(&audioFileHeader);
+        Serial.printf("Gapless: %s\n", playFile);
+        continue;
+      }
+      if (ringDrained(&playRing))
+        break;
+      if (playBytePos < heardEnd)
+        playBytePos += ringPop(&playRing, buffer, heardEnd - playBytePos, 0); // a broken tail, less than a frame
+      else
+        vTaskDelay(pdMS_TO_TICKS(1)); // the reader is still looking for the next file
+      continue;
+    }
+
+    // never take bytes of the next file along with this one
+    size_t want = min(popLen, (size_t)(heardEnd - playBytePos) / srcFrame * srcFrame);
+    bytesRead = ringPopRealtime(&playRing, popBuffer, want, pdMS_TO_TICKS(20)); // audioRING.h
+    if (bytesRead == 0)
+    {
+      if (ringDrained(&playRing))
+        break; // the file is shorter than its header says
+      continue;
+    }
+    // a late reader may leave a frame (or a block of a coded file) cut, its rest keeps the next pop aligned
+    if (bytesRead % srcFrame != 0)
+      bytesRead += ringPop(&playRing, popBuffer + bytesRead, srcFrame - bytesRead % srcFrame, pdMS_TO_TICKS(200));
+    playBytePos += bytesRead;
+    playPositionMs = fsWavPositionMs(&audioFileHeader, playBytePos);
+
+    if (coded)
+      bytesRead = codecDecode(&codec, (int16_t *)pcm, popBuffer, bytesRead / srcFrame * srcFrame); // audioCODEC.h
+    if (dacConvert != NULL)
+      bytesRead = dacConvert(pcm, pcm, bytesRead);
+    if (skipEvents)
+    {
+      devSkipEvents(&dacDevice);
+      skipEvents = false;
+    }
+    if (resample)
+    {
+      size_t frames = srcProcess(&playResampler, (int16_t *)pcm, bytesRead / dacFrame, resampled);
+      dspProcess(&playDspChain, (uint8_t *)resampled, frames * dacFrame); // audioDSP.h
+      mixProcess(&playMixer, (uint8_t *)resampled, frames * dacFrame);   // audioMIX.h
+      playWriteDac((uint8_t *)resampled, frames * dacFrame, dacFrame);
+    }
+    else
+    {
+      dspProcess(&playDspChain, pcm, bytesRead);
+      mixProcess(&playMixer, pcm, bytesRead);
+      playWriteDac(pcm, bytesRead, dacFrame);
+    }
+    devMarkFirstSample(&dacDevice, "Playback"); // audioDEV.h
+  }
+
+  // a file shorter than the DMA may still be preloading
+  dacStartStd();
+  mixStop(&playMixer); // audioMIX.h, the overlays end with the playback
+
+  // the reader may still be running (stop), wait for it before closing its file
+  // a chained file that wasn't reached stays in the queue, it plays as the next job
+  playStopReader();
+  playChainPending = false;
+  playPaused = false;
+  ringPrintStats(&playRing, "Playback");
+  Serial.printf("Playback DMA underruns: %u\n", dacDevice.session.underruns);
+  ringDestroy(&playRing);
+  free(resampled);
+  free(codedBuffer);
+  free(pcmBuffer);
+
+  // Close file, the DAC stays installed for the next play (auto clear keeps it silent)
+  playReaderFile.close();
+}
+
+// Notification bits of the DAC worker, read and cleared with ulTaskNotifyValueClear so none is lost between polls.
+// Returns the bits of mask that were set, waits for any notification when none is set yet.
+uint32_t playTakeBits(uint32_t mask, TickType_t wait)
+{
+  uint32_t bits = ulTaskNotifyValueClear(NULL, mask) & mask;
+  if (bits == 0 && wait > 0)
+  {
+    xTaskNotifyWait(0, 0, NULL, wait);
+    bits = ulTaskNotifyValueClear(NULL, mask) & mask;
+  }
+  return bits;
+}
+
+// a transport command is waiting (doesn't clear it)
+bool playTransportPending()
+{
+  return (ulTaskNotifyValueClear(NULL, 0) & PLAY_NOTIFY_TRANSPORT) != 0;
+}
+
+// Write to the DAC one DMA buffer at a time, and give up on the rest of the block once a transport command
+// is pending. A command takes effect within a single DMA buffer, even when a block spans a few.
+void playWriteDac(uint8_t *data, size_t len, int dacFrame)
+{
+  size_t chunk = dacDevice.activeBufLen * dacFrame; // audioDEV.h
+  size_t bytesWritten;
+  for (size_t offset = 0; offset < len; offset += chunk)
+  {
+    if (playTransportPending())
+      return;
+    dacWriteBuff(data + offset, min(chunk, len - offset), &bytesWritten); // audioSTD.h
+    devPollEvents(&dacDevice);                                            // audioDEV.h, underruns of the session
+  }
+}
+
+// start the prefetch reader from the current position of its file
+bool playStartReader()
+{
+  playReaderStop = false;
+  ulTaskNotifyValueClear(NULL, PLAY_NOTIFY_READER_DONE);
+  playDacHandle = xTaskGetCurrentTaskHandle();
+  if (playReaderHeader.audioFormat == WAV_FORMAT_MP3)
+    playReaderRunning = xTaskCreatePinnedToCore(dacPrefetchTask, "Decode MP3", MP3_DECODE_TASK_STACK, NULL, MP3_DECODE_TASK_PRIORITY, NULL, MP3_DECODE_TASK_CORE) == pdPASS;
+  else
+    playReaderRunning = xTaskCreatePinnedToCore(dacPrefetchTask, "Prefetch WAV", DAC_PREFETCH_TASK_STACK, NULL, DAC_PREFETCH_TASK_PRIORITY, NULL, 1) == pdPASS;
+  return playReaderRunning;
+}
+
+// make the reader quit and wait for it, it may be blocked on a full ring, so keep draining it meanwhile
+void playStopReader()
+{
+  if (!playReaderRunning)
+    return;
+  playReaderStop = true;
+  uint8_t dump[256];
+  while (!playRing.eof || ringAvailable(&playRing) > 0)
+    ringPop(&playRing, dump, sizeof(dump), pdMS_TO_TICKS(5)); // audioRING.h
+  while (playTakeBits(PLAY_NOTIFY_READER_DONE, pdMS_TO_TICKS(10)) == 0)
+    ;
+  playReaderRunning = false;
+}
+
+// (reader stopped) get the reader back to the file the DAC plays, it may have moved on to a chained one
+bool playReaderAt(WAVHeader heardHeader)
+{
+  playDataEnd = heardHeader.dataOffset + heardHeader.dataSize;
+  if (!playChainPending)
+    return true;
+
+  // the chained file wasn't reached, it is still first in the queue
+  playChainPending = false;
+  playReaderFile.close();
+  playReaderFile = FS_TYPE.open(playFile);
+  playReaderHeader = heardHeader;
+  return playReaderFile;
+}
+
+// Reader side, at the end of a file: chain the next queued file when it has the same format,
+// so its samples follow in the same ring with no gap and no DAC setup.
+// One file ahead at most, the chained job leaves the queue only when the DAC reaches it (playTakeChained).
+bool playChainNext()
+{
+  while (playChainPending && !playReaderStop)
+    vTaskDelay(pdMS_TO_TICKS(5));
+
+  // an MP3 has no exact length, the DAC couldn't tell where the next file starts
+  AudioCmd cmd;
+  if (playReaderStop || playReaderHeader.audioFormat == WAV_FORMAT_MP3 || xQueuePeek(playQueue, &cmd, 0) != pdTRUE)
+    return false;
+  if ((cmd.type != CMD_PLAY && cmd.type != CMD_ENQUEUE) || cmd.priority == CMD_PRIO_URGENT)
+    return false;
+
+  File next = FS_TYPE.open(cmd.path);
+  WAVHeader header;
+  if (!next || !fsEnsureWavHeader(next, &header) || !fsWavSameFormat(&header, &playReaderHeader)) // fsFLASH.h
+  {
+    if (next)
+      next.close();
+    return false;
+  }
+
+  playReaderFile.close();
+  playReaderFile = next;
+  playReaderHeader = header;
+  playReaderPcmPos = header.dataOffset;
+  playDataEnd = header.dataOffset + header.dataSize;
+  playChainCmd = cmd;
+  playChainHeader = header;
+  playChainLevelDb = PLAY_NORMALIZE ? playLevelDb(cmd.path) : 0;
+  playChainPending = true;
+  return true;
+}
+
+// DAC side, at the end of a file: take the chained job off the queue, it is the one playing now
+bool playTakeChained()
+{
+  AudioCmd cmd;
+  playChainPending = false;
+  if (xQueueReceive(playQueue, &cmd, 0) != pdTRUE)
+    return false;
+  if (strcmp(cmd.path, playChainCmd.path) != 0)
+  {
+    // something jumped the line meanwhile, give it back and finish here
+    xQueueSendToFront(playQueue, &cmd, 0);
+    return false;
+  }
+  strcpy(playFile, cmd.path);
+  return true;
+}
+
+// Engine side: start reading the clip of an overlay on OVERLAY_LOAD_TASK_CORE. A read of up to MIX_CLIP_MAX_BYTES
+// here would hold the DAC worker off its core (the engine is above it) for longer than the DMA plays.
+void playLoadOverlay(AudioCmd *cmd)
+{
+  if (overlayLoading)
+  {
+    Serial.printf("Overlay: %s dropped, another one is loading\n", cmd->path);
+    return;
+  }
+  memset(&overlayLoad, 0, sizeof(OverlayLoad));
+  overlayLoad.cmd = *cmd;
+  overlayLoading = true;
+  if (xTaskCreatePinnedToCore(overlayLoadTask, "Overlay load", OVERLAY_LOAD_TASK_STACK, NULL, OVERLAY_LOAD_TASK_PRIORITY, NULL, OVERLAY_LOAD_TASK_CORE) != pdPASS)
+  {
+    Serial.println("Overlay: failed to start the loader");
+    overlayLoading = false;
+  }
+}
+
+// Loads a short PCM WAV file into RAM, then posts CMD_OVERLAY_READY so the engine hands it to the mixer.
+void overlayLoadTask(void *param)
+{
+  OverlayLoad *load = &overlayLoad;
+  const char *path = load->cmd.path;
+  File file = FS_TYPE.open(path);
+  if (!file || !fsEnsureWavHeader(file, &load->header) || load->header.audioFormat != WAV_FORMAT_PCM) // fsFLASH.h
+    Serial.printf("Overlay: %s is not a PCM WAV file\n", path);
+  else if (load->header.dataSize > MIX_CLIP_MAX_BYTES)
+    Serial.printf("Overlay: %s is too long, %u B of audio at most\n", path, MIX_CLIP_MAX_BYTES);
+  else
+  {
+    load->data = (uint8_t *)malloc(load->header.dataSize);
+    if (load->data == NULL)
+      Serial.printf("Overlay: not enough RAM for %s\n", path);
+    else if (file.seek(load->header.dataOffset))
+      load->bytes = file.read(load->data, load->header.dataSize);
+  }
+  if (file)
+    file.close();
+
+  AudioCmd ready = cmdMake(CMD_OVERLAY_READY); // audioCMD.h
+  cmdSetPath(&ready, path);
+  if (load->bytes == 0 || !cmdPost(engineQueue, &ready, pdMS_TO_TICKS(100)))
+  {
+    if (load->data != NULL)
+      Serial.printf("Overlay: cannot mix %s into the playback\n", path);
+    free(load->data);
+    load->data = NULL;
+    overlayLoading = false;
+  }
+  vTaskDelete(NULL);
+}
+
+// Engine side: the clip is loaded, mix it into the playback (audioMIX.h) if it still plays.
+void playAddOverlay()
+{
+  OverlayLoad *load = &overlayLoad;
+  int source = playMixer.running ? mixAddClip(&playMixer, load->data, load->bytes, load->header.sampleRate, load->header.bitsPerSample,
+                                              load->header.numChannels, load->cmd.volume / 100.0, load->cmd.fadeMs, load->cmd.path)
+                                 : -1;
+  if (source < 0)
+  {
+    Serial.printf("Overlay: cannot mix %s into the playback\n", load->cmd.path);
+    free(load->data); // the mixer takes it only when it succeeds
+  }
+  else
+    Serial.printf("Overlay: %s as source %d\n", load->cmd.path, source);
+  load->data = NULL;
+  overlayLoading = false;
+}
+
+// Prefetch stage: reads the file in large flash-aligned blocks into the playback ring.
+// Blocks on a full ring, the DAC task is the one that sets the pace. Stops at the end of the data chunk,
+// then goes on with the next queued file when it can be played gapless.
+void dacPrefetchTask(void *param)
+{
+  uint8_t *read_buff = (uint8_t *)calloc(PLAY_READ_BLOCK, sizeof(uint8_t));
+
+  if (read_buff != NULL)
+  {
+    do
+    {
+      if (playReaderHeader.audioFormat == WAV_FORMAT_FLAC)
+      {
+        playReadFlac(read_buff); // the ring gets the decoded PCM
+        continue;
+      }
+      if (playReaderHeader.audioFormat == WAV_FORMAT_MP3)
+      {
+        playReadMp3(); // the same, up to the end of the file
+        continue;
+      }
+      // the first read ends on a block boundary (right after the header or the seek), the rest are aligned
+      size_t toRead = PLAY_READ_BLOCK - (playReaderFile.position() % PLAY_READ_BLOCK);
+      while (playReaderFile.position() < playDataEnd && !playReaderStop)
+      {
+        size_t bytesRead = playReaderFile.read(read_buff, min(toRead, (size_t)(playDataEnd - playReaderFile.position())));
+        if (bytesRead == 0)
+          break;
+        ringPush(&playRing, read_buff, bytesRead, portMAX_DELAY); // audioRING.h
+        toRead = PLAY_READ_BLOCK;
+      }
+    } while (!playReaderStop && playChainNext());
+    free(read_buff);
+  }
+  else
+  {
+    Serial.println("Failed to allocate the prefetch buffer");
+  }
+
+  ringClose(&playRing);
+  xTaskNotify(playDacHandle, PLAY_NOTIFY_READER_DONE, eSetBits); // done, the file can be closed
+  vTaskDelete(NULL);
+}
+
+// Move the reader to a byte offset of the data, of a FLAC or MP3 file the offset in the PCM it decodes to
+void playReaderSeek(uint32_t offset)
+{
+  playReaderPcmPos = offset;
+  if (playReaderHeader.audioFormat != WAV_FORMAT_FLAC && playReaderHeader.audioFormat != WAV_FORMAT_MP3)
+    playReaderFile.seek(offset);
+}
+
+// The reader of a FLAC file: decodes the frames from playReaderPcmPos up to playDataEnd and pushes their PCM.
+// It starts at the seek point before the position and drops the samples up to it, so the DAC gets the same
+// bytes as from the WAV file of the recording.
+void playReadFlac(uint8_t *read_buff)
+{
+  FlacStreamInfo info;
+  uint64_t sample;
+  int frameSize = playReaderHeader.blockAlign;
+  uint64_t target = playReaderPcmPos / frameSize;
+  uint64_t end = playDataEnd / frameSize;
+  if (!fsFlacSeek(playReaderFile, &info, target, &sample)) // fsFLASH.h
+    return;
+
+  FlacDecoder dec;
+  uint8_t *in = NULL;
+  if (flacDecoderInit(&dec, &info)) // audioFLAC.h
+    in = (uint8_t *)malloc(flacDecoderFrameBytes(&dec));
+  if (in == NULL)
+  {
+    Serial.println("Failed to allocate the FLAC decoder");
+    flacDecoderEnd(&dec);
+    return;
+  }
+
+  // the input holds the largest frame, so it is always topped up before a frame is decoded
+  size_t size = flacDecoderFrameBytes(&dec);
+  size_t have = 0;
+  bool eof = false;
+  int pushFrames = PLAY_READ_BLOCK / frameSize;
+  while (!playReaderStop && sample < end)
+  {
+    if (!eof && have < size)
+    {
+      have += playReaderFile.read(in + have, size - have);
+      eof = playReaderFile.available() == 0;
+    }
+    size_t consumed;
+    int frames = flacDecodeFrame(&dec, in, have, !eof && have < size, &consumed);
+    if (frames == 0 && consumed == 0)
+    {
+      if (eof || have == size)
+        break; // the end, or a frame that doesn't fit
+      continue;
+    }
+    memmove(in, in + consumed, have - consumed);
+    have -= consumed;
+    if (frames == 0)
+      continue; // a broken frame, decoding goes on at the next sync code
+
+    // the frames of this block from the position on, up to the end of the data
+    sample = dec.firstSample + frames;
+    int from = target > dec.firstSample ? (int)min((uint64_t)frames, target - dec.firstSample) : 0;
+    int to = end > dec.firstSample ? (int)min((uint64_t)frames, end - dec.firstSample) : 0;
+    for (int i = from; i < to && !playReaderStop; i += pushFrames)
+    {
+      size_t bytes = flacDecoderRead(&dec, read_buff, i, min(pushFrames, to - i)); // packed PCM
+      ringPush(&playRing, read_buff, bytes, portMAX_DELAY); // audioRING.h
+    }
+  }
+
+  free(in);
+  flacDecoderEnd(&dec);
+}
+
+// The reader of an MP3 file is the decoder stage: frames of 16-bit PCM into the ring, up to the end of the file.
+// A couple of frames of the file are in RAM at a time, the ring bounds the decoded PCM.
+// Pinned to MP3_DECODE_TASK_CORE, its load per frame is in playMp3Load (/position).
+void playReadMp3()
+{
+  Mp3Decoder dec;
+  if (!mp3DecoderInit(&dec, playReaderHeader.sampleRate, playReaderHeader.numChannels)) // audioMP3.h
+  {
+    Serial.println("Failed to allocate the MP3 decoder");
+    mp3DecoderEnd(&dec);
+    return;
+  }
+  if (!fsMp3Seek(playReaderFile, &playReaderHeader, playReaderPcmPos)) // fsFLASH.h
+  {
+    mp3DecoderEnd(&dec);
+    return;
+  }
+
+  bool eof = false;
+  while (!playReaderStop)
+  {
+    size_t space;
+    uint8_t *input = mp3DecoderInput(&dec, &space);
+    if (!eof && space > 0)
+    {
+      mp3DecoderFilled(&dec, playReaderFile.read(input, space));
+      eof = playReaderFile.available() == 0;
+    }
+    int frames = mp3DecodeFrame(&dec, !eof);
+    if (frames == 0)
+    {
+      if (eof)
+        break;
+      continue;
+    }
+    ringPush(&playRing, dec.pcm, frames * playReaderHeader.blockAlign, portMAX_DELAY); // audioRING.h
+    playMp3Load = dec.load;
+  }
+
+  Serial.println("MP3 decoding: " + mp3GetLoad(&dec.load));
+  mp3DecoderEnd(&dec);
+}
+
+// The I2S slot of a file format: 16-bit files are captured as MIC_SAMPLE_BITS,
+// 24/32-bit files take the whole 24-bit sample of the INMP441 (left-justified in 32-bit)
+int recSelectCaptureBits(RecFormat *format)
+{
+  return format->bitsPerSample == 16 ? MIC_SAMPLE_BITS : 32;
+}
+
+template <class Src, class Dst>
+ConvFn recKernelCh(int numChannels)
+{
+  if (numChannels == 2)
+    return convBlock<Src, Dst, 2, 2, MIC_GAIN_SHIFT>;
+  return convBlock<Src, Dst, 1, 1, MIC_GAIN_SHIFT>;
+}
+
+// pick the conversion kernel of the recording once, with the gain of MIC_GAIN_SHIFT, saturating
+ConvFn recSelectKernel(RecFormat *format, int captureBits)
+{
+  if (captureBits == 16)
+    return recKernelCh<FmtS16, FmtS16>(format->numChannels);
+  if (format->bitsPerSample == 16)
+    return recKernelCh<FmtS32, FmtS16>(format->numChannels);
+  if (format->bitsPerSample == 24)
+    return recKernelCh<FmtS32, FmtS24>(format->numChannels); // packed, 3 bytes per sample
+  return recKernelCh<FmtS32, FmtS32>(format->numChannels);
+}
+
+// The DSP stage: convert a block of raw I2S samples into the WAV format.
+// Returns the size of the output in bytes, a coded format returns whole blocks only.
+size_t recProcessBlock(uint8_t *dest, uint8_t *src, size_t len)
+{
+  // the recording ends after its frames, a FLAC file has no size to stop at
+  size_t captureFrame = recCaptureBits / 8 * recFormat.numChannels;
+  len = min(len, recFramesLeft * captureFrame);
+  recFramesLeft -= len / captureFrame;
+  // the DSP chain sees the silence too, the noise reduction learns its noise there
+  dspProcess(&recDspChain, src, len); // audioDSP.h, in place on the raw samples
+  // the silence is gone before any conversion, the time of the recording still counts it
+  len = vadFilter(&recVad, src, len); // audioVAD.h
+  if (len == 0)
+    return 0;
+
+  if (recFormat.audioFormat == WAV_FORMAT_PCM)
+  {
+    size_t pcm = recConvert(dest, src, len); // audioCONV.h
+    peakFeed(recPeaks, dest, pcm);          // audioPEAK.h
+    return pcm;
+  }
+
+  if (recFormat.audioFormat == WAV_FORMAT_FLAC)
+  {
+    // packed 16/24-bit PCM in place, then whole frames, the encoder keeps an unfinished block
+    size_t pcm = recConvert(src, src, len);
+    peakFeed(recPeaks, src, pcm);
+    return flacEncode(&recFlac, dest, src, pcm / (recFormat.bitsPerSample / 8 * recFormat.numChannels)); // audioFLAC.h
+  }
+
+  // 16-bit PCM in place (it only narrows), then the coder, it keeps the frames of an unfinished block
+  size_t pcm = recConvert(src, src, len);
+  peakFeed(recPeaks, src, pcm);
+  return codecEncode(&recEncoder, dest, (int16_t *)src, pcm / (sizeof(int16_t) * recFormat.numChannels)); // audioCODEC.h
+}
+
+// Capture stage: the only job is to keep the I2S DMA drained.
+// Runs with a high priority and never blocks on the ring, a full ring is counted as dropped audio.
+void micCaptureTask(void *param)
+{
+  size_t bytes_read;
+  uint8_t *i2s_read_buff = (uint8_t *)malloc(recCaptureBlock); // a single DMA buffer, up to DEV_DMA_MAX_BYTES (audioDEV.h)
+  if (i2s_read_buff == NULL)
+  {
+    // nothing reaches the ring, the writer gives up after REC_RING_TIMEOUT_MS
+    Serial.println("Failed to allocate the capture buffer");
+    xTaskNotifyGive(recWriterHandle);
+    vTaskDelete(NULL);
+  }
+
+  // the microphone is already primed by devAcquireMic, no startup blocks to discard here
+  devStartSession(&micDevice); // audioDEV.h, count the DMA overruns of this recording only
+  while (!recStopRequested)
+  {
+    // read data from I2S bus, in this case, from ADC.
+    micReadBuff((void *)i2s_read_buff, recCaptureBlock, &bytes_read); // audioSTD.h
+    if (devPollEvents(&micDevice) > 0) // audioDEV.h
+      Serial.println("Mic DMA overrun, audio lost");
+    if (bytes_read > 0)
+    {
+      devMarkFirstSample(&micDevice, "Recording"); // audioDEV.h
+      if (MONITORING)
+      {
+        // printing for debugging
+        fsPrintBuffer(i2s_read_buff, 64); // moved to fsFLASH.h
+      }
+      ringPush(&recRing, i2s_read_buff, bytes_read, 0); // audioRING.h
+      if (specClients > 0)
+        specFeed(&micSpectrum, i2s_read_buff, bytes_read); // audioSPEC.h
+    }
+    else
+    {
+      Serial.println("I2S read error");
+    }
+  }
+
+  free(i2s_read_buff);
+  xTaskNotifyGive(recWriterHandle); // done, the writer may release the ring
+  vTaskDelete(NULL);
+}
+
+// Optional DSP stage, pinned to the other core: raw ring -> process -> WAV ring, it frees the buffers it was given
+void recDspTask(void *param)
+{
+  uint8_t *raw_buff = recDspRawBuff;
+  uint8_t *out_buff = recDspOutBuff;
+
+  while (!recStopRequested)
+  {
+    size_t bytes_read = ringPop(&recRing, raw_buff, recRawBlock, pdMS_TO_TICKS(100));
+    if (bytes_read == 0)
+      continue;
+    size_t out_len = recProcessBlock(out_buff, raw_buff, bytes_read);
+    if (out_len > 0)
+      ringPush(&recDspRing, out_buff, out_len, pdMS_TO_TICKS(REC_RING_TIMEOUT_MS));
+    if (recFramesLeft == 0)
+      ringClose(&recDspRing); // all frames are in, the writer ends once it took them
+  }
+
+  free(raw_buff);
+  free(out_buff);
+  recDspRawBuff = NULL;
+  recDspOutBuff = NULL;
+
+  xTaskNotifyGive(recWriterHandle);
+  vTaskDelete(NULL);
+}
+
+// allocate the rings and start the capture (and DSP) tasks, the caller becomes the writer
+bool startRecordingPipeline()
+{
+  recStopRequested = false;
+  recMaxWriteTime = 0;
+  // the filters of a profile take the gain of the microphone along, the conversion only converts then
+  if (recDspChain.numStages > 0)
+    recConvert = convSelect(recCaptureBits, recFormat.numChannels, recFormat.bitsPerSample, recFormat.numChannels); // audioCONV.h
+  else
+    recConvert = recSelectKernel(&recFormat, recCaptureBits);
+  recPipelineTasks = 0;
+  recWriterHandle = xTaskGetCurrentTaskHandle();
+  specConfigure(&micSpectrum, recFormat.sampleRate, recCaptureBits, recFormat.numChannels, MIC_GAIN_SHIFT); // audioSPEC.h
+
+  if (!ringCreate(&recRing, recRawBlock, REC_RING_BLOCKS))
+  {
+    Serial.println("Failed to allocate the recording ring");
+    return false;
+  }
+
+  if (recDspActive)
+  {
+    if (!ringCreate(&recDspRing, recOutBlock, REC_RING_BLOCKS))
+    {
+      Serial.println("Failed to allocate the DSP ring");
+      ringDestroy(&recRing);
+      return false;
+    }
+    // its buffers are checked here, a task that failed later would leave the writer waiting on its ring
+    recDspRawBuff = (uint8_t *)calloc(recRawBlock, sizeof(uint8_t));
+    recDspOutBuff = (uint8_t *)calloc(recProcessMax, sizeof(uint8_t));
+    if (recDspRawBuff != NULL && recDspOutBuff != NULL &&
+        xTaskCreatePinnedToCore(recDspTask, "Rec DSP", REC_DSP_TASK_STACK, NULL, REC_DSP_TASK_PRIORITY, NULL, 0) == pdPASS)
+      recPipelineTasks++;
+    else
+    {
+      // the writer does the processing then, like on a single core
+      Serial.println("Failed to start the DSP task, processing inline");
+      free(recDspRawBuff);
+      free(recDspOutBuff);
+      recDspRawBuff = NULL;
+      recDspOutBuff = NULL;
+      ringDestroy(&recDspRing);
+      recDspActive = false;
+    }
+  }
+
+  if (xTaskCreatePinnedToCore(micCaptureTask, "Mic capture", MIC_CAPTURE_TASK_STACK, NULL, MIC_CAPTURE_TASK_PRIORITY, NULL, 1) == pdPASS)
+    recPipelineTasks++;
+  else
+  {
+    Serial.println("Failed to start the capture task");
+    stopRecordingPipeline();
+    return false;
+  }
+  return true;
+}
+
+// stop the pipeline tasks, wait for them to exit, then release the rings
+void stopRecordingPipeline()
+{
+  recStopRequested = true;
+  while (recPipelineTasks > 0)
+  {
+    ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+    recPipelineTasks--;
+  }
+
+  ringPrintStats(&recRing, "Capture"); // audioRING.h
+  recDroppedBytes = recRing.droppedBytes;
+  ringDestroy(&recRing);
+  if (recDspActive)
+  {
+    ringPrintStats(&recDspRing, "DSP");
+    recDroppedBytes += recDspRing.droppedBytes;
+    ringDestroy(&recDspRing);
+  }
+  Serial.printf("Longest flash write: %lu us\n", recMaxWriteTime);
+}
+
+// The writer stage: drains the ring in flash-sized blocks, while the capture task keeps reading I2S.
+// A slow SPIFFS write (e.g. garbage collection) is absorbed by the ring instead of the I2S DMA.
+// preroll - an armed recording: the pipeline already runs, the pre-roll is written first (armJob)
+unsigned long recordWav(PreRoll *preroll)
+{
+  unsigned long flash_wr_size = 0;
+  unsigned long flash_record_size = getFlashRecordSize(); // in bytes
+  size_t bytes_read;
+  size_t bytes_written;
+  size_t out_len;
+
+  // a FLAC block may come out larger than it went in (verbatim frames), with the frames of the previous one
+  bool flac = recFormat.audioFormat == WAV_FORMAT_FLAC;
+  recProcessMax = flac ? flacEncodeBound(&recFlac, recOutBlock / (recFormat.bitsPerSample / 8 * recFormat.numChannels)) : recOutBlock; // audioFLAC.h
+
+  uint8_t *raw_buff = (uint8_t *)calloc(recRawBlock, sizeof(uint8_t));
+  uint8_t *flash_write_buff = (uint8_t *)calloc(recProcessMax, sizeof(uint8_t));
+  if (raw_buff == NULL || flash_write_buff == NULL)
+  {
+    Serial.println("Failed to allocate the writer buffers");
+    free(raw_buff);
+    free(flash_write_buff);
+    if (preroll != NULL)
+      stopRecordingPipeline();
+    return 0;
+  }
+
+  Serial.printf("write block for recording %u B, ring of %d blocks\n", recOutBlock, REC_RING_BLOCKS);
+  Serial.printf("reserved file size: %u\n", flash_record_size);
+
+  bool coded = recFormat.audioFormat == WAV_FORMAT_IMA_ADPCM || recFormat.audioFormat == WAV_FORMAT_MULAW;
+  if (coded && !codecEncoderInit(&recEncoder, recFormat.audioFormat, recFormat.sampleRate, recFormat.numChannels)) // audioCODEC.h
+  {
+    Serial.println("Failed to allocate the encoder");
+    free(raw_buff);
+    free(flash_write_buff);
+    if (preroll != NULL)
+      stopRecordingPipeline();
+    return 0;
+  }
+
+  if (preroll != NULL || startRecordingPipeline())
+  {
+    // the frames of the recording are counted by recProcessBlock, a closed DSP ring tells the writer
+    while (flash_wr_size < flash_record_size && !micStopRequested && (recDspActive ? !ringDrained(&recDspRing) : recFramesLeft > 0))
+    {
+      if (preroll != NULL && preroll->filled > 0)
+      {
+        // the oldest audio first, the live blocks queue up behind it as it empties:
+        // the capture ring only holds REC_RING_BLOCKS of them, not the seconds of the flush
+        bytes_read = prerollPop(preroll, raw_buff, recRawBlock); // audioARM.h
+        out_len = recProcessBlock(flash_write_buff, raw_buff, bytes_read);
+        while (preroll->size - preroll->filled >= recRawBlock)
+        {
+          size_t live = ringPop(&recRing, raw_buff, recRawBlock, 0); // audioRING.h, whole frames
+          if (live == 0)
+            break;
+          prerollPush(preroll, raw_buff, live);
+        }
+        armState.droppedBytes = recRing.droppedBytes;
+      }
+      else if (recDspActive)
+      {
+        // the DSP task already did the processing
+        bytes_read = ringPop(&recDspRing, flash_write_buff, recOutBlock, pdMS_TO_TICKS(REC_RING_TIMEOUT_MS));
+        out_len = bytes_read;
+      }
+      else
+      {
+        bytes_read = ringPop(&recRing, raw_buff, recRawBlock, pdMS_TO_TICKS(REC_RING_TIMEOUT_MS));
+        out_len = recProcessBlock(flash_write_buff, raw_buff, bytes_read);
+      }
+
+      if (bytes_read == 0)
+      {
+        if (!recDspActive || !ringDrained(&recDspRing))
+          Serial.println("Recording pipeline timeout");
+        break;
+      }
+
+      // don't exceed the reserved size
+      if (out_len > flash_record_size - flash_wr_size)
+        out_len = flash_record_size - flash_wr_size;
+
+      unsigned long write_start = micros();
+      bytes_written = file_out.write((const byte *)flash_write_buff, out_len);
+      unsigned long write_time = micros() - write_start;
+      if (write_time > recMaxWriteTime)
+        recMaxWriteTime = write_time;
+      flash_wr_size += bytes_written;
+
+      if (MONITORING)
+      {
+        Serial.printf("Recording written %d B in %lu us\n", bytes_written, write_time);
+        // Check the size of the stack in the TASK.
+        // uxTaskGetStackHighWaterMark() shows how much Stack was never used. The closer to 0, the better.
+        Serial.printf("Never Used Stack Size: %u\n", uxTaskGetStackHighWaterMark(NULL));
+      }
+    }
+
+    stopRecordingPipeline();
+
+    // the last frames of a coded recording, less than a block, if there is room for them
+    if ((coded || flac) && flash_wr_size < flash_record_size)
+    {
+      out_len = flac ? flacEncoderFlush(&recFlac, flash_write_buff) : codecEncoderFlush(&recEncoder, flash_write_buff); // audioFLAC.h, audioCODEC.h
+      if (out_len > 0 && out_len <= flash_record_size - flash_wr_size)
+        flash_wr_size += file_out.write((const byte *)flash_write_buff, out_len);
+    }
+  }
+  if (coded)
+    codecEncoderEnd(&recEncoder);
+
+  // cleanup
+  free(raw_buff);
+  raw_buff = NULL;
+
+  free(flash_write_buff);
+  flash_write_buff = NULL;
+
+  return flash_wr_size;
+}
+
+// The capture path of the format: the I2S slot width, and the blocks in whole frames of both formats.
+// Then get the microphone, a warm one only drops the stale blocks, another format is reclocked and primed.
+bool recAcquireMic()
+{
+  recCaptureBits = recSelectCaptureBits(&recFormat);
+  int captureFrame = recCaptureBits / 8 * recFormat.numChannels;
+  int fileFrame = recFormat.bitsPerSample / 8 * recFormat.numChannels;
+  recCaptureBlock = devFormatBufLen(&micDevice, recCaptureBits, recFormat.numChannels) * captureFrame; // audioDEV.h
+  recOutBlock = REC_WRITE_BLOCK / fileFrame * fileFrame;
+  recRawBlock = REC_WRITE_BLOCK / fileFrame * captureFrame;
+  Serial.printf("Recording format: %u Hz, %d-bit (captured as %d-bit), %d channel(s), %s\n",
+                recFormat.sampleRate, recFormat.bitsPerSample, recCaptureBits, recFormat.numChannels, codecName(recFormat.audioFormat));
+  // the noise suppression is a stage of the chain, its noise is the start of the recording (the pre-roll when armed)
+  bool nr = recNrRequested && recFormat.numChannels == 1;
+  if (recNrRequested && !nr)
+    Serial.println("Noise suppression is for mono recordings only, skipped");
+  if (nr && !nrInit(&recNr, recFormat.sampleRate, NR_LEARN_MS)) // audioNR.h
+  {
+    Serial.println("Not enough RAM for the noise suppression, skipped");
+    nr = false;
+  }
+  dspChainInit(&recDspChain, recDspProfile, recFormat.sampleRate, recCaptureBits, recFormat.numChannels, MIC_GAIN_SHIFT, nr ? &recNr : NULL); // audioDSP.h
+
+  esp_err_t resMic = devAcquireMic(recFormat.sampleRate, recCaptureBits, recFormat.numChannels); // audioDEV.h
+  if (resMic != ESP_OK)
+  {
+    Serial.println("Failed to initialize MIC I2S");
+    return false;
+  }
+  Serial.println("Microphone I2S ready!");
+  return true;
+}
+
+// A single recording, runs on the mic worker (recorderTask).
+// Ends after record_time seconds, or earlier on a stop, the WAV header is fixed up to the actual size.
+void recordJob()
+{
+  if (xSemaphoreTake(micMutex, portMAX_DELAY) == pdTRUE)
+  {
+    if (!recAcquireMic())
+    {
+      cleanupRecording(true, false);
       return;
     }
-    Serial.println("Microphone I2S initialized!");
 
     if (!prepareForRecording())
     {
-      Serial.println("Failed to create file for recording");
-      cleanupRecording(true, false); // file is not available
-      return;
+      Serial.println("Failed to create file for recording");
+      cleanupRecording(true, false); // file is not available
+      return;
+    }
+    Serial.println("Recording file initialized!");
+
+    // Record audio data + Close file within the task
+    digitalWrite(LED, HIGH); // working...
+    Serial.println(" *** Recording Start *** ");
+    // the pipeline handles every format, see recSelectKernel
+    recDspActive = REC_DSP_TASK;
+    unsigned long wavSize = getFlashRecordSize();
+    unsigned long wavNewSize = recordWav();
+    recFinishFile(wavSize, wavNewSize);
+
+    digitalWrite(LED, LOW);   // done...
+    xSemaphoreGive(micMutex); // release semaphore
+  }
+}
+
+// An armed recording (audioARM.h), runs on the mic worker like recordJob.
+// The capture pipeline runs without a file, its blocks go to the pre-roll until the level reaches the threshold,
+// or /arm action=trigger. Then the file gets the pre-roll and cmd->recordTime seconds after the trigger.
+// Nothing is written to the flash while armed, a stop disarms without touching the previous recording.
+void armJob(AudioCmd *cmd)
+{
+  if (xSemaphoreTake(micMutex, portMAX_DELAY) == pdTRUE)
+  {
+    if (!recAcquireMic())
+    {
+      cleanupRecording(true, false);
+      return;
+    }
+
+    // the pre-roll in whole blocks of the writer
+    int captureFrame = recCaptureBits / 8 * recFormat.numChannels;
+    size_t blocks = max((size_t)1, (size_t)cmd->prerollSec * recFormat.sampleRate * captureFrame / recRawBlock);
+    PreRoll preroll = {NULL, 0, 0, 0};
+    uint8_t *raw_buff = (uint8_t *)malloc(recRawBlock);
+    if (raw_buff == NULL || !prerollCreate(&preroll, blocks * recRawBlock)) // audioARM.h
+    {
+      Serial.println("Failed to allocate the pre-roll");
+      free(raw_buff);
+      prerollDestroy(&preroll);
+      cleanupRecording(true, false);
+      return;
+    }
+
+    recDspActive = false;
+    armTriggerRequested = false;
+    memset(&armState, 0, sizeof(armState));
+    armState.prerollSec = cmd->prerollSec;
+    armState.liveSec = cmd->recordTime;
+    armState.thresholdDb = cmd->thresholdDb;
+    armState.levelDb = -120.0;
+    armState.maxLevelDb = -120.0;
+    armState.source = "";
+    if (!startRecordingPipeline())
+    {
+      free(raw_buff);
+      prerollDestroy(&preroll);
+      cleanupRecording(true, false);
+      return;
+    }
+    armState.armed = true;
+    Serial.printf("Armed: %d s of pre-roll (%u B), threshold %.1f dBFS\n", cmd->prerollSec, preroll.size, cmd->thresholdDb);
+
+    // wait for the trigger, the level of every block is measured with the gain of the recording
+    while (!micStopRequested)
+    {
+      size_t bytes_read = ringPop(&recRing, raw_buff, recRawBlock, pdMS_TO_TICKS(REC_RING_TIMEOUT_MS)); // audioRING.h
+      if (bytes_read == 0)
+      {
+        Serial.println("Recording pipeline timeout");
+        break;
+      }
+      prerollPush(&preroll, raw_buff, bytes_read);
+      armState.droppedBytes = recRing.droppedBytes;
+      armState.levelDb = armLevelDb(raw_buff, bytes_read, recCaptureBits, MIC_GAIN_SHIFT);
+      armState.maxLevelDb = max(armState.maxLevelDb, armState.levelDb);
+      if (armTriggerRequested)
+        armState.source = "api";
+      else if (cmd->thresholdDb < 0 && armState.levelDb >= cmd->thresholdDb)
+        armState.source = "level";
+      else
+        continue;
+      armState.triggered = true;
+      break;
+    }
+    free(raw_buff);
+
+    if (!armState.triggered)
+    {
+      Serial.println("Disarmed");
+      stopRecordingPipeline();
+      prerollDestroy(&preroll);
+      armState.armed = false;
+      xSemaphoreGive(micMutex);
+      return;
+    }
+
+    // the file is made for both parts, the writer counts their frames
+    size_t prerollFrames = preroll.filled / captureFrame;
+    armState.heldMs = (uint64_t)prerollFrames * 1000 / recFormat.sampleRate;
+    Serial.printf("Triggered by %s at %.1f dBFS, %u ms of pre-roll\n", armState.source, armState.levelDb, armState.heldMs);
+    // the noise is the pre-roll before the event, its last NR_LEARN_MS may already hold the onset
+    if (recDspChain.nr != NULL)
+      nrSetLearning(&recNr, armState.heldMs > 2 * NR_LEARN_MS ? armState.heldMs - NR_LEARN_MS : armState.heldMs / 2); // audioNR.h
+    record_time = cmd->prerollSec + cmd->recordTime;
+    if (!prepareForRecording())
+    {
+      Serial.println("Failed to create file for recording");
+      stopRecordingPipeline();
+      prerollDestroy(&preroll);
+      armState.armed = false;
+      cleanupRecording(true, false);
+      return;
+    }
+    recFramesLeft = prerollFrames + recFormat.sampleRate * cmd->recordTime;
+
+    digitalWrite(LED, HIGH); // working...
+    Serial.println(" *** Recording Start *** ");
+    unsigned long wavSize = getFlashRecordSize();
+    unsigned long wavNewSize = recordWav(&preroll);
+    armState.droppedBytes = recDroppedBytes;
+    recFinishFile(wavSize, wavNewSize);
+    prerollDestroy(&preroll);
+    armState.armed = false;
+
+    digitalWrite(LED, LOW);   // done...
+    xSemaphoreGive(micMutex); // release semaphore
+  }
+}
+
+// The noise suppression of a stored mono PCM WAV file into "<name>-nr.wav", runs on the mic worker between recordings.
+// The noise is learned from the first NR_LEARN_MS of the file. The delay of the suppression is taken out:
+// its first NR_FFT_SIZE samples are dropped and the same count of silence flushes the last ones, so both files align.
+void denoiseJob(AudioCmd *cmd)
+{
+  NrJob *job = &nrJob; // audioNR.h
+  memset(job, 0, sizeof(NrJob));
+  job->running = true;
+  strcpy(job->source, cmd->path);
+  String output = String(cmd->path).substring(0, strlen(cmd->path) - 4) + "-nr.wav";
+  strcpy(job->output, output.c_str());
+  Serial.printf("Noise suppression of %s into %s\n", job->source, job->output);
+
+  File in = FS_TYPE.open(cmd->path);
+  WAVHeader header;
+  if (!in || !fsEnsureWavHeader(in, &header) || header.audioFormat != WAV_FORMAT_PCM || header.numChannels != 1 ||
+      (header.bitsPerSample != 16 && header.bitsPerSample != 24 && header.bitsPerSample != 32))
+  {
+    job->error = "not a mono 16/24/32-bit PCM file";
+    Serial.printf("Noise suppression: %s\n", job->error);
+    in.close();
+    job->running = false;
+    return;
+  }
+  job->durationMs = fsWavDurationMs(&header); // fsFLASH.h
+
+  // through left-justified 32-bit samples, the way the recording chain sees them
+  const int frames = NR_FFT_SIZE * 4;
+  int sampleBytes = header.bitsPerSample / 8;
+  ConvFn load = convSelect(header.bitsPerSample, 1, 32, 1); // audioCONV.h
+  ConvFn store = convSelect(32, 1, header.bitsPerSample, 1);
+  uint8_t *raw = (uint8_t *)malloc(frames * sampleBytes);
+  int32_t *work = (int32_t *)malloc(frames * sizeof(int32_t));
+  NrState nr = {};
+  bool ready = raw != NULL && work != NULL && nrInit(&nr, header.sampleRate, NR_LEARN_MS);
+  removeSidecars(output); // of the previous output
+  PeakState *peaks = peakCreate(header.sampleRate, header.bitsPerSample, 1, header.dataSize / sampleBytes); // audioPEAK.h
+  File out = ready ? FS_TYPE.open(output, FILE_WRITE) : File();
+  if (!out)
+  {
+    job->error = ready ? "cannot create the output file" : "not enough RAM";
+    Serial.printf("Noise suppression: %s\n", job->error);
+    in.close();
+    free(raw);
+    free(work);
+    free(peaks);
+    nrEnd(&nr);
+    job->running = false;
+    return;
+  }
+  byte wavHeader[wavHeaderSize];
+  fsGenerateWavHeader(wavHeader, 0, header.sampleRate, 1, header.bitsPerSample); // fsFLASH.h
+  out.write(wavHeader, wavHeaderSize);
+
+  uint32_t left = header.dataSize / sampleBytes;
+  uint32_t done = 0;
+  int skip = NR_FFT_SIZE; // the delay of the suppression
+  int flush = NR_FFT_SIZE;
+  unsigned long dataSize = 0;
+  int64_t nrTime = 0;
+  while ((left > 0 || flush > 0) && !micStopRequested)
+  {
+    int n;
+    if (left > 0)
+    {
+      n = in.read(raw, min((uint32_t)frames, left) * sampleBytes) / sampleBytes;
+      if (n <= 0)
+        break;
+      load(work, raw, n * sampleBytes);
+      left -= n;
+    }
+    else
+    {
+      n = flush;
+      memset(work, 0, n * sizeof(int32_t));
+      flush = 0;
+    }
+
+    int64_t start = esp_timer_get_time();
+    nrProcess(&nr, work, n); // audioNR.h
+    nrTime += esp_timer_get_time() - start;
+
+    int from = min(skip, n);
+    skip -= from;
+    size_t bytes = store(raw, work + from, (n - from) * sizeof(int32_t));
+    if (out.write(raw, bytes) != bytes)
+    {
+      job->error = "the flash is full";
+      break;
+    }
+    peakFeed(peaks, raw, bytes);
+    dataSize += bytes;
+    done += n;
+    job->doneMs = (uint64_t)min(done, header.dataSize / sampleBytes) * 1000 / header.sampleRate;
+  }
+  fsUpdateWavHeader(out, dataSize); // fsFLASH.h
+  out.close();
+  in.close();
+
+  job->rtf = job->doneMs ? nrTime / 1000.0 / job->doneMs : 0;
+  job->reductionDb = nrGetReductionDb(&nr);
+  Serial.printf("Noise suppression: %lu ms in %.1f ms (RTF %.4f), %.1f dB in the last frame%s\n", (unsigned long)job->doneMs,
+                nrTime / 1000.0, job->rtf, job->reductionDb, micStopRequested ? ", stopped" : "");
+  if (peaks != NULL)
+  {
+    peakFinish(peaks);
+    writePeaks(peaks, output);
+    writeLoudness(peaks, output);
+  }
+  free(peaks);
+  free(raw);
+  free(work);
+  nrEnd(&nr);
+  job->running = false;
+}
+
+// the sidecar of a spectrogram is complete and made of a source of sourceSize bytes (audioSPEC.h)
+bool spectrogramFresh(String cache, uint32_t sourceSize)
+{
+  File file = FS_TYPE.open(cache, "r");
+  if (!file)
+    return false;
+  uint8_t header[SPGM_HEADER_BYTES] = {0};
+  file.read(header, SPGM_HEADER_BYTES);
+  bool fresh = specGramFresh(header, file.size(), sourceSize);
+  file.close();
+  return fresh;
+}
+
+// The spectrogram of a stored PCM WAV file into its sidecar "<name>.spg" (audioSPEC.h), runs on the mic worker.
+// Each column reads its SPGM_FFT_SIZE frames where it starts, so the cost is up to SPGM_MAX_COLUMNS FFTs
+// and reads of 1-2 KB, whatever the length of the file, and nothing but a column is in RAM.
+void spectrogramJob(AudioCmd *cmd)
+{
+  SpecGramJob *job = &specGramJob; // audioSPEC.h
+  job->running = true;
+  job->queued = false;
+  job->columns = 0;
+  job->doneColumns = 0;
+  job->error = NULL;
+  strcpy(job->source, cmd->path);
+  String output = fsSidecarPath(cmd->path, ".spg");
+  strcpy(job->output, output.c_str());
+
+  File in = FS_TYPE.open(cmd->path);
+  WAVHeader header;
+  ConvFn load = NULL;
+  if (in && fsEnsureWavHeader(in, &header) && header.audioFormat == WAV_FORMAT_PCM)
+    load = convSelect(header.bitsPerSample, header.numChannels, 32, 1); // audioCONV.h, stereo is mixed down
+  uint32_t frames = load ? header.dataSize / header.blockAlign : 0;
+  job->columns = specGramColumns(frames);
+  if (job->columns == 0)
+  {
+    job->error = "not a PCM file of a column at least";
+    Serial.printf("Spectrogram: %s\n", job->error);
+    in.close();
+    job->running = false;
+    return;
+  }
+  uint32_t hop = specGramHop(frames, job->columns);
+  Serial.printf("Spectrogram of %s into %s, %d columns every %lu frames\n", job->source, job->output, job->columns,
+                (unsigned long)hop);
+
+  uint8_t *raw = (uint8_t *)malloc(SPGM_FFT_SIZE * header.blockAlign);
+  int32_t *work = (int32_t *)malloc(SPGM_FFT_SIZE * sizeof(int32_t));
+  uint8_t *columns = (uint8_t *)malloc(SPGM_WRITE_COLUMNS * SPGM_BINS);
+  SpecGram *gram = (SpecGram *)malloc(sizeof(SpecGram));
+  bool ready = raw != NULL && work != NULL && columns != NULL && gram != NULL;
+  File out = ready ? FS_TYPE.open(output, FILE_WRITE) : File();
+  if (!out)
+  {
+    job->error = ready ? "cannot create the output file" : "not enough RAM";
+    Serial.printf("Spectrogram: %s\n", job->error);
+    in.close();
+    free(raw);
+    free(work);
+    free(columns);
+    free(gram);
+    job->running = false;
+    return;
+  }
+  specGramInit(gram);
+
+  // no columns in the header until the end: an unfinished sidecar is never served
+  uint8_t spgHeader[SPGM_HEADER_BYTES];
+  specGramHeader(spgHeader, in.size(), header.sampleRate, hop, 0);
+  out.write(spgHeader, SPGM_HEADER_BYTES);
+
+  int64_t start = esp_timer_get_time();
+  int pending = 0;
+  while (job->doneColumns < job->columns && !micStopRequested)
+  {
+    size_t bytes = SPGM_FFT_SIZE * header.blockAlign;
+    in.seek(header.dataOffset + (uint64_t)job->doneColumns * hop * header.blockAlign);
+    if (in.read(raw, bytes) != bytes)
+    {
+      job->error = "cannot read the file";
+      break;
     }
-    Serial.println("Recording file initialized!");
+    load(work, raw, bytes);
+    specGramColumn(gram, work, columns + pending * SPGM_BINS); // audioSPEC.h
+    job->doneColumns++;
+    if (++pending == SPGM_WRITE_COLUMNS || job->doneColumns == job->columns)
+    {
+      if (out.write(columns, pending * SPGM_BINS) != pending * SPGM_BINS)
+      {
+        job->error = "the flash is full";
+        break;
+      }
+      pending = 0;
+    }
+  }
+  bool complete = job->doneColumns == job->columns && job->error == NULL;
+  if (complete)
+  {
+    specGramHeader(spgHeader, in.size(), header.sampleRate, hop, job->columns);
+    out.seek(0);
+    out.write(spgHeader, SPGM_HEADER_BYTES);
+  }
+  out.close();
+  in.close();
+  if (!complete)
+    fsRemoveFile(output); // stopped or failed, the next request starts over
+
+  Serial.printf("Spectrogram: %d of %d columns in %.1f ms%s\n", job->doneColumns, job->columns,
+                (esp_timer_get_time() - start) / 1000.0, complete ? "" : ", not complete");
+  free(raw);
+  free(work);
+  free(columns);
+  free(gram);
+  job->running = false;
+}
 
-    // Record audio data + Close file within the task
-    digitalWrite(LED, HIGH); // working...
-    Serial.println(" *** Recording Start *** ");
-    // old verison works with SAMPLE_RATE=16000, SAMPLE_BITS=16, TASK_STACK=4096, BUFF_LEN=64
-    unsigned long wavNewSize = 0;
-    unsigned long wavSize = getFlashRecordSize();
-    if (MIC_SAMPLE_BITS == 16)
+// The live meter of an idle mic (audioSPEC.h), runs on the mic worker while a /ws/spectrum client is connected.
+// It captures in the default format, and gives the mic back to the next job of the mic worker, the monitor,
+// the calibration, or a playback on a shared port. Those who capture feed the meter themselves.
+void meterJob()
+{
+  if (!specInit(&micSpectrum) || xSemaphoreTake(micMutex, 0) != pdTRUE)
+    return; // the DAC worker has it
+  uint8_t *buff = (uint8_t *)malloc(BUFF_SIZE);
+  if (buff == NULL || devAcquireMic(MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, MIC_CHANNEL_NUM) != ESP_OK) // audioDEV.h
+  {
+    Serial.println("Failed to start the meter");
+    free(buff);
+    xSemaphoreGive(micMutex);
+    return;
+  }
+  specConfigure(&micSpectrum, MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, MIC_CHANNEL_NUM, MIC_GAIN_SHIFT);
+  Serial.println("Meter started");
+
+  size_t bytes_read;
+  while (specClients > 0 && !meterYield && uxQueueMessagesWaiting(recQueue) == 0)
+  {
+    micReadBuff(buff, BUFF_SIZE, &bytes_read); // audioSTD.h
+    if (bytes_read > 0)
+      specFeed(&micSpectrum, buff, bytes_read); // audioSPEC.h
+  }
+  Serial.println("Meter stopped");
+  free(buff);
+  xSemaphoreGive(micMutex);
+}
+
+// the DAC worker takes the mic (or the shared port), the meter lets it go within a DMA buffer
+bool micTakeFromMeter(SemaphoreHandle_t mutex)
+{
+  meterYield = true;
+  bool taken = xSemaphoreTake(mutex, portMAX_DELAY) == pdTRUE;
+  meterYield = false;
+  return taken;
+}
+
+// the clients of /ws/spectrum, the buffers of the analysis come with the first one
+void onSpectrumEvent(AsyncWebSocket *ws, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+  if (type == WS_EVT_CONNECT)
+  {
+    if (!specInit(&micSpectrum)) // audioSPEC.h, the meter tries again
+      Serial.println("Not enough RAM for the spectrum");
+    specClients++;
+    Serial.printf("Spectrum client #%u connected, %d in total\n", client->id(), specClients);
+  }
+  else if (type == WS_EVT_DISCONNECT && specClients > 0)
+  {
+    specClients--;
+    Serial.printf("Spectrum client #%u disconnected, %d left\n", client->id(), specClients);
+  }
+}
+
+// the end of a recording: the header to the actual size, the metadata next to the file
+void recFinishFile(unsigned long wavSize, unsigned long wavNewSize)
+{
+  Serial.println(" *** Recording Finished *** ");
+
+  Serial.printf("actual file size: %u B\n", file_out.size());
+  Serial.printf("WAV data size: %u B\n", wavSize);
+  Serial.printf("WAV new size: %u B\n", wavNewSize);
+  if (recDspChain.numStages > 0)
+    Serial.printf("DSP: %s\n", dspGetStats(&recDspChain).c_str()); // audioDSP.h
+  if (recVad.enabled)
+    Serial.printf("VAD: kept %u of %u frames, %d segment(s)\n", recVad.outFrames, recVad.inFrames, recVad.numSegments + recVad.moreSegments);
+
+  if (recFormat.audioFormat == WAV_FORMAT_FLAC)
+  {
+    // the format with the total of samples, and the seek points of the frames
+    if (fsWriteFlacHeader(file_out, &recFlac) == 0) // fsFLASH.h
+      Serial.println("Failed to update the FLAC header");
+    Serial.printf("FLAC: %u frames, %.2fx smaller than PCM\n", recFlac.frameNumber,
+                  wavNewSize ? (float)recFlac.info.totalSamples * recFormat.bitsPerSample / 8 * recFormat.numChannels / wavNewSize : 0);
+    flacEncoderEnd(&recFlac); // audioFLAC.h
+  }
+  // a coded file always gets its number of frames (fact chunk)
+  else if (wavSize != wavNewSize || recHeaderSize != wavHeaderSize)
+  {
+    Serial.printf("Update wav header with new data size: %u B\n", wavNewSize);
+    uint32_t sampleLength = recHeaderSize != wavHeaderSize ? codecSampleLength(&recEncoder, wavNewSize) : 0; // audioCODEC.h
+    fsUpdateWavHeader(file_out, wavNewSize, recHeaderSize, sampleLength);
+  }
+
+  // Don't forget to close the file after all done.
+  file_out.close();
+  // the microphone stays installed and clocked, ready for the next recording
+
+  // tell whether the recording is complete or has gaps, and how loud it is, next to the file
+  if (recPeaks != NULL)
+    peakFinish(recPeaks); // audioPEAK.h
+  if (!recWriteMeta(recPath(), wavNewSize))
+    Serial.println("Failed to write the recording metadata");
+  if (recPeaks != NULL)
+  {
+    if (!writePeaks(recPeaks, recPath()))
+      Serial.println("Failed to write the waveform peaks");
+    free(recPeaks);
+    recPeaks = NULL;
+  }
+
+  // re-call listing files
+  fsListFiles();
+
+  if (MONITORING)
+  {
+    // printing for debugging, using the entire file
+    Serial.println(" *** Recording WAV content begin *** ");
+    fsPrintFileContent(recPath());
+    Serial.println(" *** Recording WAV content end *** ");
+  }
+}
+
+// The monitor job holds both devices, either for live monitoring or for a single loopback test.
+// Runs on the DAC worker (playerTask), stopped like a playback.
+void monitorJob(bool loopback)
+{
+  if (micTakeFromMeter(micMutex))
+  {
+    monitorActive = true;
+    if (!AUDIO_FULL_DUPLEX)
+    {
+      // both directions on one port, nothing to monitor
+      Serial.println("Monitoring needs the mic and the DAC on separate I2S ports");
+    }
+    else if (xSemaphoreTake(dacMutex, portMAX_DELAY) == pdTRUE)
+    {
+      digitalWrite(LED, HIGH); // working...
+      if (loopback)
+        monitorLoopback();
+      else
+        monitorLive();
+      digitalWrite(LED, LOW); // done...
+      xSemaphoreGive(dacMutex);
+    }
+    monitorActive = false;
+    xSemaphoreGive(micMutex);
+  }
+}
+
+// get both devices in the format of the monitor, returns the DAC rate or 0 on failure
+int monitorAcquire()
+{
+  int dacRate = DAC_FIXED_RATE > 0 ? DAC_FIXED_RATE : MIC_SAMPLE_RATE;
+  if (devAcquireMic(MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, MIC_CHANNEL_NUM) != ESP_OK || devAcquireDac(dacRate, 16, 2) != ESP_OK) // audioDEV.h
+  {
+    Serial.println("Failed to initialize the I2S devices for monitoring");
+    return 0;
+  }
+  return dacRate;
+}
+
+// Live monitoring: every mic DMA block goes straight to the DAC (16-bit stereo).
+// The latency is bounded by one mic DMA buffer plus the DAC DMA queue, there is no ring in between.
+void monitorLive()
+{
+  int dacRate = monitorAcquire();
+  if (dacRate == 0)
+    return;
+
+  bool resample = dacRate != MIC_SAMPLE_RATE;
+  if (resample && !srcInit(&monResampler, MIC_SAMPLE_RATE, dacRate, 2)) // audioSRC.h
+  {
+    Serial.println("Failed to initialize the monitor resampler");
+    return;
+  }
+
+  // mono mic samples -> 16-bit stereo, with the recording gain
+  ConvFn monConvert = (MIC_SAMPLE_BITS == 32) ? convBlock<FmtS32, FmtS16, MIC_CHANNEL_NUM, 2, MIC_GAIN_SHIFT>
+                                              : convBlock<FmtS16, FmtS16, MIC_CHANNEL_NUM, 2, MIC_GAIN_SHIFT>;
+  const int frame = 2 * sizeof(int16_t);
+  size_t micFrames = BUFF_SIZE / (MIC_SAMPLE_BITS / 8 * MIC_CHANNEL_NUM);
+  // the block grows to stereo in place, then to the DAC rate
+  uint8_t *mic_buff = (uint8_t *)calloc(micFrames * frame, sizeof(uint8_t));
+  int16_t *dac_buff = resample ? (int16_t *)malloc(srcMaxOutFrames(&monResampler, micFrames) * frame) : NULL;
+  if (mic_buff == NULL || (resample && dac_buff == NULL))
+  {
+    Serial.println("Failed to allocate the monitor buffers");
+    free(mic_buff);
+    free(dac_buff);
+    return;
+  }
+
+  Serial.println(" *** Monitoring Start *** ");
+  monMaxBlockTime = 0;
+  specConfigure(&micSpectrum, MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, MIC_CHANNEL_NUM, MIC_GAIN_SHIFT); // audioSPEC.h
+  size_t bytes_read;
+  size_t bytes_written;
+  while ((playTakeBits(PLAY_NOTIFY_STOP, 0) & PLAY_NOTIFY_STOP) == 0)
+  {
+    micReadBuff(mic_buff, BUFF_SIZE, &bytes_read); // audioSTD.h
+    if (bytes_read == 0)
+      continue;
+    if (specClients > 0)
+      specFeed(&micSpectrum, mic_buff, bytes_read); // audioSPEC.h, before the block is converted in place
+
+    unsigned long block_start = micros();
+    size_t len = monConvert(mic_buff, mic_buff, bytes_read); // audioCONV.h
+    int16_t *out = (int16_t *)mic_buff;
+    if (resample)
+    {
+      len = srcProcess(&monResampler, (int16_t *)mic_buff, len / frame, dac_buff) * frame; // audioSRC.h
+      out = dac_buff;
+    }
+    unsigned long block_time = micros() - block_start;
+    if (block_time > monMaxBlockTime)
+      monMaxBlockTime = block_time;
+
+    dacWriteBuff(out, len, &bytes_written); // audioSTD.h
+  }
+  Serial.println(" *** Monitoring Finished *** ");
+  Serial.printf("Longest monitor block: %lu us\n", monMaxBlockTime);
+
+  free(mic_buff);
+  free(dac_buff);
+}
+
+// Acoustic loopback test, the mic must hear the speaker: queue a click on the DAC behind a full DMA queue
+// (as in the monitor), then find its first sample at the mic. The figure covers the DAC DMA queue,
+// the air and the mic DMA buffering, i.e. the monitor latency without its (short) processing time.
+void monitorLoopback()
+{
+  int dacRate = monitorAcquire();
+  if (dacRate == 0)
+    return;
+
+  size_t bytes_read;
+  size_t bytes_written;
+  size_t micFrames = BUFF_SIZE / (MIC_SAMPLE_BITS / 8 * MIC_CHANNEL_NUM);
+  uint8_t *mic_buff = (uint8_t *)calloc(BUFF_SIZE, sizeof(uint8_t));
+  int16_t *dac_buff = (int16_t *)calloc(DMA_BUF_LEN * 2, sizeof(int16_t)); // one DAC DMA buffer, 16-bit stereo
+  if (mic_buff == NULL || dac_buff == NULL)
+  {
+    Serial.println("Failed to allocate the loopback buffers");
+    free(mic_buff);
+    free(dac_buff);
+    return;
+  }
+  RecFormat monoFormat = {MIC_SAMPLE_RATE, 16, 1, WAV_FORMAT_PCM};
+  ConvFn micConvert = recSelectKernel(&monoFormat, MIC_SAMPLE_BITS); // mono 16-bit with the recording gain
+
+  // the noise floor, the threshold must be well above it
+  int32_t noise = 0;
+  micFlushStd(devBufCount(&micDevice) * devBufLen(&micDevice) * 8); // audioSTD.h
+  for (int b = 0; b < 4; b++)
+  {
+    micReadBuff(mic_buff, BUFF_SIZE, &bytes_read);
+    size_t n = micConvert(mic_buff, mic_buff, bytes_read) / sizeof(int16_t);
+    for (size_t i = 0; i < n; i++)
+      noise = max(noise, (int32_t)abs(((int16_t *)mic_buff)[i]));
+  }
+  int32_t threshold = max(noise * 4, (int32_t)2000);
+
+  // fill the DAC DMA queue with silence, the writes block once it is full
+  for (int b = 0; b * DMA_BUF_LEN <= devBufCount(&dacDevice) * devBufLen(&dacDevice); b++)
+    dacWriteBuff(dac_buff, DMA_BUF_LEN * 2 * sizeof(int16_t), &bytes_written);
+
+  // the click: one DMA buffer of a 2kHz square wave, at half scale
+  int halfPeriod = max(1, dacRate / 4000);
+  for (int i = 0; i < DMA_BUF_LEN; i++)
+    dac_buff[2 * i] = dac_buff[2 * i + 1] = ((i / halfPeriod) & 1) ? 16384 : -16384;
+
+  micFlushStd(devBufCount(&micDevice) * devBufLen(&micDevice) * 8);
+  dacWriteBuff(dac_buff, DMA_BUF_LEN * 2 * sizeof(int16_t), &bytes_written);
+  int64_t click_time = esp_timer_get_time();
+
+  monLoopbackLatency = -1;
+  while (esp_timer_get_time() - click_time < LOOPBACK_TIMEOUT_MS * 1000LL && monLoopbackLatency < 0)
+  {
+    micReadBuff(mic_buff, BUFF_SIZE, &bytes_read);
+    int64_t block_time = esp_timer_get_time(); // around the last sample of the block
+    size_t n = micConvert(mic_buff, mic_buff, bytes_read) / sizeof(int16_t);
+    for (size_t i = 0; i < n; i++)
+    {
+      if (abs(((int16_t *)mic_buff)[i]) > threshold)
+      {
+        monLoopbackLatency = block_time - (int64_t)(n - i) * 1000000 / MIC_SAMPLE_RATE - click_time;
+        break;
+      }
+    }
+  }
+
+  if (monLoopbackLatency >= 0)
+    Serial.printf("Loopback latency: %lld us (noise %d, threshold %d, mic block %u frames)\n", monLoopbackLatency, noise, threshold, micFrames);
+  else
+    Serial.println("Loopback test: the click was not heard, place the mic near the speaker");
+
+  free(mic_buff);
+  free(dac_buff);
+}
+
+// The calibration job holds both devices like the monitor, runs on the DAC worker and is stopped like a playback
+void tuneJob(AudioCmd *cmd)
+{
+  if (micTakeFromMeter(micMutex))
+  {
+    monitorActive = true;
+    if (!AUDIO_FULL_DUPLEX)
     {
-      wavNewSize = _recordWav();
+      Serial.println("Calibration needs the mic and the DAC on separate I2S ports");
     }
-    else if (MIC_SAMPLE_BITS == 32)
+    else if (xSemaphoreTake(dacMutex, portMAX_DELAY) == pdTRUE)
     {
-      wavNewSize = recordWav();
+      digitalWrite(LED, HIGH); // working...
+      tuneSweep(cmd);
+      digitalWrite(LED, LOW); // done...
+      xSemaphoreGive(dacMutex);
     }
+    monitorActive = false;
+    xSemaphoreGive(micMutex);
+  }
+}
+
+// Run the candidates from the smallest DMA up, until each device had a trial without gaps.
+// A device with a result keeps it for the next trials, so the load of the other one stays realistic.
+void tuneSweep(AudioCmd *cmd)
+{
+  TuneState *state = &tuneState;
+  memset(state, 0, sizeof(TuneState));
+  state->sampleRate = cmd->sampleRate;
+  state->bitsPerSample = cmd->bitsPerSample;
+  state->numChannels = cmd->numChannels;
+  state->trialMs = cmd->trialMs;
+
+  // the mic is captured as a recording of the format, the DAC as a playback (16-bit stereo)
+  RecFormat format = {cmd->sampleRate, cmd->bitsPerSample, cmd->numChannels, WAV_FORMAT_PCM};
+  int captureBits = recSelectCaptureBits(&format);
+  int micFrame = captureBits / 8 * format.numChannels;
+  state->numCandidates = tuneMakeCandidates(state->candidates, max(micFrame, 4)); // audioTUNE.h
+
+  if (tuneTaskDone == NULL)
+    tuneTaskDone = xSemaphoreCreateCounting(2, 0);
+  DmaGeometry micBefore = {devBufCount(&micDevice), devBufLen(&micDevice)}; // audioDEV.h
+  DmaGeometry dacBefore = {devBufCount(&dacDevice), devBufLen(&dacDevice)};
+
+  Serial.printf(" *** DMA calibration Start: %u Hz, %d-bit, %d channel(s), %d candidates of %d ms *** \n",
+                format.sampleRate, format.bitsPerSample, format.numChannels, state->numCandidates, state->trialMs);
+  state->running = true;
+  for (int i = 0; i < state->numCandidates && (state->mic.bufCount == 0 || state->dac.bufCount == 0); i++)
+  {
+    DmaGeometry *candidate = &state->candidates[i];
+    if (state->mic.bufCount == 0)
+      devSetGeometry(&micDevice, candidate->bufCount, candidate->bufLen);
+    if (state->dac.bufCount == 0)
+      devSetGeometry(&dacDevice, candidate->bufCount, candidate->bufLen);
+
+    if (!tuneTrial(&format, captureBits, state->trialMs))
+      break; // stopped, or the devices failed
+    state->tried = i + 1;
+    state->micOverruns = micDevice.session.overruns + micDevice.session.dmaErrors;
+    state->dacUnderruns = dacDevice.session.underruns + dacDevice.session.dmaErrors;
+    Serial.printf("DMA %2d x %4d: mic %u overruns, DAC %u underruns\n", candidate->bufCount, candidate->bufLen, state->micOverruns, state->dacUnderruns);
+
+    if (state->mic.bufCount == 0 && state->micOverruns == 0)
+      state->mic = *candidate;
+    if (state->dac.bufCount == 0 && state->dacUnderruns == 0)
+      state->dac = *candidate;
+  }
+  state->running = false;
+
+  // a device without a result (stopped, or even the largest DMA had gaps) goes back to its geometry
+  DmaGeometry *mic = state->mic.bufCount ? &state->mic : &micBefore;
+  DmaGeometry *dac = state->dac.bufCount ? &state->dac : &dacBefore;
+  devSetGeometry(&micDevice, mic->bufCount, mic->bufLen);
+  devSetGeometry(&dacDevice, dac->bufCount, dac->bufLen);
+  state->saved = (state->mic.bufCount || state->dac.bufCount);
+  if (state->mic.bufCount)
+    state->saved = tuneSave("mic", mic, format.sampleRate, format.bitsPerSample, format.numChannels) && state->saved; // audioTUNE.h
+  if (state->dac.bufCount)
+    state->saved = tuneSave("dac", dac, format.sampleRate, format.bitsPerSample, format.numChannels) && state->saved;
+  Serial.printf(" *** DMA calibration Finished: mic %d x %d, DAC %d x %d%s *** \n",
+                mic->bufCount, mic->bufLen, dac->bufCount, dac->bufLen, state->saved ? ", saved" : "");
+
+  // warm again in the default formats, as after the boot
+  if (DAC_FIXED_RATE > 0)
+    devAcquireDac(DAC_FIXED_RATE, 16, 2);
+  devAcquireMic(MIC_SAMPLE_RATE, MIC_SAMPLE_BITS, MIC_CHANNEL_NUM);
+}
 
-    Serial.println(" *** Recording Finished *** ");
+// One trial of the current geometry: record and play for trialMs under load, the gaps are in the device sessions.
+// Returns false when it was stopped, or the devices failed.
+bool tuneTrial(RecFormat *format, int captureBits, int trialMs)
+{
+  int dacRate = DAC_FIXED_RATE > 0 ? DAC_FIXED_RATE : format->sampleRate;
+  if (devAcquireMic(format->sampleRate, captureBits, format->numChannels) != ESP_OK || devAcquireDac(dacRate, 16, 2) != ESP_OK) // audioDEV.h
+  {
+    Serial.println("Failed to initialize the I2S devices for calibration");
+    return false;
+  }
 
-    Serial.printf("actual file size: %u B\n", file_out.size());
-    Serial.printf("WAV data size: %u B\n", wavSize);
-    Serial.printf("WAV new size: %u B\n", wavNewSize);
+  // a quiet triangle wave, whole periods of 64 frames in a block of 16-bit stereo
+  static int16_t tone[PLAY_DAC_BLOCK / sizeof(int16_t)];
+  for (int i = 0; i < PLAY_DAC_BLOCK / 4; i++)
+  {
+    int phase = i % 64;
+    tone[2 * i] = tone[2 * i + 1] = (phase < 32 ? phase : 64 - phase) * 64 - 1024;
+  }
 
-    if (wavSize != wavNewSize)
+  // fill the DAC DMA before counting, the idle DAC underruns all the time
+  size_t bytesWritten;
+  size_t dacDma = devBufCount(&dacDevice) * dacDevice.activeBufLen * 4;
+  dacPreloadStd(); // audioSTD.h
+  for (size_t loaded = 0; loaded < dacDma; loaded += PLAY_DAC_BLOCK)
+    dacWriteBuff(tone, PLAY_DAC_BLOCK, &bytesWritten);
+  dacStartStd();
+  devStartSession(&dacDevice); // audioDEV.h
+
+  tuneTrialStop = false;
+  tuneCaptureBlock = devFormatBufLen(&micDevice, captureBits, format->numChannels) * captureBits / 8 * format->numChannels;
+  int tasks = 0;
+  if (xTaskCreatePinnedToCore(tuneCaptureTask, "Tune capture", MIC_CAPTURE_TASK_STACK, NULL, MIC_CAPTURE_TASK_PRIORITY, NULL, 1) == pdPASS)
+    tasks++;
+  if (xTaskCreatePinnedToCore(tuneLoadTask, "Tune load", TUNE_LOAD_TASK_STACK, NULL, TUNE_LOAD_TASK_PRIORITY, NULL, 1) == pdPASS)
+    tasks++;
+
+  bool stopped = false;
+  int64_t start = esp_timer_get_time();
+  while (tasks == 2 && esp_timer_get_time() - start < trialMs * 1000LL)
+  {
+    playWriteDac((uint8_t *)tone, PLAY_DAC_BLOCK, 4); // polls the underruns
+    // only a stop counts, pause and seek mean nothing here
+    if ((playTakeBits(PLAY_NOTIFY_TRANSPORT, 0) & PLAY_NOTIFY_STOP) != 0)
     {
-      Serial.printf("Update wav header with new data size: %u B\n", wavNewSize);
-      fsUpdateWavHeader(file_out, wavNewSize);
+      stopped = true;
+      break;
     }
+  }
+
+  tuneTrialStop = true;
+  for (int t = 0; t < tasks; t++)
+    xSemaphoreTake(tuneTaskDone, portMAX_DELAY);
+  dacClearStd(); // audioSTD.h
+  return !stopped && tasks == 2;
+}
+
+// The trial capture, at the priority of the recording capture. The audio is dropped, only the overruns count.
+void tuneCaptureTask(void *param)
+{
+  size_t bytes_read;
+  uint8_t *buff = (uint8_t *)malloc(tuneCaptureBlock);
+  if (buff == NULL)
+    Serial.println("Failed to allocate the calibration capture buffer");
 
-    // Don't forget to close the file after all done.
-    file_out.close();
-    // cleanup - uninstall driver
-    micDestroyStd();
+  devStartSession(&micDevice); // audioDEV.h
+  while (buff != NULL && !tuneTrialStop)
+  {
+    micReadBuff(buff, tuneCaptureBlock, &bytes_read); // audioSTD.h
+    devPollEvents(&micDevice);
+  }
+
+  free(buff);
+  xSemaphoreGive(tuneTaskDone);
+  vTaskDelete(NULL);
+}
 
-    // re-call listing files
-    fsListFiles();
+// The synthetic load of a trial: the flash writes of a recording (a file rewritten over and over, so SPIFFS
+// erases its pages too) and bursts of UDP broadcasts for the WiFi and lwIP traffic of the web server.
+void tuneLoadTask(void *param)
+{
+  uint8_t *block = (uint8_t *)malloc(REC_WRITE_BLOCK);
+  if (block != NULL)
+  {
+    for (int i = 0; i < REC_WRITE_BLOCK; i++)
+      block[i] = (uint8_t)(i * 31 + 7);
+  }
+  WiFiUDP udp;
+  IPAddress broadcast = WiFi.broadcastIP();
+  size_t limit = min((size_t)TUNE_LOAD_FILE_SIZE, fsAvailableSpace() / 2); // fsFLASH.h
+  File file;
 
-    if (MONITORING)
+  while (block != NULL && !tuneTrialStop)
+  {
+    if (limit >= REC_WRITE_BLOCK)
+    {
+      if (!file || file.size() + REC_WRITE_BLOCK > limit)
+      {
+        file.close();
+        file = FS_TYPE.open(TUNE_LOAD_FILE, FILE_WRITE); // truncated, its pages are erased
+      }
+      if (file)
+        file.write(block, REC_WRITE_BLOCK);
+    }
+    for (int p = 0; p < TUNE_UDP_BURST; p++)
     {
-      // printing for debugging, using the entire file
-      Serial.println(" *** Recording WAV content begin *** ");
-      fsPrintFileContent(filename_out);
-      Serial.println(" *** Recording WAV content end *** ");
+      udp.beginPacket(broadcast, TUNE_UDP_PORT);
+      udp.write(block, TUNE_UDP_PACKET);
+      udp.endPacket();
     }
+    vTaskDelay(1);
+  }
+
+  file.close();
+  FS_TYPE.remove(TUNE_LOAD_FILE);
+  free(block);
+  xSemaphoreGive(tuneTaskDone);
+  vTaskDelete(NULL);
+}
+
+// The metadata of a recording: its format, and the gaps of the session.
+// DMA overruns lose whole I2S buffers, dropped bytes were lost in a full ring (slow flash).
+bool recWriteMeta(String path, unsigned long dataSize)
+{
+  bool complete = devSessionComplete(&micDevice) && recDroppedBytes == 0; // audioDEV.h
+  String meta = "{\"file\":\"" + path + "\"";
+  meta += ",\"sampleRate\":" + String(recFormat.sampleRate);
+  meta += ",\"bitsPerSample\":" + String(recFormat.bitsPerSample);
+  meta += ",\"numChannels\":" + String(recFormat.numChannels);
+  meta += ",\"codec\":\"" + String(codecName(recFormat.audioFormat)) + "\"";
+  meta += ",\"dataSize\":" + String(dataSize);
+  meta += ",\"complete\":" + String(complete ? "true" : "false");
+  meta += ",\"droppedBytes\":" + String(recDroppedBytes);
+  if (recVad.enabled)
+    meta += ",\"vad\":" + vadGetState(&recVad); // audioVAD.h
+  if (recDspChain.nr != NULL)
+    meta += ",\"nrReduction\":" + String(nrGetReductionDb(&recNr), 1); // audioNR.h
+  if (recPeaks != NULL)
+    meta += ",\"loudness\":" + loudGetState(&recPeaks->loud); // audioLOUD.h
+  meta += ",\"dma\":" + devGetSession(&micDevice) + "}";
+  if (!complete)
+    Serial.printf("Recording has gaps: %u DMA overruns, %lu B dropped\n", micDevice.session.overruns, recDroppedBytes);
+  return fsWriteText(fsMetaPath(path), meta); // fsFLASH.h
+}
+
+// the files that belong to an audio file: its metadata and its spectrogram
+void removeSidecars(String path)
+{
+  fsRemoveFile(fsMetaPath(path)); // fsFLASH.h
+  fsRemoveFile(fsSidecarPath(path, ".spg"));
+  fsRemoveFile(fsSidecarPath(path, ".pk"));
+}
+
+// the waveform of an audio file next to it, "<name>.pk" (audioPEAK.h)
+bool writePeaks(PeakState *peaks, String path)
+{
+  File file = FS_TYPE.open(fsSidecarPath(path, ".pk"), FILE_WRITE);
+  if (!file)
+    return false;
+  uint8_t header[PEAK_HEADER_BYTES];
+  peakHeader(peaks, header);
+  bool written = file.write(header, PEAK_HEADER_BYTES) == PEAK_HEADER_BYTES;
+  for (int l = 0; l < PEAK_LEVELS; l++)
+  {
+    size_t bytes = peakBuckets(&peaks->levels[l]) * 2;
+    written = written && file.write((const uint8_t *)peaks->levels[l].buckets, bytes) == bytes;
+  }
+  file.close();
+  return written;
+}
+
+// the metadata of a file that isn't a recording (an upload, a /denoise output): its loudness (audioLOUD.h)
+bool writeLoudness(PeakState *peaks, String path)
+{
+  return fsWriteText(fsMetaPath(path), "{\"loudness\":" + loudGetState(&peaks->loud) + "}"); // fsFLASH.h
+}
+
+// The normalisation of a file in dB, from the loudness in its metadata, 0 when it has none (audioLOUD.h)
+float playLevelDb(String path)
+{
+  File file = FS_TYPE.open(fsMetaPath(path), "r");
+  if (!file)
+    return 0;
+  JsonDocument meta;
+  DeserializationError error = deserializeJson(meta, file);
+  file.close();
+  JsonVariant loudness = meta["loudness"];
+  if (error || !loudness.is<JsonObject>())
+    return 0;
+  return loudGainDb(loudness["lufs"].as<float>(), loudness["truePeak"].as<float>(), PLAY_TARGET_LUFS);
+}
+
+// The waveform of an uploaded PCM WAV file: once PEAK_PROBE_BYTES (or all of a smaller file) are on the flash,
+// its header is read back, and the samples that are already there are measured. The next chunks go to
+// peakFeed as they come. The state is the temporary object of the request, freed with it if the upload breaks.
+void uploadPeaks(AsyncWebServerRequest *request, String filename, size_t index, size_t len, bool final)
+{
+  bool probe = index < PEAK_PROBE_BYTES && (index + len >= PEAK_PROBE_BYTES || final);
+  if (!probe || request->_tempObject != NULL)
+    return;
+  String path = getAudioPath(filename);
+  if (!path.endsWith(".wav"))
+    return;
 
-    digitalWrite(LED, LOW);     // done...
-    xSemaphoreGive(audioMutex); // release semaphore
+  request->_tempFile.flush();
+  File wav = FS_TYPE.open(path, "r");
+  WAVHeader header;
+  if (!wav || !fsEnsureWavHeader(wav, &header) || header.audioFormat != WAV_FORMAT_PCM)
+  {
+    wav.close();
+    return; // a coded WAV file has no peaks
   }
+  PeakState *peaks = peakCreate(header.sampleRate, header.bitsPerSample, header.numChannels, header.dataSize / header.blockAlign); // audioPEAK.h
+  uint8_t buff[512];
+  size_t left = index + len > header.dataOffset ? index + len - header.dataOffset : 0;
+  while (peaks != NULL && left > 0)
+  {
+    size_t bytes = wav.read(buff, min(left, sizeof(buff)));
+    if (bytes == 0)
+      break;
+    peakFeed(peaks, buff, bytes);
+    left -= bytes;
+  }
+  wav.close();
+  request->_tempObject = peaks;
+}
 
-  cleanupRecording(false, false); // cleanup, no need to release mutex
+// the file of the current recording, "/recording.flac" for a lossless one
+String recPath()
+{
+  return recFormat.audioFormat == WAV_FORMAT_FLAC ? filename_flac : filename_out;
 }
 
 bool prepareForRecording()
 {
   // Instead of formatting every time, just removing the previous recording file when it starts.
+  // There is a single recording, whatever its format
   fsRemoveFile(filename_out);
+  removeSidecars(filename_out); // and its metadata and spectrogram
+  fsRemoveFile(filename_flac);
+  removeSidecars(filename_flac);
+  recFramesLeft = recFormat.sampleRate * record_time;
+  // the PCM that goes to the coder, 16-bit for IMA-ADPCM and u-law
+  free(recPeaks);
+  bool packed = recFormat.audioFormat == WAV_FORMAT_PCM || recFormat.audioFormat == WAV_FORMAT_FLAC;
+  recPeaks = peakCreate(recFormat.sampleRate, packed ? recFormat.bitsPerSample : 16, recFormat.numChannels, recFramesLeft); // audioPEAK.h
+  vadInit(&recVad, recVadRequested, recFormat.sampleRate, recCaptureBits, recFormat.numChannels, MIC_GAIN_SHIFT); // audioVAD.h
 
   // The "/audio/recording.wav" file starts with this Wave header.
-  file_out = FS_TYPE.open(filename_out, FILE_WRITE);
+  file_out = FS_TYPE.open(recPath(), FILE_WRITE);
   if (!file_out)
   {
     Serial.println("File is not available!");
     return false;
   }
 
+  // A FLAC file starts with its format and a seek table of placeholders, both written again at the end
+  if (recFormat.audioFormat == WAV_FORMAT_FLAC)
+  {
+    if (!flacEncoderInit(&recFlac, recFormat.sampleRate, recFormat.numChannels, recFormat.bitsPerSample, recFramesLeft)) // audioFLAC.h
+    {
+      Serial.println("Failed to allocate the encoder");
+      file_out.close();
+      return false;
+    }
+    recHeaderSize = fsWriteFlacHeader(file_out, &recFlac); // fsFLASH.h
+    if (recHeaderSize == 0)
+    {
+      flacEncoderEnd(&recFlac);
+      file_out.close();
+      return false;
+    }
+    return true;
+  }
+
   // Write WAV header
   // file_out should be open
-  byte header[wavHeaderSize];
-  // we generate 16-bit header for output file
-  fsGenerateWavHeader(header, getFlashRecordSize(), MIC_SAMPLE_RATE, MIC_CHANNEL_NUM, MIC_SAMPLE_BITS_HDR);
-  file_out.write(header, wavHeaderSize);
+  byte header[wavCodecHeaderMax];
+  // the header of the runtime format, a coded one has a fact chunk too (fixed up at the end)
+  CodecLayout layout;
+  if (codecLayout(&layout, recFormat.audioFormat, recFormat.sampleRate, recFormat.numChannels)) // audioCODEC.h
+    recHeaderSize = fsGenerateCodecWavHeader(header, getFlashRecordSize(), &layout, recFormat.sampleRate, recFormat.sampleRate * record_time);
+  else
+  {
+    fsGenerateWavHeader(header, getFlashRecordSize(), recFormat.sampleRate, recFormat.numChannels, recFormat.bitsPerSample);
+    recHeaderSize = wavHeaderSize;
+  }
+  file_out.write(header, recHeaderSize);
 
   return true;
 }
@@ -808,14 +3618,7 @@ void cleanupRecording(bool releaseMutex = false, bool closeFile = false)
   if (closeFile)
     file_out.close(); // cleanup file
   if (releaseMutex)
-    xSemaphoreGive(audioMutex); // release semaphore
-  // if (recordingTaskHandle != NULL)
-  // {
-  //   vTaskDelete(recordingTaskHandle);
-  //   recordingTaskHandle = NULL;
-  // }
-  recordingTaskHandle = NULL;
-  vTaskDelete(NULL); // delete calling task
+    xSemaphoreGive(micMutex); // release semaphore
 }
 
 String extractParam(AsyncWebServerRequest *request, String param_name, bool post = false)
@@ -836,6 +3639,20 @@ String extractParam(AsyncWebServerRequest *request, String param_name, bool post
   return param_value;
 }
 
+// an optional parameter, empty if missing (no error response)
+String extractOptionalParam(AsyncWebServerRequest *request, String param_name, bool post = false)
+{
+  if (!request->hasParam(param_name, post))
+    return emptyString;
+  return request->getParam(param_name, post)->value();
+}
+
+// priority=urgent jumps the line of the device, anything else is normal
+AudioCmdPriority extractPriority(AsyncWebServerRequest *request)
+{
+  return extractOptionalParam(request, "priority", true) == "urgent" ? CMD_PRIO_URGENT : CMD_PRIO_NORMAL;
+}
+
 // return the path with the audio_dir prefix
 String getAudioPath(String filename)
 {
@@ -845,9 +3662,9 @@ String getAudioPath(String filename)
 }
 
 // extract filename parameter from the post request
-String extractFilePath(AsyncWebServerRequest *request)
+String extractFilePath(AsyncWebServerRequest *request, bool post)
 {
-  String filename = extractParam(request, "file", true);
+  String filename = extractParam(request, "file", post);
   if (filename.isEmpty())
     return emptyString;
 
@@ -861,8 +3678,135 @@ String extractFilePath(AsyncWebServerRequest *request)
   return path;
 }
 
-// get FLASH_RECORD_SIZE, depends on RECORD_TIME
+// get FLASH_RECORD_SIZE, depends on RECORD_TIME and the format of the recording
 unsigned long getFlashRecordSize()
 {
-  return (unsigned long)(MIC_CHANNEL_NUM * MIC_SAMPLE_RATE * MIC_SAMPLE_BITS_HDR / 8 * record_time);
+  return recDataSize(&recFormat, record_time);
+}
+
+// bytes of samples of a recording, a coded one in whole blocks, a FLAC one as its largest frames (it is usually 2-6x smaller)
+unsigned long recDataSize(RecFormat *format, int seconds)
+{
+  if (format->audioFormat == WAV_FORMAT_FLAC)
+  {
+    unsigned long frames = (unsigned long)format->sampleRate * seconds;
+    unsigned long blocks = (frames + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE;
+    return blocks * flacMaxFrameBytes(FLAC_BLOCK_SIZE, format->numChannels, format->bitsPerSample) + fsFlacHeaderSize(blocks); // audioFLAC.h, fsFLASH.h
+  }
+  CodecLayout layout;
+  if (codecLayout(&layout, format->audioFormat, format->sampleRate, format->numChannels)) // audioCODEC.h
+    return codecDataSize(&layout, format->sampleRate * seconds);
+  return (unsigned long)format->numChannels * format->sampleRate * format->bitsPerSample / 8 * seconds;
+}
+
+// The format of a recording: preset=low|standard|hires|stereo|long|phone|archive, then rate/bits/channels/codec override it.
+// Sends the error response and returns false on an unsupported format.
+bool extractRecFormat(AsyncWebServerRequest *request, AudioCmd *cmd)
+{
+  RecFormat format = recPresets[1].format; // standard
+  String preset = extractOptionalParam(request, "preset", true);
+  if (!preset.isEmpty())
+  {
+    int i = 0;
+    int count = sizeof(recPresets) / sizeof(recPresets[0]);
+    while (i < count && preset != recPresets[i].name)
+      i++;
+    if (i == count)
+    {
+      request->send(415, "text/plain", "Unknown preset " + preset);
+      return false;
+    }
+    format = recPresets[i].format;
+  }
+
+  String rate = extractOptionalParam(request, "rate", true);
+  String bits = extractOptionalParam(request, "bits", true);
+  String channels = extractOptionalParam(request, "channels", true);
+  if (!rate.isEmpty())
+    format.sampleRate = rate.toInt();
+  if (!bits.isEmpty())
+    format.bitsPerSample = bits.toInt();
+  if (!channels.isEmpty())
+    format.numChannels = channels.toInt();
+  String codec = extractOptionalParam(request, "codec", true);
+  if (codec == "pcm")
+    format.audioFormat = WAV_FORMAT_PCM;
+  else if (codec == "adpcm")
+    format.audioFormat = WAV_FORMAT_IMA_ADPCM;
+  else if (codec == "ulaw")
+    format.audioFormat = WAV_FORMAT_MULAW;
+  else if (codec == "flac")
+    format.audioFormat = WAV_FORMAT_FLAC;
+  else if (!codec.isEmpty())
+  {
+    request->send(415, "text/plain", "Unknown codec " + codec);
+    return false;
+  }
+
+  // the INMP441 runs from 7.8kHz to 50kHz
+  if (format.sampleRate < 8000 || format.sampleRate > 48000 ||
+      (format.bitsPerSample != 16 && format.bitsPerSample != 24 && format.bitsPerSample != 32) ||
+      (format.numChannels != 1 && format.numChannels != 2) ||
+      (format.audioFormat == WAV_FORMAT_FLAC && format.bitsPerSample == 32) ||                              // FLAC codes 16/24-bit
+      (format.audioFormat != WAV_FORMAT_PCM && format.audioFormat != WAV_FORMAT_FLAC && format.bitsPerSample != 16)) // the coders take 16-bit PCM
+  {
+    request->send(415, "text/plain", "Cannot record " + String(format.sampleRate) + " Hz, " + String(format.bitsPerSample) + "-bit, " + String(format.numChannels) + " channel(s)");
+    return false;
+  }
+
+  cmd->sampleRate = format.sampleRate;
+  cmd->bitsPerSample = format.bitsPerSample;
+  cmd->numChannels = format.numChannels;
+  cmd->audioFormat = format.audioFormat;
+  return true;
+}
+
+// dsp=none|heart|murmur|lung|speech of /record, /arm and /play (audioDSP.h), none by default.
+// Sends the error response and returns false on an unknown profile.
+bool extractDspProfile(AsyncWebServerRequest *request, AudioCmd *cmd)
+{
+  String dsp = extractOptionalParam(request, "dsp", true);
+  int profile = dsp.isEmpty() ? 0 : dspFindProfile(dsp.c_str());
+  if (profile < 0)
+  {
+    request->send(415, "text/plain", "Unknown DSP profile " + dsp);
+    return false;
+  }
+  cmd->dspProfile = profile;
+  return true;
+}
+
+// vad=true|false of /record and /arm, REC_VAD by default
+bool extractRecVad(AsyncWebServerRequest *request)
+{
+  String vad = extractOptionalParam(request, "vad", true);
+  return vad.isEmpty() ? REC_VAD : vad == "true";
+}
+
+// nr=true|false of /record and /arm, REC_NR by default
+bool extractRecNr(AsyncWebServerRequest *request)
+{
+  String nr = extractOptionalParam(request, "nr", true);
+  return nr.isEmpty() ? REC_NR : nr == "true";
+}
+
+// The recording of the command must fit on the flash, sends 507 and returns false otherwise.
+bool recCheckSpace(AsyncWebServerRequest *request, AudioCmd *cmd)
+{
+  // the previous recording is replaced, its space is reused
+  RecFormat format = {cmd->sampleRate, cmd->bitsPerSample, cmd->numChannels, cmd->audioFormat};
+  unsigned long size = recDataSize(&format, cmd->recordTime);
+  size_t available = fsAvailableSpace(); // fsFLASH.h
+  for (String path : {filename_out, filename_flac})
+  {
+    File previous = FS_TYPE.open(path, "r");
+    available += previous ? previous.size() : 0;
+    previous.close();
+  }
+  if (size + wavCodecHeaderMax > available)
+  {
+    request->send(507, "text/plain", "Not enough space for " + fsFormatBytes(size) + ", try a shorter time or a lower format");
+    return false;
+  }
+  return true;
 }
\ No newline at end of file